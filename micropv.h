@@ -13,11 +13,35 @@
 /*---------------------------------------------------------------------
   -- macros (preamble)
   ---------------------------------------------------------------------*/
-#define PRINTK(format...) micropv_printk(__FILE__, __LINE__, ##format)
+#define PRINTK(format, ...) ({                                                                             \
+        static micropv_printk_site_t __printk_site =                                                        \
+            { __FILE__, __LINE__, __builtin_constant_p(format) ? (format) : NULL };                         \
+        micropv_printk_site(&__printk_site, format, ##__VA_ARGS__);                                        \
+    })
 #define PRINTK_BINARY(buffer, buffer_len) micropv_printk_binary(__FILE__, __LINE__, buffer, buffer_len)
 #define XBT_NIL ((xenbus_transaction_t)0)
 #define SIZEOF_ARRAY(x) (sizeof((x)) / sizeof(*x))
 
+#define MICROPV_HEAP_CLASSES            14
+#define MICROPV_VMEM_GUARD              0x01
+#define MICROPV_SG_MERGE                0x01
+#define MICROPV_HYPERCALL_OPS           64
+#define MICROPV_HYPERCALL_SUBOPS        32
+#define MICROPV_PRINTK_MAX_ARGS         15
+
+#define MICROPV_PCI_CONFIG_HEADER_SIZE  256
+#define MICROPV_PCI_MAX_CAPABILITIES    16
+#define MICROPV_PCI_CAP_ID_PM           0x01
+#define MICROPV_PCI_CAP_ID_MSI          0x05
+#define MICROPV_PCI_CAP_ID_EXP          0x10
+#define MICROPV_PCI_CAP_ID_MSIX         0x11
+#define MICROPV_PCI_EXT_CAP_ID_ERR      0x0001
+#define MICROPV_PCI_EXT_CAP_ID_SRIOV    0x0010
+#define MICROPV_PCI_MAX_MSIX_VECTORS    16
+#define MICROPV_PCI_MAX_BARS            6
+#define MICROPV_PCI_MAP_UC              0
+#define MICROPV_PCI_MAP_WC              1
+
 /*---------------------------------------------------------------------
   -- standard includes
   ---------------------------------------------------------------------*/
@@ -95,17 +119,228 @@ enum xen_register_file
     xen_register_file_registers
 };
 
+/**
+ * Heap statistics of one size class. capacity is what the slabs of the
+ * class can hold, so capacity - bytes_in_use is what is lost to
+ * fragmentation. cached objects are free but held in cpu magazines.
+ */
+typedef struct micropv_heap_class_stats_t
+{
+    uint32_t object_size;
+    uint64_t objects, bytes_in_use, cached, slabs, capacity;
+} micropv_heap_class_stats_t;
+
+typedef struct micropv_heap_stats_t
+{
+    micropv_heap_class_stats_t size_class[MICROPV_HEAP_CLASSES];
+    /**
+     * Requests above the biggest class
+     */
+    uint64_t large_bytes;
+    /**
+     * Totals, reserved is what the heap has taken from the page allocator
+     */
+    uint64_t bytes_in_use, bytes_reserved;
+} micropv_heap_stats_t;
+
+/**
+ * Virtual address arenas, see micropv_vmem_alloc
+ */
+typedef enum micropv_vmem_arena_t
+{
+    micropv_vmem_arena_grant,
+    micropv_vmem_arena_mmio,
+    micropv_vmem_arena_foreign,
+    micropv_vmem_arenas
+} micropv_vmem_arena_t;
+
+/**
+ * Hypercall accounting entry, see micropv_hypercall_stats
+ */
+typedef struct micropv_hypercall_stats_t
+{
+    uint64_t count;
+    uint64_t cycles;
+} micropv_hypercall_stats_t;
+
+/**
+ * Hardware events counted by the vPMU
+ */
+typedef enum micropv_perf_event_t
+{
+    micropv_perf_instructions,
+    micropv_perf_cycles,
+    micropv_perf_ref_cycles,
+    micropv_perf_llc_references,
+    micropv_perf_llc_misses,
+    micropv_perf_branch_misses,
+    micropv_perf_events
+} micropv_perf_event_t;
+
+/**
+ * Per thread counts. The guest OS keeps one of these in each thread and
+ * points micropv_perf_thread at it when the thread is switched in.
+ */
+typedef struct micropv_perf_context_t
+{
+    uint64_t count[micropv_perf_events];
+    uint64_t start[micropv_perf_events];
+} micropv_perf_context_t;
+
+/**
+ * A PRINTK call site. PRINTK keeps one of these next to every call, the
+ * format is parsed the first time the site logs in binary and the
+ * site is given an id that the log records refer to. The format is NULL
+ * when PRINTK was given one that isn't a literal, those sites always
+ * print as text.
+ */
+typedef struct micropv_printk_site_t
+{
+    const char *file;
+    long line;
+    const char *format;
+    uint16_t id;
+    uint8_t count;
+    uint8_t classes[MICROPV_PRINTK_MAX_ARGS];
+} micropv_printk_site_t;
+
+/**
+ * A run of machine memory, as produced by micropv_virtual_to_machine_sg
+ */
+typedef struct micropv_sg_segment_t
+{
+    uint64_t mfn;
+    uint32_t offset;
+    uint32_t length;
+} micropv_sg_segment_t;
+
 typedef struct micropv_grant_handle_t
 {
     uint32_t handle;
     uint64_t dev_bus_addr;
+    /**
+     * Where the page is mapped
+     */
+    void *buffer;
+    /**
+     * Set when the page came from the grant arena, unconsume gives it back
+     */
+    int arena;
 } micropv_grant_handle_t;
 
+typedef struct micropv_pci_capability_t
+{
+    uint16_t id, offset;
+} micropv_pci_capability_t;
+
+/**
+ * MSI-X vector handler. Called in interrupt context with the vector
+ * index (position in the table passed to micropv_pci_msix_enable)
+ */
+typedef void (*micropv_pci_msix_handler_t)(int vector, void *context);
+
+/**
+ * One MSI-X vector. entry, handler, context and cpu are filled in by the
+ * caller, the rest by micropv_pci_msix_enable.
+ */
+typedef struct micropv_pci_msix_vector_t
+{
+    /**
+     * Index in the device MSI-X table
+     */
+    uint16_t entry;
+    micropv_pci_msix_handler_t handler;
+    void *context;
+    /**
+     * vcpu that takes the interrupt. Only vcpu 0 runs the event upcall so
+     * this must be 0, it is there for when the other vcpus are brought up
+     */
+    int cpu;
+    /**
+     * Physical IRQ handed out by the backend and the event channel it is
+     * bound to
+     */
+    int pirq;
+    int port;
+    uint32_t count;
+} micropv_pci_msix_vector_t;
+
 typedef struct micropv_pci_device_t
 {
     uint32_t domain, bus, slot, fun, vendor, device, rev, class, bar[4];
+    /**
+     * Shadow of the standard 256 byte configuration header, read in
+     * one pass by micropv_pci_scan_bus. Reads that only touch read-only
+     * bytes (see config_ro) are served from here.
+     */
+    uint32_t config[MICROPV_PCI_CONFIG_HEADER_SIZE / sizeof(uint32_t)];
+    uint8_t config_ro[MICROPV_PCI_CONFIG_HEADER_SIZE / 8];
+    int config_valid;
+    /**
+     * Capability lists, standard (in the header) and PCIe extended
+     * (above the header)
+     */
+    micropv_pci_capability_t capability[MICROPV_PCI_MAX_CAPABILITIES];
+    int capabilities;
+    micropv_pci_capability_t ext_capability[MICROPV_PCI_MAX_CAPABILITIES];
+    int ext_capabilities;
+    /**
+     * Per device operation state. The frontend page carries one
+     * operation at a time for the whole bus, but every device can have
+     * its own operations queued while others are in flight.
+     */
+    volatile int ops_pending;
+    /**
+     * MSI handler for this device
+     */
+    int (*msi_callback)();
+    /**
+     * MSI-X vectors, each with its own event channel
+     */
+    micropv_pci_msix_vector_t msix[MICROPV_PCI_MAX_MSIX_VECTORS];
+    int msix_vectors;
+    /**
+     * BARs mapped by micropv_pci_map_bar
+     */
+    void *bar_virtual[MICROPV_PCI_MAX_BARS];
+    uint64_t bar_size[MICROPV_PCI_MAX_BARS];
 } micropv_pci_device_t;
 
+/**
+ * Completion record of an asynchronous PCI frontend operation. The
+ * frontend page only holds one operation at a time, so operations are
+ * queued on the bus and issued one after the other from the PCI event
+ * handler. The record belongs to micropv from submission until done is
+ * set, so it must not live in a stack frame that is unwound before that.
+ */
+typedef struct micropv_pci_completion_t
+{
+    /**
+     * Operation, filled in on submission
+     */
+    uint32_t cmd, domain, bus, devfn;
+    int32_t offset, size;
+    uint32_t value;
+    /**
+     * Result. value holds the data for a read.
+     */
+    int32_t err;
+    uint32_t info;
+    volatile int done;
+    /**
+     * Called from the PCI event handler (i.e. in interrupt context) when
+     * the operation completes. Can be NULL.
+     */
+    void (*callback)(struct micropv_pci_completion_t *completion);
+    void *context;
+    micropv_pci_device_t *device;
+    /**
+     * Vector table of XEN_PCI_OP_enable_msix, value holds the count
+     */
+    micropv_pci_msix_vector_t *msix;
+    struct micropv_pci_completion_t *next;
+} micropv_pci_completion_t;
+
 typedef struct micropv_pci_bus_t
 {
     /**
@@ -154,6 +389,21 @@ typedef struct micropv_pci_bus_t
      * @author smartin (7/22/2014)
      */
     grant_ref_t grant_ref;
+    /**
+     * Queue of operations waiting for the backend. The head is the
+     * operation in the shared page.
+     */
+    micropv_pci_completion_t *op_head, *op_tail;
+    /**
+     * Device table, optionally assigned by the caller before calling
+     * micropv_pci_scan_bus. The scan fills in up to max_devices
+     * entries and sets num_devices. Without one the scan uses
+     * single_device, so only the first device is seen.
+     */
+    micropv_pci_device_t *devices;
+    int max_devices;
+    int num_devices;
+    micropv_pci_device_t single_device;
 } micropv_pci_bus_t;
 
 typedef struct micropv_pci_handle_t
@@ -166,19 +416,103 @@ typedef struct micropv_pci_handle_t
     micropv_pci_bus_t *bus;
 
     /**
-     * Device data. This is set up to just handle one PCI device.
-     * This is enough for me as I only have one, however other
-     * people will have to generalize this, either defining this as
-     * a fixed array or having the caller assign an array. I think
-     * the second option is better.
-     *
-     * @author smartin (7/23/2014)
+     * Device that the operations on this handle go to. This points
+     * into the bus device table; micropv_pci_scan_bus points it at the
+     * first device, and a driver for several devices uses one handle
+     * per device (see micropv_pci_find_device).
      */
-    micropv_pci_device_t device;
+    micropv_pci_device_t *device;
 } micropv_pci_handle_t;
 
+/**
+ * Device queue that runs in poll mode while it is busy and goes back to
+ * its MSI-X vector when it is idle. Created by micropv_pci_queue_init.
+ */
+typedef struct micropv_pci_queue_t
+{
+    micropv_pci_handle_t *handle;
+    int vector;
+    /**
+     * Service the queue, doing at most budget items. Returns the number
+     * of items done, 0 means the queue is empty.
+     */
+    int (*poll)(struct micropv_pci_queue_t *queue, int budget);
+    /**
+     * Optional, switch the interrupt on/off in the device itself
+     */
+    void (*interrupt)(struct micropv_pci_queue_t *queue, int enable);
+    /**
+     * Optional, guest OS hooks for micropv_pci_queue_run. wait blocks the
+     * queue task until wake is called, wake is called from the MSI-X
+     * handler. A wake that comes before the wait must not be lost (a
+     * semaphore does). Without them the idle task blocks the domain until
+     * the next event.
+     */
+    void (*wait)(struct micropv_pci_queue_t *queue);
+    void (*wake)(struct micropv_pci_queue_t *queue);
+    void *context;
+    int budget;
+    volatile int polling;
+    volatile int stop;
+    /**
+     * Adaptive moderation, see xenpoll.c
+     */
+    uint32_t idle_polls, idle_threshold, rate;
+    uint32_t window_work, window_polls;
+    uint64_t window_start;
+    /**
+     * Counters
+     */
+    uint64_t polls, empty_polls;
+    volatile uint64_t interrupts;
+} micropv_pci_queue_t;
+
 typedef uint32_t xenbus_transaction_t;
 typedef void (*evtchn_handler_t)(uint32_t port, struct pt_regs *register_file, void *context);
+typedef void (*micropv_registry_watch_t)(const char *path, void *context);
+
+/**
+ * The xenstore only stores text, so binary data has to be
+ * encoded on the way in and decoded on the way out.
+ */
+typedef enum micropv_registry_encoding_t
+{
+    micropv_registry_encoding_hex,
+    micropv_registry_encoding_base64
+} micropv_registry_encoding_t;
+
+/**
+ * Directory listing iterator. The caller supplies the buffer and
+ * the names are handed back in place (no copies), so a name is
+ * only valid until the next call to micropv_registry_dir_next.
+ * If the list doesn't fit in the buffer then it is read in parts
+ * with XS_DIRECTORY_PART.
+ */
+typedef struct micropv_registry_dir_t
+{
+    xenbus_transaction_t xbt;
+    const char *path;
+    char *buffer;
+    size_t buffer_size;
+    /**
+     * Number of valid bytes in the buffer
+     */
+    size_t length;
+    /**
+     * Index in the buffer of the next name
+     */
+    size_t position;
+    /**
+     * Offset in the complete list of the next part to read
+     */
+    size_t offset;
+    /**
+     * Directory generation count, used to detect changes between parts
+     */
+    uint64_t generation;
+    int partial;
+    int complete;
+} micropv_registry_dir_t;
 
 /*---------------------------------------------------------------------
   -- function prototypes
@@ -281,6 +615,43 @@ void micropv_printk(const char *file, long line, const char *format, ...) __attr
  */
 void (*micropv_printkv)(const char *file, long line, const char *format, va_list args);
 
+/**
+ * Kernel print routine behind PRINTK. Prints like micropv_printk unless
+ * binary logging is on, in which case only the site id and the raw
+ * arguments are stored and the formatting is left to whoever reads the
+ * log. Strings are copied (up to 64 characters) as they may be gone by
+ * then.
+ *
+ * @param site   The call site, with the file, the line and the format.
+ * @param format The format of the site, passed again so that the compiler
+ *               checks it against the parameters.
+ */
+void micropv_printk_site(micropv_printk_site_t *site, const char *format, ...) __attribute__((format (printf, 2, 3)));
+
+/**
+ * Switch binary logging of PRINTK on or off. The log is kept in memory,
+ * when it is full the oldest records are dropped.
+ *
+ * @param enable Non zero for binary logging, zero for text to the console.
+ */
+void micropv_printk_log_enable(int enable);
+
+/**
+ * Format and remove the oldest records of the binary log, one line per
+ * record with the time it was logged, the file and the line.
+ *
+ * @param buffer Where to write the text.
+ * @param size   The size of the buffer. Only whole lines are written.
+ *
+ * @return The number of characters written, 0 when the log is empty.
+ */
+size_t micropv_printk_log_read(char *buffer, size_t size);
+
+/**
+ * Print out and empty the binary log.
+ */
+void micropv_printk_log_dump(void);
+
 /**
  * Kernel print routine. Whatever is written here is available in the
  * Xen dmesg log for this VM. This will print binary data in a
@@ -332,6 +703,119 @@ int micropv_console_read(void *ptr, size_t len);
  */
 int micropv_console_write(const void *ptr, size_t len);
 
+//--- PROFILER
+/**
+ * Start sampling the code the timer interrupt lands in. Any earlier
+ * samples are thrown away. Samples are only taken on timer ticks, so
+ * the period is rounded up to the scheduler's tick.
+ *
+ * @param period Nanoseconds between samples
+ */
+void micropv_profile_start(uint64_t period);
+
+/**
+ * Stop sampling. The samples are kept for export.
+ */
+void micropv_profile_stop(void);
+
+/**
+ * Write the samples in folded stack format, one line per distinct call
+ * chain. The buffer can be shared with another domain to get it out.
+ *
+ * @param buffer Where to write the text, it is NUL terminated
+ * @param size   Size of buffer
+ *
+ * @return Number of characters written, lines that don't fit are left off
+ */
+size_t micropv_profile_export(char *buffer, size_t size);
+
+/**
+ * Write the samples in folded stack format to the console
+ */
+void micropv_profile_dump(void);
+
+//--- CRASH DUMP
+/**
+ * Set aside a region for crash dumps and grant it, read only, to the
+ * domain that will collect them. The region is advertised in the xenstore
+ * under data/crashdump. On a fatal trap an ELF core style image with the
+ * registers, FP state, stack, call chain, console log and any ranges
+ * added with micropv_crash_dump_add_range is written into it.
+ *
+ * @param remote_dom Domain that collects the dump, normally 0
+ * @param order      log2 of the number of pages in the region
+ *
+ * @return 0 on success, -1 on failure
+ */
+int micropv_crash_dump_init(int remote_dom, unsigned int order);
+
+/**
+ * Add a memory range to the crash dump
+ *
+ * @param start  Start of the range
+ * @param length Length in bytes
+ *
+ * @return 0 on success, -1 if there are too many ranges
+ */
+int micropv_crash_dump_add_range(const void *start, size_t length);
+
+//--- DEBUGGER
+/**
+ * Start the GDB stub. From now on the console ring carries the GDB
+ * remote protocol, breakpoint and debug traps stop in the stub instead
+ * of crashing, and a ^C from GDB stops the guest. This returns straight
+ * away, call micropv_gdb_break afterwards to wait for GDB to attach.
+ */
+void micropv_gdb_enable(void);
+
+/**
+ * Stop in the debugger, as if a breakpoint had been hit
+ */
+void micropv_gdb_break(void);
+
+//--- PERFORMANCE COUNTERS
+/**
+ * Start the hardware performance counters through the Xen vPMU. Xen
+ * must be booted with vpmu=on and the CPU must have the Intel
+ * architectural PMU.
+ *
+ * @return 0 on success, -1 if there is no vPMU
+ */
+int micropv_perf_init(void);
+
+/**
+ * Read a counter. If micropv_perf_thread is set the count is for that
+ * thread alone, otherwise it is the raw counter.
+ *
+ * @param event Event to read
+ *
+ * @return Count, 0 if the vPMU isn't running
+ */
+uint64_t micropv_perf_read(micropv_perf_event_t event);
+
+//--- HYPERCALL ACCOUNTING
+/**
+ * Hypercall counts and TSC cycles, only kept when built with
+ * -DMICROPV_HYPERCALL_STATS. The table is indexed
+ * [hypercall][sub operation], MICROPV_HYPERCALL_OPS by
+ * MICROPV_HYPERCALL_SUBOPS. The sub operation is the command for
+ * hypercalls that take one (event_channel_op, vcpu_op, memory_op, ...)
+ * and 0 for the rest.
+ *
+ * @return The table or NULL if accounting isn't built in
+ */
+const micropv_hypercall_stats_t *micropv_hypercall_stats(void);
+
+/**
+ * Zero the hypercall accounting table
+ */
+void micropv_hypercall_stats_reset(void);
+
+/**
+ * Print the non zero entries of the hypercall accounting table
+ */
+void micropv_hypercall_stats_dump(void);
+
 //--- SHARED MEMORY
 /**
  * Publish a shared page. The page MUST be one complete processor page, i.e.
@@ -356,11 +840,14 @@ void micropv_shared_memory_unpublish(const char *name);
  * processor page, i.e. declare as char
  * __atribute__((aligned(4096)).
  *
- * @param handle Stores the grant context data.
+ * @param handle Stores the grant context data. handle->buffer is set to
+ *               where the page is mapped.
  * @param name   Name of the entry in the Xen store (relative to
  *               this VM)
  * @param buffer Address of the memory to be mapped. This must
- *               be a pointer to a processor page.
+ *               be a pointer to a processor page. If NULL a page is
+ *               taken from the grant arena, and given back by
+ *               micropv_shared_memory_unconsume.
  *
  * @return 0 on success, otherwise -1.
  */
@@ -416,6 +903,144 @@ uint64_t micropv_virtual_to_machine_address(uint64_t virtual_address);
  */
 uint64_t micropv_machine_to_virtual_address(uint64_t machine_address);
 
+/**
+ * Convert a guest buffer to the list of machine memory runs behind it.
+ * Without MICROPV_SG_MERGE there is one segment per page touched, which
+ * is what grants need. With it, frames that are adjacent in machine
+ * memory are merged into a single segment for DMA descriptors.
+ *
+ * @param buffer   Start of the buffer
+ * @param length   Length of the buffer in bytes
+ * @param segments Filled in with the segments
+ * @param max_segments
+ *                 Number of entries in segments
+ * @param flags    MICROPV_SG_MERGE or 0
+ *
+ * @return Number of segments used or -1 if they don't fit in max_segments
+ *         or part of the buffer has no machine frame behind it
+ */
+int micropv_virtual_to_machine_sg(const void *buffer, size_t length, micropv_sg_segment_t *segments, size_t max_segments, int flags);
+
+/**
+ * Allocate 2^order contiguous pages from the page allocator.
+ *
+ * @param order log2 of the number of pages
+ *
+ * @return Pointer to the first page or NULL if there is no block that big
+ */
+void *micropv_page_alloc(unsigned int order);
+
+/**
+ * Allocate 2^order contiguous pages, mapping each 2MB chunk with a
+ * superpage where the hypervisor allows it (this saves TLB entries on
+ * big tables). Falls back to 4K pages transparently. The pages can't be
+ * remapped one at a time until they are freed.
+ *
+ * @param order log2 of the number of pages
+ *
+ * @return Pointer to the first page or NULL if there is no block that big
+ */
+void *micropv_page_alloc_large(unsigned int order);
+
+/**
+ * Give pages back to the page allocator. Buddies are merged back
+ * into bigger blocks.
+ *
+ * @param page  Pointer returned by micropv_page_alloc
+ * @param order Order that was allocated
+ */
+void micropv_page_free(void *page, unsigned int order);
+
+/**
+ * Give back a single page whose contents are not in the CPU cache (e.g.
+ * after a device has written to it), so it is reused last.
+ *
+ * @param page Pointer returned by micropv_page_alloc(0)
+ */
+void micropv_page_free_cold(void *page);
+
+/**
+ * @return Number of free pages
+ */
+uint64_t micropv_page_free_count(void);
+
+/**
+ * Reserve a run of virtual pages to map grants, MMIO or foreign frames
+ * over. Runs can be given back and are reused.
+ *
+ * @param arena Arena to take the pages from
+ * @param pages Number of pages
+ * @param flags MICROPV_VMEM_GUARD to leave an unmapped page after the run
+ *
+ * @return Address of the run or NULL if the arena is full
+ */
+void *micropv_vmem_alloc(micropv_vmem_arena_t arena, size_t pages, int flags);
+
+/**
+ * Give a run back to its arena. Anything mapped over it must have been
+ * unmapped.
+ *
+ * @param virtual_address Address returned by micropv_vmem_alloc
+ *
+ * @return 0 on success, otherwise -1
+ */
+int micropv_vmem_free(void *virtual_address);
+
+/**
+ * Set the balloon target directly, as if memory/target had been
+ * written. Pages above the target go back to the hypervisor.
+ *
+ * @param pages Number of pages the guest should have
+ */
+void micropv_balloon_set_target(uint64_t pages);
+
+/**
+ * @return Number of pages in the balloon, i.e. given back to the hypervisor
+ */
+uint64_t micropv_balloon_pages(void);
+
+/**
+ * Heap. These follow the C library functions of the same name and can
+ * be called from event handlers. aligned_alloc supports alignments up to
+ * a page.
+ */
+void *micropv_malloc(size_t size);
+void micropv_free(void *ptr);
+void *micropv_calloc(size_t count, size_t size);
+void *micropv_realloc(void *ptr, size_t size);
+void *micropv_aligned_alloc(size_t alignment, size_t size);
+
+/**
+ * Take a snapshot of the heap usage
+ *
+ * @param stats Output buffer
+ */
+void micropv_heap_stats(micropv_heap_stats_t *stats);
+
+/**
+ * Allocate a machine contiguous buffer that a passthrough device can
+ * DMA to. The size is rounded up to a power of two number of pages (at
+ * most 2MB), the pages come from the page allocator and their frames
+ * are exchanged for one contiguous extent.
+ *
+ * @param size         Length of the buffer in bytes
+ * @param address_bits Machine address width the device can reach
+ *                     (e.g. 32), 0 for no limit
+ * @param bus_address  Address to give to the device
+ *
+ * @return Pointer to the buffer or NULL on failure
+ */
+void *micropv_dma_alloc(size_t size, unsigned int address_bits, uint64_t *bus_address);
+
+/**
+ * Free a buffer from micropv_dma_alloc. The contiguous extent goes back
+ * to the hypervisor and the pages to the page allocator.
+ *
+ * @param buffer Pointer returned by micropv_dma_alloc
+ * @param size   Size that was allocated
+ */
+void micropv_dma_free(void *buffer, size_t size);
+
 //--- HYPERVISOR_STATUS
 
 /**
@@ -440,8 +1065,96 @@ int micropv_is_ready(xenbus_transaction_t xbt);
 //--- REGISTRY
 int micropv_registry_read_integer(xenbus_transaction_t xbt, const char *path, int *value);
 int micropv_registry_write_integer(xenbus_transaction_t xbt, const char *path, int value);
+int micropv_registry_read_int64(xenbus_transaction_t xbt, const char *path, int64_t *value);
+int micropv_registry_write_int64(xenbus_transaction_t xbt, const char *path, int64_t value);
+int micropv_registry_read_uint64(xenbus_transaction_t xbt, const char *path, uint64_t *value);
+int micropv_registry_write_uint64(xenbus_transaction_t xbt, const char *path, uint64_t value);
+
+/**
+ * Read a string from the registry. The result is always NUL
+ * terminated.
+ *
+ * @param xbt        transaction or XBT_NIL
+ * @param path       registry key
+ * @param value      output buffer
+ * @param value_size size of the output buffer including the terminator
+ *
+ * @return int 0 on success, 1 if the value was truncated, <0 on error
+ */
+int micropv_registry_read_string(xenbus_transaction_t xbt, const char *path, char *value, size_t value_size);
+int micropv_registry_write_string(xenbus_transaction_t xbt, const char *path, const char *value);
+
+/**
+ * Read a binary blob from the registry.
+ *
+ * @param xbt         transaction or XBT_NIL
+ * @param path        registry key
+ * @param data        output buffer
+ * @param data_size   size of the output buffer
+ * @param data_length number of bytes decoded into the output buffer
+ * @param encoding    encoding used when the blob was written
+ *
+ * @return int 0 on success, 1 if the value was truncated, <0 on error or bad encoding
+ */
+int micropv_registry_read_binary(xenbus_transaction_t xbt, const char *path, void *data, size_t data_size, size_t *data_length, micropv_registry_encoding_t encoding);
+
+/**
+ * Write a binary blob to the registry. The encoded value must fit
+ * in a single xenstore payload (4096 bytes including the path).
+ *
+ * @return int 0 on success, otherwise -1
+ */
+int micropv_registry_write_binary(xenbus_transaction_t xbt, const char *path, const void *data, size_t data_length, micropv_registry_encoding_t encoding);
+
+/**
+ * Start listing a registry directory.
+ *
+ * @param dir         iterator to initialise
+ * @param xbt         transaction or XBT_NIL
+ * @param path        registry directory. This must stay valid while iterating
+ * @param buffer      buffer that receives the list
+ * @param buffer_size size of the buffer
+ *
+ * @return int 0 on success, 1 if the list was truncated and the xenstore
+ *         can't return it in parts, <0 on error
+ */
+int micropv_registry_dir_open(micropv_registry_dir_t *dir, xenbus_transaction_t xbt, const char *path, char *buffer, size_t buffer_size);
+
+/**
+ * Get the next name in a registry directory
+ *
+ * @param dir iterator initialised by micropv_registry_dir_open
+ *
+ * @return const char* name of the entry (pointer into the iterator
+ *         buffer) or NULL at the end of the list
+ */
+const char *micropv_registry_dir_next(micropv_registry_dir_t *dir);
+
 int micropv_registry_rm(xenbus_transaction_t xbt, const char *path);
 
+/**
+ * Watch a xenstore path. The watch fires once straight away, and then
+ * every time the path or anything below it changes.
+ *
+ * @param path     path to watch
+ * @param callback called from micropv_registry_poll_watches with the
+ *                 watched path
+ * @param context  passed to the callback
+ *
+ * @return 0 on success, otherwise -1
+ */
+int micropv_registry_watch(const char *path, micropv_registry_watch_t callback, void *context);
+
+/**
+ * Run the callbacks of the watches that have fired. Watch events are
+ * only noticed when the xenstore is used or this is called, so the OS
+ * should call it regularly from a task (not from an event handler, the
+ * callbacks normally read the xenstore).
+ *
+ * @return number of callbacks run
+ */
+int micropv_registry_poll_watches(void);
+
 //--- PCI interface
 /**
  * Map a PCI bus into our domain
@@ -470,17 +1183,195 @@ void micropv_pci_unmap_bus(micropv_pci_handle_t *handle);
  *
  * @author smartin (7/18/2014)
  *
- * @param handle stores the device context data
+ * @param handle stores the device context data. handle->bus->devices
+ *               and handle->bus->max_devices are assigned to see more
+ *               than one device.
  *
  * @return int 0 on success, otherwise -1
  */
 int micropv_pci_scan_bus(micropv_pci_handle_t *handle);
 
+/**
+ * Point a handle at a device in the bus device table
+ *
+ * @param handle   handle to set up. handle->bus must be scanned.
+ * @param vendor   vendor id to look for
+ * @param device   device id to look for
+ * @param instance 0 for the first matching device, 1 for the second...
+ *
+ * @return int 0 on success, -1 if there is no such device
+ */
+int micropv_pci_find_device(micropv_pci_handle_t *handle, uint32_t vendor, uint32_t device, int instance);
+
+/**
+ * Block until all the queued operations of the handle's device
+ * have completed. The caller yields to the other tasks while it
+ * waits.
+ *
+ * @param handle stores the device context data
+ */
+void micropv_pci_flush(micropv_pci_handle_t *handle);
+
+/**
+ * Read/write the device configuration space. These wait until
+ * pciback answers on the PCI event channel, yielding to the other
+ * tasks in the meantime.
+ */
 int micropv_pci_conf_read(micropv_pci_handle_t *handle, unsigned int off, unsigned int size, unsigned int *val);
 int micropv_pci_conf_write(micropv_pci_handle_t *handle, unsigned int off, unsigned int size, unsigned int val);
+
+/**
+ * Queue a configuration space read and return straight away. The
+ * result is in completion->value once completion->done is set (or
+ * the callback is called).
+ *
+ * @param handle     stores the device context data
+ * @param off        configuration space offset
+ * @param size       access size in bytes (1, 2 or 4)
+ * @param completion operation record, see micropv_pci_completion_t.
+ *                   callback and context must be set by the caller.
+ *
+ * @return int 0 if queued, otherwise -1
+ */
+int micropv_pci_conf_read_async(micropv_pci_handle_t *handle, unsigned int off, unsigned int size, micropv_pci_completion_t *completion);
+
+/**
+ * Queue a configuration space write and return straight away.
+ *
+ * @see micropv_pci_conf_read_async
+ */
+int micropv_pci_conf_write_async(micropv_pci_handle_t *handle, unsigned int off, unsigned int size, unsigned int val, micropv_pci_completion_t *completion);
+
+/**
+ * Block until an asynchronous operation completes. The caller
+ * yields to the other tasks while it waits.
+ *
+ * @param completion operation record passed to the async call
+ *
+ * @return int the backend error code, 0 on success
+ */
+int micropv_pci_wait(micropv_pci_completion_t *completion);
+/**
+ * Find a capability in the standard capability list. This is served
+ * from the configuration shadow, so there is no backend round trip.
+ *
+ * @param handle stores the device context data
+ * @param id     capability id (MICROPV_PCI_CAP_ID_xxx)
+ *
+ * @return int configuration space offset of the capability, 0 if not found
+ */
+int micropv_pci_find_capability(micropv_pci_handle_t *handle, unsigned int id);
+
+/**
+ * Find a capability in the PCIe extended capability list.
+ *
+ * @param handle stores the device context data
+ * @param id     extended capability id (MICROPV_PCI_EXT_CAP_ID_xxx)
+ *
+ * @return int configuration space offset of the capability, 0 if not found
+ */
+int micropv_pci_find_ext_capability(micropv_pci_handle_t *handle, unsigned int id);
+
 int micropv_pci_msi_enable(micropv_pci_handle_t *handle, int (*callback)());
 int micropv_pci_msi_disable(micropv_pci_handle_t *handle);
 
+/**
+ * Enable MSI-X for the device. Every vector gets its own physical IRQ
+ * from the backend and is bound to its own event channel, so the
+ * vectors can be serviced and masked independently (e.g. one per NIC
+ * queue). All the vectors go to vcpu 0, a vector with any other cpu
+ * is rejected.
+ *
+ * @param handle  stores the device context data
+ * @param vectors vectors to enable; entry, handler, context and cpu
+ *                must be filled in. The table is copied into the device.
+ * @param count   number of vectors, at most MICROPV_PCI_MAX_MSIX_VECTORS
+ *
+ * @return int 0 on success, otherwise the backend error or -1 (also if
+ *             a vector's cpu isn't 0)
+ */
+int micropv_pci_msix_enable(micropv_pci_handle_t *handle, const micropv_pci_msix_vector_t *vectors, int count);
+
+/**
+ * Unbind all the MSI-X vectors and disable MSI-X for the device
+ *
+ * @param handle stores the device context data
+ *
+ * @return int 0 on success, otherwise the backend error
+ */
+int micropv_pci_msix_disable(micropv_pci_handle_t *handle);
+
+/**
+ * Mask/unmask a single MSI-X vector
+ *
+ * @param handle stores the device context data
+ * @param vector vector index
+ */
+void micropv_pci_msix_mask(micropv_pci_handle_t *handle, int vector);
+void micropv_pci_msix_unmask(micropv_pci_handle_t *handle, int vector);
+
+/**
+ * Decode a memory BAR (32 or 64 bit) from the configuration space.
+ *
+ * @param handle  stores the device context data
+ * @param bar     BAR index, 0 to 5 (0 or 1 for a bridge). A 64 bit BAR
+ *                uses bar and bar + 1.
+ * @param address machine address of the BAR
+ * @param size    size of the BAR in bytes
+ *
+ * @return int 0 on success, -1 if it is not an assigned memory BAR
+ */
+int micropv_pci_decode_bar(micropv_pci_handle_t *handle, int bar, uint64_t *address, uint64_t *size);
+
+/**
+ * Map a memory BAR into the MMIO arena of the guest. Mapping a BAR a
+ * second time returns the existing mapping.
+ *
+ * @param handle stores the device context data
+ * @param bar    BAR index, 0 to 5
+ * @param cache  MICROPV_PCI_MAP_UC for registers, MICROPV_PCI_MAP_WC
+ *               for doorbells and other write mostly areas
+ * @param size   if not NULL, receives the size of the BAR
+ *
+ * @return void* address of the BAR or NULL on failure
+ */
+void *micropv_pci_map_bar(micropv_pci_handle_t *handle, int bar, int cache, uint64_t *size);
+
+/**
+ * Set up a poll mode queue on an enabled MSI-X vector. This takes over
+ * the vector handler. The queue starts in poll mode.
+ *
+ * @param queue   queue to initialise
+ * @param handle  stores the device context data
+ * @param vector  MSI-X vector index of the queue
+ * @param poll    function that services the queue
+ * @param context caller data, available as queue->context
+ *
+ * @return int 0 on success, otherwise -1
+ */
+int micropv_pci_queue_init(micropv_pci_queue_t *queue, micropv_pci_handle_t *handle, int vector,
+                           int (*poll)(micropv_pci_queue_t *queue, int budget), void *context);
+
+/**
+ * Poll the queue once if it is in poll mode. After enough empty polls
+ * the queue switches back to interrupts.
+ *
+ * @param queue poll mode queue
+ *
+ * @return int number of items done
+ */
+int micropv_pci_queue_poll(micropv_pci_queue_t *queue);
+
+/**
+ * Body of a dedicated queue task. Polls while the queue is busy and
+ * sleeps in queue->wait (or blocks the domain) until the MSI-X
+ * interrupt when it is idle. Returns when queue->stop is set, the task
+ * that sets it calls queue->wake as well.
+ *
+ * @param queue poll mode queue
+ */
+void micropv_pci_queue_run(micropv_pci_queue_t *queue);
+
 /*---------------------------------------------------------------------
   -- global variables
   ---------------------------------------------------------------------*/
@@ -496,6 +1387,13 @@ int micropv_pci_msi_disable(micropv_pci_handle_t *handle);
  */
 extern uint64_t (*micropv_scheduler_timer_callback)(struct pt_regs *regs, uint64_t deadline);
 
+/**
+ * Performance counter context of the running thread. The overlying
+ * operating system sets this from its timer and yield handlers when it
+ * switches thread, and the counts move over with it.
+ */
+extern micropv_perf_context_t *micropv_perf_thread;
+
 /**
  * This is the register where the overlying operating system must store the
  * pointer to its' yield handler. This is called when a process
@@ -0,0 +1,151 @@
+/*  ***********************************************************************
+    * Project:
+    * File: bench_string.c
+    * Author: smartin
+    ***********************************************************************
+
+    Throughput of the stdlib memcpy, memmove and memset against the host C library, for sizes from 8 bytes to 1MB.
+    The stdlib functions are linked in under a micropv_ prefix (see the Makefile) so both can be called from here.
+
+    Each size is run over a buffer aligned to a cache line plus an odd offset, so the aligned fast paths don't
+    flatter either side, and repeated until it has taken long enough to time. The buffers of the small sizes stay in
+    the cache, from 256KB up they don't.
+
+    Modifications
+    0.00 10/19/2026 created
+*/
+
+/*---------------------------------------------------------------------
+  -- macros (preamble)
+  ---------------------------------------------------------------------*/
+#define _GNU_SOURCE
+
+/*---------------------------------------------------------------------
+  -- standard includes
+  ---------------------------------------------------------------------*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*---------------------------------------------------------------------
+  -- project includes (imports)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- project includes (exports)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- macros (postamble)
+  ---------------------------------------------------------------------*/
+#define BENCH_MIN_SIZE          8
+#define BENCH_MAX_SIZE          (1024 * 1024)
+#define BENCH_OFFSET            3
+#define BENCH_TIME              20000000UL
+
+/*---------------------------------------------------------------------
+  -- forward declarations
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- data types
+  ---------------------------------------------------------------------*/
+typedef void *(*bench_copy_t)(void *dest, const void *src, size_t n);
+typedef void *(*bench_set_t)(void *dest, int c, size_t n);
+
+/*---------------------------------------------------------------------
+  -- function prototypes
+  ---------------------------------------------------------------------*/
+void *micropv_memcpy(void *dest, const void *src, size_t n);
+void *micropv_memmove(void *dest, const void *src, size_t n);
+void *micropv_memset(void *dest, int c, size_t n);
+
+/*---------------------------------------------------------------------
+  -- global variables
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- local variables
+  ---------------------------------------------------------------------*/
+// called through these so the compiler can't inline or drop the host calls
+static bench_copy_t volatile host_memcpy = memcpy;
+static bench_copy_t volatile host_memmove = memmove;
+static bench_set_t volatile host_memset = memset;
+
+/*---------------------------------------------------------------------
+  -- implementation
+  ---------------------------------------------------------------------*/
+
+static uint64_t bench_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// MB/s of copies of size bytes. The moves go a few bytes up the source, which takes the backward path
+static double bench_copy(bench_copy_t copy, uint8_t *dest, uint8_t *src, size_t size)
+{
+    uint64_t start = bench_clock(), now;
+    uint64_t bytes = 0;
+
+    do
+    {
+        for (int i = 0; i < 64; i++)
+            copy(dest, src, size);
+        bytes += 64 * size;
+    }
+    while ((now = bench_clock()) - start < BENCH_TIME);
+
+    return bytes * 1000.0 / (now - start);
+}
+
+static double bench_set(bench_set_t set, uint8_t *dest, size_t size)
+{
+    uint64_t start = bench_clock(), now;
+    uint64_t bytes = 0;
+
+    do
+    {
+        for (int i = 0; i < 64; i++)
+            set(dest, i, size);
+        bytes += 64 * size;
+    }
+    while ((now = bench_clock()) - start < BENCH_TIME);
+
+    return bytes * 1000.0 / (now - start);
+}
+
+int main(int argc, char *argv[])
+{
+    uint8_t *src = aligned_alloc(64, BENCH_MAX_SIZE + 128);
+    uint8_t *dest = aligned_alloc(64, BENCH_MAX_SIZE + 128);
+    size_t size;
+
+    if (!src || !dest)
+        return 1;
+    memset(src, 0x5a, BENCH_MAX_SIZE + 128);
+    memset(dest, 0, BENCH_MAX_SIZE + 128);
+
+    printf("%8s %20s %20s %20s\n", "", "memcpy MB/s", "memmove MB/s", "memset MB/s");
+    printf("%8s %9s %10s %9s %10s %9s %10s\n", "size", "micropv", "host", "micropv", "host", "micropv", "host");
+
+    for (size = BENCH_MIN_SIZE; size <= BENCH_MAX_SIZE; size *= 2)
+    {
+        uint8_t *to = dest + BENCH_OFFSET;
+        uint8_t *from = src + BENCH_OFFSET + 1;
+        uint8_t *overlap = src + BENCH_OFFSET + 8;
+
+        printf("%8zu %9.0f %10.0f %9.0f %10.0f %9.0f %10.0f\n", size,
+            bench_copy(micropv_memcpy, to, from, size), bench_copy(host_memcpy, to, from, size),
+            bench_copy(micropv_memmove, overlap, from, size), bench_copy(host_memmove, overlap, from, size),
+            bench_set(micropv_memset, to, size), bench_set(host_memset, to, size));
+    }
+
+    free(src);
+    free(dest);
+
+    return 0;
+}
@@ -0,0 +1,662 @@
+/*  ***********************************************************************
+    * Project:
+    * File: xensim.c
+    * Author: smartin
+    ***********************************************************************
+
+    A hypervisor in a Linux process, so that the event, console, time, xenstore and scheduler code can be run,
+    debugged and profiled on a development machine. Build the guest code with -DMICROPV_SIM and every hypercall comes
+    here through xensim_hypercall instead of the hypercall page.
+
+    The thread that calls micropv_sim_start is the guest's only vCPU. The shared info page is ordinary memory and the
+    event channel bits in it are set and cleared exactly as Xen does, so xenevents.c doesn't know the difference.
+    Upcalls are SIGUSR1 sent to the guest thread: the handler builds a pt_regs from the signal context, calls
+    do_hypervisor_callback with it and writes it back, so a scheduler that switches stacks by changing regs works as
+    it does under Xen. As with Xen nothing is delivered in the middle of a hypercall, the handler backs off and the
+    upcall happens on the way out.
+
+    System time is CLOCK_MONOTONIC from the start of the simulation. The TSC scale in the shared info page is
+    calibrated against it at startup so the guest's own TSC based clock agrees with the timers.
+
+    Memory management, grant tables and PCI have no simulation: those hypercalls fail with ENOSYS. Lazy FPU switching
+    isn't simulated either, fpu_taskswitch does nothing.
+
+    Modifications
+    0.00 10/19/2026 created
+*/
+
+/*---------------------------------------------------------------------
+  -- macros (preamble)
+  ---------------------------------------------------------------------*/
+#define _GNU_SOURCE
+
+/*---------------------------------------------------------------------
+  -- standard includes
+  ---------------------------------------------------------------------*/
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <xen/xen.h>
+#include <xen/event_channel.h>
+#include <xen/sched.h>
+#include <xen/vcpu.h>
+#include <xen/version.h>
+
+/*---------------------------------------------------------------------
+  -- project includes (imports)
+  ---------------------------------------------------------------------*/
+#include "../micropv.h"
+#include "hypervisor.h"
+#include "hypercall.h"
+#include "os.h"
+#include "psnprintf.h"
+#include "xenconsole.h"
+#include "xenevents.h"
+#include "xenschedule.h"
+#include "xenstore.h"
+#include "xentime.h"
+
+/*---------------------------------------------------------------------
+  -- project includes (exports)
+  ---------------------------------------------------------------------*/
+#include "xensim.h"
+
+/*---------------------------------------------------------------------
+  -- macros (postamble)
+  ---------------------------------------------------------------------*/
+#define SIM_PORTS               64
+#define SIM_VIRQS               24
+#define SIM_UPCALL_SIGNAL       SIGUSR1
+#define SIM_PRINTK_BUFFER_SIZE  128
+
+#define SIM_PORT_BIT(port)      (1UL << ((port) % (sizeof(xen_ulong_t) * 8)))
+#define SIM_PORT_WORD(port)     ((port) / (sizeof(xen_ulong_t) * 8))
+
+/*---------------------------------------------------------------------
+  -- forward declarations
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- data types
+  ---------------------------------------------------------------------*/
+typedef enum sim_port_state_t
+{
+    sim_port_free,
+    sim_port_unbound,
+    sim_port_interdomain,
+    sim_port_virq,
+    sim_port_backend
+} sim_port_state_t;
+
+typedef struct sim_port_t
+{
+    sim_port_state_t state;
+    // the other end of an interdomain port, the eventfd of a backend port
+    int peer;
+    int eventfd;
+} sim_port_t;
+
+/*---------------------------------------------------------------------
+  -- function prototypes
+  ---------------------------------------------------------------------*/
+void do_hypervisor_callback(struct pt_regs *regs);
+void hypervisor_callback(void);
+void failsafe_callback(void);
+static void sim_printkv(const char *file, long line, const char *format, va_list args);
+
+/*---------------------------------------------------------------------
+  -- global variables
+  ---------------------------------------------------------------------*/
+start_info_t hypervisor_start_info;
+shared_info_t *hypervisor_shared_info;
+void (*micropv_printkv)(const char *file, long line, const char *format, va_list args) = sim_printkv;
+
+// the modules that aren't part of the simulator build
+micropv_perf_context_t *micropv_perf_thread = NULL;
+
+/*---------------------------------------------------------------------
+  -- local variables
+  ---------------------------------------------------------------------*/
+static shared_info_t sim_shared_info __attribute__((aligned(__PAGE_SIZE)));
+static sim_port_t sim_ports[SIM_PORTS];
+static evtchn_port_t sim_virqs[SIM_VIRQS];
+static pthread_t sim_guest;
+static uint64_t sim_boot;
+
+// hypercalls in progress on the guest thread, upcalls wait until this is back to 0
+static volatile sig_atomic_t sim_depth = 0;
+
+/*---------------------------------------------------------------------
+  -- implementation
+  ---------------------------------------------------------------------*/
+
+static uint64_t sim_clock(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+uint64_t xensim_system_time(void)
+{
+    return sim_clock(CLOCK_MONOTONIC) - sim_boot;
+}
+
+/* Work out the scale the guest uses to turn TSC ticks into nanoseconds, the same way Xen does:
+ * ns = ((ticks << shift) * mul) >> 32
+ */
+static void sim_time_init(void)
+{
+    struct vcpu_time_info *time = &sim_shared_info.vcpu_info[0].time;
+    uint64_t tsc0, tsc1, ns0, ns1;
+
+    sim_boot = sim_clock(CLOCK_MONOTONIC);
+
+    ns0 = xensim_system_time();
+    rdtscll(tsc0);
+    do
+        ns1 = xensim_system_time();
+    while ((ns1 - ns0) < 20000000UL);
+    rdtscll(tsc1);
+
+    uint64_t ticks_per_second = (tsc1 - tsc0) * 1000000000UL / (ns1 - ns0);
+    int shift = 0;
+
+    while (ticks_per_second > 2000000000UL)
+    {
+        ticks_per_second >>= 1;
+        shift--;
+    }
+    while (ticks_per_second <= 1000000000UL)
+    {
+        ticks_per_second <<= 1;
+        shift++;
+    }
+
+    time->version++;
+    wmb();
+    time->tsc_to_system_mul = (uint32_t)((1000000000UL << 32) / ticks_per_second);
+    time->tsc_shift = shift;
+    rdtscll(time->tsc_timestamp);
+    time->system_time = xensim_system_time();
+    wmb();
+    time->version++;
+
+    // the wall clock is the time we booted
+    uint64_t boot = sim_clock(CLOCK_REALTIME) - xensim_system_time();
+    sim_shared_info.wc_version++;
+    wmb();
+    sim_shared_info.wc_sec = boot / 1000000000UL;
+    sim_shared_info.wc_nsec = boot % 1000000000UL;
+    wmb();
+    sim_shared_info.wc_version++;
+}
+
+static evtchn_port_t sim_port_alloc(sim_port_state_t state)
+{
+    evtchn_port_t port;
+
+    // port 0 is never handed out, the guest takes it to mean no port
+    for (port = 1; port < SIM_PORTS; port++)
+    {
+        if (sim_ports[port].state == sim_port_free)
+        {
+            sim_ports[port].state = state;
+            sim_ports[port].peer = 0;
+            sim_ports[port].eventfd = -1;
+            return port;
+        }
+    }
+
+    return 0;
+}
+
+void xensim_raise(evtchn_port_t port)
+{
+    shared_info_t *s = &sim_shared_info;
+    vcpu_info_t *vcpu = &s->vcpu_info[0];
+
+    // the same steps as evtchn_set_pending in Xen
+    if (__atomic_fetch_or(&s->evtchn_pending[SIM_PORT_WORD(port)], SIM_PORT_BIT(port), __ATOMIC_SEQ_CST) & SIM_PORT_BIT(port))
+        return;
+    if (!(__atomic_load_n(&s->evtchn_mask[SIM_PORT_WORD(port)], __ATOMIC_SEQ_CST) & SIM_PORT_BIT(port)) &&
+        !(__atomic_fetch_or(&vcpu->evtchn_pending_sel, 1UL << SIM_PORT_WORD(port), __ATOMIC_SEQ_CST) & (1UL << SIM_PORT_WORD(port))))
+        vcpu->evtchn_upcall_pending = 1;
+
+    // a masked port still wakes SCHEDOP_poll, the handler ignores what it can't deliver. On the guest thread
+    // itself it goes on the way out of the hypercall
+    if (!pthread_equal(pthread_self(), sim_guest))
+        pthread_kill(sim_guest, SIM_UPCALL_SIGNAL);
+}
+
+void xensim_raise_virq(unsigned int virq)
+{
+    if ((virq < SIM_VIRQS) && sim_virqs[virq])
+        xensim_raise(sim_virqs[virq]);
+}
+
+evtchn_port_t xensim_bind_backend(int eventfd)
+{
+    evtchn_port_t port = sim_port_alloc(sim_port_backend);
+
+    if (port)
+        sim_ports[port].eventfd = eventfd;
+
+    return port;
+}
+
+static void sim_regs_from_context(struct pt_regs *regs, const ucontext_t *uc)
+{
+    const greg_t *gregs = uc->uc_mcontext.gregs;
+
+    memset(regs, 0, sizeof(*regs));
+    regs->r15 = gregs[REG_R15];
+    regs->r14 = gregs[REG_R14];
+    regs->r13 = gregs[REG_R13];
+    regs->r12 = gregs[REG_R12];
+    regs->bp = gregs[REG_RBP];
+    regs->bx = gregs[REG_RBX];
+    regs->r11 = gregs[REG_R11];
+    regs->r10 = gregs[REG_R10];
+    regs->r9 = gregs[REG_R9];
+    regs->r8 = gregs[REG_R8];
+    regs->ax = gregs[REG_RAX];
+    regs->cx = gregs[REG_RCX];
+    regs->dx = gregs[REG_RDX];
+    regs->si = gregs[REG_RSI];
+    regs->di = gregs[REG_RDI];
+    regs->orig_ax = -1;
+    regs->ip = gregs[REG_RIP];
+    regs->cs = gregs[REG_CSGSFS] & 0xffff;
+    regs->flags = gregs[REG_EFL];
+    regs->sp = gregs[REG_RSP];
+    { uint64_t ss; __asm__("\t movq %%ss,%0" : "=r"(ss)); regs->ss = ss; }
+}
+
+static void sim_regs_to_context(const struct pt_regs *regs, ucontext_t *uc)
+{
+    greg_t *gregs = uc->uc_mcontext.gregs;
+
+    gregs[REG_R15] = regs->r15;
+    gregs[REG_R14] = regs->r14;
+    gregs[REG_R13] = regs->r13;
+    gregs[REG_R12] = regs->r12;
+    gregs[REG_RBP] = regs->bp;
+    gregs[REG_RBX] = regs->bx;
+    gregs[REG_R11] = regs->r11;
+    gregs[REG_R10] = regs->r10;
+    gregs[REG_R9] = regs->r9;
+    gregs[REG_R8] = regs->r8;
+    gregs[REG_RAX] = regs->ax;
+    gregs[REG_RCX] = regs->cx;
+    gregs[REG_RDX] = regs->dx;
+    gregs[REG_RSI] = regs->si;
+    gregs[REG_RDI] = regs->di;
+    gregs[REG_RIP] = regs->ip;
+    gregs[REG_EFL] = regs->flags;
+    gregs[REG_RSP] = regs->sp;
+}
+
+static void sim_upcall(int signal, siginfo_t *info, void *context)
+{
+    vcpu_info_t *vcpu = &sim_shared_info.vcpu_info[0];
+    struct pt_regs regs;
+
+    // in a hypercall, it is delivered on the way out
+    if (sim_depth)
+        return;
+
+    sim_regs_from_context(&regs, context);
+
+    // events are masked while the callback runs, as they are when Xen enters hypervisor_callback
+    while (vcpu->evtchn_upcall_pending && !vcpu->evtchn_upcall_mask)
+    {
+        vcpu->evtchn_upcall_mask = 1;
+        barrier();
+        do_hypervisor_callback(&regs);
+        barrier();
+        vcpu->evtchn_upcall_mask = 0;
+    }
+
+    sim_regs_to_context(&regs, context);
+}
+
+/* Wait with the upcall signal let through until something is pending, or until the system time deadline when
+ * there is one
+ */
+static void sim_wait(const evtchn_port_t *ports, unsigned int nr_ports, uint64_t deadline)
+{
+    vcpu_info_t *vcpu = &sim_shared_info.vcpu_info[0];
+    sigset_t blocked, waiting;
+    unsigned int i;
+
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIM_UPCALL_SIGNAL);
+    pthread_sigmask(SIG_BLOCK, &blocked, &waiting);
+    sigdelset(&waiting, SIM_UPCALL_SIGNAL);
+
+    for (;;)
+    {
+        if (!ports && vcpu->evtchn_upcall_pending)
+            break;
+        for (i = 0; i < nr_ports; i++)
+            if (sim_shared_info.evtchn_pending[SIM_PORT_WORD(ports[i])] & SIM_PORT_BIT(ports[i]))
+                break;
+        if (ports && (i < nr_ports))
+            break;
+
+        if (!deadline)
+        {
+            sigsuspend(&waiting);
+            continue;
+        }
+
+        uint64_t now = xensim_system_time();
+        if (now >= deadline)
+            break;
+        struct timespec timeout = { .tv_sec = (deadline - now) / 1000000000UL, .tv_nsec = (deadline - now) % 1000000000UL };
+        sigtimedwait(&blocked, NULL, &timeout);
+    }
+
+    pthread_sigmask(SIG_UNBLOCK, &blocked, NULL);
+}
+
+static long sim_sched_op(unsigned long cmd, void *arg)
+{
+    switch (cmd)
+    {
+    case SCHEDOP_yield:
+        sched_yield();
+        return 0;
+
+    case SCHEDOP_block:
+        // blocking enables events, like Xen
+        sim_shared_info.vcpu_info[0].evtchn_upcall_mask = 0;
+        sim_wait(NULL, 0, 0);
+        return 0;
+
+    case SCHEDOP_poll:
+    {
+        struct sched_poll *poll = arg;
+        evtchn_port_t *ports;
+        get_xen_guest_handle(ports, poll->ports);
+        sim_wait(ports, poll->nr_ports, poll->timeout);
+        return 0;
+    }
+
+    case SCHEDOP_shutdown:
+    {
+        struct sched_shutdown *shutdown = arg;
+        exit(shutdown->reason == SHUTDOWN_poweroff ? 0 : 128 + shutdown->reason);
+    }
+    }
+
+    return -ENOSYS;
+}
+
+static long sim_vcpu_op(unsigned long cmd, void *arg)
+{
+    switch (cmd)
+    {
+    case VCPUOP_set_singleshot_timer:
+    {
+        vcpu_set_singleshot_timer_t *timer = arg;
+        if ((timer->flags & VCPU_SSHOTTMR_future) && (timer->timeout_abs_ns < xensim_system_time()))
+            return -ETIME;
+        xensim_backend_singleshot(timer->timeout_abs_ns);
+        return 0;
+    }
+
+    case VCPUOP_stop_singleshot_timer:
+        xensim_backend_singleshot(0);
+        return 0;
+
+    case VCPUOP_set_periodic_timer:
+        xensim_backend_periodic(((vcpu_set_periodic_timer_t *)arg)->period_ns);
+        return 0;
+
+    case VCPUOP_stop_periodic_timer:
+        xensim_backend_periodic(0);
+        return 0;
+    }
+
+    return -ENOSYS;
+}
+
+static long sim_event_channel_op(unsigned long cmd, void *arg)
+{
+    shared_info_t *s = &sim_shared_info;
+    evtchn_port_t port;
+
+    switch (cmd)
+    {
+    case EVTCHNOP_alloc_unbound:
+    {
+        evtchn_alloc_unbound_t *op = arg;
+        if (!(op->port = sim_port_alloc(sim_port_unbound)))
+            return -ENOSPC;
+        return 0;
+    }
+
+    case EVTCHNOP_bind_interdomain:
+    {
+        // we are the only domain with unbound ports, whatever the remote domain says
+        evtchn_bind_interdomain_t *op = arg;
+        if ((op->remote_port >= SIM_PORTS) || (sim_ports[op->remote_port].state != sim_port_unbound))
+            return -EINVAL;
+        if (!(op->local_port = sim_port_alloc(sim_port_interdomain)))
+            return -ENOSPC;
+        sim_ports[op->local_port].peer = op->remote_port;
+        sim_ports[op->remote_port].state = sim_port_interdomain;
+        sim_ports[op->remote_port].peer = op->local_port;
+        return 0;
+    }
+
+    case EVTCHNOP_bind_virq:
+    {
+        evtchn_bind_virq_t *op = arg;
+        if ((op->virq >= SIM_VIRQS) || sim_virqs[op->virq])
+            return -EEXIST;
+        if (!(op->port = sim_port_alloc(sim_port_virq)))
+            return -ENOSPC;
+        sim_virqs[op->virq] = op->port;
+        return 0;
+    }
+
+    case EVTCHNOP_bind_vcpu:
+        return 0;
+
+    case EVTCHNOP_close:
+        port = ((evtchn_close_t *)arg)->port;
+        if ((port >= SIM_PORTS) || (sim_ports[port].state == sim_port_free))
+            return -EINVAL;
+        if (sim_ports[port].state == sim_port_interdomain)
+            sim_ports[sim_ports[port].peer].state = sim_port_unbound;
+        for (unsigned int virq = 0; virq < SIM_VIRQS; virq++)
+            if (sim_virqs[virq] == port)
+                sim_virqs[virq] = 0;
+        sim_ports[port].state = sim_port_free;
+        return 0;
+
+    case EVTCHNOP_send:
+        port = ((evtchn_send_t *)arg)->port;
+        if (port >= SIM_PORTS)
+            return -EINVAL;
+        if (sim_ports[port].state == sim_port_interdomain)
+            xensim_raise(sim_ports[port].peer);
+        else if (sim_ports[port].state == sim_port_backend)
+        {
+            uint64_t one = 1;
+            if (write(sim_ports[port].eventfd, &one, sizeof(one)) < 0)
+                return -errno;
+        }
+        return 0;
+
+    case EVTCHNOP_unmask:
+        port = ((evtchn_unmask_t *)arg)->port;
+        if (port >= SIM_PORTS)
+            return -EINVAL;
+        __atomic_fetch_and(&s->evtchn_mask[SIM_PORT_WORD(port)], ~SIM_PORT_BIT(port), __ATOMIC_SEQ_CST);
+        if (s->evtchn_pending[SIM_PORT_WORD(port)] & SIM_PORT_BIT(port))
+        {
+            __atomic_fetch_and(&s->evtchn_pending[SIM_PORT_WORD(port)], ~SIM_PORT_BIT(port), __ATOMIC_SEQ_CST);
+            xensim_raise(port);
+        }
+        return 0;
+    }
+
+    return -ENOSYS;
+}
+
+static long sim_dispatch(unsigned int op, unsigned long a1, unsigned long a2, unsigned long a3, unsigned long a4, unsigned long a5)
+{
+    switch (op)
+    {
+    case __HYPERVISOR_sched_op:
+        return sim_sched_op(a1, (void *)a2);
+
+    case __HYPERVISOR_vcpu_op:
+        return sim_vcpu_op(a1, (void *)a3);
+
+    case __HYPERVISOR_event_channel_op:
+        return sim_event_channel_op(a1, (void *)a2);
+
+    case __HYPERVISOR_set_timer_op:
+        xensim_backend_singleshot(a1);
+        return 0;
+
+    case __HYPERVISOR_console_io:
+        // the hypervisor log, the guest console is on stdout
+        if (a1 == CONSOLEIO_write)
+            return (write(STDERR_FILENO, (const void *)a3, a2) < 0) ? -errno : 0;
+        return -ENOSYS;
+
+    case __HYPERVISOR_xen_version:
+        if (a1 == XENVER_version)
+            return (4 << 16) | 4;
+        if (a1 == XENVER_get_features)
+            ((xen_feature_info_t *)a2)->submap = 0;
+        return 0;
+
+    // nothing to do for these in a process
+    case __HYPERVISOR_set_callbacks:
+    case __HYPERVISOR_set_trap_table:
+    case __HYPERVISOR_stack_switch:
+    case __HYPERVISOR_fpu_taskswitch:
+    case __HYPERVISOR_vm_assist:
+        return 0;
+    }
+
+    return -ENOSYS;
+}
+
+long xensim_hypercall(unsigned int op, unsigned long a1, unsigned long a2, unsigned long a3, unsigned long a4, unsigned long a5)
+{
+    vcpu_info_t *vcpu = &sim_shared_info.vcpu_info[0];
+    long rc;
+
+    sim_depth++;
+    rc = sim_dispatch(op, a1, a2, a3, a4, a5);
+    sim_depth--;
+
+    // what came in during the hypercall is delivered now, as a signal so the callback gets the registers
+    if (!sim_depth && vcpu->evtchn_upcall_pending && !vcpu->evtchn_upcall_mask)
+        pthread_kill(sim_guest, SIM_UPCALL_SIGNAL);
+
+    return rc;
+}
+
+/* The upcall entry points of bootstrap.x86_64.S. xenevents_init hands them to set_callbacks, in the simulator the
+ * signal handler calls do_hypervisor_callback instead
+ */
+void hypervisor_callback(void)
+{
+}
+
+void failsafe_callback(void)
+{
+}
+
+static void sim_printk_flush(void *context, const char *data, size_t length)
+{
+    HYPERVISOR_console_io(CONSOLEIO_write, length, (char *)data);
+}
+
+static void sim_printkv(const char *file, long line, const char *format, va_list args)
+{
+    char buffer[SIM_PRINTK_BUFFER_SIZE];
+    psink_t sink;
+
+    // nothing to print
+    if (!*format)
+        return;
+
+    uint64_t now = xensim_system_time();
+    psink_init(&sink, buffer, sizeof(buffer), sim_printk_flush, NULL);
+    psprintf_sink(&sink, "%lu.%06lu %s@%.5li: ", now / 1000000000UL, (now / 1000UL) % 1000000UL, file, line);
+    pvsprintf_sink(&sink, format, args);
+    psink_write(&sink, "\n", 1);
+    psink_flush(&sink);
+}
+
+void micropv_printk(const char *file, long line, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    micropv_printkv(file, line, format, args);
+    va_end(args);
+}
+
+// the modules that aren't part of the simulator build
+void xengdb_console_event(struct pt_regs *regs)
+{
+}
+
+void xenpmu_switch(micropv_perf_context_t *from, micropv_perf_context_t *to)
+{
+}
+
+void xenprofile_tick(struct pt_regs *regs, uint64_t now)
+{
+}
+
+int micropv_sim_start(void)
+{
+    struct sigaction action;
+
+    hypervisor_shared_info = &sim_shared_info;
+    hypervisor_start_info.shared_info = (unsigned long)&sim_shared_info;
+    sim_guest = pthread_self();
+    sim_time_init();
+
+    // upcalls
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = sim_upcall;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIM_UPCALL_SIGNAL, &action, NULL))
+    {
+        PRINTK("Failed to install the upcall handler");
+        return -1;
+    }
+
+    // the other end of the xenstore and the console
+    if (xensim_backend_start())
+        return -1;
+
+    // the same order as hypervisor_start
+    xenevents_init();
+    xenconsole_init();
+    xentime_init();
+    xenstore_init();
+    xenscheduler_init();
+
+    return 0;
+}
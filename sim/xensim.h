@@ -0,0 +1,112 @@
+/*  ***********************************************************************
+    * Project:
+    * File: xensim.h
+    * Author: smartin
+    ***********************************************************************
+
+    Modifications
+    0.00 10/19/2026 created
+*/
+
+/*---------------------------------------------------------------------
+  -- macros (preamble)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- standard includes
+  ---------------------------------------------------------------------*/
+#include <stdint.h>
+#include <xen/xen.h>
+#include <xen/event_channel.h>
+
+/*---------------------------------------------------------------------
+  -- project includes (imports)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- project includes (exports)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- macros (postamble)
+  ---------------------------------------------------------------------*/
+// our domain id and the one the backends pretend to be
+#define XENSIM_DOMID            1
+#define XENSIM_BACKEND_DOMID    0
+
+/*---------------------------------------------------------------------
+  -- forward declarations
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- data types
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- function prototypes
+  ---------------------------------------------------------------------*/
+
+/**
+ * Bring up the simulated hypervisor and the parts of micropv that run on
+ * it: events, console, time, xenstore and the scheduler timer. Call it
+ * once from the thread that is going to be the guest, before anything
+ * else in micropv. Events are delivered to that thread as signals.
+ *
+ * @return 0 on success, otherwise -1.
+ */
+int micropv_sim_start(void);
+
+/**
+ * Mark a port pending and, if the guest can take it, get an upcall to the
+ * guest thread. Safe from any thread.
+ */
+void xensim_raise(evtchn_port_t port);
+
+/**
+ * Raise the port bound to a virtual IRQ, if there is one.
+ */
+void xensim_raise_virq(unsigned int virq);
+
+/**
+ * Allocate a port connected to a backend. Whenever the guest sends on it
+ * the eventfd is written.
+ *
+ * @return The port, 0 if there are none left.
+ */
+evtchn_port_t xensim_bind_backend(int eventfd);
+
+/**
+ * Current system time in nanoseconds, the same clock as the shared info
+ * page gives the guest.
+ */
+uint64_t xensim_system_time(void);
+
+/**
+ * Start the backend thread and create the xenstore and console rings.
+ * Fills in the rings and their ports in hypervisor_start_info.
+ *
+ * @return 0 on success, otherwise -1.
+ */
+int xensim_backend_start(void);
+
+/**
+ * Arm the single shot VIRQ_TIMER timer for a system time deadline, 0 stops it.
+ */
+void xensim_backend_singleshot(uint64_t deadline);
+
+/**
+ * Arm the periodic VIRQ_TIMER timer, a period of 0 stops it.
+ */
+void xensim_backend_periodic(uint64_t period);
+
+/*---------------------------------------------------------------------
+  -- global variables
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- local variables
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- implementation
+  ---------------------------------------------------------------------*/
@@ -0,0 +1,699 @@
+/*  ***********************************************************************
+    * Project:
+    * File: xensim_backend.c
+    * Author: smartin
+    ***********************************************************************
+
+    The other ends of the simulated guest: xenstored, the console daemon and the timer. They run on one thread of
+    their own that sleeps in poll(), so that the guest thread only ever sees what it would see under Xen, rings in
+    shared pages and events arriving on its ports.
+
+    Each backend port has an eventfd that is written when the guest sends on the port. The timers are timerfds, when
+    one fires VIRQ_TIMER is raised. The console writes what the guest prints to stdout and feeds it stdin.
+
+    The xenstore is a flat table of paths, enough for what micropv does with it: read, write, mkdir, rm, directory
+    listings, permissions that are remembered but not enforced, and watches. Transactions aren't isolated, every
+    write goes straight in and ending a transaction always succeeds. Our domain is XENSIM_DOMID and relative paths
+    are under /local/domain/<domid>.
+
+    The guest only notifies the store port once a request is complete, and it spins on the rings without notifying
+    when they are full. The rings are checked every time the thread wakes up, and while a request or response is
+    part way through the thread wakes up every millisecond to keep it moving.
+
+    Modifications
+    0.00 10/19/2026 created
+*/
+
+/*---------------------------------------------------------------------
+  -- macros (preamble)
+  ---------------------------------------------------------------------*/
+#define _GNU_SOURCE
+
+/*---------------------------------------------------------------------
+  -- standard includes
+  ---------------------------------------------------------------------*/
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <xen/xen.h>
+#include <xen/io/console.h>
+#include <xen/io/xs_wire.h>
+
+/*---------------------------------------------------------------------
+  -- project includes (imports)
+  ---------------------------------------------------------------------*/
+#include "../micropv.h"
+#include "hypervisor.h"
+#include "os.h"
+
+/*---------------------------------------------------------------------
+  -- project includes (exports)
+  ---------------------------------------------------------------------*/
+#include "xensim.h"
+
+/*---------------------------------------------------------------------
+  -- macros (postamble)
+  ---------------------------------------------------------------------*/
+// XS_DIRECTORY_PART is not in the older xs_wire.h, the same as in xenstore.c
+#define BACKEND_DIRECTORY_PART  22
+
+#define BACKEND_WATCHES         64
+#define BACKEND_PATH_MAX        256
+#define BACKEND_BUSY_TIMEOUT    1
+#define BACKEND_IDLE_TIMEOUT    100
+
+/*---------------------------------------------------------------------
+  -- forward declarations
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- data types
+  ---------------------------------------------------------------------*/
+typedef struct backend_node_t
+{
+    char *path;
+    char *value;
+    size_t length;
+    char *perms;
+} backend_node_t;
+
+typedef struct backend_watch_t
+{
+    // absolute, and whether the guest asked with a relative path
+    char path[BACKEND_PATH_MAX];
+    char token[BACKEND_PATH_MAX];
+    int relative;
+} backend_watch_t;
+
+/*---------------------------------------------------------------------
+  -- function prototypes
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- global variables
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- local variables
+  ---------------------------------------------------------------------*/
+static struct xenstore_domain_interface *backend_store;
+static struct xencons_interface *backend_console;
+static evtchn_port_t backend_store_port;
+static evtchn_port_t backend_console_port;
+static int backend_store_fd = -1;
+static int backend_console_fd = -1;
+static int backend_singleshot_fd = -1;
+static int backend_periodic_fd = -1;
+static int backend_stdin = 0;
+static pthread_t backend_thread;
+
+static backend_node_t *backend_nodes = NULL;
+static size_t backend_node_count = 0;
+static size_t backend_node_size = 0;
+static backend_watch_t backend_watches[BACKEND_WATCHES];
+static int backend_watch_count = 0;
+static uint32_t backend_transaction = 0;
+static char backend_prefix[32];
+
+// the request being read from the ring, and the responses waiting for room in the ring
+static char backend_request[sizeof(struct xsd_sockmsg) + XENSTORE_PAYLOAD_MAX];
+static size_t backend_request_length = 0;
+static size_t backend_request_discard = 0;
+static char *backend_output = NULL;
+static size_t backend_output_length = 0;
+static size_t backend_output_size = 0;
+
+/*---------------------------------------------------------------------
+  -- implementation
+  ---------------------------------------------------------------------*/
+
+static int backend_absolute(const char *path, char *absolute)
+{
+    int length;
+
+    if (*path == '/')
+        length = snprintf(absolute, BACKEND_PATH_MAX, "%s", path);
+    else
+        length = snprintf(absolute, BACKEND_PATH_MAX, "%s/%s", backend_prefix, path);
+
+    return (length < BACKEND_PATH_MAX) ? 0 : -1;
+}
+
+// whether path is node itself or somewhere below it
+static int backend_below(const char *path, const char *node)
+{
+    size_t length = strlen(node);
+    return !strncmp(path, node, length) && ((path[length] == 0) || (path[length] == '/') || !strcmp(node, "/"));
+}
+
+static backend_node_t *backend_node_find(const char *path)
+{
+    size_t i;
+
+    for (i = 0; i < backend_node_count; i++)
+        if (!strcmp(backend_nodes[i].path, path))
+            return &backend_nodes[i];
+
+    return NULL;
+}
+
+static backend_node_t *backend_node_create(const char *path)
+{
+    char parent[BACKEND_PATH_MAX];
+    char *slash;
+    backend_node_t *node;
+
+    if ((node = backend_node_find(path)) != NULL)
+        return node;
+
+    // the parents come first, like xenstored every node on the way exists with an empty value
+    snprintf(parent, sizeof(parent), "%s", path);
+    if (((slash = strrchr(parent, '/')) != NULL) && (slash != parent))
+    {
+        *slash = 0;
+        backend_node_create(parent);
+    }
+
+    if (backend_node_count == backend_node_size)
+    {
+        backend_node_size = backend_node_size ? backend_node_size * 2 : 64;
+        backend_nodes = realloc(backend_nodes, backend_node_size * sizeof(backend_node_t));
+    }
+
+    node = &backend_nodes[backend_node_count++];
+    node->path = strdup(path);
+    node->value = strdup("");
+    node->length = 0;
+    node->perms = NULL;
+
+    return node;
+}
+
+static void backend_node_set(const char *path, const char *value, size_t length)
+{
+    backend_node_t *node = backend_node_create(path);
+
+    free(node->value);
+    node->value = malloc(length + 1);
+    memcpy(node->value, value, length);
+    node->value[length] = 0;
+    node->length = length;
+}
+
+static int backend_node_remove(const char *path)
+{
+    size_t i = 0;
+    int removed = 0;
+
+    while (i < backend_node_count)
+    {
+        if (backend_below(backend_nodes[i].path, path))
+        {
+            free(backend_nodes[i].path);
+            free(backend_nodes[i].value);
+            free(backend_nodes[i].perms);
+            backend_nodes[i] = backend_nodes[--backend_node_count];
+            removed++;
+        }
+        else
+            i++;
+    }
+
+    return removed;
+}
+
+// the names of the nodes right under path, each NUL terminated
+static size_t backend_children(const char *path, char *children, size_t size)
+{
+    size_t length = strlen(path);
+    size_t used = 0;
+    size_t i;
+
+    if ((length == 1) && (*path == '/'))
+        length = 0;
+
+    for (i = 0; i < backend_node_count; i++)
+    {
+        const char *child = backend_nodes[i].path;
+        if (strncmp(child, path, length) || (child[length] != '/') || !child[length + 1] || strchr(child + length + 1, '/'))
+            continue;
+
+        size_t child_length = strlen(child + length + 1) + 1;
+        if ((used + child_length) > size)
+            break;
+        memcpy(children + used, child + length + 1, child_length);
+        used += child_length;
+    }
+
+    return used;
+}
+
+static void backend_queue(uint32_t type, uint32_t req_id, uint32_t tx_id, const void *payload, size_t length)
+{
+    struct xsd_sockmsg msg = { .type = type, .req_id = req_id, .tx_id = tx_id, .len = length };
+
+    if ((backend_output_length + sizeof(msg) + length) > backend_output_size)
+    {
+        backend_output_size = (backend_output_length + sizeof(msg) + length) * 2;
+        backend_output = realloc(backend_output, backend_output_size);
+    }
+
+    memcpy(backend_output + backend_output_length, &msg, sizeof(msg));
+    memcpy(backend_output + backend_output_length + sizeof(msg), payload, length);
+    backend_output_length += sizeof(msg) + length;
+}
+
+static void backend_queue_error(const struct xsd_sockmsg *request, const char *error)
+{
+    backend_queue(XS_ERROR, request->req_id, request->tx_id, error, strlen(error) + 1);
+}
+
+static void backend_watch_event(const backend_watch_t *watch, const char *path)
+{
+    char event[2 * BACKEND_PATH_MAX];
+    size_t prefix = strlen(backend_prefix) + 1;
+
+    // the path comes back the way the watch was asked for
+    if (watch->relative && !strncmp(path, backend_prefix, prefix - 1) && (path[prefix - 1] == '/'))
+        path += prefix;
+
+    int length = snprintf(event, sizeof(event), "%s%c%s", path, 0, watch->token) + 1;
+    backend_queue(XS_WATCH_EVENT, 0, 0, event, length);
+}
+
+static void backend_watch_fire(const char *path)
+{
+    int i;
+
+    for (i = 0; i < backend_watch_count; i++)
+        if (backend_below(path, backend_watches[i].path))
+            backend_watch_event(&backend_watches[i], path);
+}
+
+static void backend_store_request(const struct xsd_sockmsg *request, char *payload)
+{
+    char path[BACKEND_PATH_MAX];
+    char children[XENSTORE_PAYLOAD_MAX];
+    const char *second;
+    backend_node_t *node;
+    size_t length;
+    int i;
+
+    // most requests start with a path, anything after it is the second argument
+    if (backend_absolute(payload, path))
+        return backend_queue_error(request, "E2BIG");
+    second = payload + strlen(payload) + 1;
+
+    switch (request->type)
+    {
+    case XS_READ:
+        if (!(node = backend_node_find(path)))
+            return backend_queue_error(request, "ENOENT");
+        return backend_queue(XS_READ, request->req_id, request->tx_id, node->value, node->length);
+
+    case XS_WRITE:
+        length = (second <= payload + request->len) ? (payload + request->len) - second : 0;
+        backend_node_set(path, second, length);
+        backend_queue(XS_WRITE, request->req_id, request->tx_id, "OK", 3);
+        return backend_watch_fire(path);
+
+    case XS_MKDIR:
+        if (!backend_node_find(path))
+        {
+            backend_node_create(path);
+            backend_watch_fire(path);
+        }
+        return backend_queue(XS_MKDIR, request->req_id, request->tx_id, "OK", 3);
+
+    case XS_RM:
+        if (backend_node_remove(path))
+            backend_watch_fire(path);
+        return backend_queue(XS_RM, request->req_id, request->tx_id, "OK", 3);
+
+    case XS_DIRECTORY:
+        if (!backend_node_find(path))
+            return backend_queue_error(request, "ENOENT");
+        length = backend_children(path, children, sizeof(children));
+        return backend_queue(XS_DIRECTORY, request->req_id, request->tx_id, children, length);
+
+    case BACKEND_DIRECTORY_PART:
+    {
+        // the generation, then the children from the offset on with an empty name after the last
+        char part[XENSTORE_PAYLOAD_MAX];
+        size_t offset = strtoul(second, NULL, 10);
+        size_t used;
+
+        if (!backend_node_find(path))
+            return backend_queue_error(request, "ENOENT");
+        length = backend_children(path, children, sizeof(children));
+        if (offset > length)
+            return backend_queue_error(request, "EINVAL");
+
+        used = snprintf(part, sizeof(part), "%u", backend_transaction) + 1;
+        length -= offset;
+        if (length > sizeof(part) - used - 1)
+            length = sizeof(part) - used - 1;
+        memcpy(part + used, children + offset, length);
+        used += length;
+        part[used++] = 0;
+        return backend_queue(BACKEND_DIRECTORY_PART, request->req_id, request->tx_id, part, used);
+    }
+
+    case XS_GET_PERMS:
+        if (!(node = backend_node_find(path)))
+            return backend_queue_error(request, "ENOENT");
+        if (node->perms)
+            return backend_queue(XS_GET_PERMS, request->req_id, request->tx_id, node->perms, strlen(node->perms) + 1);
+        length = snprintf(children, sizeof(children), "n%u", XENSIM_DOMID) + 1;
+        return backend_queue(XS_GET_PERMS, request->req_id, request->tx_id, children, length);
+
+    case XS_SET_PERMS:
+        node = backend_node_create(path);
+        free(node->perms);
+        node->perms = strdup(second);
+        return backend_queue(XS_SET_PERMS, request->req_id, request->tx_id, "OK", 3);
+
+    case XS_WATCH:
+        if ((backend_watch_count == BACKEND_WATCHES) || (strlen(second) >= BACKEND_PATH_MAX))
+            return backend_queue_error(request, "E2BIG");
+        strcpy(backend_watches[backend_watch_count].path, path);
+        strcpy(backend_watches[backend_watch_count].token, second);
+        backend_watches[backend_watch_count].relative = (*payload != '/');
+        backend_queue(XS_WATCH, request->req_id, request->tx_id, "OK", 3);
+
+        // a new watch always fires once
+        return backend_watch_event(&backend_watches[backend_watch_count++], path);
+
+    case XS_UNWATCH:
+        for (i = 0; i < backend_watch_count; i++)
+            if (!strcmp(backend_watches[i].path, path) && !strcmp(backend_watches[i].token, second))
+                break;
+        if (i == backend_watch_count)
+            return backend_queue_error(request, "ENOENT");
+        backend_watches[i] = backend_watches[--backend_watch_count];
+        return backend_queue(XS_UNWATCH, request->req_id, request->tx_id, "OK", 3);
+
+    case XS_TRANSACTION_START:
+        // micropv ends a transaction with this too, the payload is T or F instead of empty
+        if (*payload)
+            return backend_queue(XS_TRANSACTION_START, request->req_id, request->tx_id, "OK", 3);
+        length = snprintf(children, sizeof(children), "%u", ++backend_transaction) + 1;
+        return backend_queue(XS_TRANSACTION_START, request->req_id, request->tx_id, children, length);
+
+    case XS_TRANSACTION_END:
+        return backend_queue(XS_TRANSACTION_END, request->req_id, request->tx_id, "OK", 3);
+
+    case XS_GET_DOMAIN_PATH:
+        length = snprintf(children, sizeof(children), "/local/domain/%s", payload) + 1;
+        return backend_queue(XS_GET_DOMAIN_PATH, request->req_id, request->tx_id, children, length);
+    }
+
+    backend_queue_error(request, "ENOSYS");
+}
+
+static void backend_store_read(void)
+{
+    struct xenstore_domain_interface *ring = backend_store;
+    const struct xsd_sockmsg *request = (const struct xsd_sockmsg *)backend_request;
+    XENSTORE_RING_IDX cons = ring->req_cons;
+    XENSTORE_RING_IDX prod = ring->req_prod;
+
+    rmb();
+    while (cons != prod)
+    {
+        char c = ring->req[MASK_XENSTORE_IDX(cons++)];
+
+        // the rest of a request too big to take
+        if (backend_request_discard)
+        {
+            backend_request_discard--;
+            continue;
+        }
+
+        backend_request[backend_request_length++] = c;
+        if (backend_request_length < sizeof(*request))
+            continue;
+
+        if (request->len > XENSTORE_PAYLOAD_MAX)
+        {
+            backend_queue_error(request, "E2BIG");
+            backend_request_discard = request->len;
+            backend_request_length = 0;
+            continue;
+        }
+
+        if (backend_request_length == sizeof(*request) + request->len)
+        {
+            // room to terminate the path and the second argument, the guest doesn't always
+            char payload[XENSTORE_PAYLOAD_MAX + 2];
+            memcpy(payload, backend_request + sizeof(*request), request->len);
+            payload[request->len] = payload[request->len + 1] = 0;
+            backend_store_request(request, payload);
+            backend_request_length = 0;
+        }
+    }
+
+    mb();
+    ring->req_cons = cons;
+}
+
+static void backend_store_write(void)
+{
+    struct xenstore_domain_interface *ring = backend_store;
+    XENSTORE_RING_IDX prod = ring->rsp_prod;
+    size_t sent = 0;
+
+    mb();
+    while ((sent < backend_output_length) && ((prod - ring->rsp_cons) < XENSTORE_RING_SIZE))
+        ring->rsp[MASK_XENSTORE_IDX(prod++)] = backend_output[sent++];
+
+    if (!sent)
+        return;
+
+    memmove(backend_output, backend_output + sent, backend_output_length - sent);
+    backend_output_length -= sent;
+
+    wmb();
+    ring->rsp_prod = prod;
+    xensim_raise(backend_store_port);
+}
+
+static void backend_console_write(void)
+{
+    struct xencons_interface *ring = backend_console;
+    XENCONS_RING_IDX cons = ring->out_cons;
+    XENCONS_RING_IDX prod = ring->out_prod;
+
+    rmb();
+    while (cons != prod)
+    {
+        // up to the end of the ring in one go
+        size_t offset = MASK_XENCONS_IDX(cons, ring->out);
+        size_t length = prod - cons;
+        if (length > sizeof(ring->out) - offset)
+            length = sizeof(ring->out) - offset;
+
+        if (write(STDOUT_FILENO, ring->out + offset, length) < 0)
+            break;
+        cons += length;
+    }
+
+    mb();
+    ring->out_cons = cons;
+}
+
+static void backend_console_read(void)
+{
+    struct xencons_interface *ring = backend_console;
+    XENCONS_RING_IDX prod = ring->in_prod;
+    char buffer[sizeof(ring->in)];
+    ssize_t length, i;
+
+    mb();
+    length = sizeof(ring->in) - (prod - ring->in_cons);
+    if ((length = read(STDIN_FILENO, buffer, length)) <= 0)
+    {
+        // end of file, stop watching
+        backend_stdin = (length < 0) && (errno == EINTR);
+        return;
+    }
+
+    for (i = 0; i < length; i++)
+        ring->in[MASK_XENCONS_IDX(prod++, ring->in)] = buffer[i];
+
+    wmb();
+    ring->in_prod = prod;
+    xensim_raise(backend_console_port);
+}
+
+static void backend_drain(int fd)
+{
+    uint64_t count;
+
+    if (read(fd, &count, sizeof(count)) < 0)
+        return;
+}
+
+static void *backend_main(void *context)
+{
+    struct pollfd fds[5];
+    int i;
+
+    for (;;)
+    {
+        fds[0].fd = backend_store_fd;
+        fds[1].fd = backend_console_fd;
+        fds[2].fd = backend_singleshot_fd;
+        fds[3].fd = backend_periodic_fd;
+        // stdin waits while the in ring is full, the guest doesn't notify when it reads
+        fds[4].fd = (backend_stdin && ((backend_console->in_prod - backend_console->in_cons) < sizeof(backend_console->in))) ? STDIN_FILENO : -1;
+        for (i = 0; i < 5; i++)
+        {
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+
+        int busy = backend_request_length || backend_output_length || (backend_store->req_cons != backend_store->req_prod);
+        if (poll(fds, 5, busy ? BACKEND_BUSY_TIMEOUT : BACKEND_IDLE_TIMEOUT) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            PRINTK("poll failed %i", errno);
+            return NULL;
+        }
+
+        if (fds[0].revents & POLLIN)
+            backend_drain(backend_store_fd);
+        if (fds[1].revents & POLLIN)
+            backend_drain(backend_console_fd);
+
+        if (fds[2].revents & POLLIN)
+        {
+            backend_drain(backend_singleshot_fd);
+            xensim_raise_virq(VIRQ_TIMER);
+        }
+        if (fds[3].revents & POLLIN)
+        {
+            backend_drain(backend_periodic_fd);
+            xensim_raise_virq(VIRQ_TIMER);
+        }
+
+        // the rings whatever woke us up, the guest doesn't always notify
+        backend_store_read();
+        backend_store_write();
+        backend_console_write();
+        if ((fds[4].fd >= 0) && (fds[4].revents & (POLLIN | POLLHUP)))
+            backend_console_read();
+    }
+
+    return NULL;
+}
+
+static void backend_timer(int fd, uint64_t value, uint64_t interval)
+{
+    struct itimerspec timer = { { 0, 0 }, { 0, 0 } };
+
+    timer.it_value.tv_sec = value / 1000000000UL;
+    timer.it_value.tv_nsec = value % 1000000000UL;
+    timer.it_interval.tv_sec = interval / 1000000000UL;
+    timer.it_interval.tv_nsec = interval % 1000000000UL;
+
+    if (timerfd_settime(fd, 0, &timer, NULL))
+        PRINTK("timerfd_settime failed %i", errno);
+}
+
+void xensim_backend_singleshot(uint64_t deadline)
+{
+    uint64_t now = xensim_system_time();
+
+    if (!deadline)
+        return backend_timer(backend_singleshot_fd, 0, 0);
+
+    // a deadline that has already gone fires straight away, a 0 timeout would disarm the timer
+    if (deadline <= now)
+    {
+        backend_timer(backend_singleshot_fd, 0, 0);
+        return xensim_raise_virq(VIRQ_TIMER);
+    }
+
+    backend_timer(backend_singleshot_fd, deadline - now, 0);
+}
+
+void xensim_backend_periodic(uint64_t period)
+{
+    backend_timer(backend_periodic_fd, period, period);
+}
+
+int xensim_backend_start(void)
+{
+    sigset_t all, saved;
+
+    backend_store = aligned_alloc(__PAGE_SIZE, __PAGE_SIZE);
+    backend_console = aligned_alloc(__PAGE_SIZE, __PAGE_SIZE);
+    if (!backend_store || !backend_console)
+    {
+        PRINTK("Failed to allocate the rings");
+        return -1;
+    }
+    memset(backend_store, 0, __PAGE_SIZE);
+    memset(backend_console, 0, __PAGE_SIZE);
+
+    backend_store_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    backend_console_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    backend_singleshot_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    backend_periodic_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if ((backend_store_fd < 0) || (backend_console_fd < 0) || (backend_singleshot_fd < 0) || (backend_periodic_fd < 0))
+    {
+        PRINTK("Failed to create the backend descriptors %i", errno);
+        return -1;
+    }
+
+    backend_store_port = xensim_bind_backend(backend_store_fd);
+    backend_console_port = xensim_bind_backend(backend_console_fd);
+    if (!backend_store_port || !backend_console_port)
+    {
+        PRINTK("Failed to bind the backend ports");
+        return -1;
+    }
+
+    // what xenstore.c and xenconsole.c look for
+    hypervisor_start_info.store_mfn = (unsigned long)backend_store >> __PAGE_SHIFT;
+    hypervisor_start_info.store_evtchn = backend_store_port;
+    hypervisor_start_info.console.domU.mfn = (unsigned long)backend_console >> __PAGE_SHIFT;
+    hypervisor_start_info.console.domU.evtchn = backend_console_port;
+    hypervisor_start_info.flags = 0;
+
+    // our part of the store
+    snprintf(backend_prefix, sizeof(backend_prefix), "/local/domain/%u", XENSIM_DOMID);
+    char path[BACKEND_PATH_MAX];
+    backend_absolute("domid", path);
+    backend_node_set(path, "1", 1);
+    backend_absolute("name", path);
+    backend_node_set(path, "micropv-sim", 11);
+    backend_absolute("data", path);
+    backend_node_create(path);
+
+    // only read the terminal, a pipe or a file on stdin belongs to the program
+    backend_stdin = isatty(STDIN_FILENO);
+
+    // upcalls go to the guest thread only, the backend thread doesn't take any signals
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    int rc = pthread_create(&backend_thread, NULL, backend_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (rc)
+    {
+        PRINTK("Failed to start the backend thread %i", rc);
+        return -1;
+    }
+
+    return 0;
+}
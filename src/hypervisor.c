@@ -39,6 +39,10 @@
 #include "xentime.h"
 #include "xengnttab.h"
 #include "xenmmu.h"
+#include "xenpage.h"
+#include "xenheap.h"
+#include "xenballoon.h"
+#include "xencrash.h"
 #include "xenschedule.h"
 
 /*---------------------------------------------------------------------
@@ -49,6 +53,7 @@
 /*---------------------------------------------------------------------
   -- macros (postamble)
   ---------------------------------------------------------------------*/
+#define CONSOLE_BUFFER_SIZE 128
 
 /*---------------------------------------------------------------------
   -- data types
@@ -82,47 +87,48 @@ start_info_t hypervisor_start_info;
   -- public functions
   ---------------------------------------------------------------------*/
 
-static void console_printkv(const char *file, long line, const char *format, va_list args)
+static void console_flush(void *context, const char *data, size_t length)
 {
-    va_list args0;;
-    int message_length;
-
-    // preserve the args
-    va_copy(args0, args);
+    HYPERVISOR_console_io(CONSOLEIO_write, length, (char *)data);
 
-    // process the format once to get the string length
-    message_length = pvsnprintf(NULL, 0, format, args);
+    // keep a copy for the crash dump
+    xencrash_log(data, length);
+}
 
-    // if we have a string then print it
-    if (message_length > 0)
-    {
-        // create the header
-        char header[strlen(file)+ 30];
-        struct timeval tv;
-        micropv_time_gettimeofday(&tv, NULL);
-        uint64_t millisecond = tv.tv_usec / 1000;
-        uint64_t second = tv.tv_sec % 60; tv.tv_sec /= 60;
-        uint64_t minute = tv.tv_sec % 60; tv.tv_sec /= 60;
-        uint64_t hour = tv.tv_sec % 24;
-        int header_length = psnprintf(header, sizeof(header), "%02lu:%02lu:%02lu.%03lu %s@%.5li: ", hour, minute, second, millisecond, file, line);
-
-        // create the output string
-        char message[message_length + 1];
-        message_length = pvsnprintf(message, message_length + 1, format, args0);
-
-        // send to the console
-        HYPERVISOR_console_io(CONSOLEIO_write, header_length, header);
-        HYPERVISOR_console_io(CONSOLEIO_write, message_length, message);
-
-        // make sure that the line is terminated
-        // I see that long lines in the xl dmesg automatically seem to have a line feed so limit on length
-        if ((header_length + message_length) < 80) {
-            static char lf = '\n';
-            HYPERVISOR_console_io(CONSOLEIO_write, 1, &lf);
-        }
+static void console_printkv(const char *file, long line, const char *format, va_list args)
+{
+    char buffer[CONSOLE_BUFFER_SIZE];
+    psink_t sink;
+
+    // nothing to print
+    if (!*format)
+        return;
+
+    // the header and the message are formatted in one pass, the sink hands
+    // them to the console whenever the buffer fills up
+    psink_init(&sink, buffer, sizeof(buffer), console_flush, NULL);
+
+    // create the header
+    struct timeval tv;
+    micropv_time_gettimeofday(&tv, NULL);
+    uint64_t millisecond = tv.tv_usec / 1000;
+    uint64_t second = tv.tv_sec % 60; tv.tv_sec /= 60;
+    uint64_t minute = tv.tv_sec % 60; tv.tv_sec /= 60;
+    uint64_t hour = tv.tv_sec % 24;
+    psprintf_sink(&sink, "%02lu:%02lu:%02lu.%03lu %s@%.5li: ", hour, minute, second, millisecond, file, line);
+
+    // create the output string
+    pvsprintf_sink(&sink, format, args);
+
+    // make sure that the line is terminated
+    // I see that long lines in the xl dmesg automatically seem to have a line feed so limit on length
+    int length = sink.count;
+    psink_flush(&sink);
+    if (length < 80) {
+        static char lf = '\n';
+        HYPERVISOR_console_io(CONSOLEIO_write, 1, &lf);
     }
-
-    va_end(args0);
+    xencrash_log("\n", 1);
 }
 
 void micropv_printk(const char *file, long line, const char *format, ...)
@@ -241,6 +247,10 @@ void hypervisor_start(start_info_t *si)
     hypervisor_shared_info = micropv_remap_page((unsigned long)&shared_info, hypervisor_start_info.shared_info, sizeof(shared_info), 0);
     BUG_ON(hypervisor_shared_info == NULL);
 
+    // hand the rest of the boot mapping to the page allocator
+    xenpage_init();
+    xenheap_init();
+
     // initialise the event interface -- activates the hypervisor callbacks
     xenevents_init();
 
@@ -253,6 +263,9 @@ void hypervisor_start(start_info_t *si)
     // initialise the xenstore interface
     xenstore_init();
 
+    // start following the memory target
+    xenballoon_init();
+
     // initialise the mapped memory
     xengnttab_init();
 
@@ -44,7 +44,27 @@
 
 extern char hypercall_page[__PAGE_SIZE];
 
-#define _hypercall0(type, name)         \
+/*
+ * Build with -DMICROPV_SIM to run on Linux. Every hypercall then goes to
+ * the simulated hypervisor in sim/xensim.c instead of the hypercall page.
+ */
+#ifdef MICROPV_SIM
+long xensim_hypercall(unsigned int op, unsigned long a1, unsigned long a2, unsigned long a3, unsigned long a4, unsigned long a5);
+
+#define __hypercall0(type, name) \
+    ((type)xensim_hypercall(__HYPERVISOR_##name, 0, 0, 0, 0, 0))
+#define __hypercall1(type, name, a1) \
+    ((type)xensim_hypercall(__HYPERVISOR_##name, (unsigned long)(a1), 0, 0, 0, 0))
+#define __hypercall2(type, name, a1, a2) \
+    ((type)xensim_hypercall(__HYPERVISOR_##name, (unsigned long)(a1), (unsigned long)(a2), 0, 0, 0))
+#define __hypercall3(type, name, a1, a2, a3) \
+    ((type)xensim_hypercall(__HYPERVISOR_##name, (unsigned long)(a1), (unsigned long)(a2), (unsigned long)(a3), 0, 0))
+#define __hypercall4(type, name, a1, a2, a3, a4) \
+    ((type)xensim_hypercall(__HYPERVISOR_##name, (unsigned long)(a1), (unsigned long)(a2), (unsigned long)(a3), (unsigned long)(a4), 0))
+#define __hypercall5(type, name, a1, a2, a3, a4, a5) \
+    ((type)xensim_hypercall(__HYPERVISOR_##name, (unsigned long)(a1), (unsigned long)(a2), (unsigned long)(a3), (unsigned long)(a4), (unsigned long)(a5)))
+#else
+#define __hypercall0(type, name)         \
 ({                      \
     long __res;             \
     __asm volatile (                \
@@ -55,7 +75,7 @@ extern char hypercall_page[__PAGE_SIZE];
     (type)__res;                \
 })
 
-#define _hypercall1(type, name, a1)             \
+#define __hypercall1(type, name, a1)             \
 ({                              \
     long __res, __ign1;                 \
     __asm volatile (                        \
@@ -66,7 +86,7 @@ extern char hypercall_page[__PAGE_SIZE];
     (type)__res;                        \
 })
 
-#define _hypercall2(type, name, a1, a2)             \
+#define __hypercall2(type, name, a1, a2)             \
 ({                              \
     long __res, __ign1, __ign2;             \
     __asm volatile (                        \
@@ -77,7 +97,7 @@ extern char hypercall_page[__PAGE_SIZE];
     (type)__res;                        \
 })
 
-#define _hypercall3(type, name, a1, a2, a3)         \
+#define __hypercall3(type, name, a1, a2, a3)         \
 ({                              \
     long __res, __ign1, __ign2, __ign3;         \
     __asm volatile (                        \
@@ -90,7 +110,7 @@ extern char hypercall_page[__PAGE_SIZE];
     (type)__res;                        \
 })
 
-#define _hypercall4(type, name, a1, a2, a3, a4)         \
+#define __hypercall4(type, name, a1, a2, a3, a4)         \
 ({                              \
     long __res, __ign1, __ign2, __ign3;         \
     __asm volatile (                        \
@@ -104,7 +124,7 @@ extern char hypercall_page[__PAGE_SIZE];
     (type)__res;                        \
 })
 
-#define _hypercall5(type, name, a1, a2, a3, a4, a5)     \
+#define __hypercall5(type, name, a1, a2, a3, a4, a5)     \
 ({                              \
     long __res, __ign1, __ign2, __ign3;         \
     __asm volatile (                        \
@@ -118,6 +138,70 @@ extern char hypercall_page[__PAGE_SIZE];
         : "memory", "r10", "r8" );          \
     (type)__res;                        \
 })
+#endif
+
+/*
+ * Build with -DMICROPV_HYPERCALL_STATS to count every hypercall and the TSC
+ * cycles it takes, per hypercall and per sub operation. See xenhypercall.c
+ */
+#ifdef MICROPV_HYPERCALL_STATS
+#include "xenhypercall.h"
+
+static inline unsigned long _hypercall_tsc(void)
+{
+    unsigned int a, d;
+    __asm volatile ("rdtsc" : "=a" (a), "=d" (d));
+    return ((unsigned long)d << 32) | a;
+}
+
+#define _hypercall_accounted(name, a1, call)   \
+({                              \
+    unsigned long __start = _hypercall_tsc();   \
+    long __r = call;                    \
+    xenhypercall_account(__HYPERVISOR_##name, (unsigned long)(a1), __start); \
+    __r;                            \
+})
+
+#define _hypercall0(type, name)         \
+    ((type)_hypercall_accounted(name, 0, __hypercall0(long, name)))
+
+#define _hypercall1(type, name, a1)         \
+({                              \
+    long __a1 = (long)(a1);             \
+    (type)_hypercall_accounted(name, __a1, __hypercall1(long, name, __a1)); \
+})
+
+#define _hypercall2(type, name, a1, a2)         \
+({                              \
+    long __a1 = (long)(a1);             \
+    (type)_hypercall_accounted(name, __a1, __hypercall2(long, name, __a1, a2)); \
+})
+
+#define _hypercall3(type, name, a1, a2, a3)     \
+({                              \
+    long __a1 = (long)(a1);             \
+    (type)_hypercall_accounted(name, __a1, __hypercall3(long, name, __a1, a2, a3)); \
+})
+
+#define _hypercall4(type, name, a1, a2, a3, a4)     \
+({                              \
+    long __a1 = (long)(a1);             \
+    (type)_hypercall_accounted(name, __a1, __hypercall4(long, name, __a1, a2, a3, a4)); \
+})
+
+#define _hypercall5(type, name, a1, a2, a3, a4, a5) \
+({                              \
+    long __a1 = (long)(a1);             \
+    (type)_hypercall_accounted(name, __a1, __hypercall5(long, name, __a1, a2, a3, a4, a5)); \
+})
+#else
+#define _hypercall0 __hypercall0
+#define _hypercall1 __hypercall1
+#define _hypercall2 __hypercall2
+#define _hypercall3 __hypercall3
+#define _hypercall4 __hypercall4
+#define _hypercall5 __hypercall5
+#endif
 
 static inline int
 HYPERVISOR_set_trap_table(
@@ -328,6 +412,13 @@ HYPERVISOR_domctl(
     return _hypercall1(int, domctl, op);
 }
 
+static inline int
+HYPERVISOR_xenpmu_op(
+    unsigned int op, void *arg)
+{
+    return _hypercall2(int, xenpmu_op, op, arg);
+}
+
 #endif /* __HYPERCALL_X86_64_H__ */
 
 /*
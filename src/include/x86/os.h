@@ -24,6 +24,17 @@
 
 #define wrmsrl(msr,val) wrmsr(msr,(uint32_t)((uint64_t)(val)),((uint64_t)(val))>>32)
 
+#define rdmsrl(msr,val) do { \
+     unsigned int __a,__d; \
+     __asm__ __volatile__("rdmsr" : "=a" (__a), "=d" (__d) : "c" (msr)); \
+     (val) = ((unsigned long)__a) | (((unsigned long)__d)<<32); \
+} while(0)
+
+#define cpuid(leaf,subleaf,a,b,c,d) \
+      __asm__ __volatile__("cpuid" \
+                           : "=a" (a), "=b" (b), "=c" (c), "=d" (d) \
+                           : "a" (leaf), "c" (subleaf))
+
 #define __pte(x) ((pte_t) { (x) } )
 
 #define mb()    __asm__ __volatile__ ("mfence":::"memory")
@@ -38,6 +49,7 @@
 
 #define ADDR (*(volatile long *) addr)
 #define smp_processor_id() 0
+#define NR_CPUS 1
 
 #define synch_test_bit(nr,addr) (__builtin_constant_p(nr) ? synch_const_test_bit((nr),(addr)) : synch_var_test_bit((nr),(addr)))
 
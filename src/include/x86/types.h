@@ -43,7 +43,10 @@ typedef   signed long int64_t;
 typedef unsigned long uint64_t;
 typedef uint64_t uintmax_t;
 typedef  int64_t intmax_t;
+#ifndef MICROPV_SIM
+// the simulator gets it from the host C library, which has it signed
 typedef uint64_t off_t;
+#endif
 typedef intptr_t            ptrdiff_t;
 typedef long ssize_t;
 
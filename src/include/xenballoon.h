@@ -0,0 +1,68 @@
+/*  ***********************************************************************
+    * Project:
+    * File: xenballoon.h
+    * Author: smartin
+    ***********************************************************************
+
+    Modifications
+    0.00 10/19/2026 created
+*/
+
+/*---------------------------------------------------------------------
+  -- macros (preamble)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- standard includes
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- project includes (imports)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- project includes (exports)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- macros (postamble)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- forward declarations
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- data types
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- function prototypes
+  ---------------------------------------------------------------------*/
+
+/**
+ * Start watching memory/target. Must be called after xenstore_init.
+ */
+void xenballoon_init(void);
+
+/**
+ * Take pages back from the balloon because the page allocator has run
+ * dry. This can go above the target.
+ *
+ * @param pages Number of pages wanted
+ *
+ * @return Number of pages put back into the page allocator
+ */
+uint64_t xenballoon_reclaim(uint64_t pages);
+
+/*---------------------------------------------------------------------
+  -- global variables
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- local variables
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- implementation
+  ---------------------------------------------------------------------*/
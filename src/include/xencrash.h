@@ -0,0 +1,65 @@
+/*  ***********************************************************************
+    * Project:
+    * File: xencrash.h
+    * Author: smartin
+    ***********************************************************************
+
+    Modifications
+    0.00 10/19/2026 created
+*/
+
+/*---------------------------------------------------------------------
+  -- macros (preamble)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- standard includes
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- project includes (imports)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- project includes (exports)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- macros (postamble)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- forward declarations
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- data types
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- function prototypes
+  ---------------------------------------------------------------------*/
+
+/**
+ * Keep a copy of console output for the crash dump
+ */
+void xencrash_log(const char *text, size_t length);
+
+/**
+ * Write the crash dump for a fatal trap, if a dump region has been set up
+ *
+ * @param regs Registers at the trap
+ */
+void xencrash_write(struct pt_regs *regs);
+
+/*---------------------------------------------------------------------
+  -- global variables
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- local variables
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- implementation
+  ---------------------------------------------------------------------*/
@@ -79,6 +79,45 @@ evtchn_port_t xenevents_bind_virq(int virq, evtchn_handler_t probe);
  */
 evtchn_port_t xenevents_bind_handler(int channel, evtchn_handler_t handler);
 
+/**
+ * Bind a function to an event channel. The context is passed to the
+ * handler on every event.
+ *
+ * @param channel Xen event channel
+ * @param handler Function to be bound
+ * @param context Data passed to the handler
+ *
+ * @return -1 if falure, otherwise the associted port number
+ */
+evtchn_port_t xenevents_bind_handler_context(int channel, evtchn_handler_t handler, void *context);
+
+/**
+ * Bind a physical IRQ (e.g. an MSI-X vector handed out by pciback) to a
+ * new event channel and attach a handler to it.
+ *
+ * @param pirq    physical IRQ number
+ * @param handler Function to be bound
+ * @param context Data passed to the handler
+ *
+ * @return -1 if falure, otherwise the associted port number
+ */
+evtchn_port_t xenevents_bind_pirq(int pirq, evtchn_handler_t handler, void *context);
+
+/**
+ * Mask/unmask a single event channel
+ *
+ * @param port event channel
+ */
+void xenevents_mask_channel(evtchn_port_t port);
+void xenevents_unmask_channel(evtchn_port_t port);
+
+/**
+ * Unbind the handler and give the channel back to the hypervisor
+ *
+ * @param port port to close
+ */
+void xenevents_close_channel(evtchn_port_t port);
+
 /**
  * Ask the hypervisor to give us a new channel
  *
@@ -138,3 +177,26 @@ static inline int xenevents_notify_remote_via_evtchn(evtchn_port_t port)
     return HYPERVISOR_event_channel_op(EVTCHNOP_send, &op);
 }
 
+
+/**
+ * Mask events and return the previous state, so that code that may be
+ * called with events already masked can nest.
+ */
+static inline int xenevents_save_disable(void)
+{
+    vcpu_info_t *vcpu = &hypervisor_shared_info->vcpu_info[smp_processor_id()];
+    int flags = vcpu->evtchn_upcall_mask;
+    vcpu->evtchn_upcall_mask = 1;
+    barrier();
+    return flags;
+}
+
+/**
+ * Put back the state saved by xenevents_save_disable
+ */
+static inline void xenevents_restore(int flags)
+{
+    barrier();
+    if (!flags)
+        micropv_interrupt_enable();
+}
@@ -0,0 +1,70 @@
+/*  ***********************************************************************
+    * Project:
+    * File: xengdb.h
+    * Author: smartin
+    ***********************************************************************
+
+    Modifications
+    0.00 10/19/2026 created
+*/
+
+/*---------------------------------------------------------------------
+  -- macros (preamble)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- standard includes
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- project includes (imports)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- project includes (exports)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- macros (postamble)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- forward declarations
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- data types
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- function prototypes
+  ---------------------------------------------------------------------*/
+
+/**
+ * Give a debug or breakpoint trap to the debugger
+ *
+ * @param regs   Registers at the trap, changed by the debugger
+ * @param vector 1 for the debug trap, 3 for int3
+ *
+ * @return 1 if the debugger dealt with it, 0 if the debugger isn't enabled
+ */
+int xengdb_trap(struct pt_regs *regs, int vector);
+
+/**
+ * Called with console input while the guest runs, a ^C stops it
+ *
+ * @param regs Registers of the interrupted code
+ */
+void xengdb_console_event(struct pt_regs *regs);
+
+/*---------------------------------------------------------------------
+  -- global variables
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- local variables
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- implementation
+  ---------------------------------------------------------------------*/
@@ -39,6 +39,11 @@
 #define _PAGE_PSE      0x080ULL
 #define _PAGE_GLOBAL   0x100ULL
 
+/* Cache types through Xen's PAT layout (WB, WT, UC-, UC, WC, WP, UC, UC) */
+#define _PAGE_CACHE_WB 0ULL
+#define _PAGE_CACHE_UC (_PAGE_PCD|_PAGE_PWT)
+#define _PAGE_CACHE_WC (_PAGE_PAT)
+
 #define L1_PROT                     (_PAGE_PRESENT|_PAGE_RW|_PAGE_ACCESSED|_PAGE_USER)
 #define L1_PROT_RO                  (_PAGE_PRESENT|_PAGE_ACCESSED|_PAGE_USER)
 #define L2_PROT                     (_PAGE_PRESENT|_PAGE_RW|_PAGE_ACCESSED|_PAGE_DIRTY|_PAGE_USER)
@@ -59,6 +64,10 @@
 #define L2_MASK                     ((1UL << L3_PAGETABLE_SHIFT) - 1)
 #define L3_MASK                     ((1UL << L4_PAGETABLE_SHIFT) - 1)
 
+#define PTE_MFN(entry)              (((entry) & 0x000ffffffffff000ULL) >> L1_PAGETABLE_SHIFT)
+#define SUPERPAGE_ORDER             (L2_PAGETABLE_SHIFT - L1_PAGETABLE_SHIFT)
+#define SUPERPAGE_SIZE              (1UL << L2_PAGETABLE_SHIFT)
+
 /* Given a virtual address, get an entry offset into a page table. */
 #define l1_table_offset(_a) \
   (((_a) >> L1_PAGETABLE_SHIFT) & (L1_PAGETABLE_ENTRIES - 1))
@@ -74,13 +83,25 @@
 
 #define to_phys(x)                  ((unsigned long)(x)-VIRT_START)
 #define to_virt(x)                  ((void *)((unsigned long)(x)+VIRT_START))
+#ifdef MICROPV_SIM
+// there is no machine memory in the simulator, a frame is a page of the host process
+#define mfn_to_pfn(_mfn)            ((unsigned long)(_mfn))
+#else
 #define mfn_to_pfn(_mfn)            (machine_to_phys_mapping[(_mfn)])
+#endif
 #define mfn_to_virt(_mfn)           (to_virt(mfn_to_pfn(_mfn) << __PAGE_SHIFT))
 #define PFN_DOWN(x)                 ((x) >> L1_PAGETABLE_SHIFT)
 #define virt_to_pfn(_virt)          (PFN_DOWN(to_phys(_virt)))
+#ifdef MICROPV_SIM
+#define pfn_to_mfn(_pfn)            ((unsigned long)(_pfn))
+#else
 #define pfn_to_mfn(_pfn)            (phys_to_machine_mapping[(_pfn)])
+#endif
 #define virt_to_mfn(_virt)          (pfn_to_mfn(virt_to_pfn(_virt)))
 
+/* p2m entry of a pfn that has no frame behind it */
+#define INVALID_P2M_ENTRY           (~0UL)
+
 /*---------------------------------------------------------------------
   -- forward declarations
   ---------------------------------------------------------------------*/
@@ -98,18 +119,162 @@ typedef unsigned long maddr_t;
 void xenmmu_init(void);
 
 /**
- * Map an array of machine pages into a contiguous set of pages. See the
- * caveats in the xenmmu_remap_page for restrictions.
+ * Map an array of machine pages into a contiguous set of pages taken
+ * from the foreign frame arena, with a guard page after them.
  *
  * @param mfn      Array of machine frame numbers.
  * @param mfn_size Number of elements in the frame number array.
  * @param readonly Page access privilege
  *
  * @return Pointer to the VM memory area if successfull, otherwise NULL.
- * @see xenmmu_remap_page
  */
 void *xenmmu_map_frames(uint64_t mfn[], size_t mfn_size, int readonly);
 
+/**
+ * Map each 2MB chunk of a run of pages with a single L2 entry where the
+ * hypervisor allows it. Chunks that are not machine contiguous are
+ * exchanged for a contiguous extent first. Chunks that can't be done
+ * stay on 4K pages, so the run is usable whatever happens.
+ *
+ * @param virtual_address  2MB aligned address in the image
+ * @param pages            Number of pages, a multiple of 512
+ *
+ * @return Number of 2MB chunks mapped as superpages
+ */
+int xenmmu_promote_superpages(uint64_t virtual_address, size_t pages);
+
+/**
+ * Extend the 1:1 map of the boot page tables over a run of pfns, the
+ * way mini-os build_pagetable does. Missing L3, L2 and L1 tables are
+ * made from the pages at *table_pfn onwards, which must already be
+ * mapped, as must everything below start_pfn. Mapping stops early at
+ * a pfn that has no frame in the p2m.
+ *
+ * @param start_pfn  First pfn to map
+ * @param end_pfn    pfn after the last one to map
+ * @param table_pfn  Next page to make a page table from, moved past
+ *                   the pages that were used
+ *
+ * @return The pfn mapping stopped at, end_pfn if it got everything
+ */
+uint64_t xenmmu_map_pfns(uint64_t start_pfn, uint64_t end_pfn, uint64_t *table_pfn);
+
+/**
+ * Make sure there are page tables down to L1 for a run of virtual pages
+ * outside the 1:1 map, so that they can be mapped one page at a time.
+ * The missing tables are made from pages of the page allocator, nothing
+ * is mapped.
+ *
+ * @param virtual_address  Page aligned address
+ * @param pages            Number of pages
+ *
+ * @return 0 on success, otherwise -1.
+ */
+int xenmmu_build_tables(uint64_t virtual_address, size_t pages);
+
+/**
+ * Put the 4K page tables back under any superpages in a run of pages,
+ * so that single pages can be remapped again.
+ *
+ * @param virtual_address  2MB aligned address in the image
+ * @param pages            Number of pages
+ */
+void xenmmu_demote_superpages(uint64_t virtual_address, size_t pages);
+
+/**
+ * Give pages back to the hypervisor with XENMEM_decrease_reservation.
+ * The pages are unmapped and their p2m entries invalidated first.
+ *
+ * @param pfns   Page frame numbers
+ * @param count  Number of pages
+ * @param mapped 0 for pages the 1:1 map doesn't cover, there is
+ *               nothing to unmap
+ *
+ * @return Number of pages released (from the start of the list), -1 on failure
+ */
+int xenmmu_decrease_reservation(const uint64_t *pfns, size_t count, int mapped);
+
+/**
+ * Get new frames for ballooned pages with XENMEM_increase_reservation
+ * and map them back in. Frames that can't be mapped go straight back to
+ * the hypervisor.
+ *
+ * @param pfns  Page frame numbers
+ * @param count Number of pages
+ *
+ * @return Number of pages populated and mapped (from the start of the list)
+ */
+int xenmmu_increase_reservation(const uint64_t *pfns, size_t count);
+
+/**
+ * Check that an address can be read without faulting by walking the
+ * page tables
+ *
+ * @param virtual_address Address to check
+ *
+ * @return 1 if the page is present, 0 if not
+ */
+int xenmmu_virtual_mapped(uint64_t virtual_address);
+
+/**
+ * Release pages mapped by xenmmu_map_frames
+ *
+ * @param virtual_address Pointer returned by xenmmu_map_frames
+ */
+void xenmmu_unmap_frames(void *virtual_address);
+
+/**
+ * Unmap a run of pages, e.g. to make guard pages
+ *
+ * @param virtual_address  Page aligned address in the image
+ * @param pages            Number of pages
+ *
+ * @return 0 on success, otherwise -1.
+ */
+int xenmmu_unmap_range(uint64_t virtual_address, size_t pages);
+
+/**
+ * Map a machine contiguous range (e.g. a PCI BAR) over existing
+ * virtual pages. The pages are updated in batches of multicalls rather
+ * than one hypercall per page, and the TLB is flushed once per batch.
+ *
+ * @param virtual_address  Page aligned address in the image
+ * @param machine_address  Page aligned machine address
+ * @param size             Length in bytes, rounded up to pages
+ * @param cache            _PAGE_CACHE_xxx
+ *
+ * @return 0 on success, otherwise -1.
+ */
+int xenmmu_map_io(uint64_t virtual_address, uint64_t machine_address, size_t size, uint64_t cache);
+
+/**
+ * Swap the frames behind a run of virtual pages for one machine
+ * contiguous extent using XENMEM_exchange, then update the p2m, m2p
+ * and page tables to match.
+ *
+ * @param virtual_address  Page aligned address in the image
+ * @param order            log2 of the number of pages, at most
+ *                         SUPERPAGE_ORDER
+ * @param address_bits     highest machine address width the extent may
+ *                         use, 0 for no limit
+ * @param machine_address  Machine address of the extent
+ *
+ * @return 0 on success, otherwise -1.
+ */
+int xenmmu_make_contiguous(uint64_t virtual_address, unsigned int order, unsigned int address_bits, uint64_t *machine_address);
+
+/**
+ * Swap the machine contiguous extent behind a run of virtual pages back
+ * for any frames, undoing xenmmu_make_contiguous.
+ *
+ * @param virtual_address  Page aligned address in the image
+ * @param order            log2 of the number of pages, at most
+ *                         SUPERPAGE_ORDER
+ *
+ * @return 0 on success, otherwise -1.
+ */
+int xenmmu_release_contiguous(uint64_t virtual_address, unsigned int order);
+
 /*---------------------------------------------------------------------
   -- global variables
   ---------------------------------------------------------------------*/
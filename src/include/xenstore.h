@@ -41,10 +41,20 @@ int xenstore_read(xenbus_transaction_t xbt, const char *key, char *value, size_t
 int xenstore_write_if_different(xenbus_transaction_t xbt, const char *key, const char *value);
 int xenstore_write_integer(xenbus_transaction_t xbt, const char *path, int32_t value);
 int xenstore_read_integer(xenbus_transaction_t xbt, const char *path, int32_t *value);
+int xenstore_write_int64(xenbus_transaction_t xbt, const char *path, int64_t value);
+int xenstore_read_int64(xenbus_transaction_t xbt, const char *path, int64_t *value);
+int xenstore_write_uint64(xenbus_transaction_t xbt, const char *path, uint64_t value);
+int xenstore_read_uint64(xenbus_transaction_t xbt, const char *path, uint64_t *value);
+int xenstore_write_binary(xenbus_transaction_t xbt, const char *path, const void *data, size_t data_length, micropv_registry_encoding_t encoding);
+int xenstore_read_binary(xenbus_transaction_t xbt, const char *path, void *data, size_t data_size, size_t *data_length, micropv_registry_encoding_t encoding);
+int xenstore_ls(xenbus_transaction_t xbt, const char *key, char *values, size_t value_size, size_t *value_length);
+int xenstore_ls_part(xenbus_transaction_t xbt, const char *key, size_t offset, char *values, size_t value_size, size_t *value_length);
 int xenstore_transaction_start(xenbus_transaction_t *xbt);
 int xenstore_transaction_end(xenbus_transaction_t xbt, int abort, int *retry);
 void xenstore_wait_for_event(void);
 int xenstore_rm(xenbus_transaction_t xbt, const char *path);
+int xenstore_watch(const char *path, micropv_registry_watch_t callback, void *context);
+int xenstore_poll_watches(void);
 
 /*---------------------------------------------------------------------
   -- global variables
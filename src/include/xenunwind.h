@@ -0,0 +1,77 @@
+/*  ***********************************************************************
+    * Project:
+    * File: xenunwind.h
+    * Author: smartin
+    ***********************************************************************
+
+    Modifications
+    0.00 10/19/2026 created
+*/
+
+/*---------------------------------------------------------------------
+  -- macros (preamble)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- standard includes
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- project includes (imports)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- project includes (exports)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- macros (postamble)
+  ---------------------------------------------------------------------*/
+#define XENUNWIND_STACK_WINDOW  (64 * 1024)
+
+/*---------------------------------------------------------------------
+  -- forward declarations
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- data types
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- function prototypes
+  ---------------------------------------------------------------------*/
+
+/**
+ * Follow the frame pointer chain. Frames must be 8 byte aligned, mapped,
+ * move up the stack and stay within XENUNWIND_STACK_WINDOW of sp.
+ *
+ * @param bp  Frame pointer to start from
+ * @param sp  Stack pointer at the same point
+ * @param ips Filled in with the return addresses, innermost first
+ * @param max Number of entries in ips
+ *
+ * @return Number of return addresses found
+ */
+size_t xenunwind_walk(uint64_t bp, uint64_t sp, uint64_t *ips, size_t max);
+
+/**
+ * Find the function containing an address in the table built at link time
+ *
+ * @param address Code address
+ * @param offset  Set to the offset of address into the function, can be NULL
+ *
+ * @return Function name or NULL if the address isn't in our code
+ */
+const char *xenunwind_symbol(uint64_t address, uint64_t *offset);
+
+/*---------------------------------------------------------------------
+  -- global variables
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- local variables
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- implementation
+  ---------------------------------------------------------------------*/
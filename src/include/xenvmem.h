@@ -0,0 +1,76 @@
+/*  ***********************************************************************
+    * Project:
+    * File: xenvmem.h
+    * Author: smartin
+    ***********************************************************************
+
+    Modifications
+    0.00 10/19/2026 created
+*/
+
+/*---------------------------------------------------------------------
+  -- macros (preamble)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- standard includes
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- project includes (imports)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- project includes (exports)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- macros (postamble)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- forward declarations
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- data types
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- function prototypes
+  ---------------------------------------------------------------------*/
+
+/**
+ * Reserve a run of virtual pages in an arena. Nothing is mapped at the
+ * pages until the caller maps something there, the page tables for
+ * them are ready.
+ *
+ * @param arena Arena to take the pages from
+ * @param pages Number of pages
+ * @param flags MICROPV_VMEM_xxx
+ *
+ * @return Address of the first page or NULL if the arena is full
+ */
+void *xenvmem_alloc(micropv_vmem_arena_t arena, size_t pages, int flags);
+
+/**
+ * Give a run back to its arena. The pages, and the guard page if there
+ * is one, are unmapped so they can be reused.
+ *
+ * @param virtual_address Address returned by xenvmem_alloc
+ *
+ * @return 0 on success, -1 if the address is not the start of a run
+ */
+int xenvmem_free(void *virtual_address);
+
+/*---------------------------------------------------------------------
+  -- global variables
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- local variables
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- implementation
+  ---------------------------------------------------------------------*/
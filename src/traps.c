@@ -28,11 +28,17 @@
 #include "hypercall.h"
 #include "hypervisor.h"
 #include "traps.h"
+#include "xenmmu.h"
+#include "xenunwind.h"
 #include "../micropv.h"
+#include "xencrash.h"
+#include "xenprintk.h"
+#include "xengdb.h"
 
 /*---------------------------------------------------------------------
   -- macros (postamble)
   ---------------------------------------------------------------------*/
+#define STACK_WALK_DEPTH 32
 
 /*---------------------------------------------------------------------
   -- data types
@@ -143,14 +149,27 @@ static void dump_fp_regs(struct pt_regs *regs)
     PRINTK("XMM15: %016lx MXCSR: %016lx", xmm15, mxcsr);
 }
 
-static void do_stack_walk(unsigned long frame_base)
+static void dump_address(int depth, uint64_t address)
+{
+    uint64_t offset;
+    const char *name = xenunwind_symbol(address, &offset);
+
+    if (name)
+        PRINTK("#%-2i %016lx %s+%#lx", depth, address, name, offset);
+    else
+        PRINTK("#%-2i %016lx", depth, address);
+}
+
+static void do_stack_walk(struct pt_regs *regs)
 {
     PRINTK("-------------------- STACK WALK    --------------------");
-    unsigned long *frame = (void*) frame_base;
-    PRINTK("base is %#lx ", frame_base);
-    PRINTK("caller is %#lx", frame[1]);
-    //if (frame[0])
-    //    do_stack_walk(frame[0]);
+    uint64_t ips[STACK_WALK_DEPTH];
+    size_t depth = xenunwind_walk(regs->bp, regs->sp, ips, STACK_WALK_DEPTH);
+    size_t i;
+
+    dump_address(0, regs->ip);
+    for (i = 0; i < depth; i++)
+        dump_address(i + 1, ips[i]);
 }
 
 static void dump_mem(unsigned long addr)
@@ -160,6 +179,16 @@ static void dump_mem(unsigned long addr)
     if (addr < __PAGE_SIZE)
         return;
 
+    // the range can cross into the page either side
+    for (i = ((addr)-16 ) & ~15; i < (((addr)+48 ) & ~15); i += __PAGE_SIZE - (i & __PAGE_MASK))
+    {
+        if (!xenmmu_virtual_mapped(i))
+        {
+            PRINTK("%016lx: not mapped", i);
+            return;
+        }
+    }
+
     for (i = ((addr)-16 ) & ~15; i < (((addr)+48 ) & ~15); )
     {
         static char hexchar[16] = { '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f' };
@@ -186,14 +215,20 @@ static void dump_mem(unsigned long addr)
 
 static void dump_context(struct pt_regs *regs)
 {
+    // whatever was logged in binary, and the context below, goes out as text
+    xenprintk_dump();
+
     // log context
     dump_regs(regs);
     dump_fp_regs(regs);
-    do_stack_walk(regs->bp);
+    do_stack_walk(regs);
     dump_mem(regs->sp);
     dump_mem(regs->bp);
     dump_mem(regs->ip);
 
+    // leave the full picture for dom0
+    xencrash_write(regs);
+
     // stop
     struct sched_shutdown sched_shutdown = { .reason = SHUTDOWN_crash };
     HYPERVISOR_sched_op(SCHEDOP_shutdown, &sched_shutdown);
@@ -205,8 +240,25 @@ static void dump_context(struct pt_regs *regs)
 
 /* Dummy implementation.  Should actually do something */
 void do_divide_error(struct pt_regs *regs)                  { PRINTK("%s", __FUNCTION__); dump_context(regs); }
-void do_debug(struct pt_regs *regs)                         { PRINTK("%s", __FUNCTION__); dump_context(regs); }
-void do_int3(struct pt_regs *regs)                          { PRINTK("%s", __FUNCTION__); dump_context(regs); }
+
+void do_debug(struct pt_regs *regs)
+{
+    // the debugger may be single stepping
+    if (xengdb_trap(regs, 1))
+        return;
+    PRINTK("%s", __FUNCTION__);
+    dump_context(regs);
+}
+
+void do_int3(struct pt_regs *regs)
+{
+    // the debugger may have set a breakpoint
+    if (xengdb_trap(regs, 3))
+        return;
+    PRINTK("%s", __FUNCTION__);
+    dump_context(regs);
+}
+
 void do_overflow(struct pt_regs *regs)                      { PRINTK("%s", __FUNCTION__); dump_context(regs); }
 void do_bounds(struct pt_regs *regs)                        { PRINTK("%s", __FUNCTION__); dump_context(regs); }
 void do_invalid_op(struct pt_regs *regs)                    { PRINTK("%s", __FUNCTION__); dump_context(regs); }
@@ -0,0 +1,306 @@
+/*  ***********************************************************************
+    * Project:
+    * File: xenballoon.c
+    * Author: smartin
+    ***********************************************************************
+
+    Balloon driver. The toolstack sets memory/target (in KiB) and we inflate the balloon by taking free pages out of
+    the page allocator and handing them back to Xen, or deflate it by getting new frames for the pages we gave away
+    and putting them back in the page allocator.
+
+    The balloon can only hold pages we started with, we don't have any page tables for pages above nr_pages. Pages
+    below nr_pages that xenpage_init couldn't map are no use to us, they go back to Xen when the balloon starts and
+    don't come back.
+
+    The page frame numbers of the pages in the balloon are kept in a stack of chunks. A chunk is a page from the
+    page allocator, it can't live in a ballooned page as those aren't mapped. There is always room on the stack
+    for a batch before its pages are given away, with a spare chunk if the top one is nearly full, so a page
+    can't be lost for want of somewhere to write its pfn down.
+
+    If the page allocator runs dry it takes pages back from the balloon, even if that puts us above the target.
+    The next change of target (or micropv_balloon_set_target) puts that right.
+
+    Modifications
+    0.00 10/19/2026 created
+*/
+
+/*---------------------------------------------------------------------
+  -- macros (preamble)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- standard includes
+  ---------------------------------------------------------------------*/
+#include <stdint.h>
+#include <string.h>
+
+/*---------------------------------------------------------------------
+  -- project includes (imports)
+  ---------------------------------------------------------------------*/
+#include "../micropv.h"
+#include "hypervisor.h"
+#include "xenevents.h"
+#include "xenmmu.h"
+#include "xenpage.h"
+#include "xenstore.h"
+
+/*---------------------------------------------------------------------
+  -- project includes (exports)
+  ---------------------------------------------------------------------*/
+#include "xenballoon.h"
+
+/*---------------------------------------------------------------------
+  -- macros (postamble)
+  ---------------------------------------------------------------------*/
+#define BALLOON_BATCH           256
+#define BALLOON_CHUNK_PFNS      ((__PAGE_SIZE - 2 * sizeof(uint64_t)) / sizeof(uint64_t))
+#define BALLOON_TARGET_PATH     "memory/target"
+
+/*---------------------------------------------------------------------
+  -- forward declarations
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- data types
+  ---------------------------------------------------------------------*/
+typedef struct balloon_chunk_t
+{
+    struct balloon_chunk_t *next;
+    uint64_t count;
+    uint64_t pfn[BALLOON_CHUNK_PFNS];
+} balloon_chunk_t;
+
+/*---------------------------------------------------------------------
+  -- function prototypes
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- global variables
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- local variables
+  ---------------------------------------------------------------------*/
+static balloon_chunk_t *balloon_stack = NULL;
+static balloon_chunk_t *balloon_spare = NULL;
+static uint64_t balloon_pages = 0;
+static uint64_t balloon_unmapped = 0;
+static uint64_t balloon_target = 0;
+static volatile int balloon_busy = 0;
+
+/*---------------------------------------------------------------------
+  -- implementation
+  ---------------------------------------------------------------------*/
+
+/* Make sure the next count pushes (at most a chunk) have somewhere to go */
+static int balloon_reserve(size_t count)
+{
+    size_t room = balloon_stack ? BALLOON_CHUNK_PFNS - balloon_stack->count : 0;
+
+    if ((room < count) && !balloon_spare && !(balloon_spare = micropv_page_alloc(0)))
+        return -1;
+
+    return 0;
+}
+
+/* balloon_reserve has made room, or a pop has just left a spare chunk */
+static void balloon_push(uint64_t pfn)
+{
+    if (!balloon_stack || (balloon_stack->count == BALLOON_CHUNK_PFNS))
+    {
+        balloon_chunk_t *chunk = balloon_spare;
+        balloon_spare = NULL;
+        chunk->next = balloon_stack;
+        chunk->count = 0;
+        balloon_stack = chunk;
+    }
+
+    balloon_stack->pfn[balloon_stack->count++] = pfn;
+}
+
+/* Take up to count pfns off the stack, the first empty chunk is kept as the spare and the rest are freed */
+static size_t balloon_pop(uint64_t *pfns, size_t count)
+{
+    size_t popped = 0;
+
+    while ((popped < count) && balloon_stack)
+    {
+        pfns[popped++] = balloon_stack->pfn[--balloon_stack->count];
+        if (!balloon_stack->count)
+        {
+            balloon_chunk_t *chunk = balloon_stack;
+            balloon_stack = chunk->next;
+            if (!balloon_spare)
+                balloon_spare = chunk;
+            else
+                micropv_page_free(chunk, 0);
+        }
+    }
+
+    return popped;
+}
+
+/* Give up to count free pages back to xen */
+static uint64_t balloon_inflate(uint64_t count)
+{
+    uint64_t pfns[BALLOON_BATCH];
+    uint64_t done = 0;
+
+    while (done < count)
+    {
+        // somewhere to write the pfns down before the pages go
+        if (balloon_reserve(BALLOON_BATCH))
+        {
+            PRINTK("no page for the balloon's pfn list");
+            break;
+        }
+
+        size_t batch = 0;
+        while ((batch < BALLOON_BATCH) && (done + batch < count))
+        {
+            void *page = micropv_page_alloc(0);
+            if (!page)
+                break;
+            pfns[batch++] = virt_to_pfn(page);
+        }
+        if (!batch)
+            break;
+
+        int released = xenmmu_decrease_reservation(pfns, batch, 1);
+        if (released < 0)
+            released = 0;
+
+        size_t i;
+        for (i = 0; i < released; i++)
+            balloon_push(pfns[i]);
+        balloon_pages += released;
+
+        // whatever xen didn't take is still mapped
+        for (i = released; i < batch; i++)
+            micropv_page_free(to_virt(pfns[i] << __PAGE_SHIFT), 0);
+
+        done += released;
+        if (released < batch)
+            break;
+    }
+
+    return done;
+}
+
+/* Get frames back for up to count ballooned pages */
+static uint64_t balloon_deflate(uint64_t count)
+{
+    uint64_t pfns[BALLOON_BATCH];
+    uint64_t done = 0;
+
+    while (done < count)
+    {
+        size_t batch = balloon_pop(pfns, (count - done < BALLOON_BATCH) ? count - done : BALLOON_BATCH);
+        if (!batch)
+            break;
+
+        size_t populated = xenmmu_increase_reservation(pfns, batch);
+        balloon_pages -= populated;
+
+        size_t i;
+        for (i = 0; i < populated; i++)
+            micropv_page_free(to_virt(pfns[i] << __PAGE_SHIFT), 0);
+
+        // xen is out of memory, keep the rest in the balloon. They were on the stack a moment ago, so there is room
+        for (i = populated; i < batch; i++)
+            balloon_push(pfns[i]);
+
+        done += populated;
+        if (populated < batch)
+            break;
+    }
+
+    return done;
+}
+
+static void balloon_adjust(void)
+{
+    uint64_t current = hypervisor_start_info.nr_pages - balloon_unmapped - balloon_pages;
+
+    if (balloon_busy)
+        return;
+    balloon_busy = 1;
+
+    if (balloon_target < current)
+        PRINTK("balloon inflated by %lu pages", balloon_inflate(current - balloon_target));
+    else if (balloon_target > current)
+        PRINTK("balloon deflated by %lu pages", balloon_deflate(balloon_target - current));
+
+    balloon_busy = 0;
+}
+
+static void balloon_target_changed(const char *path, void *context)
+{
+    uint64_t target_kb;
+
+    if (xenstore_read_uint64(XBT_NIL, BALLOON_TARGET_PATH, &target_kb))
+        return;
+
+    balloon_target = target_kb >> (__PAGE_SHIFT - 10);
+    PRINTK("memory target %lu pages, %lu in the balloon", balloon_target, balloon_pages);
+    balloon_adjust();
+}
+
+/* Give the pages xenpage_init couldn't map back to xen, they don't count against the target any more */
+static void balloon_release_unmapped(void)
+{
+    uint64_t pfns[BALLOON_BATCH];
+    uint64_t pfn = xenpage_end_pfn();
+
+    while (pfn < hypervisor_start_info.nr_pages)
+    {
+        size_t batch = 0;
+        for (; (pfn < hypervisor_start_info.nr_pages) && (batch < BALLOON_BATCH); pfn++)
+            if (pfn_to_mfn(pfn) != INVALID_P2M_ENTRY)
+                pfns[batch++] = pfn;
+
+        int released = batch ? xenmmu_decrease_reservation(pfns, batch, 0) : 0;
+        if (released > 0)
+            balloon_unmapped += released;
+        if (released < (int)batch)
+            break;
+    }
+
+    if (balloon_unmapped)
+        PRINTK("gave %lu pages that aren't mapped back to xen", balloon_unmapped);
+}
+
+void xenballoon_init(void)
+{
+    balloon_release_unmapped();
+    balloon_target = hypervisor_start_info.nr_pages - balloon_unmapped;
+
+    if (xenstore_watch(BALLOON_TARGET_PATH, balloon_target_changed, NULL))
+        PRINTK("no balloon, can't watch %s", BALLOON_TARGET_PATH);
+}
+
+uint64_t xenballoon_reclaim(uint64_t pages)
+{
+    uint64_t reclaimed;
+
+    // the chunks come from the page allocator, so this can be called from inside the balloon
+    if (balloon_busy || !balloon_pages)
+        return 0;
+    balloon_busy = 1;
+
+    reclaimed = balloon_deflate(pages);
+
+    balloon_busy = 0;
+    return reclaimed;
+}
+
+void micropv_balloon_set_target(uint64_t pages)
+{
+    balloon_target = pages;
+    balloon_adjust();
+}
+
+uint64_t micropv_balloon_pages(void)
+{
+    return balloon_pages;
+}
@@ -30,10 +30,12 @@
 #include "xenevents.h"
 #include "xenmmu.h"
 #include "psnprintf.h"
+#include "xengdb.h"
 
 /*---------------------------------------------------------------------
   -- macros (postamble)
   ---------------------------------------------------------------------*/
+#define XENCONSOLE_BUFFER_SIZE 128
 
 /*---------------------------------------------------------------------
   -- data types
@@ -95,7 +97,8 @@ static int xenconsole_ring_send(struct xencons_interface *ring, evtchn_port_t po
 
     do
     {
-        sent += xenconsole_ring_send_no_notify(ring, data, len);
+        // a full ring takes what fits, the rest goes once the backend has made room
+        sent += xenconsole_ring_send_no_notify(ring, data + sent, len - sent);
         xenevents_notify_remote_via_evtchn(port);
     }
     while (sent < len);
@@ -114,34 +117,32 @@ int micropv_console_write_available()
     return (ring->out_prod - ring->out_cons - 1) & (sizeof(ring->out) - 1);
 }
 
+static void xenconsole_flush(void *context, const char *data, size_t length)
+{
+    micropv_console_write(data, length);
+}
+
 int xenconsole_printf(const char *format, ...)
 {
+    char buffer[XENCONSOLE_BUFFER_SIZE];
+    psink_t sink;
     va_list args;
-    int length;
 
-    // process the format once to get the string length
+    // format straight into the ring in buffer sized pieces
+    psink_init(&sink, buffer, sizeof(buffer), xenconsole_flush, NULL);
     va_start(args, format);
-    length = pvsnprintf(NULL, 0, format, args);
+    pvsprintf_sink(&sink, format, args);
     va_end(args);
+    psink_flush(&sink);
 
-    // if we have a string then print it
-    if (length > 0)
-    {
-        // create the output string
-        char message[length + 1];
-        va_start(args, format);
-        length = pvsnprintf(message, length + 1, format, args);
-        va_end(args);
-
-        // send to the console
-        micropv_console_write(message, length);
-    }
-
-    return length;
+    return sink.count;
 }
 
 static void xenconsole_event_handler(evtchn_port_t port, struct pt_regs *regs, void *data)
 {
+    // with the debugger enabled a ^C stops the guest here
+    xengdb_console_event(regs);
+
 #if 0
     struct xencons_interface *ring = xenconsole_interface();
 
@@ -0,0 +1,369 @@
+/*  ***********************************************************************
+    * Project:
+    * File: xencrash.c
+    * Author: smartin
+    ***********************************************************************
+
+    Crash dumps for dom0. micropv_crash_dump_init sets aside a region of pages, grants them to the remote domain up
+    front and advertises them in the xenstore, so at crash time all we have to do is copy memory.
+
+    The xenstore has data/crashdump/pages and data/crashdump/index, the grant of the index page. The index page
+    holds a crash_index_t with the grant of every page in the region, and length is set once a dump is complete.
+
+    The dump is laid out like an ELF core file: a PT_NOTE segment followed by a PT_LOAD segment per memory range with
+    p_vaddr set to where the range was. The notes are owned by "MICROPV":
+        1 - struct pt_regs at the trap
+        2 - fxsave area
+        3 - return addresses from the frame pointer walk
+        4 - the console log, oldest first
+    The first load segment is the stack above the trap, then whatever was added with micropv_crash_dump_add_range.
+    Ranges are cut short at the first unmapped page and the dump is cut short when the region is full.
+
+    Modifications
+    0.00 10/19/2026 created
+*/
+
+/*---------------------------------------------------------------------
+  -- macros (preamble)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- standard includes
+  ---------------------------------------------------------------------*/
+#include <stdint.h>
+#include <string.h>
+
+/*---------------------------------------------------------------------
+  -- project includes (imports)
+  ---------------------------------------------------------------------*/
+#include "../micropv.h"
+#include "hypervisor.h"
+#include "xengnttab.h"
+#include "xenmmu.h"
+#include "xenstore.h"
+#include "xenunwind.h"
+
+/*---------------------------------------------------------------------
+  -- project includes (exports)
+  ---------------------------------------------------------------------*/
+#include "xencrash.h"
+
+/*---------------------------------------------------------------------
+  -- macros (postamble)
+  ---------------------------------------------------------------------*/
+#define CRASH_INDEX_MAGIC       0x504d5243      // "CRMP"
+#define CRASH_INDEX_PATH        "data/crashdump/index"
+#define CRASH_PAGES_PATH        "data/crashdump/pages"
+#define CRASH_MAX_PAGES         ((__PAGE_SIZE - 16) / sizeof(uint32_t))
+#define CRASH_MAX_RANGES        16
+#define CRASH_LOG_SIZE          (16 * 1024)
+#define CRASH_MAX_FRAMES        64
+#define CRASH_NOTE_NAME         "MICROPV"
+
+#define CRASH_NOTE_REGS         1
+#define CRASH_NOTE_FPU          2
+#define CRASH_NOTE_FRAMES       3
+#define CRASH_NOTE_LOG          4
+
+#define ELF_CLASS64             2
+#define ELF_DATA2LSB            1
+#define ELF_VERSION             1
+#define ELF_ET_CORE             4
+#define ELF_EM_X86_64           62
+#define ELF_PT_LOAD             1
+#define ELF_PT_NOTE             4
+#define ELF_PF_R                4
+
+/*---------------------------------------------------------------------
+  -- forward declarations
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- data types
+  ---------------------------------------------------------------------*/
+typedef struct crash_index_t
+{
+    uint32_t magic;
+    uint32_t pages;
+    uint64_t length;
+    uint32_t gref[CRASH_MAX_PAGES];
+} crash_index_t;
+
+typedef struct crash_range_t
+{
+    uint64_t start;
+    uint64_t length;
+} crash_range_t;
+
+typedef struct elf_header_t
+{
+    uint8_t  e_ident[16];
+    uint16_t e_type;
+    uint16_t e_machine;
+    uint32_t e_version;
+    uint64_t e_entry;
+    uint64_t e_phoff;
+    uint64_t e_shoff;
+    uint32_t e_flags;
+    uint16_t e_ehsize;
+    uint16_t e_phentsize;
+    uint16_t e_phnum;
+    uint16_t e_shentsize;
+    uint16_t e_shnum;
+    uint16_t e_shstrndx;
+} elf_header_t;
+
+typedef struct elf_program_header_t
+{
+    uint32_t p_type;
+    uint32_t p_flags;
+    uint64_t p_offset;
+    uint64_t p_vaddr;
+    uint64_t p_paddr;
+    uint64_t p_filesz;
+    uint64_t p_memsz;
+    uint64_t p_align;
+} elf_program_header_t;
+
+typedef struct elf_note_t
+{
+    uint32_t n_namesz;
+    uint32_t n_descsz;
+    uint32_t n_type;
+} elf_note_t;
+
+/*---------------------------------------------------------------------
+  -- function prototypes
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- global variables
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- local variables
+  ---------------------------------------------------------------------*/
+static crash_index_t *crash_index = NULL;
+static char *crash_region = NULL;
+static size_t crash_region_size = 0;
+static crash_range_t crash_ranges[CRASH_MAX_RANGES];
+static int crash_range_count = 0;
+static volatile int crash_writing = 0;
+
+static char crash_log[CRASH_LOG_SIZE];
+static uint64_t crash_log_head = 0;
+
+/*---------------------------------------------------------------------
+  -- implementation
+  ---------------------------------------------------------------------*/
+
+void xencrash_log(const char *text, size_t length)
+{
+    // only the tail of a long message fits
+    if (length > CRASH_LOG_SIZE)
+    {
+        text += length - CRASH_LOG_SIZE;
+        length = CRASH_LOG_SIZE;
+    }
+
+    size_t offset = crash_log_head & (CRASH_LOG_SIZE - 1);
+    size_t first = (length < CRASH_LOG_SIZE - offset) ? length : CRASH_LOG_SIZE - offset;
+    memcpy(crash_log + offset, text, first);
+    memcpy(crash_log, text + first, length - first);
+    crash_log_head += length;
+}
+
+int micropv_crash_dump_init(int remote_dom, unsigned int order)
+{
+    size_t pages = 1UL << order;
+    size_t i;
+
+    if (crash_region)
+        return 0;
+    if (pages > CRASH_MAX_PAGES)
+    {
+        PRINTK("crash dump region of %lu pages is too big", pages);
+        return -1;
+    }
+
+    crash_index = micropv_page_alloc(0);
+    crash_region = micropv_page_alloc(order);
+    if (!crash_index || !crash_region)
+    {
+        PRINTK("no memory for a crash dump region of %lu pages", pages);
+        goto fail;
+    }
+
+    memset(crash_index, 0, __PAGE_SIZE);
+    crash_index->magic = CRASH_INDEX_MAGIC;
+    crash_index->pages = pages;
+    for (i = 0; i < pages; i++)
+        crash_index->gref[i] = xengnttab_share(remote_dom, crash_region + i * __PAGE_SIZE, 1);
+
+    if (xenstore_write_integer(XBT_NIL, CRASH_PAGES_PATH, pages) ||
+        xenstore_write_integer(XBT_NIL, CRASH_INDEX_PATH, xengnttab_share(remote_dom, crash_index, 1)))
+    {
+        PRINTK("unable to advertise the crash dump region");
+        // the grants stay, dom0 can't find them without the xenstore entries
+        crash_region = NULL;
+        return -1;
+    }
+
+    crash_region_size = pages * __PAGE_SIZE;
+    return 0;
+
+fail:
+    if (crash_index)
+        micropv_page_free(crash_index, 0);
+    if (crash_region)
+        micropv_page_free(crash_region, order);
+    crash_index = NULL;
+    crash_region = NULL;
+    return -1;
+}
+
+int micropv_crash_dump_add_range(const void *start, size_t length)
+{
+    if (crash_range_count == CRASH_MAX_RANGES)
+        return -1;
+
+    crash_ranges[crash_range_count].start = (uint64_t)start;
+    crash_ranges[crash_range_count].length = length;
+    crash_range_count++;
+    return 0;
+}
+
+/* How much of a range can be read, stopping at the first unmapped page */
+static uint64_t crash_mapped_length(uint64_t start, uint64_t length)
+{
+    uint64_t address = start & ~__PAGE_MASK;
+
+    while (address < start + length)
+    {
+        if (!xenmmu_virtual_mapped(address))
+            return (address > start) ? address - start : 0;
+        address += __PAGE_SIZE;
+    }
+
+    return length;
+}
+
+/* Append a note, returns the new offset or 0 if there isn't room */
+static size_t crash_note(size_t offset, uint32_t type, const void *data, size_t length)
+{
+    size_t size = sizeof(elf_note_t) + ((sizeof(CRASH_NOTE_NAME) + 3) & ~3) + ((length + 3) & ~3);
+    if (offset + size > crash_region_size)
+        return 0;
+
+    elf_note_t *note = (elf_note_t *)(crash_region + offset);
+    note->n_namesz = sizeof(CRASH_NOTE_NAME);
+    note->n_descsz = length;
+    note->n_type = type;
+    offset += sizeof(elf_note_t);
+
+    memcpy(crash_region + offset, CRASH_NOTE_NAME, sizeof(CRASH_NOTE_NAME));
+    offset += (sizeof(CRASH_NOTE_NAME) + 3) & ~3;
+
+    memcpy(crash_region + offset, data, length);
+    return offset + ((length + 3) & ~3);
+}
+
+void xencrash_write(struct pt_regs *regs)
+{
+    crash_range_t ranges[CRASH_MAX_RANGES + 1];
+    uint8_t fxsave[512] __attribute__((aligned(16)));
+    uint64_t frames[CRASH_MAX_FRAMES];
+    int count = 0, i;
+
+    // a fault while dumping gets no second go
+    if (!crash_region || crash_writing)
+        return;
+    crash_writing = 1;
+
+    __asm__ __volatile__ ("fxsave %0" : "=m" (fxsave));
+    size_t depth = xenunwind_walk(regs->bp, regs->sp, frames, CRASH_MAX_FRAMES);
+
+    // the stack first, then anything the guest OS asked for
+    ranges[count].start = regs->sp;
+    ranges[count].length = crash_mapped_length(regs->sp, XENUNWIND_STACK_WINDOW);
+    count++;
+    for (i = 0; i < crash_range_count; i++)
+    {
+        ranges[count].start = crash_ranges[i].start;
+        ranges[count].length = crash_mapped_length(crash_ranges[i].start, crash_ranges[i].length);
+        count++;
+    }
+
+    // headers
+    elf_header_t *header = (elf_header_t *)crash_region;
+    elf_program_header_t *program = (elf_program_header_t *)(header + 1);
+    memset(header, 0, sizeof(*header) + (count + 1) * sizeof(*program));
+    memcpy(header->e_ident, "\177ELF", 4);
+    header->e_ident[4] = ELF_CLASS64;
+    header->e_ident[5] = ELF_DATA2LSB;
+    header->e_ident[6] = ELF_VERSION;
+    header->e_type = ELF_ET_CORE;
+    header->e_machine = ELF_EM_X86_64;
+    header->e_version = ELF_VERSION;
+    header->e_phoff = sizeof(*header);
+    header->e_ehsize = sizeof(*header);
+    header->e_phentsize = sizeof(*program);
+
+    // notes
+    size_t offset = sizeof(*header) + (count + 1) * sizeof(*program);
+    size_t notes = offset;
+    offset = crash_note(offset, CRASH_NOTE_REGS, regs, sizeof(*regs));
+    if (offset)
+        offset = crash_note(offset, CRASH_NOTE_FPU, fxsave, sizeof(fxsave));
+    if (offset)
+        offset = crash_note(offset, CRASH_NOTE_FRAMES, frames, depth * sizeof(uint64_t));
+    if (offset)
+    {
+        // unwrap the log so the oldest line comes first
+        size_t length = (crash_log_head < CRASH_LOG_SIZE) ? crash_log_head : CRASH_LOG_SIZE;
+        size_t start = (crash_log_head - length) & (CRASH_LOG_SIZE - 1);
+        size_t first = (length < CRASH_LOG_SIZE - start) ? length : CRASH_LOG_SIZE - start;
+        offset = crash_note(offset, CRASH_NOTE_LOG, crash_log + start, first);
+        if (offset && (first < length))
+            offset = crash_note(offset, CRASH_NOTE_LOG, crash_log, length - first);
+    }
+    if (!offset)
+    {
+        crash_writing = 0;
+        return;
+    }
+
+    program[0].p_type = ELF_PT_NOTE;
+    program[0].p_offset = notes;
+    program[0].p_filesz = offset - notes;
+    header->e_phnum = 1;
+
+    // memory
+    for (i = 0; i < count; i++)
+    {
+        offset = (offset + 15) & ~15;
+        if (offset >= crash_region_size)
+            break;
+
+        uint64_t length = ranges[i].length;
+        if (length > crash_region_size - offset)
+            length = crash_region_size - offset;
+
+        elf_program_header_t *segment = &program[header->e_phnum++];
+        segment->p_type = ELF_PT_LOAD;
+        segment->p_flags = ELF_PF_R;
+        segment->p_offset = offset;
+        segment->p_vaddr = ranges[i].start;
+        segment->p_filesz = length;
+        segment->p_memsz = ranges[i].length;
+        segment->p_align = 16;
+
+        memcpy(crash_region + offset, (void *)ranges[i].start, length);
+        offset += length;
+    }
+
+    // let dom0 know that there is a complete dump
+    wmb();
+    crash_index->length = offset;
+    PRINTK("crash dump of %lu bytes written", offset);
+}
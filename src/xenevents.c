@@ -165,7 +165,6 @@ static void unmask_evtchn(uint32_t port)
     shared_info_t *s = hypervisor_shared_info;
     vcpu_info_t *vcpu_info = &s->vcpu_info[smp_processor_id()];
 
-    PRINTK("unmask port %d", port);
     synch_clear_bit(port, &s->evtchn_mask[0]);
 
     /*
@@ -269,7 +268,12 @@ evtchn_port_t xenevents_bind_virq(int virq, evtchn_handler_t handler)
 
 evtchn_port_t xenevents_bind_handler(int channel, evtchn_handler_t handler)
 {
-    evtchn_port_t port = bind_event_handler(channel, handler, NULL);
+    return xenevents_bind_handler_context(channel, handler, NULL);
+}
+
+evtchn_port_t xenevents_bind_handler_context(int channel, evtchn_handler_t handler, void *context)
+{
+    evtchn_port_t port = bind_event_handler(channel, handler, context);
     if (-1 == port)
     {
         PRINTK("Error initialising channel %i", channel);
@@ -285,6 +289,44 @@ void xenevents_unbind_channel(evtchn_port_t port)
     unbind_event_handler(port);
 }
 
+evtchn_port_t xenevents_bind_pirq(int pirq, evtchn_handler_t handler, void *context)
+{
+    evtchn_bind_pirq_t op;
+    int rc;
+
+    op.pirq = pirq;
+    op.flags = 0;
+    if ((rc = HYPERVISOR_event_channel_op(EVTCHNOP_bind_pirq, &op)) != 0)
+    {
+        PRINTK("Failed to bind physical IRQ %d with rc=%d", pirq, rc);
+        return -1;
+    }
+
+    return xenevents_bind_handler_context(op.port, handler, context);
+}
+
+void xenevents_mask_channel(evtchn_port_t port)
+{
+    mask_evtchn(port);
+}
+
+void xenevents_unmask_channel(evtchn_port_t port)
+{
+    unmask_evtchn(port);
+}
+
+void xenevents_close_channel(evtchn_port_t port)
+{
+    evtchn_close_t op;
+    int rc;
+
+    xenevents_unbind_channel(port);
+
+    op.port = port;
+    if ((rc = HYPERVISOR_event_channel_op(EVTCHNOP_close, &op)) != 0)
+        PRINTK("Failed to close port %d with rc=%d", port, rc);
+}
+
 evtchn_port_t xenevents_bind_interdomain_channel(int remote_dom, int remote_port, int *local_port)
 {
     int rc;
@@ -309,7 +351,7 @@ int xenevents_create_event(evtchn_port_t *event_port, evtchn_handler_t event_han
         return -1;
     }
 
-    int local_port;
+    int local_port = -1;
     if (xenevents_bind_interdomain_channel(DOMID_SELF, remote_port, &local_port))
     {
         PRINTK("Failed to bind to interdomain channel");
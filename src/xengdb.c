@@ -0,0 +1,490 @@
+/*  ***********************************************************************
+    * Project:
+    * File: xengdb.c
+    * Author: smartin
+    ***********************************************************************
+
+    GDB remote serial protocol stub over the PV console ring. Once micropv_gdb_enable has been called, int3 and the
+    debug trap stop in here instead of crashing, and a ^C on the console stops the guest wherever it is. Connect with
+    something like:
+        socat pty,link=/tmp/micropv-gdb `xl console -t pv -n 0 <domain>`
+        gdb -ex 'target remote /tmp/micropv-gdb'
+
+    While stopped we poll the console ring with events masked, so nothing else in the guest runs.
+
+    Supported: ? g G p P m M c s Z0 z0 k D and enough of the q packets to keep gdb happy. Breakpoints are int3 bytes
+    written over the code, gdb takes them out whenever we stop so there is no stepping over them to do here.
+    Single step sets the trap flag in the interrupted eflags and we come back through the debug trap.
+
+    Memory accesses are checked against the page tables first, a bad address gets an error rather than a fault.
+    The console ring is used for nothing else while the stub is enabled.
+
+    Modifications
+    0.00 10/19/2026 created
+*/
+
+/*---------------------------------------------------------------------
+  -- macros (preamble)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- standard includes
+  ---------------------------------------------------------------------*/
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*---------------------------------------------------------------------
+  -- project includes (imports)
+  ---------------------------------------------------------------------*/
+#include "../micropv.h"
+#include "hypercall.h"
+#include "hypervisor.h"
+#include "psnprintf.h"
+#include "xenevents.h"
+#include "xenmmu.h"
+
+/*---------------------------------------------------------------------
+  -- project includes (exports)
+  ---------------------------------------------------------------------*/
+#include "xengdb.h"
+
+/*---------------------------------------------------------------------
+  -- macros (postamble)
+  ---------------------------------------------------------------------*/
+#define GDB_BUFFER_SIZE         4096
+#define GDB_MAX_BREAKPOINTS     32
+#define GDB_SIGTRAP             5
+#define GDB_SIGINT              2
+#define GDB_EFLAGS_TF           0x100
+#define GDB_INT3                0xcc
+
+/*---------------------------------------------------------------------
+  -- forward declarations
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- data types
+  ---------------------------------------------------------------------*/
+typedef struct gdb_breakpoint_t
+{
+    uint64_t address;
+    uint8_t saved;
+    uint8_t used;
+} gdb_breakpoint_t;
+
+/*---------------------------------------------------------------------
+  -- function prototypes
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- global variables
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- local variables
+  ---------------------------------------------------------------------*/
+static int gdb_enabled = 0;
+static int gdb_stepping = 0;
+static gdb_breakpoint_t gdb_breakpoints[GDB_MAX_BREAKPOINTS];
+static char gdb_in[GDB_BUFFER_SIZE];
+static char gdb_out[GDB_BUFFER_SIZE];
+static const char gdb_hex[] = "0123456789abcdef";
+
+// gdb's amd64 register order: 17 64 bit registers then eflags and the segments at 32 bits. -1 reads as 0
+static const int gdb_registers[] =
+{
+    offsetof(struct pt_regs, ax), offsetof(struct pt_regs, bx), offsetof(struct pt_regs, cx), offsetof(struct pt_regs, dx),
+    offsetof(struct pt_regs, si), offsetof(struct pt_regs, di), offsetof(struct pt_regs, bp), offsetof(struct pt_regs, sp),
+    offsetof(struct pt_regs, r8), offsetof(struct pt_regs, r9), offsetof(struct pt_regs, r10), offsetof(struct pt_regs, r11),
+    offsetof(struct pt_regs, r12), offsetof(struct pt_regs, r13), offsetof(struct pt_regs, r14), offsetof(struct pt_regs, r15),
+    offsetof(struct pt_regs, ip),
+    offsetof(struct pt_regs, flags), offsetof(struct pt_regs, cs), offsetof(struct pt_regs, ss), -1, -1, -1, -1
+};
+#define GDB_REGISTERS           (sizeof(gdb_registers) / sizeof(gdb_registers[0]))
+#define GDB_REGISTER_SIZE(_r)   ((_r) < 17 ? 8 : 4)
+
+/*---------------------------------------------------------------------
+  -- implementation
+  ---------------------------------------------------------------------*/
+
+static int gdb_getc(void)
+{
+    char c;
+
+    // nothing else runs while we are stopped, so give the cpu back while we wait
+    while (!micropv_console_read(&c, 1))
+        HYPERVISOR_sched_op(SCHEDOP_yield, NULL);
+
+    return (unsigned char)c;
+}
+
+static int gdb_digit(int c)
+{
+    if ((c >= '0') && (c <= '9'))
+        return c - '0';
+    if ((c >= 'a') && (c <= 'f'))
+        return c - 'a' + 10;
+    if ((c >= 'A') && (c <= 'F'))
+        return c - 'A' + 10;
+    return -1;
+}
+
+/* Parse hex digits, leaving *text after them */
+static uint64_t gdb_parse(const char **text)
+{
+    uint64_t value = 0;
+    int digit;
+
+    while ((digit = gdb_digit(**text)) >= 0)
+    {
+        value = (value << 4) | digit;
+        (*text)++;
+    }
+
+    return value;
+}
+
+static char *gdb_encode(char *out, const void *data, size_t length)
+{
+    const uint8_t *bytes = data;
+
+    while (length--)
+    {
+        *out++ = gdb_hex[*bytes >> 4];
+        *out++ = gdb_hex[*bytes++ & 0xf];
+    }
+    *out = 0;
+
+    return out;
+}
+
+static int gdb_decode(const char *in, void *data, size_t length)
+{
+    uint8_t *bytes = data;
+
+    while (length--)
+    {
+        int high = gdb_digit(in[0]);
+        int low = gdb_digit(in[1]);
+        if ((high < 0) || (low < 0))
+            return -1;
+        *bytes++ = (high << 4) | low;
+        in += 2;
+    }
+
+    return 0;
+}
+
+/* Read a packet into gdb_in, acknowledging it */
+static void gdb_receive(void)
+{
+    for (;;)
+    {
+        size_t length = 0;
+        uint8_t checksum = 0;
+        int c;
+
+        while (gdb_getc() != '$')
+            ;
+
+        while (((c = gdb_getc()) != '#') && (length < GDB_BUFFER_SIZE - 1))
+        {
+            gdb_in[length++] = c;
+            checksum += c;
+        }
+        gdb_in[length] = 0;
+
+        int high = gdb_digit(gdb_getc());
+        int low = gdb_digit(gdb_getc());
+        if ((c == '#') && (((high << 4) | low) == checksum))
+        {
+            micropv_console_write("+", 1);
+            return;
+        }
+
+        micropv_console_write("-", 1);
+    }
+}
+
+static void gdb_send(const char *packet)
+{
+    size_t length = strlen(packet);
+    uint8_t checksum = 0;
+    char trailer[3];
+    size_t i;
+
+    for (i = 0; i < length; i++)
+        checksum += packet[i];
+    trailer[0] = '#';
+    trailer[1] = gdb_hex[checksum >> 4];
+    trailer[2] = gdb_hex[checksum & 0xf];
+
+    // resend until gdb acknowledges it
+    do
+    {
+        micropv_console_write("$", 1);
+        micropv_console_write(packet, length);
+        micropv_console_write(trailer, sizeof(trailer));
+    }
+    while (gdb_getc() == '-');
+}
+
+static int gdb_accessible(uint64_t address, size_t length)
+{
+    uint64_t page;
+
+    for (page = address & ~__PAGE_MASK; page < address + length; page += __PAGE_SIZE)
+        if (!xenmmu_virtual_mapped(page))
+            return 0;
+
+    return 1;
+}
+
+static void gdb_read_register(struct pt_regs *regs, int reg, char *out)
+{
+    uint64_t value = (gdb_registers[reg] < 0) ? 0 : *(uint64_t *)((char *)regs + gdb_registers[reg]);
+    gdb_encode(out, &value, GDB_REGISTER_SIZE(reg));
+}
+
+static int gdb_write_register(struct pt_regs *regs, int reg, const char *in)
+{
+    uint64_t value = 0;
+
+    if (gdb_decode(in, &value, GDB_REGISTER_SIZE(reg)))
+        return -1;
+    if (gdb_registers[reg] >= 0)
+        *(uint64_t *)((char *)regs + gdb_registers[reg]) = value;
+    return 0;
+}
+
+static const char *gdb_breakpoint(int insert, uint64_t address)
+{
+    int i, free = -1;
+
+    for (i = 0; i < GDB_MAX_BREAKPOINTS; i++)
+    {
+        if (gdb_breakpoints[i].used && (gdb_breakpoints[i].address == address))
+            break;
+        if (!gdb_breakpoints[i].used && (free < 0))
+            free = i;
+    }
+
+    if (insert)
+    {
+        if (i < GDB_MAX_BREAKPOINTS)
+            return "OK";
+        if ((free < 0) || !gdb_accessible(address, 1))
+            return "E0e";
+
+        gdb_breakpoints[free].address = address;
+        gdb_breakpoints[free].saved = *(uint8_t *)address;
+        gdb_breakpoints[free].used = 1;
+        *(uint8_t *)address = GDB_INT3;
+        return "OK";
+    }
+
+    if (i == GDB_MAX_BREAKPOINTS)
+        return "E0e";
+
+    *(uint8_t *)address = gdb_breakpoints[i].saved;
+    gdb_breakpoints[i].used = 0;
+    return "OK";
+}
+
+static void gdb_remove_breakpoints(void)
+{
+    int i;
+
+    for (i = 0; i < GDB_MAX_BREAKPOINTS; i++)
+        if (gdb_breakpoints[i].used)
+            gdb_breakpoint(0, gdb_breakpoints[i].address);
+}
+
+/* Talk to gdb until it tells us to carry on */
+static void gdb_stopped(struct pt_regs *regs, int signal)
+{
+    psnprintf(gdb_out, sizeof(gdb_out), "S%02x", signal);
+    gdb_send(gdb_out);
+
+    for (;;)
+    {
+        const char *in = gdb_in + 1;
+        const char *reply = gdb_out;
+        uint64_t address, length;
+        int reg;
+
+        gdb_receive();
+        gdb_out[0] = 0;
+
+        switch (gdb_in[0])
+        {
+        case '?':
+            psnprintf(gdb_out, sizeof(gdb_out), "S%02x", signal);
+            break;
+
+        case 'g':
+            for (reg = 0; reg < GDB_REGISTERS; reg++)
+                gdb_read_register(regs, reg, gdb_out + strlen(gdb_out));
+            break;
+
+        case 'G':
+            reply = "OK";
+            for (reg = 0; (reg < GDB_REGISTERS) && *in; reg++)
+            {
+                if (gdb_write_register(regs, reg, in))
+                {
+                    reply = "E01";
+                    break;
+                }
+                in += 2 * GDB_REGISTER_SIZE(reg);
+            }
+            break;
+
+        case 'p':
+            reg = gdb_parse(&in);
+            if (reg < GDB_REGISTERS)
+                gdb_read_register(regs, reg, gdb_out);
+            else
+                reply = "E01";
+            break;
+
+        case 'P':
+            reg = gdb_parse(&in);
+            reply = ((reg < GDB_REGISTERS) && (*in++ == '=') && !gdb_write_register(regs, reg, in)) ? "OK" : "E01";
+            break;
+
+        case 'm':
+            address = gdb_parse(&in);
+            in++;
+            length = gdb_parse(&in);
+            if ((length > (GDB_BUFFER_SIZE - 1) / 2) || !gdb_accessible(address, length))
+                reply = "E0e";
+            else
+                gdb_encode(gdb_out, (void *)address, length);
+            break;
+
+        case 'M':
+            address = gdb_parse(&in);
+            in++;
+            length = gdb_parse(&in);
+            in++;
+            if (!gdb_accessible(address, length) || gdb_decode(in, (void *)address, length))
+                reply = "E0e";
+            else
+                reply = "OK";
+            break;
+
+        case 'Z':
+        case 'z':
+            // software breakpoints only
+            if (gdb_in[1] != '0')
+                break;
+            in = gdb_in + 3;
+            address = gdb_parse(&in);
+            reply = gdb_breakpoint(gdb_in[0] == 'Z', address);
+            break;
+
+        case 'c':
+        case 's':
+            if (*in)
+                regs->ip = gdb_parse(&in);
+            gdb_stepping = (gdb_in[0] == 's');
+            if (gdb_stepping)
+                regs->flags |= GDB_EFLAGS_TF;
+            return;
+
+        case 'D':
+            gdb_remove_breakpoints();
+            gdb_send("OK");
+            return;
+
+        case 'k':
+            micropv_exit();
+            break;
+
+        case 'H':
+            reply = "OK";
+            break;
+
+        case 'q':
+            if (!strncmp(gdb_in, "qSupported", 10))
+                psnprintf(gdb_out, sizeof(gdb_out), "PacketSize=%x", GDB_BUFFER_SIZE - 1);
+            else if (!strcmp(gdb_in, "qAttached"))
+                reply = "1";
+            else if (!strcmp(gdb_in, "qC"))
+                reply = "QC1";
+            else if (!strcmp(gdb_in, "qfThreadInfo"))
+                reply = "m1";
+            else if (!strcmp(gdb_in, "qsThreadInfo"))
+                reply = "l";
+            break;
+
+        default:
+            // an empty reply tells gdb we don't do this one
+            break;
+        }
+
+        gdb_send(reply);
+    }
+}
+
+int xengdb_trap(struct pt_regs *regs, int vector)
+{
+    if (!gdb_enabled)
+        return 0;
+
+    int flags = xenevents_save_disable();
+
+    if (vector == 1)
+    {
+        // end of a single step
+        regs->flags &= ~GDB_EFLAGS_TF;
+        gdb_stepping = 0;
+    }
+    else
+    {
+        // ip is past the int3, put it back on the instruction we replaced
+        int i;
+        for (i = 0; i < GDB_MAX_BREAKPOINTS; i++)
+            if (gdb_breakpoints[i].used && (gdb_breakpoints[i].address == regs->ip - 1))
+                regs->ip--;
+    }
+
+    gdb_stopped(regs, GDB_SIGTRAP);
+
+    xenevents_restore(flags);
+    return 1;
+}
+
+void xengdb_console_event(struct pt_regs *regs)
+{
+    char c;
+
+    if (!gdb_enabled || !regs)
+        return;
+
+    // gdb sends a bare ^C to interrupt, anything else is left over from a session and can go
+    while (micropv_console_read(&c, 1))
+    {
+        if (c == 0x03)
+        {
+            int flags = xenevents_save_disable();
+            gdb_stopped(regs, GDB_SIGINT);
+            xenevents_restore(flags);
+            return;
+        }
+    }
+}
+
+void micropv_gdb_enable(void)
+{
+    gdb_enabled = 1;
+    // nothing stops here, the guest carries on until a trap, micropv_gdb_break or a ^C from gdb
+    PRINTK("gdb stub enabled on the console");
+}
+
+void micropv_gdb_break(void)
+{
+    __asm__ __volatile__ ("int3");
+}
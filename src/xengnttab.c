@@ -72,6 +72,7 @@
 #include "xenmmu.h"
 #include "xenevents.h"
 #include "xenstore.h"
+#include "xenvmem.h"
 
 /*---------------------------------------------------------------------
   -- project includes (exports)
@@ -225,18 +226,36 @@ int micropv_shared_memory_consume(micropv_grant_handle_t *handle, const char *na
     if (xenstore_read_integer(XBT_NIL, name, (signed *)&ref))
         return -1;
 
+    // no buffer from the caller, use the grant arena
+    void *arena_buffer = NULL;
+    if (!buffer && !(buffer = arena_buffer = xenvmem_alloc(micropv_vmem_arena_grant, 1, MICROPV_VMEM_GUARD)))
+        return -1;
+
     // map the reference
     BUG_ON(interface == NULL);
     int rc = interface->xengnttab_map(handle, 0, ref, buffer, 0);
     PRINTK("grant_handle %i for physical_address=%p mapped to dom=0 with grant_ref=%i", handle->handle, buffer, ref);
+    if (rc && arena_buffer)
+        xenvmem_free(arena_buffer);
+    handle->buffer = rc ? NULL : buffer;
+    handle->arena = !rc && arena_buffer;
     return rc;
 }
 
 void micropv_shared_memory_unconsume(micropv_grant_handle_t *handle, void *buffer)
 {
+    if (!buffer)
+        buffer = handle->buffer;
+
     BUG_ON(interface == NULL);
     PRINTK("Unmap handle=%i for physical_address=%p", handle->handle, buffer);
     interface->xengnttab_unmap(handle, buffer);
+
+    // the page came from the grant arena, give it back
+    if (handle->arena && (buffer == handle->buffer))
+        xenvmem_free(buffer);
+    handle->buffer = NULL;
+    handle->arena = 0;
 }
 
 static void xengnttab_unshare_v1(grant_ref_t ref)
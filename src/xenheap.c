@@ -0,0 +1,436 @@
+/*  ***********************************************************************
+    * Project:
+    * File: xenheap.c
+    * Author: smartin
+    ***********************************************************************
+
+    Heap on top of the page allocator.
+
+    Small requests are rounded up to a size class and come out of slabs. A slab is an order 2 block, so the slab
+    header of any object is found by masking the object address. Requests above the biggest class get their own
+    block straight from the page allocator, with a header at the start of the block that is found the same way.
+
+    Each cpu keeps a magazine of free objects per class. Allocation and free only touch the magazine; the slabs are
+    only visited to refill an empty magazine or to drain a full one, and then half a magazine at a time.
+
+    Modifications
+    0.00 10/19/2026 created
+*/
+
+/*---------------------------------------------------------------------
+  -- macros (preamble)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- standard includes
+  ---------------------------------------------------------------------*/
+#include <stdint.h>
+#include <string.h>
+
+/*---------------------------------------------------------------------
+  -- project includes (imports)
+  ---------------------------------------------------------------------*/
+#include "../micropv.h"
+#include "hypervisor.h"
+#include "xenevents.h"
+
+/*---------------------------------------------------------------------
+  -- project includes (exports)
+  ---------------------------------------------------------------------*/
+#include "xenheap.h"
+
+/*---------------------------------------------------------------------
+  -- macros (postamble)
+  ---------------------------------------------------------------------*/
+#define SLAB_ORDER          2
+#define SLAB_SIZE           (__PAGE_SIZE << SLAB_ORDER)
+#define SLAB_MAGIC          0x51ab51abU
+#define LARGE_MAGIC         0x1a26e1a2U
+#define HEAP_ALIGN          16
+#define HEAP_MAX_SMALL      2048
+#define MAGAZINE_SIZE       32
+#define ROUND_UP(x, a)      (((x) + (a) - 1) & ~((uint64_t)(a) - 1))
+
+/*---------------------------------------------------------------------
+  -- forward declarations
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- data types
+  ---------------------------------------------------------------------*/
+typedef struct free_object_t
+{
+    struct free_object_t *next;
+} free_object_t;
+
+typedef struct slab_t
+{
+    uint32_t magic;
+    uint16_t size_class;
+    uint16_t inuse;
+    free_object_t *free;
+    struct slab_t *next, *prev;
+} slab_t;
+
+typedef struct large_t
+{
+    uint32_t magic;
+    uint32_t order;
+    size_t size;
+} large_t;
+
+typedef struct size_class_t
+{
+    uint32_t size;
+    uint32_t objects;
+    uint32_t offset;
+    slab_t partial;
+    uint64_t slabs;
+} size_class_t;
+
+typedef struct magazine_t
+{
+    void *object[MAGAZINE_SIZE];
+    uint32_t count;
+    uint64_t allocs, frees;
+} magazine_t;
+
+/*---------------------------------------------------------------------
+  -- function prototypes
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- global variables
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- local variables
+  ---------------------------------------------------------------------*/
+static size_class_t size_class[MICROPV_HEAP_CLASSES] =
+{
+    { 16 }, { 32 }, { 48 }, { 64 }, { 96 }, { 128 }, { 192 }, { 256 },
+    { 384 }, { 512 }, { 768 }, { 1024 }, { 1536 }, { 2048 }
+};
+static uint8_t size_class_index[HEAP_MAX_SMALL / HEAP_ALIGN + 1];
+static magazine_t magazine[NR_CPUS][MICROPV_HEAP_CLASSES];
+static uint64_t large_bytes = 0, large_pages = 0;
+
+/*---------------------------------------------------------------------
+  -- implementation
+  ---------------------------------------------------------------------*/
+
+void xenheap_init(void)
+{
+    int c, i = 0;
+
+    for (c = 0; c < MICROPV_HEAP_CLASSES; c++)
+    {
+        size_class_t *class = &size_class[c];
+
+        // power of two classes are aligned to their size so that aligned_alloc can use them
+        if (!(class->size & (class->size - 1)))
+            class->offset = ROUND_UP(sizeof(slab_t), class->size);
+        else
+            class->offset = ROUND_UP(sizeof(slab_t), 64);
+        class->objects = (SLAB_SIZE - class->offset) / class->size;
+        class->partial.next = class->partial.prev = &class->partial;
+
+        for (; (i * HEAP_ALIGN <= class->size) && (i < SIZEOF_ARRAY(size_class_index)); i++)
+            size_class_index[i] = c;
+    }
+}
+
+static slab_t *slab_create(int c)
+{
+    size_class_t *class = &size_class[c];
+    slab_t *slab = micropv_page_alloc(SLAB_ORDER);
+    if (!slab)
+        return NULL;
+
+    slab->magic = SLAB_MAGIC;
+    slab->size_class = c;
+    slab->inuse = 0;
+    slab->free = NULL;
+
+    // thread the free list so that the lowest address goes out first
+    int i;
+    for (i = class->objects - 1; i >= 0; i--)
+    {
+        free_object_t *object = (free_object_t *)((char *)slab + class->offset + i * class->size);
+        object->next = slab->free;
+        slab->free = object;
+    }
+
+    slab->next = class->partial.next;
+    slab->prev = &class->partial;
+    class->partial.next->prev = slab;
+    class->partial.next = slab;
+    class->slabs++;
+
+    return slab;
+}
+
+/* Fill up to count objects from the slabs into the magazine. Called with events masked */
+static void magazine_refill(magazine_t *mag, int c, uint32_t count)
+{
+    size_class_t *class = &size_class[c];
+
+    while (mag->count < count)
+    {
+        slab_t *slab = class->partial.next;
+        if ((slab == &class->partial) && !(slab = slab_create(c)))
+            return;
+
+        while (slab->free && (mag->count < count))
+        {
+            mag->object[mag->count++] = slab->free;
+            slab->free = slab->free->next;
+            slab->inuse++;
+        }
+
+        // full slabs leave the partial list until something is freed into them
+        if (!slab->free)
+        {
+            slab->prev->next = slab->next;
+            slab->next->prev = slab->prev;
+            slab->next = slab->prev = slab;
+        }
+    }
+}
+
+/* Give objects back to their slabs until the magazine holds count. Called with events masked */
+static void magazine_drain(magazine_t *mag, int c, uint32_t count)
+{
+    size_class_t *class = &size_class[c];
+
+    while (mag->count > count)
+    {
+        free_object_t *object = mag->object[--mag->count];
+        slab_t *slab = (slab_t *)((uint64_t)object & ~((uint64_t)SLAB_SIZE - 1));
+
+        if (!slab->free)
+        {
+            slab->next = class->partial.next;
+            slab->prev = &class->partial;
+            class->partial.next->prev = slab;
+            class->partial.next = slab;
+        }
+
+        object->next = slab->free;
+        slab->free = object;
+        slab->inuse--;
+
+        // keep one empty slab around so a class on the edge doesn't thrash the page allocator
+        if (!slab->inuse && (class->partial.next != slab || slab->next != &class->partial))
+        {
+            slab->prev->next = slab->next;
+            slab->next->prev = slab->prev;
+            slab->magic = 0;
+            class->slabs--;
+            micropv_page_free(slab, SLAB_ORDER);
+        }
+    }
+}
+
+static void *large_alloc(size_t size, size_t align)
+{
+    size_t offset = ROUND_UP(sizeof(large_t), align < HEAP_ALIGN ? HEAP_ALIGN : align);
+    unsigned int order = SLAB_ORDER;
+
+    while (((size_t)__PAGE_SIZE << order) < size + offset)
+        order++;
+
+    large_t *large = micropv_page_alloc_large(order);
+    if (!large)
+        return NULL;
+
+    large->magic = LARGE_MAGIC;
+    large->order = order;
+    large->size = size;
+
+    int flags = xenevents_save_disable();
+    large_bytes += size;
+    large_pages += 1UL << order;
+    xenevents_restore(flags);
+
+    return (char *)large + offset;
+}
+
+static void *class_alloc(int c)
+{
+    int flags = xenevents_save_disable();
+    magazine_t *mag = &magazine[smp_processor_id()][c];
+    void *object = NULL;
+
+    if (!mag->count)
+        magazine_refill(mag, c, MAGAZINE_SIZE / 2);
+    if (mag->count)
+    {
+        object = mag->object[--mag->count];
+        mag->allocs++;
+    }
+
+    xenevents_restore(flags);
+    return object;
+}
+
+void *micropv_malloc(size_t size)
+{
+    if (!size)
+        return NULL;
+    if (size > HEAP_MAX_SMALL)
+        return large_alloc(size, HEAP_ALIGN);
+
+    return class_alloc(size_class_index[(size + HEAP_ALIGN - 1) / HEAP_ALIGN]);
+}
+
+void micropv_free(void *ptr)
+{
+    if (!ptr)
+        return;
+
+    slab_t *slab = (slab_t *)((uint64_t)ptr & ~((uint64_t)SLAB_SIZE - 1));
+    if (slab->magic == LARGE_MAGIC)
+    {
+        large_t *large = (large_t *)slab;
+        int flags = xenevents_save_disable();
+        large_bytes -= large->size;
+        large_pages -= 1UL << large->order;
+        xenevents_restore(flags);
+
+        large->magic = 0;
+        micropv_page_free(large, large->order);
+        return;
+    }
+
+    if (slab->magic != SLAB_MAGIC)
+    {
+        PRINTK("free of %p which is not on the heap", ptr);
+        return;
+    }
+
+    int flags = xenevents_save_disable();
+    magazine_t *mag = &magazine[smp_processor_id()][slab->size_class];
+
+    if (mag->count == MAGAZINE_SIZE)
+        magazine_drain(mag, slab->size_class, MAGAZINE_SIZE / 2);
+    mag->object[mag->count++] = ptr;
+    mag->frees++;
+
+    xenevents_restore(flags);
+}
+
+void *micropv_calloc(size_t count, size_t size)
+{
+    if (size && (count > (size_t)-1 / size))
+        return NULL;
+
+    void *ptr = micropv_malloc(count * size);
+    if (ptr)
+        memset(ptr, 0, count * size);
+    return ptr;
+}
+
+static size_t usable_size(void *ptr)
+{
+    slab_t *slab = (slab_t *)((uint64_t)ptr & ~((uint64_t)SLAB_SIZE - 1));
+    if (slab->magic == LARGE_MAGIC)
+        return ((size_t)__PAGE_SIZE << ((large_t *)slab)->order) - ((char *)ptr - (char *)slab);
+    return size_class[slab->size_class].size;
+}
+
+void *micropv_realloc(void *ptr, size_t size)
+{
+    if (!ptr)
+        return micropv_malloc(size);
+    if (!size)
+    {
+        micropv_free(ptr);
+        return NULL;
+    }
+
+    size_t old_size = usable_size(ptr);
+    if (size <= old_size)
+    {
+        slab_t *slab = (slab_t *)((uint64_t)ptr & ~((uint64_t)SLAB_SIZE - 1));
+        if (slab->magic == LARGE_MAGIC)
+        {
+            // it still fits, just keep the statistics right
+            large_t *large = (large_t *)slab;
+            int flags = xenevents_save_disable();
+            large_bytes += size - large->size;
+            large->size = size;
+            xenevents_restore(flags);
+        }
+        return ptr;
+    }
+
+    void *new_ptr = micropv_malloc(size);
+    if (new_ptr)
+    {
+        memcpy(new_ptr, ptr, old_size);
+        micropv_free(ptr);
+    }
+    return new_ptr;
+}
+
+void *micropv_aligned_alloc(size_t alignment, size_t size)
+{
+    if (!alignment || (alignment & (alignment - 1)) || (alignment > __PAGE_SIZE))
+    {
+        PRINTK("unsupported alignment %lu", alignment);
+        return NULL;
+    }
+    if (!size)
+        return NULL;
+
+    if (alignment <= HEAP_ALIGN)
+        return micropv_malloc(size);
+
+    // the power of two classes are aligned to their size
+    size_t rounded = size < alignment ? alignment : size;
+    int c;
+    for (c = 0; c < MICROPV_HEAP_CLASSES; c++)
+    {
+        uint32_t class_size = size_class[c].size;
+        if ((class_size >= rounded) && !(class_size & (class_size - 1)) && !(class_size & (alignment - 1)))
+            return class_alloc(c);
+    }
+
+    return large_alloc(size, alignment);
+}
+
+void micropv_heap_stats(micropv_heap_stats_t *stats)
+{
+    int c, cpu;
+
+    memset(stats, 0, sizeof(*stats));
+
+    int flags = xenevents_save_disable();
+    for (c = 0; c < MICROPV_HEAP_CLASSES; c++)
+    {
+        size_class_t *class = &size_class[c];
+        micropv_heap_class_stats_t *entry = &stats->size_class[c];
+        uint64_t allocs = 0, frees = 0;
+
+        for (cpu = 0; cpu < NR_CPUS; cpu++)
+        {
+            allocs += magazine[cpu][c].allocs;
+            frees += magazine[cpu][c].frees;
+            entry->cached += magazine[cpu][c].count;
+        }
+
+        entry->object_size = class->size;
+        entry->objects = allocs - frees;
+        entry->bytes_in_use = entry->objects * class->size;
+        entry->slabs = class->slabs;
+        entry->capacity = class->slabs * class->objects * class->size;
+
+        stats->bytes_in_use += entry->bytes_in_use;
+        stats->bytes_reserved += class->slabs * SLAB_SIZE;
+    }
+    stats->large_bytes = large_bytes;
+    stats->bytes_in_use += large_bytes;
+    stats->bytes_reserved += large_pages * __PAGE_SIZE;
+    xenevents_restore(flags);
+}
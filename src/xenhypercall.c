@@ -0,0 +1,185 @@
+/*  ***********************************************************************
+    * Project:
+    * File: xenhypercall.c
+    * Author: smartin
+    ***********************************************************************
+
+    Hypercall accounting. Building with -DMICROPV_HYPERCALL_STATS makes the _hypercallN macros in hypercall.h read
+    the TSC around every hypercall and call xenhypercall_account with the hypercall number and its first argument.
+
+    For the hypercalls that multiplex on a command in the first argument (event_channel_op, vcpu_op, memory_op and
+    the like) the counts are kept per command, everything else is kept under sub operation 0. Commands past the end
+    of the table share the last slot. Multicalls are counted as one multicall, not by what is in them.
+
+    The counters aren't atomic. A hypercall from an event handler can land in the middle of an update and lose a
+    count, which doesn't matter for the numbers we want. Without the define the table stays empty and the dump says
+    so.
+
+    Modifications
+    0.00 10/19/2026 created
+*/
+
+/*---------------------------------------------------------------------
+  -- macros (preamble)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- standard includes
+  ---------------------------------------------------------------------*/
+#include <stdint.h>
+#include <string.h>
+
+/*---------------------------------------------------------------------
+  -- project includes (imports)
+  ---------------------------------------------------------------------*/
+#include "../micropv.h"
+#include "hypercall.h"
+
+/*---------------------------------------------------------------------
+  -- project includes (exports)
+  ---------------------------------------------------------------------*/
+#include "xenhypercall.h"
+
+/*---------------------------------------------------------------------
+  -- macros (postamble)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- forward declarations
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- data types
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- function prototypes
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- global variables
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- local variables
+  ---------------------------------------------------------------------*/
+#ifdef MICROPV_HYPERCALL_STATS
+static micropv_hypercall_stats_t hypercall_stats[MICROPV_HYPERCALL_OPS][MICROPV_HYPERCALL_SUBOPS];
+
+static const char *hypercall_names[MICROPV_HYPERCALL_OPS] =
+{
+    [__HYPERVISOR_set_trap_table] = "set_trap_table",
+    [__HYPERVISOR_mmu_update] = "mmu_update",
+    [__HYPERVISOR_stack_switch] = "stack_switch",
+    [__HYPERVISOR_set_callbacks] = "set_callbacks",
+    [__HYPERVISOR_fpu_taskswitch] = "fpu_taskswitch",
+    [__HYPERVISOR_set_debugreg] = "set_debugreg",
+    [__HYPERVISOR_get_debugreg] = "get_debugreg",
+    [__HYPERVISOR_update_descriptor] = "update_descriptor",
+    [__HYPERVISOR_memory_op] = "memory_op",
+    [__HYPERVISOR_multicall] = "multicall",
+    [__HYPERVISOR_update_va_mapping] = "update_va_mapping",
+    [__HYPERVISOR_set_timer_op] = "set_timer_op",
+    [__HYPERVISOR_xen_version] = "xen_version",
+    [__HYPERVISOR_console_io] = "console_io",
+    [__HYPERVISOR_grant_table_op] = "grant_table_op",
+    [__HYPERVISOR_vm_assist] = "vm_assist",
+    [__HYPERVISOR_vcpu_op] = "vcpu_op",
+    [__HYPERVISOR_set_segment_base] = "set_segment_base",
+    [__HYPERVISOR_mmuext_op] = "mmuext_op",
+    [__HYPERVISOR_nmi_op] = "nmi_op",
+    [__HYPERVISOR_sched_op] = "sched_op",
+    [__HYPERVISOR_event_channel_op] = "event_channel_op",
+    [__HYPERVISOR_physdev_op] = "physdev_op",
+    [__HYPERVISOR_sysctl] = "sysctl",
+    [__HYPERVISOR_domctl] = "domctl",
+    [__HYPERVISOR_xenpmu_op] = "xenpmu_op",
+};
+#endif
+
+/*---------------------------------------------------------------------
+  -- implementation
+  ---------------------------------------------------------------------*/
+
+#ifdef MICROPV_HYPERCALL_STATS
+/* Hypercalls whose first argument is a command rather than a pointer or value */
+static inline int hypercall_multiplexed(unsigned int op)
+{
+    switch (op)
+    {
+    case __HYPERVISOR_memory_op:
+    case __HYPERVISOR_xen_version:
+    case __HYPERVISOR_console_io:
+    case __HYPERVISOR_grant_table_op:
+    case __HYPERVISOR_vm_assist:
+    case __HYPERVISOR_vcpu_op:
+    case __HYPERVISOR_nmi_op:
+    case __HYPERVISOR_sched_op:
+    case __HYPERVISOR_event_channel_op:
+    case __HYPERVISOR_physdev_op:
+    case __HYPERVISOR_xenpmu_op:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+void xenhypercall_account(unsigned int op, unsigned long subop, unsigned long start)
+{
+    unsigned long cycles = _hypercall_tsc() - start;
+
+    if (op >= MICROPV_HYPERCALL_OPS)
+        return;
+
+    if (!hypercall_multiplexed(op))
+        subop = 0;
+    else if (subop >= MICROPV_HYPERCALL_SUBOPS)
+        subop = MICROPV_HYPERCALL_SUBOPS - 1;
+
+    hypercall_stats[op][subop].count++;
+    hypercall_stats[op][subop].cycles += cycles;
+}
+#endif
+
+const micropv_hypercall_stats_t *micropv_hypercall_stats(void)
+{
+#ifdef MICROPV_HYPERCALL_STATS
+    return &hypercall_stats[0][0];
+#else
+    return NULL;
+#endif
+}
+
+void micropv_hypercall_stats_reset(void)
+{
+#ifdef MICROPV_HYPERCALL_STATS
+    memset(hypercall_stats, 0, sizeof(hypercall_stats));
+#endif
+}
+
+void micropv_hypercall_stats_dump(void)
+{
+#ifdef MICROPV_HYPERCALL_STATS
+    int op, subop;
+
+    // take a copy, the PRINTKs are hypercalls themselves
+    static micropv_hypercall_stats_t stats[MICROPV_HYPERCALL_OPS][MICROPV_HYPERCALL_SUBOPS];
+    memcpy(stats, hypercall_stats, sizeof(stats));
+
+    PRINTK("hypercall            subop        count       cycles   cycles/call");
+    for (op = 0; op < MICROPV_HYPERCALL_OPS; op++)
+    {
+        for (subop = 0; subop < MICROPV_HYPERCALL_SUBOPS; subop++)
+        {
+            micropv_hypercall_stats_t *entry = &stats[op][subop];
+            if (!entry->count)
+                continue;
+
+            PRINTK("%-20s %5i %12lu %12lu %12lu", hypercall_names[op] ? hypercall_names[op] : "?", subop,
+                   entry->count, entry->cycles, entry->cycles / entry->count);
+        }
+    }
+#else
+    PRINTK("hypercall accounting not built in, build with -DMICROPV_HYPERCALL_STATS");
+#endif
+}
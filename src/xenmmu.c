@@ -20,6 +20,8 @@
   ---------------------------------------------------------------------*/
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <xen/memory.h>
 
 /*---------------------------------------------------------------------
   -- project includes (imports)
@@ -27,6 +29,8 @@
 #include "../micropv.h"
 #include "hypercall.h"
 #include "hypervisor.h"
+#include "xenvmem.h"
+#include "xenevents.h"
 
 /*---------------------------------------------------------------------
   -- project includes (exports)
@@ -36,6 +40,10 @@
 /*---------------------------------------------------------------------
   -- macros (postamble)
   ---------------------------------------------------------------------*/
+#define MMU_BATCH 32
+#define SUPERPAGE_MAX 64
+#define CONTIGUOUS_MAX_ORDER SUPERPAGE_ORDER
+#define RESERVATION_BATCH 256
 
 /*---------------------------------------------------------------------
   -- forward declarations
@@ -44,10 +52,28 @@
 /*---------------------------------------------------------------------
   -- data types
   ---------------------------------------------------------------------*/
+/* The L2 entry that a superpage replaced, to put it back on demotion */
+typedef struct superpage_t
+{
+    uint64_t virtual_address;
+    uint64_t l2_entry;
+} superpage_t;
+
+/* Gives the pfn of a mapped page to make a page table from, 0 if there are none */
+typedef uint64_t (*table_alloc_t)(void *context);
+
+/* Boot page table pages, taken in order from next up to (not including) the first pfn that isn't mapped yet */
+typedef struct boot_tables_t
+{
+    uint64_t *next;
+    uint64_t mapped;
+} boot_tables_t;
 
 /*---------------------------------------------------------------------
   -- function prototypes
   ---------------------------------------------------------------------*/
+static int update_va_range(uint64_t virtual_address, uint64_t machine_address, const uint64_t *frames, size_t pages, uint64_t pte_flags);
+static int update_va_list(const uint64_t *pfns, const uint64_t *frames, size_t count, uint64_t pte_flags);
 
 /*---------------------------------------------------------------------
   -- global variables
@@ -57,7 +83,15 @@ uint64_t *phys_to_machine_mapping;
 /*---------------------------------------------------------------------
   -- local variables
   ---------------------------------------------------------------------*/
-static uint64_t max_pfn = 0;
+/* Cleared the first time the hypervisor refuses a superpage, it isn't going to change its mind */
+static int superpages_allowed = 1;
+static superpage_t superpage[SUPERPAGE_MAX];
+
+/* Frames handed to XENMEM_exchange by xenmmu_make_contiguous, too big for the stack. Used with events off */
+static xen_pfn_t contiguous_frames[1 << CONTIGUOUS_MAX_ORDER];
+
+/* Frames for XENMEM_increase/decrease_reservation, a batch at a time. Used with events off */
+static xen_pfn_t reservation_frames[RESERVATION_BATCH];
 
 /*---------------------------------------------------------------------
   -- implementation
@@ -65,9 +99,6 @@ static uint64_t max_pfn = 0;
 
 void xenmmu_init(void)
 {
-    // set the initial top of memory
-    max_pfn = hypervisor_start_info.nr_pages;
-
     /* set up minimal memory infos */
     phys_to_machine_mapping = (uint64_t *)hypervisor_start_info.mfn_list;
 }
@@ -98,18 +129,677 @@ void *micropv_remap_page(uint64_t physical_address, uint64_t machine_address, si
 
 void *xenmmu_map_frames(uint64_t mfn[], size_t mfn_size, int readonly)
 {
-    // get a pointer to the current top of memory
-    uint64_t physical_address = max_pfn << __PAGE_SHIFT;
-    void *physical_ptr = (void *)physical_address;
+    void *virtual_address = xenvmem_alloc(micropv_vmem_arena_foreign, mfn_size, MICROPV_VMEM_GUARD);
+    if (!virtual_address)
+        return NULL;
+
+    if (update_va_range((uint64_t)virtual_address, 0, mfn, mfn_size, readonly ? L1_PROT_RO : L1_PROT))
+    {
+        xenvmem_free(virtual_address);
+        return NULL;
+    }
+
+    return virtual_address;
+}
+
+void xenmmu_unmap_frames(void *virtual_address)
+{
+    xenvmem_free(virtual_address);
+}
+
+/*
+ * Point a run of virtual pages at a machine contiguous range in batches, or at the frames in the frame list if there
+ * is one. A pte_flags of 0 unmaps them.
+ */
+static int update_va_range(uint64_t virtual_address, uint64_t machine_address, const uint64_t *frames, size_t pages, uint64_t pte_flags)
+{
+    multicall_entry_t call[MMU_BATCH];
+    size_t page = 0;
+
+    while (page < pages)
+    {
+        int calls = (pages - page) < MMU_BATCH ? (pages - page) : MMU_BATCH;
+        int i;
+
+        for (i = 0; i < calls; i++, page++)
+        {
+            call[i].op = __HYPERVISOR_update_va_mapping;
+            call[i].args[0] = virtual_address + (page << __PAGE_SHIFT);
+            uint64_t machine = frames ? frames[page] << __PAGE_SHIFT : machine_address + (page << __PAGE_SHIFT);
+            call[i].args[1] = pte_flags ? machine | pte_flags : 0;
+            // one flush at the end of the batch is enough
+            call[i].args[2] = (i == calls - 1) ? UVMF_TLB_FLUSH | UVMF_LOCAL : UVMF_NONE;
+            call[i].result = 0;
+        }
+
+        int rc = HYPERVISOR_multicall(call, calls);
+        if (rc)
+        {
+            PRINTK("HYPERVISOR_multicall returns %i", rc);
+            return -1;
+        }
+
+        for (i = 0; i < calls; i++)
+        {
+            if (call[i].result)
+            {
+                PRINTK("FAIL mapping virtual address 0x%lx to machine address 0x%lx with %li",
+                       call[i].args[0], call[i].args[1] & ~__PAGE_MASK, (long)call[i].result);
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Same as update_va_range for pages that are scattered about, one pfn per page */
+static int update_va_list(const uint64_t *pfns, const uint64_t *frames, size_t count, uint64_t pte_flags)
+{
+    multicall_entry_t call[MMU_BATCH];
+    size_t page = 0;
+
+    while (page < count)
+    {
+        int calls = (count - page) < MMU_BATCH ? (count - page) : MMU_BATCH;
+        int i;
+
+        for (i = 0; i < calls; i++, page++)
+        {
+            call[i].op = __HYPERVISOR_update_va_mapping;
+            call[i].args[0] = (uint64_t)to_virt(pfns[page] << __PAGE_SHIFT);
+            call[i].args[1] = pte_flags ? (frames[page] << __PAGE_SHIFT) | pte_flags : 0;
+            call[i].args[2] = (i == calls - 1) ? UVMF_TLB_FLUSH | UVMF_LOCAL : UVMF_NONE;
+            call[i].result = 0;
+        }
+
+        int rc = HYPERVISOR_multicall(call, calls);
+        if (rc)
+        {
+            PRINTK("HYPERVISOR_multicall returns %i", rc);
+            return -1;
+        }
+
+        for (i = 0; i < calls; i++)
+        {
+            if (call[i].result)
+            {
+                PRINTK("FAIL mapping virtual address 0x%lx with %li", call[i].args[0], (long)call[i].result);
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int xenmmu_map_io(uint64_t virtual_address, uint64_t machine_address, size_t size, uint64_t cache)
+{
+    return update_va_range(virtual_address, machine_address, NULL, (size + __PAGE_SIZE - 1) >> __PAGE_SHIFT, L1_PROT | cache);
+}
+
+int xenmmu_unmap_range(uint64_t virtual_address, size_t pages)
+{
+    return update_va_range(virtual_address, 0, NULL, pages, 0);
+}
+
+/*
+ * Swap the frames behind a run of 2^order pages with XENMEM_exchange, single frames for one machine contiguous extent
+ * (contiguous set) or the extent back for single frames, and update the p2m, m2p and page tables to match.
+ */
+static int exchange_frames(uint64_t virtual_address, unsigned int order, int contiguous, unsigned int address_bits, uint64_t *machine_address)
+{
+    size_t pages = 1UL << order;
+    uint64_t pfn = virt_to_pfn(virtual_address);
+    // the single frames side of the exchange, the extent side is one frame
+    xen_pfn_t *frames = contiguous_frames;
+    xen_pfn_t extent = pfn_to_mfn(pfn);
+    size_t i;
+    int rc = -1;
+
+    if (order > CONTIGUOUS_MAX_ORDER)
+    {
+        PRINTK("contiguous extent of order %u is too big", order);
+        return -1;
+    }
+
+    // one exchange at a time, they share the frame list
+    int flags = xenevents_save_disable();
+
+    if (contiguous)
+        for (i = 0; i < pages; i++)
+            frames[i] = pfn_to_mfn(pfn + i);
+
+    // the old frames go back to xen, so nothing may point at them any more
+    if (update_va_range(virtual_address, 0, NULL, pages, 0))
+        goto out;
+    for (i = 0; i < pages; i++)
+        phys_to_machine_mapping[pfn + i] = INVALID_P2M_ENTRY;
+
+    xen_memory_exchange_t exchange =
+    {
+        .in =
+        {
+            .nr_extents = contiguous ? pages : 1,
+            .extent_order = contiguous ? 0 : order,
+            .domid = DOMID_SELF
+        },
+        .out =
+        {
+            .nr_extents = contiguous ? 1 : pages,
+            .extent_order = contiguous ? order : 0,
+            .mem_flags = contiguous ? XENMEMF_address_bits(address_bits) : 0,
+            .domid = DOMID_SELF
+        },
+        .nr_exchanged = 0
+    };
+    set_xen_guest_handle(exchange.in.extent_start, contiguous ? frames : &extent);
+    set_xen_guest_handle(exchange.out.extent_start, contiguous ? &extent : frames);
+
+    int exchange_rc = HYPERVISOR_memory_op(XENMEM_exchange, &exchange);
+    if (exchange_rc || (exchange.nr_exchanged != (contiguous ? pages : 1)))
+    {
+        // a single extent is exchanged all or nothing, so the old frames are still ours
+        PRINTK("XENMEM_exchange of order %u below %u bits failed with %i", order, address_bits, exchange_rc);
+        for (i = 0; i < pages; i++)
+        {
+            uint64_t mfn = contiguous ? frames[i] : extent + i;
+            phys_to_machine_mapping[pfn + i] = mfn;
+            update_va_range(virtual_address + (i << __PAGE_SHIFT), mfn << __PAGE_SHIFT, NULL, 1, L1_PROT);
+        }
+        goto out;
+    }
+
+    // update the p2m, m2p and page tables for the new frames, the m2p a batch at a time
+    mmu_update_t m2p[MMU_BATCH];
+    for (i = 0; i < pages; i += MMU_BATCH)
+    {
+        int updates = (pages - i) < MMU_BATCH ? (pages - i) : MMU_BATCH;
+        int j;
+        for (j = 0; j < updates; j++)
+        {
+            uint64_t mfn = contiguous ? extent + i + j : frames[i + j];
+            phys_to_machine_mapping[pfn + i + j] = mfn;
+            m2p[j].ptr = (mfn << __PAGE_SHIFT) | MMU_MACHPHYS_UPDATE;
+            m2p[j].val = pfn + i + j;
+        }
+        int update_rc = HYPERVISOR_mmu_update(m2p, updates, NULL, DOMID_SELF);
+        if (update_rc)
+        {
+            PRINTK("HYPERVISOR_mmu_update returns %i", update_rc);
+            goto out;
+        }
+    }
+    if (update_va_range(virtual_address, (uint64_t)extent << __PAGE_SHIFT, contiguous ? NULL : frames, pages, L1_PROT))
+        goto out;
+
+    if (machine_address)
+        *machine_address = (uint64_t)extent << __PAGE_SHIFT;
+    rc = 0;
+
+out:
+    xenevents_restore(flags);
+    return rc;
+}
+
+int xenmmu_make_contiguous(uint64_t virtual_address, unsigned int order, unsigned int address_bits, uint64_t *machine_address)
+{
+    return exchange_frames(virtual_address, order, 1, address_bits, machine_address);
+}
+
+int xenmmu_release_contiguous(uint64_t virtual_address, unsigned int order)
+{
+    return exchange_frames(virtual_address, order, 0, 0, NULL);
+}
+
+/* Find the machine address of the L2 entry that maps a virtual address */
+static int l2_entry_address(uint64_t virtual_address, uint64_t *entry_address, uint64_t *entry)
+{
+    uint64_t *table = (uint64_t *)hypervisor_start_info.pt_base;
+    uint64_t l4 = table[l4_table_offset(virtual_address)];
+    if (!(l4 & _PAGE_PRESENT))
+        return -1;
+
+    table = mfn_to_virt(PTE_MFN(l4));
+    uint64_t l3 = table[l3_table_offset(virtual_address)];
+    if (!(l3 & _PAGE_PRESENT))
+        return -1;
+
+    table = mfn_to_virt(PTE_MFN(l3));
+    *entry = table[l2_table_offset(virtual_address)];
+    *entry_address = (PTE_MFN(l3) << L1_PAGETABLE_SHIFT) + l2_table_offset(virtual_address) * sizeof(uint64_t);
+    return 0;
+}
+
+int xenmmu_virtual_mapped(uint64_t virtual_address)
+{
+    uint64_t entry_address, l2;
+
+    // canonical addresses only
+    if (((int64_t)virtual_address >> 47) != 0 && ((int64_t)virtual_address >> 47) != -1)
+        return 0;
+
+    if (l2_entry_address(virtual_address, &entry_address, &l2) || !(l2 & _PAGE_PRESENT))
+        return 0;
+    if (l2 & _PAGE_PSE)
+        return 1;
+
+    uint64_t *table = mfn_to_virt(PTE_MFN(l2));
+    return (table[l1_table_offset(virtual_address)] & _PAGE_PRESENT) ? 1 : 0;
+}
+
+/*
+ * Hook a new, empty page table into the table above it, the way mini-os new_pt_frame does. Xen won't take a writable
+ * page as a page table, so the page is cleared and then mapped read-only first.
+ */
+static int new_table(uint64_t table_pfn, uint64_t parent_mfn, unsigned int offset, uint64_t prot)
+{
+    uint64_t virtual_address = (uint64_t)to_virt(table_pfn << __PAGE_SHIFT);
+    uint64_t mfn = pfn_to_mfn(table_pfn);
+    int rc;
+
+    memset((void *)virtual_address, 0, __PAGE_SIZE);
+    if ((rc = HYPERVISOR_update_va_mapping(virtual_address, __pte((mfn << __PAGE_SHIFT) | L1_PROT_RO), UVMF_INVLPG)) != 0)
+    {
+        PRINTK("FAIL making pfn 0x%lx read-only for a page table with %i", table_pfn, rc);
+        return -1;
+    }
 
-    // update the memory mapping
-    for (int fn = 0; fn < mfn_size; fn++, max_pfn++, physical_address += __PAGE_SIZE)
+    mmu_update_t update;
+    update.ptr = ((parent_mfn << __PAGE_SHIFT) + offset * sizeof(uint64_t)) | MMU_NORMAL_PT_UPDATE;
+    update.val = (mfn << __PAGE_SHIFT) | prot;
+    if ((rc = HYPERVISOR_mmu_update(&update, 1, NULL, DOMID_SELF)) != 0)
     {
-        micropv_remap_page(physical_address, mfn[fn] << L1_PAGETABLE_SHIFT, __PAGE_SIZE, readonly);
+        PRINTK("FAIL adding page table pfn 0x%lx with %i", table_pfn, rc);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Machine frame of the L1 table for a virtual address, the tables that are missing on the way down are built */
+static uint64_t l1_table(uint64_t virtual_address, table_alloc_t alloc, void *context)
+{
+    static const unsigned int shift[] = { L4_PAGETABLE_SHIFT, L3_PAGETABLE_SHIFT, L2_PAGETABLE_SHIFT };
+    static const uint64_t prot[] = { L4_PROT, L3_PROT, L2_PROT };
+    uint64_t *table = (uint64_t *)hypervisor_start_info.pt_base;
+    uint64_t mfn = virt_to_mfn(table);
+    int level;
+
+    for (level = 0; level < 3; level++)
+    {
+        unsigned int offset = (virtual_address >> shift[level]) & (L1_PAGETABLE_ENTRIES - 1);
+        if (!(table[offset] & _PAGE_PRESENT))
+        {
+            uint64_t pfn = alloc(context);
+            if (!pfn || new_table(pfn, mfn, offset, prot[level]))
+                return 0;
+        }
+
+        // a superpage has no L1 table
+        if (table[offset] & _PAGE_PSE)
+            return 0;
+
+        mfn = PTE_MFN(table[offset]);
+        table = mfn_to_virt(mfn);
+    }
+
+    return mfn;
+}
+
+static uint64_t boot_table_alloc(void *context)
+{
+    boot_tables_t *tables = context;
+
+    if (*tables->next >= tables->mapped)
+        return 0;
+
+    return (*tables->next)++;
+}
+
+static uint64_t page_table_alloc(void *context)
+{
+    void *page = micropv_page_alloc(0);
+    return page ? virt_to_pfn(page) : 0;
+}
+
+int xenmmu_build_tables(uint64_t virtual_address, size_t pages)
+{
+    uint64_t end = virtual_address + (pages << __PAGE_SHIFT);
+    int rc = 0;
+
+    // one L1 table per 2MB, two callers mustn't both add the same one
+    int flags = xenevents_save_disable();
+    for (virtual_address &= ~L1_MASK; virtual_address < end; virtual_address += SUPERPAGE_SIZE)
+    {
+        if (!l1_table(virtual_address, page_table_alloc, NULL))
+        {
+            PRINTK("no page table for 0x%lx", virtual_address);
+            rc = -1;
+            break;
+        }
     }
+    xenevents_restore(flags);
 
-    // return a pointer to this buffer
-    return physical_ptr;
+    return rc;
+}
+
+uint64_t xenmmu_map_pfns(uint64_t start_pfn, uint64_t end_pfn, uint64_t *table_pfn)
+{
+    boot_tables_t tables = { table_pfn, start_pfn };
+    mmu_update_t update[MMU_BATCH];
+    uint64_t pfn, l1_mfn = 0;
+    int updates = 0, rc;
+
+    for (pfn = start_pfn; pfn < end_pfn; pfn++)
+    {
+        uint64_t virtual_address = (uint64_t)to_virt(pfn << __PAGE_SHIFT);
+
+        // a pfn without a frame can't be mapped, the balloon deals with whatever is left
+        if (pfn_to_mfn(pfn) == INVALID_P2M_ENTRY)
+            break;
+
+        // the next page table may be one of the pages in the batch, so it goes first
+        if (!l1_mfn || !l1_table_offset(virtual_address) || (updates == MMU_BATCH))
+        {
+            if (updates && ((rc = HYPERVISOR_mmu_update(update, updates, NULL, DOMID_SELF)) != 0))
+            {
+                PRINTK("HYPERVISOR_mmu_update returns %i", rc);
+                return pfn - updates;
+            }
+            tables.mapped = pfn;
+            updates = 0;
+        }
+
+        if (!l1_mfn || !l1_table_offset(virtual_address))
+        {
+            if (!(l1_mfn = l1_table(virtual_address, boot_table_alloc, &tables)))
+            {
+                PRINTK("no page table for pfn 0x%lx", pfn);
+                return pfn;
+            }
+        }
+
+        update[updates].ptr = ((l1_mfn << __PAGE_SHIFT) + l1_table_offset(virtual_address) * sizeof(uint64_t)) | MMU_NORMAL_PT_UPDATE;
+        update[updates].val = (pfn_to_mfn(pfn) << __PAGE_SHIFT) | L1_PROT;
+        updates++;
+    }
+
+    if (updates && ((rc = HYPERVISOR_mmu_update(update, updates, NULL, DOMID_SELF)) != 0))
+    {
+        PRINTK("HYPERVISOR_mmu_update returns %i", rc);
+        return pfn - updates;
+    }
+
+    return pfn;
+}
+
+static int flush_tlb(void)
+{
+    mmuext_op_t op;
+    op.cmd = MMUEXT_TLB_FLUSH_LOCAL;
+    return HYPERVISOR_mmuext_op(&op, 1, NULL, DOMID_SELF);
+}
+
+static int map_superpage(uint64_t virtual_address)
+{
+    uint64_t pfn = virt_to_pfn(virtual_address);
+    uint64_t mfn = pfn_to_mfn(pfn);
+    uint64_t entry_address, entry;
+    int i, slot;
+
+    // the 512 frames must be one aligned machine extent
+    for (i = 0; i < L1_PAGETABLE_ENTRIES; i++)
+        if (pfn_to_mfn(pfn + i) != mfn + i)
+            break;
+    if ((i < L1_PAGETABLE_ENTRIES) || (mfn & (L1_PAGETABLE_ENTRIES - 1)))
+    {
+        uint64_t machine_address;
+        if (xenmmu_make_contiguous(virtual_address, SUPERPAGE_ORDER, 0, &machine_address))
+            return -1;
+        mfn = machine_address >> L1_PAGETABLE_SHIFT;
+    }
+
+    for (slot = 0; slot < SUPERPAGE_MAX; slot++)
+        if (!superpage[slot].virtual_address)
+            break;
+    if (slot == SUPERPAGE_MAX)
+        return -1;
+
+    if (l2_entry_address(virtual_address, &entry_address, &entry) || !(entry & _PAGE_PRESENT) || (entry & _PAGE_PSE))
+        return -1;
+
+    mmu_update_t update;
+    update.ptr = entry_address | MMU_NORMAL_PT_UPDATE;
+    update.val = (mfn << L1_PAGETABLE_SHIFT) | L2_PROT | _PAGE_PSE;
+    int rc = HYPERVISOR_mmu_update(&update, 1, NULL, DOMID_SELF);
+    if (rc)
+    {
+        PRINTK("superpages not allowed (%i), staying on 4K pages", rc);
+        superpages_allowed = 0;
+        return -1;
+    }
+    flush_tlb();
+
+    superpage[slot].virtual_address = virtual_address;
+    superpage[slot].l2_entry = entry;
+    return 0;
+}
+
+int xenmmu_promote_superpages(uint64_t virtual_address, size_t pages)
+{
+    int mapped = 0;
+    size_t chunk;
+
+    if (virtual_address & (SUPERPAGE_SIZE - 1))
+        return 0;
+
+    for (chunk = 0; superpages_allowed && (chunk + L1_PAGETABLE_ENTRIES <= pages); chunk += L1_PAGETABLE_ENTRIES)
+        if (!map_superpage(virtual_address + (chunk << L1_PAGETABLE_SHIFT)))
+            mapped++;
+
+    return mapped;
+}
+
+void xenmmu_demote_superpages(uint64_t virtual_address, size_t pages)
+{
+    uint64_t end = virtual_address + (pages << L1_PAGETABLE_SHIFT);
+    int slot;
+
+    for (slot = 0; slot < SUPERPAGE_MAX; slot++)
+    {
+        uint64_t address = superpage[slot].virtual_address;
+        if (!address || (address < virtual_address) || (address >= end))
+            continue;
+
+        // the old L1 table still maps the same frames, it was never written while the superpage was in place
+        uint64_t entry_address, entry;
+        if (!l2_entry_address(address, &entry_address, &entry))
+        {
+            mmu_update_t update;
+            update.ptr = entry_address | MMU_NORMAL_PT_UPDATE;
+            update.val = superpage[slot].l2_entry;
+            int rc = HYPERVISOR_mmu_update(&update, 1, NULL, DOMID_SELF);
+            if (rc)
+                PRINTK("FAIL restoring the 4K mapping at 0x%lx with %i", address, rc);
+        }
+        superpage[slot].virtual_address = 0;
+    }
+
+    flush_tlb();
+}
+
+/* Up to RESERVATION_BATCH pages of xenmmu_decrease_reservation */
+static int decrease_reservation(const uint64_t *pfns, size_t count, int mapped)
+{
+    xen_pfn_t *frames = reservation_frames;
+    size_t i;
+
+    for (i = 0; i < count; i++)
+        frames[i] = pfn_to_mfn(pfns[i]);
+
+    // nothing may point at the frames once they are gone
+    if (mapped && update_va_list(pfns, NULL, count, 0))
+        return -1;
+    for (i = 0; i < count; i++)
+        phys_to_machine_mapping[pfns[i]] = INVALID_P2M_ENTRY;
+
+    xen_memory_reservation_t reservation =
+    {
+        .nr_extents = count,
+        .extent_order = 0,
+        .mem_flags = 0,
+        .domid = DOMID_SELF
+    };
+    set_xen_guest_handle(reservation.extent_start, frames);
+
+    int rc = HYPERVISOR_memory_op(XENMEM_decrease_reservation, &reservation);
+    size_t released = rc > 0 ? rc : 0;
+    if (released < count)
+    {
+        // xen goes through the list in order, so the tail is still ours
+        PRINTK("XENMEM_decrease_reservation released %lu of %lu pages", released, count);
+        for (i = released; i < count; i++)
+            phys_to_machine_mapping[pfns[i]] = frames[i];
+        if (mapped)
+            update_va_list(pfns + released, frames + released, count - released, L1_PROT);
+    }
+
+    return released;
+}
+
+int xenmmu_decrease_reservation(const uint64_t *pfns, size_t count, int mapped)
+{
+    int flags = xenevents_save_disable();
+    size_t done = 0;
+    int rc = 0;
+
+    while (done < count)
+    {
+        size_t batch = (count - done) < RESERVATION_BATCH ? (count - done) : RESERVATION_BATCH;
+        if ((rc = decrease_reservation(pfns + done, batch, mapped)) < 0)
+            break;
+
+        done += rc;
+        if (rc < batch)
+            break;
+    }
+
+    xenevents_restore(flags);
+    return ((rc < 0) && !done) ? -1 : done;
+}
+
+/* Up to RESERVATION_BATCH pages of xenmmu_increase_reservation */
+static int increase_reservation(const uint64_t *pfns, size_t count)
+{
+    xen_pfn_t *frames = reservation_frames;
+    mmu_update_t m2p[MMU_BATCH];
+    size_t i, j;
+
+    xen_memory_reservation_t reservation =
+    {
+        .nr_extents = count,
+        .extent_order = 0,
+        .mem_flags = 0,
+        .domid = DOMID_SELF
+    };
+    set_xen_guest_handle(reservation.extent_start, frames);
+
+    int rc = HYPERVISOR_memory_op(XENMEM_increase_reservation, &reservation);
+    if (rc <= 0)
+        return 0;
+
+    for (i = 0; i < rc; i++)
+        phys_to_machine_mapping[pfns[i]] = frames[i];
+
+    int failed = 0;
+    for (i = 0; (i < rc) && !failed; i += MMU_BATCH)
+    {
+        int updates = (rc - i) < MMU_BATCH ? (rc - i) : MMU_BATCH;
+        for (j = 0; j < updates; j++)
+        {
+            m2p[j].ptr = ((uint64_t)frames[i + j] << __PAGE_SHIFT) | MMU_MACHPHYS_UPDATE;
+            m2p[j].val = pfns[i + j];
+        }
+        failed = HYPERVISOR_mmu_update(m2p, updates, NULL, DOMID_SELF);
+    }
+
+    if (failed || update_va_list(pfns, frames, rc, L1_PROT))
+    {
+        // the pages can't be used, so give the frames straight back and leave the pages in the balloon
+        PRINTK("FAIL mapping %i new pages", rc);
+        int released = decrease_reservation(pfns, rc, 1);
+        if (released < rc)
+            PRINTK("%i unmapped pages are neither ours nor xen's", rc - (released > 0 ? released : 0));
+        return 0;
+    }
+
+    return rc;
+}
+
+int xenmmu_increase_reservation(const uint64_t *pfns, size_t count)
+{
+    int flags = xenevents_save_disable();
+    size_t done = 0;
+
+    while (done < count)
+    {
+        size_t batch = (count - done) < RESERVATION_BATCH ? (count - done) : RESERVATION_BATCH;
+        int rc = increase_reservation(pfns + done, batch);
+
+        done += rc;
+        if (rc < batch)
+            break;
+    }
+
+    xenevents_restore(flags);
+    return done;
+}
+
+static unsigned int dma_order(size_t size)
+{
+    unsigned int order = 0;
+    while ((__PAGE_SIZE << order) < size)
+        order++;
+    return order;
+}
+
+void *micropv_dma_alloc(size_t size, unsigned int address_bits, uint64_t *bus_address)
+{
+    unsigned int order = dma_order(size);
+    if (order > CONTIGUOUS_MAX_ORDER)
+    {
+        PRINTK("DMA buffer of %lu bytes is too big", size);
+        return NULL;
+    }
+
+    void *buffer = micropv_page_alloc(order);
+    if (!buffer)
+    {
+        PRINTK("no block of order %u for a DMA buffer", order);
+        return NULL;
+    }
+
+    uint64_t machine_address;
+    if (xenmmu_make_contiguous((uint64_t)buffer, order, address_bits, &machine_address))
+    {
+        micropv_page_free(buffer, order);
+        return NULL;
+    }
+
+    // without an IOMMU in the way the bus sees machine addresses
+    *bus_address = machine_address;
+    return buffer;
+}
+
+void micropv_dma_free(void *buffer, size_t size)
+{
+    unsigned int order = dma_order(size);
+
+    // low machine memory is scarce, so the extent goes back to xen for any frames. If xen won't have it the pages
+    // still work as ordinary pages
+    xenmmu_release_contiguous((uint64_t)buffer, order);
+    micropv_page_free(buffer, order);
 }
 
 uint64_t micropv_virtual_to_machine_address(uint64_t virtual_address)
@@ -131,3 +821,65 @@ uint64_t micropv_machine_to_virtual_address(uint64_t machine_address)
     return virtual_address | offset;
 }
 
+/* Machine frame behind a page, from the p2m in the 1:1 map and from the page tables anywhere else */
+static uint64_t virtual_to_mfn(uint64_t virtual_address)
+{
+    uint64_t pfn = virt_to_pfn(virtual_address);
+    if (pfn < hypervisor_start_info.nr_pages)
+        return pfn_to_mfn(pfn);
+
+    uint64_t entry_address, l2;
+    if (!xenmmu_virtual_mapped(virtual_address) || l2_entry_address(virtual_address, &entry_address, &l2))
+        return INVALID_P2M_ENTRY;
+    if (l2 & _PAGE_PSE)
+        return (PTE_MFN(l2) & ~((1UL << SUPERPAGE_ORDER) - 1)) + l1_table_offset(virtual_address);
+
+    uint64_t *table = mfn_to_virt(PTE_MFN(l2));
+    return PTE_MFN(table[l1_table_offset(virtual_address)]);
+}
+
+int micropv_virtual_to_machine_sg(const void *buffer, size_t length, micropv_sg_segment_t *segments, size_t max_segments, int flags)
+{
+    uint64_t virtual_address = (uint64_t)buffer;
+    uint32_t offset = virtual_address & (__PAGE_SIZE - 1);
+    uint64_t next_mfn = ~0UL;
+    size_t count = 0;
+
+    // one lookup per page
+    while (length)
+    {
+        uint64_t mfn = virtual_to_mfn(virtual_address);
+        uint32_t chunk = __PAGE_SIZE - offset;
+        if (chunk > length)
+            chunk = length;
+
+        // ballooned out or not mapped, there is nothing for the device to see
+        if (mfn == INVALID_P2M_ENTRY)
+        {
+            PRINTK("no machine frame at 0x%lx", virtual_address);
+            return -1;
+        }
+
+        // keep segment lengths well clear of wrapping
+        if ((mfn == next_mfn) && (segments[count - 1].length < (1U << 31)))
+        {
+            segments[count - 1].length += chunk;
+        }
+        else
+        {
+            if (count == max_segments)
+                return -1;
+            segments[count].mfn = mfn;
+            segments[count].offset = offset;
+            segments[count].length = chunk;
+            count++;
+        }
+
+        next_mfn = (flags & MICROPV_SG_MERGE) ? mfn + 1 : ~0UL;
+        virtual_address += chunk;
+        length -= chunk;
+        offset = 0;
+    }
+
+    return count;
+}
@@ -0,0 +1,365 @@
+/*  ***********************************************************************
+    * Project:
+    * File: xenpage.c
+    * Author: smartin
+    ***********************************************************************
+
+    Buddy allocator for the guest page frames.
+
+    Xen lays out the boot region as the image, the p2m list, the start info, xenstore and console pages, the page
+    tables and a boot stack page, and maps it with a bit of padding. The rest of memory up to nr_pages is mapped here
+    (see xenmmu_map_pfns), with the new page tables taken from the first pages after the boot region, and everything
+    after those is handed to the allocator. If the mapping stops short the pages it didn't get to are left alone, the
+    balloon gives them back.
+
+    Free blocks are kept on one list per order, linked through the pages themselves. A byte per page records the
+    order of a free block at its first page so that a freed block can find out whether its buddy is free.
+
+    Single pages go through a small per cpu cache in front of the buddy lists. Recently freed pages are still in
+    the CPU cache so they go out first (hot end), pages freed after DMA have been overwritten by the device so they
+    go in at the other end (cold end) and are only reused when the hot ones run out.
+
+    Modifications
+    0.00 10/19/2026 created
+*/
+
+/*---------------------------------------------------------------------
+  -- macros (preamble)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- standard includes
+  ---------------------------------------------------------------------*/
+#include <stdint.h>
+#include <string.h>
+
+/*---------------------------------------------------------------------
+  -- project includes (imports)
+  ---------------------------------------------------------------------*/
+#include "../micropv.h"
+#include "hypervisor.h"
+#include "xenevents.h"
+#include "xenmmu.h"
+#include "xenballoon.h"
+
+/*---------------------------------------------------------------------
+  -- project includes (exports)
+  ---------------------------------------------------------------------*/
+#include "xenpage.h"
+
+/*---------------------------------------------------------------------
+  -- macros (postamble)
+  ---------------------------------------------------------------------*/
+#define PAGE_NOT_FREE       0xff
+#define PAGE_CACHE_SIZE     64
+#define PAGE_CACHE_BATCH    16
+#define PFN_UP(x)           (((x) + __PAGE_SIZE - 1) >> __PAGE_SHIFT)
+
+/*---------------------------------------------------------------------
+  -- forward declarations
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- data types
+  ---------------------------------------------------------------------*/
+typedef struct free_block_t
+{
+    struct free_block_t *next, *prev;
+} free_block_t;
+
+/* Ring of single pages, the hottest one is at head */
+typedef struct page_cache_t
+{
+    void *page[PAGE_CACHE_SIZE];
+    unsigned int head, count;
+} page_cache_t;
+
+/*---------------------------------------------------------------------
+  -- function prototypes
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- global variables
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- local variables
+  ---------------------------------------------------------------------*/
+static free_block_t free_list[XENPAGE_MAX_ORDER + 1];
+static uint8_t *free_order = NULL;
+static uint64_t first_pfn = 0, last_pfn = 0;
+static uint64_t free_pages = 0;
+static page_cache_t page_cache[NR_CPUS];
+
+/*---------------------------------------------------------------------
+  -- implementation
+  ---------------------------------------------------------------------*/
+
+/* Walk the boot page tables to see whether a page is mapped */
+static int pfn_mapped(uint64_t pfn)
+{
+    uint64_t va = (uint64_t)to_virt(pfn << __PAGE_SHIFT);
+    uint64_t *table = (uint64_t *)hypervisor_start_info.pt_base;
+    uint64_t entry;
+
+    entry = table[l4_table_offset(va)];
+    if (!(entry & _PAGE_PRESENT))
+        return 0;
+    table = mfn_to_virt(PTE_MFN(entry));
+
+    entry = table[l3_table_offset(va)];
+    if (!(entry & _PAGE_PRESENT))
+        return 0;
+    table = mfn_to_virt(PTE_MFN(entry));
+
+    entry = table[l2_table_offset(va)];
+    if (!(entry & _PAGE_PRESENT))
+        return 0;
+    if (entry & _PAGE_PSE)
+        return 1;
+    table = mfn_to_virt(PTE_MFN(entry));
+
+    return (table[l1_table_offset(va)] & _PAGE_PRESENT) != 0;
+}
+
+static void block_push(uint64_t pfn, unsigned int order)
+{
+    free_block_t *block = to_virt(pfn << __PAGE_SHIFT);
+    free_block_t *head = &free_list[order];
+
+    block->next = head->next;
+    block->prev = head;
+    head->next->prev = block;
+    head->next = block;
+    free_order[pfn - first_pfn] = order;
+}
+
+static void block_remove(uint64_t pfn)
+{
+    free_block_t *block = to_virt(pfn << __PAGE_SHIFT);
+
+    block->prev->next = block->next;
+    block->next->prev = block->prev;
+    free_order[pfn - first_pfn] = PAGE_NOT_FREE;
+}
+
+static void *buddy_alloc(unsigned int order)
+{
+    unsigned int current;
+
+    for (current = order; current <= XENPAGE_MAX_ORDER; current++)
+        if (free_list[current].next != &free_list[current])
+            break;
+
+    if (current > XENPAGE_MAX_ORDER)
+        return NULL;
+
+    uint64_t pfn = virt_to_pfn(free_list[current].next);
+    block_remove(pfn);
+
+    // give the top halves back until the block is the right size
+    while (current > order)
+    {
+        current--;
+        block_push(pfn + (1UL << current), current);
+    }
+
+    free_pages -= 1UL << order;
+    return to_virt(pfn << __PAGE_SHIFT);
+}
+
+static void buddy_free(void *page, unsigned int order)
+{
+    uint64_t pfn = virt_to_pfn(page);
+
+    free_pages += 1UL << order;
+
+    while (order < XENPAGE_MAX_ORDER)
+    {
+        uint64_t buddy = pfn ^ (1UL << order);
+        if ((buddy < first_pfn) || (buddy + (1UL << order) > last_pfn) || (free_order[buddy - first_pfn] != order))
+            break;
+
+        block_remove(buddy);
+        pfn &= ~(1UL << order);
+        order++;
+    }
+
+    block_push(pfn, order);
+}
+
+void xenpage_init(void)
+{
+    unsigned int order;
+
+    for (order = 0; order <= XENPAGE_MAX_ORDER; order++)
+        free_list[order].next = free_list[order].prev = &free_list[order];
+
+    // skip the page tables and the boot stack page that follows them
+    first_pfn = PFN_UP(to_phys(hypervisor_start_info.pt_base)) + hypervisor_start_info.nr_pt_frames + 1;
+    for (last_pfn = first_pfn; (last_pfn < hypervisor_start_info.nr_pages) && pfn_mapped(last_pfn); last_pfn++)
+        ;
+
+    // the boot mapping stops a little after the boot region, the page tables for the rest come off the free pages
+    if (last_pfn < hypervisor_start_info.nr_pages)
+    {
+        uint64_t table_pfn = first_pfn;
+        uint64_t mapped_pfn = xenmmu_map_pfns(last_pfn, hypervisor_start_info.nr_pages, &table_pfn);
+        PRINTK("Mapped pfn 0x%lx-0x%lx with %lu new page tables", last_pfn, mapped_pfn, table_pfn - first_pfn);
+        first_pfn = table_pfn;
+        last_pfn = mapped_pfn;
+    }
+
+    if (last_pfn <= first_pfn)
+    {
+        PRINTK("No free pages after the boot region");
+        return;
+    }
+
+    // the order map comes out of the free pages
+    free_order = to_virt(first_pfn << __PAGE_SHIFT);
+    memset(free_order, PAGE_NOT_FREE, last_pfn - first_pfn);
+    uint64_t pfn = first_pfn + PFN_UP(last_pfn - first_pfn);
+
+    // carve the rest into the biggest aligned blocks that fit
+    while (pfn < last_pfn)
+    {
+        order = XENPAGE_MAX_ORDER;
+        while ((pfn & ((1UL << order) - 1)) || (pfn + (1UL << order) > last_pfn))
+            order--;
+
+        block_push(pfn, order);
+        free_pages += 1UL << order;
+        pfn += 1UL << order;
+    }
+
+    PRINTK("Page allocator has %lu free pages in pfn 0x%lx-0x%lx", free_pages, first_pfn, last_pfn);
+}
+
+uint64_t xenpage_end_pfn(void)
+{
+    return last_pfn;
+}
+
+static void *page_alloc(unsigned int order)
+{
+    void *page = NULL;
+
+    int flags = xenevents_save_disable();
+
+    if (!order)
+    {
+        page_cache_t *cache = &page_cache[smp_processor_id()];
+
+        // refill in a batch so the buddy lists are only touched now and then
+        if (!cache->count)
+        {
+            while (cache->count < PAGE_CACHE_BATCH)
+            {
+                void *refill = buddy_alloc(0);
+                if (!refill)
+                    break;
+                cache->page[(cache->head + cache->count) % PAGE_CACHE_SIZE] = refill;
+                cache->count++;
+            }
+        }
+
+        if (cache->count)
+        {
+            page = cache->page[cache->head];
+            cache->head = (cache->head + 1) % PAGE_CACHE_SIZE;
+            cache->count--;
+        }
+    }
+    else
+        page = buddy_alloc(order);
+
+    xenevents_restore(flags);
+    return page;
+}
+
+void *micropv_page_alloc(unsigned int order)
+{
+    if (order > XENPAGE_MAX_ORDER)
+        return NULL;
+
+    void *page = page_alloc(order);
+
+    // out of pages, see if the balloon can give some back
+    if (!page && xenballoon_reclaim(1UL << order))
+        page = page_alloc(order);
+
+    return page;
+}
+
+static void page_free(void *page, unsigned int order, int cold)
+{
+    if (!page || (order > XENPAGE_MAX_ORDER))
+        return;
+
+    int flags = xenevents_save_disable();
+
+    if (!order)
+    {
+        page_cache_t *cache = &page_cache[smp_processor_id()];
+
+        // full, give the coldest pages back to the buddy lists
+        if (cache->count == PAGE_CACHE_SIZE)
+        {
+            int i;
+            for (i = 0; i < PAGE_CACHE_BATCH; i++)
+            {
+                cache->count--;
+                buddy_free(cache->page[(cache->head + cache->count) % PAGE_CACHE_SIZE], 0);
+            }
+        }
+
+        if (cold)
+            cache->page[(cache->head + cache->count) % PAGE_CACHE_SIZE] = page;
+        else
+        {
+            cache->head = (cache->head + PAGE_CACHE_SIZE - 1) % PAGE_CACHE_SIZE;
+            cache->page[cache->head] = page;
+        }
+        cache->count++;
+    }
+    else
+        buddy_free(page, order);
+
+    xenevents_restore(flags);
+}
+
+void *micropv_page_alloc_large(unsigned int order)
+{
+    void *block = micropv_page_alloc(order);
+
+    if (block && (order >= SUPERPAGE_ORDER))
+        xenmmu_promote_superpages((uint64_t)block, 1UL << order);
+
+    return block;
+}
+
+void micropv_page_free(void *page, unsigned int order)
+{
+    // blocks this big may have come from micropv_page_alloc_large, the next owner may want 4K pages
+    if (page && (order >= SUPERPAGE_ORDER))
+        xenmmu_demote_superpages((uint64_t)page, 1UL << order);
+
+    page_free(page, order, 0);
+}
+
+void micropv_page_free_cold(void *page)
+{
+    page_free(page, 0, 1);
+}
+
+uint64_t micropv_page_free_count(void)
+{
+    uint64_t count = free_pages;
+    int cpu;
+
+    for (cpu = 0; cpu < NR_CPUS; cpu++)
+        count += page_cache[cpu].count;
+
+    return count;
+}
@@ -12,6 +12,28 @@
   ---------------------------------------------------------------------*/
 #define PCI_DEVFN(slot, func) ((((slot) & 0x1f) << 3) | ((func) & 0x07))
 
+#define PCI_STATUS                  0x06
+#define PCI_STATUS_CAP_LIST         0x10
+#define PCI_HEADER_TYPE             0x0e
+#define PCI_HEADER_TYPE_MASK        0x7f
+#define PCI_HEADER_TYPE_NORMAL      0
+#define PCI_HEADER_TYPE_BRIDGE      1
+#define PCI_CAPABILITY_LIST         0x34
+#define PCI_EXT_CAP_START           0x100
+#define PCI_EXT_CAP_END             0x1000
+#define PCI_EXT_CAP_ID(header)      ((header) & 0xffff)
+#define PCI_EXT_CAP_NEXT(header)    (((header) >> 20) & 0xffc)
+
+#define PCI_BASE_ADDRESS_0              0x10
+#define PCI_BASE_ADDRESS_SPACE_IO       0x01
+#define PCI_BASE_ADDRESS_MEM_TYPE_MASK  0x06
+#define PCI_BASE_ADDRESS_MEM_TYPE_64    0x04
+#define PCI_BASE_ADDRESS_MEM_MASK       (~0x0fUL)
+#define PCI_BRIDGE_BARS                 2
+
+// configuration reads in flight at once while the shadow is filled
+#define PCI_SHADOW_WINDOW               8
+
 /*---------------------------------------------------------------------
   -- standard includes
   ---------------------------------------------------------------------*/
@@ -28,6 +50,8 @@
 #include "xenstore.h"
 #include "xengnttab.h"
 #include "xenevents.h"
+#include "xenmmu.h"
+#include "xenvmem.h"
 #include "../micropv.h"
 
 /*---------------------------------------------------------------------
@@ -53,8 +77,12 @@
 /*---------------------------------------------------------------------
   -- local variables
   ---------------------------------------------------------------------*/
-static volatile unsigned long pci_flags = 0;
-static int (*pci_event_callback)() = NULL;
+/* Read-only bytes of a type 0 header: ids, revision, class, header type, subsystem, capability pointer, pin, min/max */
+static const uint8_t pci_config_ro[MICROPV_PCI_CONFIG_HEADER_SIZE / 8] = { 0x0f, 0x4f, 0x00, 0x00, 0x00, 0xf0, 0x10, 0xe0 };
+/* Type 1 (bridge): ids, revision, class, header type, capability pointer, pin. The bus numbers and windows are writable */
+static const uint8_t pci_config_ro_bridge[MICROPV_PCI_CONFIG_HEADER_SIZE / 8] = { 0x0f, 0x4f, 0x00, 0x00, 0x00, 0x00, 0x10, 0x20 };
+/* Anything else, only the part every header has in common */
+static const uint8_t pci_config_ro_other[MICROPV_PCI_CONFIG_HEADER_SIZE / 8] = { 0x0f, 0x4f };
 
 /*---------------------------------------------------------------------
   -- private functions
@@ -64,14 +92,90 @@ static int (*pci_event_callback)() = NULL;
   -- public functions
   ---------------------------------------------------------------------*/
 
+/* Put an operation in the shared page and kick the backend. Called with events disabled */
+static void pci_op_issue(micropv_pci_bus_t *bus, micropv_pci_completion_t *completion)
+{
+    struct xen_pci_sharedinfo *info = (struct xen_pci_sharedinfo *)bus->page_buffer;
+
+    info->op.cmd = completion->cmd;
+    info->op.domain = completion->domain;
+    info->op.bus = completion->bus;
+    info->op.devfn = completion->devfn;
+    info->op.offset = completion->offset;
+    info->op.size = completion->size;
+    info->op.value = completion->value;
+    info->op.err = 0;
+    info->op.info = 0;
+    if (completion->cmd == XEN_PCI_OP_enable_msix)
+    {
+        int i;
+        for (i = 0; i < completion->value; i++)
+        {
+            info->op.msix_entries[i].entry = completion->msix[i].entry;
+            info->op.msix_entries[i].vector = 0;
+        }
+    }
+    /* Make sure info is written before the flag */
+    wmb();
+    set_bit(_XEN_PCIF_active, (void *)&info->flags);
+    xenevents_notify_remote_via_evtchn(bus->channel);
+}
+
+/* Pick up the result of the operation in the shared page and start the next one. Called with events disabled */
+static void pci_op_complete(micropv_pci_bus_t *bus)
+{
+    struct xen_pci_sharedinfo *info = (struct xen_pci_sharedinfo *)bus->page_buffer;
+    micropv_pci_completion_t *completion = bus->op_head;
+
+    // nothing in flight, or the backend hasn't finished with it yet
+    if (!completion || test_bit(_XEN_PCIF_active, (void *)&info->flags))
+        return;
+
+    /* Make sure flag is read before info */
+    rmb();
+    completion->err = info->op.err;
+    completion->info = info->op.info;
+    // enable_msix returns the vector count in value, keep it for the copy back below
+    if (completion->cmd != XEN_PCI_OP_enable_msix)
+        completion->value = info->op.value;
+    if (completion->cmd == XEN_PCI_OP_conf_read)
+        completion->value &= (1L << (completion->size << 3)) - 1;
+    if ((completion->cmd == XEN_PCI_OP_enable_msix) && !completion->err)
+    {
+        int i;
+        for (i = 0; i < completion->value; i++)
+            completion->msix[i].pirq = info->op.msix_entries[i].vector;
+    }
+
+    // move the queue on before telling anyone, the callback may queue more work
+    bus->op_head = completion->next;
+    if (!bus->op_head)
+        bus->op_tail = NULL;
+    if (bus->op_head)
+        pci_op_issue(bus, bus->op_head);
+
+    completion->device->ops_pending--;
+    wmb();
+    completion->done = 1;
+    if (completion->callback)
+        completion->callback(completion);
+}
+
 static void pci_event_handler(evtchn_port_t port, struct pt_regs *register_file, void *data)
 {
     //PRINTK("pci_event port=%i register_file=%p data=%p", port, register_file, data);
+    micropv_pci_bus_t *bus = data;
+    int d;
 
-    if (pci_event_callback)
-        pci_event_callback();
+    if (!bus)
+        return;
 
-    set_bit(0, &pci_flags);
+    // the MSI notification comes in on the bus channel, so every device with a handler gets a look
+    for (d = 0; d < bus->num_devices; d++)
+        if (bus->devices[d].msi_callback)
+            bus->devices[d].msi_callback();
+
+    pci_op_complete(bus);
 }
 
 void micropv_pci_unmap_bus(micropv_pci_handle_t *handle)
@@ -158,7 +262,8 @@ int micropv_pci_map_bus(micropv_pci_handle_t *handle)
 
     if (xenevents_alloc_channel(handle->bus->backend_domain, &handle->bus->channel))
         goto fail;
-    handle->bus->port = xenevents_bind_handler(handle->bus->channel, pci_event_handler);
+    handle->bus->op_head = handle->bus->op_tail = NULL;
+    handle->bus->port = xenevents_bind_handler_context(handle->bus->channel, pci_event_handler, handle->bus);
 
     memset(handle->bus->page_buffer, 0, 4096);
     handle->bus->grant_ref = xengnttab_share(handle->bus->backend_domain, handle->bus->page_buffer, 0);
@@ -221,53 +326,132 @@ fail:
     return -1;
 }
 
-void pci_op(micropv_pci_handle_t *handle, struct xen_pci_op *op)
+static int pci_op_submit(micropv_pci_handle_t *handle, micropv_pci_completion_t *completion)
 {
-    struct xen_pci_sharedinfo *info = (struct xen_pci_sharedinfo *)handle->bus->page_buffer;
+    micropv_pci_bus_t *bus = handle->bus;
+
+    if ((bus->port == -1) || !handle->device)
+        return -1;
+
+    completion->device = handle->device;
+    completion->domain = handle->device->domain;
+    completion->bus = handle->device->bus;
+    completion->devfn = PCI_DEVFN(handle->device->slot, handle->device->fun);
+    completion->err = 0;
+    completion->info = 0;
+    completion->done = 0;
+    completion->next = NULL;
+
+    // queue the operation. If nothing is in flight then it goes straight to the backend. Callers may already have
+    // events off, so the previous state is put back rather than enabling
+    int flags = xenevents_save_disable();
+    handle->device->ops_pending++;
+    if (bus->op_tail)
+        bus->op_tail->next = completion;
+    else
+    {
+        bus->op_head = completion;
+        pci_op_issue(bus, completion);
+    }
+    bus->op_tail = completion;
+    xenevents_restore(flags);
 
-    info->op = *op;
-    /* Make sure info is written before the flag */
-    wmb();
-    clear_bit(0, &pci_flags);
-    set_bit(_XEN_PCIF_active, (void *)&info->flags);
-    xenevents_notify_remote_via_evtchn(handle->bus->channel);
+    return 0;
+}
 
-    while (!test_bit(0, &pci_flags) || test_bit(_XEN_PCIF_active, (void *)&info->flags));
+int micropv_pci_wait(micropv_pci_completion_t *completion)
+{
+    // the event handler sets done, the other tasks run until it does
+    while (!completion->done)
+        micropv_scheduler_yield();
 
-    /* Make sure flag is read before info */
+    /* Make sure done is read before the result */
     rmb();
-    *op = info->op;
+    return completion->err;
+}
+
+void micropv_pci_flush(micropv_pci_handle_t *handle)
+{
+    while (handle->device->ops_pending)
+        micropv_scheduler_yield();
+}
+
+static void pci_op(micropv_pci_handle_t *handle, micropv_pci_completion_t *completion)
+{
+    completion->callback = NULL;
+    if (pci_op_submit(handle, completion))
+    {
+        completion->err = XEN_PCI_ERR_op_failed;
+        return;
+    }
+    micropv_pci_wait(completion);
+}
+
+int micropv_pci_conf_read_async(micropv_pci_handle_t *handle, unsigned int off, unsigned int size, micropv_pci_completion_t *completion)
+{
+    completion->cmd = XEN_PCI_OP_conf_read;
+    completion->offset = off;
+    completion->size = size;
+    completion->value = 0;
+
+    return pci_op_submit(handle, completion);
+}
+
+int micropv_pci_conf_write_async(micropv_pci_handle_t *handle, unsigned int off, unsigned int size, unsigned int val, micropv_pci_completion_t *completion)
+{
+    completion->cmd = XEN_PCI_OP_conf_write;
+    completion->offset = off;
+    completion->size = size;
+    completion->value = val;
+
+    return pci_op_submit(handle, completion);
+}
+
+static int pci_shadow_read(micropv_pci_device_t *device, unsigned int off, unsigned int size, unsigned int *val)
+{
+    unsigned int i;
+
+    if (!device->config_valid || (off + size > MICROPV_PCI_CONFIG_HEADER_SIZE))
+        return -1;
+
+    // every byte has to be read-only, otherwise the device may have changed it
+    for (i = off; i < off + size; i++)
+        if (!(device->config_ro[i >> 3] & (1 << (i & 7))))
+            return -1;
+
+    *val = 0;
+    memcpy(val, (uint8_t *)device->config + off, size);
+
+    return 0;
 }
 
 int micropv_pci_conf_read(micropv_pci_handle_t *handle, unsigned int off, unsigned int size, unsigned int *val)
 {
-    struct xen_pci_op op;
+    micropv_pci_completion_t op;
+
+    if (!pci_shadow_read(handle->device, off, size, val))
+        return 0;
 
     op.cmd = XEN_PCI_OP_conf_read;
-    op.domain = handle->device.domain;
-    op.bus = handle->device.bus;
-    op.devfn = PCI_DEVFN(handle->device.slot, handle->device.fun);
     op.offset = off;
     op.size = size;
+    op.value = 0;
 
     pci_op(handle, &op);
 
     if (op.err)
         return op.err;
 
-    *val = op.value & ((1L << (size << 3)) - 1);
+    *val = op.value;
 
     return 0;
 }
 
 int micropv_pci_conf_write(micropv_pci_handle_t *handle, unsigned int off, unsigned int size, unsigned int val)
 {
-    struct xen_pci_op op;
+    micropv_pci_completion_t op;
 
     op.cmd = XEN_PCI_OP_conf_write;
-    op.domain = handle->device.domain;
-    op.bus = handle->device.bus;
-    op.devfn = PCI_DEVFN(handle->device.slot, handle->device.fun);
     op.offset = off;
     op.size = size;
     op.value = val;
@@ -280,59 +464,279 @@ int micropv_pci_conf_write(micropv_pci_handle_t *handle, unsigned int off, unsig
     return 0;
 }
 
+static void pci_shadow_mark_ro(micropv_pci_device_t *device, unsigned int off, unsigned int size)
+{
+    for (; size; size--, off++)
+        device->config_ro[off >> 3] |= 1 << (off & 7);
+}
+
+static uint8_t pci_shadow_byte(micropv_pci_device_t *device, unsigned int off)
+{
+    return ((uint8_t *)device->config)[off];
+}
+
+/* Walk the capability lists. The standard list comes from the shadow, the extended one needs the backend */
+static void pci_capability_scan(micropv_pci_handle_t *handle)
+{
+    micropv_pci_device_t *device = handle->device;
+    unsigned int offset;
+    int ttl;
+
+    device->capabilities = device->ext_capabilities = 0;
+    if (!(pci_shadow_byte(device, PCI_STATUS) & PCI_STATUS_CAP_LIST))
+        return;
+
+    // the ttl stops a broken device sending us round in circles
+    offset = pci_shadow_byte(device, PCI_CAPABILITY_LIST) & ~3;
+    for (ttl = 48; offset && (offset < MICROPV_PCI_CONFIG_HEADER_SIZE) && ttl; ttl--)
+    {
+        uint8_t id = pci_shadow_byte(device, offset);
+        if (id == 0xff)
+            break;
+
+        if (device->capabilities < MICROPV_PCI_MAX_CAPABILITIES)
+        {
+            device->capability[device->capabilities].id = id;
+            device->capability[device->capabilities].offset = offset;
+            device->capabilities++;
+        }
+
+        // the id and next pointer never change so they can come from the shadow
+        pci_shadow_mark_ro(device, offset, 2);
+        offset = pci_shadow_byte(device, offset + 1) & ~3;
+    }
+
+    // only PCIe devices have an extended configuration space
+    if (!micropv_pci_find_capability(handle, MICROPV_PCI_CAP_ID_EXP))
+        return;
+
+    offset = PCI_EXT_CAP_START;
+    for (ttl = (PCI_EXT_CAP_END - PCI_EXT_CAP_START) / 8; offset && ttl; ttl--)
+    {
+        unsigned int header;
+        if (micropv_pci_conf_read(handle, offset, 4, &header) || !header || (header == 0xffffffff))
+            break;
+
+        if (device->ext_capabilities < MICROPV_PCI_MAX_CAPABILITIES)
+        {
+            device->ext_capability[device->ext_capabilities].id = PCI_EXT_CAP_ID(header);
+            device->ext_capability[device->ext_capabilities].offset = offset;
+            device->ext_capabilities++;
+        }
+
+        offset = PCI_EXT_CAP_NEXT(header);
+        if (offset < PCI_EXT_CAP_START)
+            break;
+    }
+}
+
+static int pci_header_type(micropv_pci_device_t *device)
+{
+    return pci_shadow_byte(device, PCI_HEADER_TYPE) & PCI_HEADER_TYPE_MASK;
+}
+
+/* Read the complete header in one pass. A window of reads is kept queued so the backend works through them back to back */
+static int pci_shadow_fill(micropv_pci_handle_t *handle)
+{
+    micropv_pci_device_t *device = handle->device;
+    micropv_pci_completion_t op[PCI_SHADOW_WINDOW];
+    int queued = 0, done, rc = 0;
+
+    device->config_valid = 0;
+    memset(device->config_ro, 0, sizeof(device->config_ro));
+
+    for (done = 0; done < SIZEOF_ARRAY(device->config); done++)
+    {
+        // top the window up, after a failure only the ones in flight are finished off
+        while (!rc && (queued < SIZEOF_ARRAY(device->config)) && (queued - done < PCI_SHADOW_WINDOW))
+        {
+            micropv_pci_completion_t *read = &op[queued % PCI_SHADOW_WINDOW];
+            read->callback = NULL;
+            if (micropv_pci_conf_read_async(handle, queued << 2, 4, read))
+                rc = -1;
+            else
+                queued++;
+        }
+
+        // they complete in order, but we have to wait for all of them as they are on our stack
+        if (done == queued)
+            break;
+        if (micropv_pci_wait(&op[done % PCI_SHADOW_WINDOW]))
+            rc = -1;
+        device->config[done] = op[done % PCI_SHADOW_WINDOW].value;
+    }
+
+    if (rc)
+        return -1;
+
+    // which bytes can be served from the shadow depends on the header layout
+    switch (pci_header_type(device))
+    {
+    case PCI_HEADER_TYPE_NORMAL:
+        memcpy(device->config_ro, pci_config_ro, sizeof(device->config_ro));
+        break;
+    case PCI_HEADER_TYPE_BRIDGE:
+        memcpy(device->config_ro, pci_config_ro_bridge, sizeof(device->config_ro));
+        break;
+    default:
+        memcpy(device->config_ro, pci_config_ro_other, sizeof(device->config_ro));
+        break;
+    }
+
+    device->config_valid = 1;
+
+    // a CardBus header has its capability pointer somewhere else
+    if (pci_header_type(device) <= PCI_HEADER_TYPE_BRIDGE)
+        pci_capability_scan(handle);
+
+    return 0;
+}
+
+int micropv_pci_find_capability(micropv_pci_handle_t *handle, unsigned int id)
+{
+    int i;
+    for (i = 0; i < handle->device->capabilities; i++)
+        if (handle->device->capability[i].id == id)
+            return handle->device->capability[i].offset;
+    return 0;
+}
+
+int micropv_pci_find_ext_capability(micropv_pci_handle_t *handle, unsigned int id)
+{
+    int i;
+    for (i = 0; i < handle->device->ext_capabilities; i++)
+        if (handle->device->ext_capability[i].id == id)
+            return handle->device->ext_capability[i].offset;
+    return 0;
+}
+
 int micropv_pci_scan_bus(micropv_pci_handle_t *handle)
 {
-    char path[strlen(handle->bus->backend_path) + 1 + 5 + 10 + 1];
+    micropv_pci_bus_t *bus = handle->bus;
+    char path[strlen(bus->backend_path) + 1 + 5 + 10 + 1];
+
+    // single device drivers don't need to bother with a table
+    if (!bus->devices || (bus->max_devices <= 0))
+    {
+        bus->devices = &bus->single_device;
+        bus->max_devices = 1;
+    }
 
-    snprintf(path, sizeof(path), "%s/num_devs", handle->bus->backend_path);
+    snprintf(path, sizeof(path), "%s/num_devs", bus->backend_path);
     int num_devs = 0;
     xenstore_read_integer(XBT_NIL, path, &num_devs);
+    if (num_devs > bus->max_devices)
+    {
+        PRINTK("%i devices on the bus but only room for %i", num_devs, bus->max_devices);
+        num_devs = bus->max_devices;
+    }
+
+    // the event handler walks the table, so only publish devices once they are filled in
+    bus->num_devices = 0;
 
     int d;
     for (d = 0; (d < num_devs); d++)
     {
+        micropv_pci_handle_t device_handle = { .bus = bus, .device = &bus->devices[bus->num_devices] };
+        micropv_pci_device_t *device = device_handle.device;
+        memset(device, 0, sizeof(*device));
+
         char dev[15] = { 0 };
         size_t dev_length;
-        snprintf(path, sizeof(path), "%s/vdev-%d", handle->bus->backend_path, d);
+        snprintf(path, sizeof(path), "%s/vdev-%d", bus->backend_path, d);
         xenstore_read(XBT_NIL, path, dev, sizeof(dev), &dev_length);
         PRINTK("Virtual Device=%s", dev);
 
         char *end, *start = dev;
-        handle->device.domain = strtol(start, &end, 16); start = end + 1;
-        handle->device.bus    = strtol(start, &end, 16); start = end + 1;
-        handle->device.slot   = strtol(start, &end, 16); start = end + 1;
-        handle->device.fun    = strtol(start, &end, 16);
+        device->domain = strtol(start, &end, 16); start = end + 1;
+        device->bus    = strtol(start, &end, 16); start = end + 1;
+        device->slot   = strtol(start, &end, 16); start = end + 1;
+        device->fun    = strtol(start, &end, 16);
+
+        if (pci_shadow_fill(&device_handle))
+        {
+            PRINTK("%04x:%02x:%02x.%02x configuration read failed",
+                   device->domain, device->bus, device->slot, device->fun);
+            continue;
+        }
 
-        micropv_pci_conf_read(handle, 0x00, 2, &handle->device.vendor);
-        micropv_pci_conf_read(handle, 0x02, 2, &handle->device.device);
-        micropv_pci_conf_read(handle, 0x08, 1, &handle->device.rev);
-        micropv_pci_conf_read(handle, 0x0a, 2, &handle->device.class);
+        // these all come from the shadow now
+        micropv_pci_conf_read(&device_handle, 0x00, 2, &device->vendor);
+        micropv_pci_conf_read(&device_handle, 0x02, 2, &device->device);
+        micropv_pci_conf_read(&device_handle, 0x08, 1, &device->rev);
+        micropv_pci_conf_read(&device_handle, 0x0a, 2, &device->class);
 
         PRINTK("%04x:%02x:%02x.%02x %04x: %04x:%04x (rev %02x)",
-               handle->device.domain, handle->device.bus, handle->device.slot, handle->device.fun,
-               handle->device.class, handle->device.vendor, handle->device.device, handle->device.rev);
+               device->domain, device->bus, device->slot, device->fun,
+               device->class, device->vendor, device->device, device->rev);
 
         int i;
-        for (i = 0; i < SIZEOF_ARRAY(handle->device.bar); i++)
+        for (i = 0; i < SIZEOF_ARRAY(device->bar); i++)
         {
-            micropv_pci_conf_read(handle, 0x10 + (i << 2), 4, &handle->device.bar[i]);
-            PRINTK("bar[%i]=%x", i, handle->device.bar[i]);
+            device->bar[i] = device->config[(0x10 >> 2) + i];
+            PRINTK("bar[%i]=%x", i, device->bar[i]);
         }
+
+        for (i = 0; i < device->capabilities; i++)
+            PRINTK("capability %02x at %02x", device->capability[i].id, device->capability[i].offset);
+        for (i = 0; i < device->ext_capabilities; i++)
+            PRINTK("extended capability %04x at %03x", device->ext_capability[i].id, device->ext_capability[i].offset);
+
+        wmb();
+        bus->num_devices++;
     }
 
+    // keep single device drivers working
+    if (!handle->device && bus->num_devices)
+        handle->device = &bus->devices[0];
+
     return 0;
 }
 
+int micropv_pci_find_device(micropv_pci_handle_t *handle, uint32_t vendor, uint32_t device, int instance)
+{
+    int d;
+    for (d = 0; d < handle->bus->num_devices; d++)
+    {
+        micropv_pci_device_t *entry = &handle->bus->devices[d];
+        if ((entry->vendor == vendor) && (entry->device == device) && !instance--)
+        {
+            handle->device = entry;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* Every MSI-X vector has its own port, find which one fired and hand it over */
+static void pci_msix_handler(evtchn_port_t port, struct pt_regs *register_file, void *data)
+{
+    micropv_pci_device_t *device = data;
+    int i;
+
+    for (i = 0; i < device->msix_vectors; i++)
+    {
+        micropv_pci_msix_vector_t *vector = &device->msix[i];
+        if (vector->port == port)
+        {
+            vector->count++;
+            if (vector->handler)
+                vector->handler(i, vector->context);
+            return;
+        }
+    }
+}
+
 int micropv_pci_msi_enable(micropv_pci_handle_t *handle, int (*callback)())
 {
-    pci_event_callback = callback;
+    handle->device->msi_callback = callback;
 
-    struct xen_pci_op op;
+    micropv_pci_completion_t op;
 
     op.cmd = XEN_PCI_OP_enable_msi;
-    op.domain = handle->device.domain;
-    op.bus = handle->device.bus;
-    op.devfn = PCI_DEVFN(handle->device.slot, handle->device.fun);
+    op.offset = op.size = 0;
+    op.value = 0;
 
     pci_op(handle, &op);
 
@@ -345,14 +749,13 @@ int micropv_pci_msi_enable(micropv_pci_handle_t *handle, int (*callback)())
 
 int micropv_pci_msi_disable(micropv_pci_handle_t *handle)
 {
-    pci_event_callback = NULL;
+    handle->device->msi_callback = NULL;
 
-    struct xen_pci_op op;
+    micropv_pci_completion_t op;
 
     op.cmd = XEN_PCI_OP_disable_msi;
-    op.domain = handle->device.domain;
-    op.bus = handle->device.bus;
-    op.devfn = PCI_DEVFN(handle->device.slot, handle->device.fun);
+    op.offset = op.size = 0;
+    op.value = 0;
 
     pci_op(handle, &op);
 
@@ -362,3 +765,208 @@ int micropv_pci_msi_disable(micropv_pci_handle_t *handle)
     return 0;
 }
 
+
+int micropv_pci_msix_enable(micropv_pci_handle_t *handle, const micropv_pci_msix_vector_t *vectors, int count)
+{
+    micropv_pci_device_t *device = handle->device;
+
+    if ((count <= 0) || (count > SIZEOF_ARRAY(device->msix)) || (count > SH_INFO_MAX_VEC))
+    {
+        PRINTK("invalid MSI-X vector count %i", count);
+        return -1;
+    }
+
+    if (device->msix_vectors)
+    {
+        PRINTK("MSI-X already enabled");
+        return -1;
+    }
+
+    // the upcall only runs on vcpu 0, an event sent to any other vcpu would never be seen
+    int i;
+    for (i = 0; i < count; i++)
+        if (vectors[i].cpu)
+        {
+            PRINTK("MSI-X entry %i can't go to vcpu %i, only vcpu 0 is supported", vectors[i].entry, vectors[i].cpu);
+            return -1;
+        }
+
+    memcpy(device->msix, vectors, count * sizeof(*vectors));
+
+    micropv_pci_completion_t op;
+
+    op.cmd = XEN_PCI_OP_enable_msix;
+    op.offset = op.size = 0;
+    op.value = count;
+    op.msix = device->msix;
+
+    pci_op(handle, &op);
+
+    if (op.err)
+    {
+        PRINTK("enable MSI-X failed with %i", op.err);
+        return op.err;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        micropv_pci_msix_vector_t *vector = &device->msix[i];
+
+        vector->count = 0;
+        vector->port = -1;
+        if (vector->pirq <= 0)
+        {
+            PRINTK("no physical IRQ for MSI-X entry %i", vector->entry);
+            goto fail;
+        }
+
+        // publish the vector before the port can fire
+        device->msix_vectors = i + 1;
+        wmb();
+
+        vector->port = xenevents_bind_pirq(vector->pirq, pci_msix_handler, device);
+        if (vector->port == -1)
+            goto fail;
+    }
+
+    return 0;
+
+fail:
+    micropv_pci_msix_disable(handle);
+    return -1;
+}
+
+int micropv_pci_msix_disable(micropv_pci_handle_t *handle)
+{
+    micropv_pci_device_t *device = handle->device;
+    int i;
+
+    for (i = 0; i < device->msix_vectors; i++)
+        if (device->msix[i].port != -1)
+            xenevents_close_channel(device->msix[i].port);
+    device->msix_vectors = 0;
+
+    micropv_pci_completion_t op;
+
+    op.cmd = XEN_PCI_OP_disable_msix;
+    op.offset = op.size = 0;
+    op.value = 0;
+
+    pci_op(handle, &op);
+
+    if (op.err)
+        return op.err;
+
+    return 0;
+}
+
+void micropv_pci_msix_mask(micropv_pci_handle_t *handle, int vector)
+{
+    if ((vector >= 0) && (vector < handle->device->msix_vectors))
+        xenevents_mask_channel(handle->device->msix[vector].port);
+}
+
+void micropv_pci_msix_unmask(micropv_pci_handle_t *handle, int vector)
+{
+    if ((vector >= 0) && (vector < handle->device->msix_vectors))
+        xenevents_unmask_channel(handle->device->msix[vector].port);
+}
+
+/* Write all ones to a BAR register, read back the size mask and put the old value back */
+static int pci_bar_mask(micropv_pci_handle_t *handle, unsigned int offset, unsigned int *value, unsigned int *mask)
+{
+    if (micropv_pci_conf_read(handle, offset, 4, value) ||
+        micropv_pci_conf_write(handle, offset, 4, 0xffffffff) ||
+        micropv_pci_conf_read(handle, offset, 4, mask) ||
+        micropv_pci_conf_write(handle, offset, 4, *value))
+    {
+        PRINTK("sizing BAR at %02x failed", offset);
+        return -1;
+    }
+
+    return 0;
+}
+
+int micropv_pci_decode_bar(micropv_pci_handle_t *handle, int bar, uint64_t *address, uint64_t *size)
+{
+    unsigned int offset = PCI_BASE_ADDRESS_0 + (bar << 2);
+    unsigned int low, low_mask, high = 0, high_mask = 0xffffffff;
+
+    // a bridge has two BARs, the registers after them are its bus numbers and windows
+    int bars = MICROPV_PCI_MAX_BARS;
+    if (pci_header_type(handle->device) == PCI_HEADER_TYPE_BRIDGE)
+        bars = PCI_BRIDGE_BARS;
+    else if (pci_header_type(handle->device) != PCI_HEADER_TYPE_NORMAL)
+        bars = 0;
+
+    if ((bar < 0) || (bar >= bars))
+        return -1;
+
+    if (pci_bar_mask(handle, offset, &low, &low_mask))
+        return -1;
+
+    if (low & PCI_BASE_ADDRESS_SPACE_IO)
+    {
+        PRINTK("BAR %i is an I/O BAR", bar);
+        return -1;
+    }
+
+    if ((low & PCI_BASE_ADDRESS_MEM_TYPE_MASK) == PCI_BASE_ADDRESS_MEM_TYPE_64)
+    {
+        if ((bar + 1) >= bars)
+            return -1;
+        if (pci_bar_mask(handle, offset + 4, &high, &high_mask))
+            return -1;
+    }
+
+    uint64_t mask = ((uint64_t)high_mask << 32) | (low_mask & PCI_BASE_ADDRESS_MEM_MASK);
+    *address = ((uint64_t)high << 32) | (low & PCI_BASE_ADDRESS_MEM_MASK);
+    *size = ~mask + 1;
+
+    if (!*address || !(low_mask & PCI_BASE_ADDRESS_MEM_MASK))
+    {
+        PRINTK("BAR %i is not assigned", bar);
+        return -1;
+    }
+
+    return 0;
+}
+
+void *micropv_pci_map_bar(micropv_pci_handle_t *handle, int bar, int cache, uint64_t *size)
+{
+    micropv_pci_device_t *device = handle->device;
+    uint64_t address, length;
+
+    if ((bar < 0) || (bar >= MICROPV_PCI_MAX_BARS))
+        return NULL;
+
+    if (!device->bar_virtual[bar])
+    {
+        if (micropv_pci_decode_bar(handle, bar, &address, &length))
+            return NULL;
+
+        // small BARs share a page with something else, so map whole pages and keep the offset
+        uint64_t offset = address & __PAGE_MASK;
+        int pages = (offset + length + __PAGE_SIZE - 1) >> __PAGE_SHIFT;
+
+        char *virtual = xenvmem_alloc(micropv_vmem_arena_mmio, pages, MICROPV_VMEM_GUARD);
+        if (!virtual)
+            return NULL;
+
+        if (xenmmu_map_io((uint64_t)virtual, address - offset, (size_t)pages << __PAGE_SHIFT,
+                          (cache == MICROPV_PCI_MAP_WC) ? _PAGE_CACHE_WC : _PAGE_CACHE_UC))
+        {
+            xenvmem_free(virtual);
+            return NULL;
+        }
+
+        device->bar_virtual[bar] = virtual + offset;
+        device->bar_size[bar] = length;
+        PRINTK("BAR %i at 0x%lx mapped to %p for 0x%lx bytes", bar, address, device->bar_virtual[bar], length);
+    }
+
+    if (size)
+        *size = device->bar_size[bar];
+
+    return device->bar_virtual[bar];
+}
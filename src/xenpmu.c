@@ -0,0 +1,237 @@
+/*  ***********************************************************************
+    * Project:
+    * File: xenpmu.c
+    * Author: smartin
+    ***********************************************************************
+
+    Hardware performance counters through the Xen vPMU. Xen has to be booted with vpmu=on for this to work.
+
+    XENPMU_init gives Xen a page where it keeps the PMU state for us, after that Xen emulates the PMU MSRs and
+    delivers counter interrupts on VIRQ_XENPMU. We only count, we never ask for an interrupt, so the handler just
+    clears any overflow status and flushes the cached state back with XENPMU_flush.
+
+    Only the Intel architectural PMU (CPUID leaf 0xa, version 2 or later) is programmed: the three fixed counters
+    for instructions, cycles and reference cycles, and three general counters for LLC references, LLC misses and
+    branch misses.
+
+    The counters run all the time. Per thread counts are kept by snapshotting the counters when a thread is switched
+    in and adding the difference to its context when it is switched out. The guest OS points micropv_perf_thread at
+    the context of the thread it is switching to from inside its scheduler callbacks and xenschedule notices the
+    change. Counters are narrower than 64 bits, differences are taken modulo their width.
+
+    Modifications
+    0.00 10/19/2026 created
+*/
+
+/*---------------------------------------------------------------------
+  -- macros (preamble)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- standard includes
+  ---------------------------------------------------------------------*/
+#include <stdint.h>
+#include <string.h>
+#include <xen/xen.h>
+#include <xen/pmu.h>
+
+/*---------------------------------------------------------------------
+  -- project includes (imports)
+  ---------------------------------------------------------------------*/
+#include "../micropv.h"
+#include "hypercall.h"
+#include "hypervisor.h"
+#include "os.h"
+#include "xenevents.h"
+#include "xenmmu.h"
+
+/*---------------------------------------------------------------------
+  -- project includes (exports)
+  ---------------------------------------------------------------------*/
+#include "xenpmu.h"
+
+/*---------------------------------------------------------------------
+  -- macros (postamble)
+  ---------------------------------------------------------------------*/
+#define MSR_PMC0                0x0c1
+#define MSR_PERFEVTSEL0         0x186
+#define MSR_FIXED_CTR0          0x309
+#define MSR_FIXED_CTR_CTRL      0x38d
+#define MSR_PERF_GLOBAL_STATUS  0x38e
+#define MSR_PERF_GLOBAL_CTRL    0x38f
+#define MSR_PERF_GLOBAL_OVF_CTRL 0x390
+
+#define EVTSEL_USR              (1 << 16)
+#define EVTSEL_OS               (1 << 17)
+#define EVTSEL_EN               (1 << 22)
+#define EVTSEL(_event, _umask)  ((_event) | ((_umask) << 8) | EVTSEL_USR | EVTSEL_OS | EVTSEL_EN)
+
+// count in rings 0 to 3 for each of the three fixed counters
+#define FIXED_CTRL_ALL          0x333
+
+#define PMU_FIXED               3
+#define PMU_GENERAL             3
+
+/*---------------------------------------------------------------------
+  -- forward declarations
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- data types
+  ---------------------------------------------------------------------*/
+typedef struct pmu_counter_t
+{
+    uint32_t msr;
+    uint64_t mask;
+} pmu_counter_t;
+
+/*---------------------------------------------------------------------
+  -- function prototypes
+  ---------------------------------------------------------------------*/
+static void pmu_handler(evtchn_port_t port, struct pt_regs *regs, void *data);
+
+/*---------------------------------------------------------------------
+  -- global variables
+  ---------------------------------------------------------------------*/
+micropv_perf_context_t *micropv_perf_thread = NULL;
+
+/*---------------------------------------------------------------------
+  -- local variables
+  ---------------------------------------------------------------------*/
+static struct xen_pmu_data *pmu_data = NULL;
+static evtchn_port_t pmu_port = -1;
+static pmu_counter_t pmu_counters[micropv_perf_events];
+
+// general counter event selects, in micropv_perf_event_t order after the fixed counters
+static const uint64_t pmu_general_events[PMU_GENERAL] =
+{
+    EVTSEL(0x2e, 0x4f),     // LLC references
+    EVTSEL(0x2e, 0x41),     // LLC misses
+    EVTSEL(0xc5, 0x00),     // branch misses retired
+};
+
+/*---------------------------------------------------------------------
+  -- implementation
+  ---------------------------------------------------------------------*/
+
+static void pmu_handler(evtchn_port_t port, struct pt_regs *regs, void *data)
+{
+    uint64_t status;
+    struct xen_pmu_params params;
+
+    // nothing asks for an interrupt, so just tidy up after whatever raised this one
+    rdmsrl(MSR_PERF_GLOBAL_STATUS, status);
+    if (status)
+        wrmsrl(MSR_PERF_GLOBAL_OVF_CTRL, status);
+
+    memset(&params, 0, sizeof(params));
+    params.version.maj = XENPMU_VER_MAJ;
+    params.version.min = XENPMU_VER_MIN;
+    HYPERVISOR_xenpmu_op(XENPMU_flush, &params);
+}
+
+static inline uint64_t pmu_read(micropv_perf_event_t event)
+{
+    uint64_t value;
+    rdmsrl(pmu_counters[event].msr, value);
+    return value;
+}
+
+int micropv_perf_init(void)
+{
+    struct xen_pmu_params params;
+    uint32_t eax, ebx, ecx, edx;
+    int i;
+
+    if (pmu_data)
+        return 0;
+
+    // we need version 2 for the global control and the fixed counters
+    cpuid(0, 0, eax, ebx, ecx, edx);
+    if ((ebx != 0x756e6547) || (eax < 0xa))
+    {
+        PRINTK("vPMU needs an Intel architectural PMU");
+        return -1;
+    }
+    cpuid(0xa, 0, eax, ebx, ecx, edx);
+    if (((eax & 0xff) < 2) || (((eax >> 8) & 0xff) < PMU_GENERAL) || ((edx & 0x1f) < PMU_FIXED))
+    {
+        PRINTK("vPMU version %u with %u counters isn't enough", eax & 0xff, (eax >> 8) & 0xff);
+        return -1;
+    }
+    uint64_t general_mask = (1UL << ((eax >> 16) & 0xff)) - 1;
+    uint64_t fixed_mask = (1UL << ((edx >> 5) & 0xff)) - 1;
+
+    // give xen the page it keeps our pmu state in
+    pmu_data = micropv_page_alloc(0);
+    if (!pmu_data)
+        return -1;
+    memset(pmu_data, 0, __PAGE_SIZE);
+
+    memset(&params, 0, sizeof(params));
+    params.version.maj = XENPMU_VER_MAJ;
+    params.version.min = XENPMU_VER_MIN;
+    params.val = virt_to_mfn(pmu_data);
+    params.vcpu = smp_processor_id();
+    int rc = HYPERVISOR_xenpmu_op(XENPMU_init, &params);
+    if (rc)
+    {
+        PRINTK("XENPMU_init returns %i, is xen booted with vpmu=on?", rc);
+        micropv_page_free(pmu_data, 0);
+        pmu_data = NULL;
+        return -1;
+    }
+
+    pmu_port = xenevents_bind_virq(VIRQ_XENPMU, pmu_handler);
+
+    // fixed counters: instructions, cycles, reference cycles
+    for (i = 0; i < PMU_FIXED; i++)
+    {
+        pmu_counters[micropv_perf_instructions + i].msr = MSR_FIXED_CTR0 + i;
+        pmu_counters[micropv_perf_instructions + i].mask = fixed_mask;
+    }
+    wrmsrl(MSR_FIXED_CTR_CTRL, FIXED_CTRL_ALL);
+
+    // general counters
+    for (i = 0; i < PMU_GENERAL; i++)
+    {
+        pmu_counters[micropv_perf_llc_references + i].msr = MSR_PMC0 + i;
+        pmu_counters[micropv_perf_llc_references + i].mask = general_mask;
+        wrmsrl(MSR_PERFEVTSEL0 + i, pmu_general_events[i]);
+    }
+
+    wrmsrl(MSR_PERF_GLOBAL_CTRL, ((1UL << PMU_FIXED) - 1) << 32 | ((1UL << PMU_GENERAL) - 1));
+    PRINTK("vPMU counting on port %i", pmu_port);
+    return 0;
+}
+
+void xenpmu_switch(micropv_perf_context_t *from, micropv_perf_context_t *to)
+{
+    int event;
+
+    if (!pmu_data)
+        return;
+
+    for (event = 0; event < micropv_perf_events; event++)
+    {
+        uint64_t now = pmu_read(event);
+
+        if (from)
+            from->count[event] += (now - from->start[event]) & pmu_counters[event].mask;
+        if (to)
+            to->start[event] = now;
+    }
+}
+
+uint64_t micropv_perf_read(micropv_perf_event_t event)
+{
+    if (!pmu_data || (event >= micropv_perf_events))
+        return 0;
+
+    uint64_t now = pmu_read(event);
+    micropv_perf_context_t *thread = micropv_perf_thread;
+    if (!thread)
+        return now;
+
+    return thread->count[event] + ((now - thread->start[event]) & pmu_counters[event].mask);
+}
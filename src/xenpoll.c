@@ -0,0 +1,223 @@
+/*  ***********************************************************************
+    * Project:
+    * File: xenpoll.c
+    * Author: smartin
+    ***********************************************************************
+
+    Poll mode for passthrough device queues. A queue starts out interrupt driven: its MSI-X vector masks itself and
+    switches the queue to polling, then the queue task calls micropv_pci_queue_poll until the device goes quiet. After
+    enough empty polls in a row the vector is unmasked and the task sleeps until the next interrupt, in the guest OS
+    wait hook if it has one, otherwise blocking the domain.
+
+    How many empty polls count as quiet depends on the traffic. The packet rate and the poll rate are sampled every
+    millisecond, and the queue keeps spinning for a few expected packet gaps before it gives up. At low rates there is
+    nothing to gain from spinning, so it goes back to interrupts straight away.
+
+    Modifications
+    0.00 10/19/2026 created
+*/
+
+/*---------------------------------------------------------------------
+  -- macros (preamble)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- standard includes
+  ---------------------------------------------------------------------*/
+#include <stdint.h>
+#include <string.h>
+
+/*---------------------------------------------------------------------
+  -- project includes (imports)
+  ---------------------------------------------------------------------*/
+#include "hypervisor.h"
+#include "xenevents.h"
+#include "../micropv.h"
+
+/*---------------------------------------------------------------------
+  -- project includes (exports)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- macros (postamble)
+  ---------------------------------------------------------------------*/
+#define POLL_WINDOW_NS          1000000ULL
+#define POLL_BUDGET             64
+#define POLL_MIN_IDLE           8
+#define POLL_MAX_IDLE           4096
+#define POLL_MIN_RATE           16
+#define POLL_IDLE_GAPS          4
+
+/*---------------------------------------------------------------------
+  -- forward declarations
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- data types
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- function prototypes
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- global variables
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- local variables
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- implementation
+  ---------------------------------------------------------------------*/
+
+static void queue_interrupt_mode(micropv_pci_queue_t *queue, int enable)
+{
+    if (queue->interrupt)
+        queue->interrupt(queue, enable);
+
+    if (enable)
+        micropv_pci_msix_unmask(queue->handle, queue->vector);
+    else
+        micropv_pci_msix_mask(queue->handle, queue->vector);
+}
+
+/* MSI-X handler, switch to polling and let the queue task pick it up */
+static void queue_msix_handler(int vector, void *context)
+{
+    micropv_pci_queue_t *queue = context;
+
+    queue->interrupts++;
+    queue_interrupt_mode(queue, 0);
+    queue->polling = 1;
+
+    if (queue->wake)
+        queue->wake(queue);
+}
+
+/* Sample the packet and poll rates and work out how long to spin before sleeping */
+static void queue_adapt(micropv_pci_queue_t *queue, uint64_t now)
+{
+    uint64_t elapsed = now - queue->window_start;
+    if (elapsed < POLL_WINDOW_NS)
+        return;
+
+    uint32_t rate = (queue->window_work * POLL_WINDOW_NS) / elapsed;
+    uint32_t poll_rate = (queue->window_polls * POLL_WINDOW_NS) / elapsed;
+
+    // smooth it a bit, a single quiet millisecond shouldn't undo a burst
+    queue->rate = (3 * queue->rate + rate) / 4;
+
+    if (queue->rate < POLL_MIN_RATE)
+        queue->idle_threshold = POLL_MIN_IDLE;
+    else
+    {
+        uint32_t threshold = (POLL_IDLE_GAPS * poll_rate) / queue->rate;
+        if (threshold < POLL_MIN_IDLE)
+            threshold = POLL_MIN_IDLE;
+        if (threshold > POLL_MAX_IDLE)
+            threshold = POLL_MAX_IDLE;
+        queue->idle_threshold = threshold;
+    }
+
+    queue->window_start = now;
+    queue->window_work = queue->window_polls = 0;
+}
+
+int micropv_pci_queue_init(micropv_pci_queue_t *queue, micropv_pci_handle_t *handle, int vector,
+                           int (*poll)(micropv_pci_queue_t *queue, int budget), void *context)
+{
+    if ((vector < 0) || (vector >= handle->device->msix_vectors))
+    {
+        PRINTK("MSI-X vector %i is not enabled", vector);
+        return -1;
+    }
+
+    memset(queue, 0, sizeof(*queue));
+    queue->handle = handle;
+    queue->vector = vector;
+    queue->poll = poll;
+    queue->context = context;
+    queue->budget = POLL_BUDGET;
+    queue->idle_threshold = POLL_MIN_IDLE;
+    queue->window_start = micropv_time_monotonic_clock();
+
+    // start with a poll in case the device already has work queued
+    queue->polling = 1;
+    queue_interrupt_mode(queue, 0);
+
+    micropv_pci_msix_vector_t *msix = &handle->device->msix[vector];
+    msix->context = queue;
+    wmb();
+    msix->handler = queue_msix_handler;
+
+    return 0;
+}
+
+int micropv_pci_queue_poll(micropv_pci_queue_t *queue)
+{
+    if (!queue->polling)
+        return 0;
+
+    int work = queue->poll(queue, queue->budget);
+
+    queue->polls++;
+    queue->window_polls++;
+    queue->window_work += work;
+    queue_adapt(queue, micropv_time_monotonic_clock());
+
+    if (work)
+    {
+        queue->idle_polls = 0;
+        return work;
+    }
+
+    queue->empty_polls++;
+    if (++queue->idle_polls < queue->idle_threshold)
+        return 0;
+
+    // quiet for long enough, go back to interrupts
+    queue->idle_polls = 0;
+    queue->polling = 0;
+    wmb();
+    queue_interrupt_mode(queue, 1);
+
+    // anything that came in before the unmask won't raise an interrupt, so look once more
+    work = queue->poll(queue, queue->budget);
+    if (work)
+    {
+        queue_interrupt_mode(queue, 0);
+        queue->polling = 1;
+        queue->window_work += work;
+    }
+
+    return work;
+}
+
+/* Sleep until the MSI-X handler switches the queue back to polling */
+static void queue_wait(micropv_pci_queue_t *queue)
+{
+    if (queue->wait)
+    {
+        queue->wait(queue);
+        return;
+    }
+
+    // events are off across the check so the interrupt can't slip in before the block, SCHEDOP_block turns them
+    // back on and returns straight away if one is pending
+    int flags = xenevents_save_disable();
+    if (!queue->polling && !queue->stop)
+        micropv_scheduler_block();
+    xenevents_restore(flags);
+}
+
+void micropv_pci_queue_run(micropv_pci_queue_t *queue)
+{
+    while (!queue->stop)
+    {
+        // idle, the other tasks run until the queue's event comes in
+        if (!micropv_pci_queue_poll(queue) && !queue->polling)
+            queue_wait(queue);
+    }
+}
@@ -0,0 +1,374 @@
+/*  ***********************************************************************
+    * Project:
+    * File: xenprintk.c
+    * Author: smartin
+    ***********************************************************************
+
+    Binary logging for PRINTK. Each PRINTK has a static site with its file, line and format. The first time a site
+    logs in binary its format is parsed once into the list of argument classes it takes off the va_list, and the
+    site gets an id. After that a call costs a walk over that list: the record is the id, the time and the raw
+    arguments, 8 bytes each, with strings copied in as they may not be around by the time the log is read.
+
+    The records go into a ring that drops the oldest records when it fills. A record never wraps, when it doesn't
+    fit before the end of the ring the rest is padded and the record starts again at the beginning. Reading the
+    log parses the format of the site again and formats each argument from the record with pformat_value.
+
+    Sites with more arguments than fit, and any site beyond the id table, are printed as text.
+
+    Modifications
+    0.00 10/19/2026 created
+*/
+
+/*---------------------------------------------------------------------
+  -- macros (preamble)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- standard includes
+  ---------------------------------------------------------------------*/
+#include <stdint.h>
+#include <string.h>
+
+/*---------------------------------------------------------------------
+  -- project includes (imports)
+  ---------------------------------------------------------------------*/
+#include "../micropv.h"
+#include "os.h"
+#include "psnprintf.h"
+#include "xenevents.h"
+
+/*---------------------------------------------------------------------
+  -- project includes (exports)
+  ---------------------------------------------------------------------*/
+#include "xenprintk.h"
+
+/*---------------------------------------------------------------------
+  -- macros (postamble)
+  ---------------------------------------------------------------------*/
+#define PRINTK_LOG_SIZE         (64 * 1024)
+#define PRINTK_SITES            1024
+#define PRINTK_STRING_MAX       64
+#define PRINTK_LINE_SIZE        256
+
+// the id of padding records and of sites that always print as text
+#define PRINTK_SITE_NONE        0
+#define PRINTK_SITE_TEXT        0xffff
+
+#define PRINTK_RECORD_MAX       (sizeof(printk_record_t) + MICROPV_PRINTK_MAX_ARGS * (PRINTK_STRING_MAX + 8))
+
+/*---------------------------------------------------------------------
+  -- forward declarations
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- data types
+  ---------------------------------------------------------------------*/
+typedef struct printk_record_t
+{
+    uint16_t site;
+    // whole record in bytes, always a multiple of 8
+    uint16_t size;
+    uint32_t reserved;
+    uint64_t time;
+    uint64_t data[];
+} printk_record_t;
+
+/*---------------------------------------------------------------------
+  -- function prototypes
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- global variables
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- local variables
+  ---------------------------------------------------------------------*/
+static int printk_binary = 0;
+static micropv_printk_site_t *printk_sites[PRINTK_SITES];
+static uint16_t printk_site_count = 0;
+
+static uint64_t printk_log[PRINTK_LOG_SIZE / sizeof(uint64_t)];
+static uint64_t printk_head = 0;
+static uint64_t printk_tail = 0;
+static uint64_t printk_dropped = 0;
+
+/*---------------------------------------------------------------------
+  -- implementation
+  ---------------------------------------------------------------------*/
+
+static void printk_site_register(micropv_printk_site_t *site)
+{
+    const char *format = site->format;
+    pformat_spec_t spec;
+    int count = 0;
+
+    // collect what every conversion takes off the va_list, in order
+    while ((format = strchr(format, '%')) != NULL)
+    {
+        format = pformat_parse(format + 1, &spec);
+        int class = pformat_class(&spec);
+        int needed = (spec.width == PFORMAT_VARIABLE) + (spec.precision == PFORMAT_VARIABLE) + (class != PFORMAT_CLASS_NONE);
+
+        if ((count + needed) > MICROPV_PRINTK_MAX_ARGS)
+        {
+            site->id = PRINTK_SITE_TEXT;
+            return;
+        }
+
+        if (spec.width == PFORMAT_VARIABLE)
+            site->classes[count++] = PFORMAT_CLASS_INT;
+        if (spec.precision == PFORMAT_VARIABLE)
+            site->classes[count++] = PFORMAT_CLASS_INT;
+        if (class != PFORMAT_CLASS_NONE)
+            site->classes[count++] = class;
+    }
+    site->count = count;
+
+    if (printk_site_count == (PRINTK_SITES - 1))
+    {
+        site->id = PRINTK_SITE_TEXT;
+        return;
+    }
+
+    site->id = ++printk_site_count;
+    printk_sites[site->id] = site;
+}
+
+static inline printk_record_t *printk_record(uint64_t offset)
+{
+    return (printk_record_t *)((uint8_t *)printk_log + (offset % PRINTK_LOG_SIZE));
+}
+
+static void printk_log_write(const printk_record_t *record)
+{
+    size_t to_end = PRINTK_LOG_SIZE - (printk_head % PRINTK_LOG_SIZE);
+    size_t needed = record->size + ((record->size > to_end) ? to_end : 0);
+
+    // make room by dropping the oldest records
+    while ((printk_head + needed - printk_tail) > PRINTK_LOG_SIZE)
+    {
+        printk_record_t *oldest = printk_record(printk_tail);
+        if (oldest->site != PRINTK_SITE_NONE)
+            printk_dropped++;
+        printk_tail += oldest->size;
+    }
+
+    // records don't wrap, pad out the end of the ring
+    if (record->size > to_end)
+    {
+        printk_record_t *pad = printk_record(printk_head);
+        pad->site = PRINTK_SITE_NONE;
+        pad->size = to_end;
+        printk_head += to_end;
+    }
+
+    memcpy(printk_record(printk_head), record, record->size);
+    printk_head += record->size;
+}
+
+static void printk_log_binary(micropv_printk_site_t *site, va_list args)
+{
+    uint64_t buffer[PRINTK_RECORD_MAX / sizeof(uint64_t)];
+    printk_record_t *record = (printk_record_t *)buffer;
+    uint64_t *data = record->data;
+    pformat_value_t value;
+    int i;
+
+    record->site = site->id;
+    record->reserved = 0;
+    record->time = micropv_time_monotonic_clock();
+
+    for (i = 0; i < site->count; i++)
+    {
+        switch (site->classes[i])
+        {
+        case PFORMAT_CLASS_INT:         *data++ = (int64_t)va_arg(args, int); break;
+        case PFORMAT_CLASS_LONG:        *data++ = va_arg(args, long); break;
+        case PFORMAT_CLASS_POINTER:     *data++ = (uintptr_t)va_arg(args, void *); break;
+        case PFORMAT_CLASS_DOUBLE:      value.d = va_arg(args, double); *data++ = value.u; break;
+        case PFORMAT_CLASS_LONG_DOUBLE: value.d = va_arg(args, long double); *data++ = value.u; break;
+
+        case PFORMAT_CLASS_STRING:
+        {
+            const char *str = va_arg(args, const char *);
+            size_t length;
+
+            if (!str)
+                str = "<null>";
+            length = pstrnlen(str, PRINTK_STRING_MAX);
+
+            // NUL terminated and padded out to whole words
+            memcpy(data, str, length);
+            ((char *)data)[length] = 0;
+            data += (length + sizeof(uint64_t)) / sizeof(uint64_t);
+            break;
+        }
+        }
+    }
+
+    record->size = (uint8_t *)data - (uint8_t *)record;
+
+    int flags = xenevents_save_disable();
+    printk_log_write(record);
+    xenevents_restore(flags);
+}
+
+static void printk_format_record(psink_t *sink, const printk_record_t *record)
+{
+    const micropv_printk_site_t *site = printk_sites[record->site];
+    const char *format = site->format;
+    const uint64_t *data = record->data;
+    pformat_spec_t spec;
+
+    psprintf_sink(sink, "%lu.%06lu %s@%.5li: ", record->time / 1000000000UL, (record->time / 1000UL) % 1000000UL, site->file, site->line);
+
+    while (*format)
+    {
+        const char *literal = format;
+        while (*format && (*format != '%'))
+            format++;
+        if (format != literal)
+            psink_write(sink, literal, format - literal);
+        if (!*format)
+            break;
+
+        format = pformat_parse(format + 1, &spec);
+
+        int width = (spec.width == PFORMAT_VARIABLE) ? (int)*data++ : spec.width;
+        int precision = (spec.precision == PFORMAT_VARIABLE) ? (int)*data++ : spec.precision;
+        pformat_value_t value;
+
+        switch (pformat_class(&spec))
+        {
+        case PFORMAT_CLASS_NONE:
+            value.u = 0;
+            break;
+
+        case PFORMAT_CLASS_STRING:
+            value.s = (const char *)data;
+            data += (strlen(value.s) + sizeof(uint64_t)) / sizeof(uint64_t);
+            break;
+
+        default:
+            value.u = *data++;
+            break;
+        }
+
+        // the place %n wrote to is long gone
+        if (spec.conversion != 'n')
+            pformat_value(sink, &spec, width, precision, value);
+    }
+
+    psink_write(sink, "\n", 1);
+}
+
+void micropv_printk_site(micropv_printk_site_t *site, const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+
+    // a format that isn't a literal has no site format and is always printed as text
+    if (printk_binary && site->format)
+    {
+        if (site->id == PRINTK_SITE_NONE)
+        {
+            int flags = xenevents_save_disable();
+            if (site->id == PRINTK_SITE_NONE)
+                printk_site_register(site);
+            xenevents_restore(flags);
+        }
+
+        if (site->id != PRINTK_SITE_TEXT)
+        {
+            printk_log_binary(site, args);
+            va_end(args);
+            return;
+        }
+    }
+
+    micropv_printkv(site->file, site->line, format, args);
+    va_end(args);
+}
+
+void micropv_printk_log_enable(int enable)
+{
+    printk_binary = enable;
+}
+
+size_t micropv_printk_log_read(char *buffer, size_t size)
+{
+    uint64_t record[PRINTK_RECORD_MAX / sizeof(uint64_t)];
+    char line[PRINTK_LINE_SIZE];
+    size_t used = 0;
+    uint64_t tail;
+    psink_t sink;
+
+    for (;;)
+    {
+        // take a copy of the oldest record so that logging can carry on while it is formatted
+        int flags = xenevents_save_disable();
+        while ((printk_tail != printk_head) && (printk_record(printk_tail)->site == PRINTK_SITE_NONE))
+            printk_tail += printk_record(printk_tail)->size;
+        if (printk_tail == printk_head)
+        {
+            xenevents_restore(flags);
+            break;
+        }
+        tail = printk_tail;
+        memcpy(record, printk_record(tail), printk_record(tail)->size);
+        xenevents_restore(flags);
+
+        // only whole lines. A line longer than the line buffer is cut short, the last byte is kept back so that
+        // it still ends in a line feed
+        psink_init(&sink, line, sizeof(line) - 1, NULL, NULL);
+        printk_format_record(&sink, (printk_record_t *)record);
+        if (!sink.used || (line[sink.used - 1] != '\n'))
+            line[sink.used++] = '\n';
+        if ((used + sink.used) > size)
+            break;
+        memcpy(buffer + used, line, sink.used);
+        used += sink.used;
+
+        // unless the writer has already dropped it to make room
+        flags = xenevents_save_disable();
+        if (printk_tail == tail)
+            printk_tail += ((printk_record_t *)record)->size;
+        xenevents_restore(flags);
+    }
+
+    return used;
+}
+
+void micropv_printk_log_dump(void)
+{
+    char buffer[PRINTK_LINE_SIZE];
+    size_t length;
+
+    // straight to the console, PRINTK may be logging into what we are reading
+    if (printk_dropped)
+        micropv_printk(__FILE__, __LINE__, "binary log dropped %lu records", printk_dropped);
+    printk_dropped = 0;
+
+    while ((length = micropv_printk_log_read(buffer, sizeof(buffer))) > 0)
+    {
+        const char *line = buffer;
+        const char *end = buffer + length;
+
+        while (line < end)
+        {
+            const char *lf = memchr(line, '\n', end - line);
+            if (!lf)
+                lf = end;
+            micropv_printk(__FILE__, __LINE__, "%.*s", (int)(lf - line), line);
+            line = lf + 1;
+        }
+    }
+}
+
+void xenprintk_dump(void)
+{
+    printk_binary = 0;
+    micropv_printk_log_dump();
+}
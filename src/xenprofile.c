@@ -0,0 +1,252 @@
+/*  ***********************************************************************
+    * Project:
+    * File: xenprofile.c
+    * Author: smartin
+    ***********************************************************************
+
+    Sampling profiler. The timer interrupt hands us the interrupted registers, and when a sample is due we record
+    the instruction pointer and the frame pointer chain above it.
+
+    Samples are folded as they are taken: each CPU has a small open addressed table of distinct call chains and a
+    count for each, so a long run doesn't need a long buffer. Chains that don't find a slot are counted as dropped.
+
+    The export is the folded stack format flamegraph.pl and friends read, one "outer;...;leaf count" line per chain.
+    Frames in our code are written as function names from the link time symbol table, anything else (the guest OS)
+    as hex addresses. Code built without frame pointers gives short chains.
+
+    Modifications
+    0.00 10/19/2026 created
+*/
+
+/*---------------------------------------------------------------------
+  -- macros (preamble)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- standard includes
+  ---------------------------------------------------------------------*/
+#include <stdint.h>
+#include <string.h>
+
+/*---------------------------------------------------------------------
+  -- project includes (imports)
+  ---------------------------------------------------------------------*/
+#include "../micropv.h"
+#include "os.h"
+#include "psnprintf.h"
+#include "xenevents.h"
+#include "xenunwind.h"
+
+/*---------------------------------------------------------------------
+  -- project includes (exports)
+  ---------------------------------------------------------------------*/
+#include "xenprofile.h"
+
+/*---------------------------------------------------------------------
+  -- macros (postamble)
+  ---------------------------------------------------------------------*/
+#define PROFILE_MAX_DEPTH       16
+#define PROFILE_ENTRIES         1024
+#define PROFILE_PROBES          8
+#define PROFILE_FRAME_SIZE      48
+#define PROFILE_COUNT_SIZE      24
+#define PROFILE_LINE_SIZE       (PROFILE_MAX_DEPTH * PROFILE_FRAME_SIZE + PROFILE_COUNT_SIZE)
+
+/*---------------------------------------------------------------------
+  -- forward declarations
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- data types
+  ---------------------------------------------------------------------*/
+typedef struct profile_entry_t
+{
+    uint64_t count;
+    uint64_t depth;
+    // leaf first
+    uint64_t ip[PROFILE_MAX_DEPTH];
+} profile_entry_t;
+
+typedef struct profile_cpu_t
+{
+    uint64_t next_sample;
+    uint64_t samples;
+    uint64_t dropped;
+    profile_entry_t entries[PROFILE_ENTRIES];
+} profile_cpu_t;
+
+/*---------------------------------------------------------------------
+  -- function prototypes
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- global variables
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- local variables
+  ---------------------------------------------------------------------*/
+static uint64_t profile_period = 0;
+static profile_cpu_t profile_cpus[NR_CPUS];
+
+/*---------------------------------------------------------------------
+  -- implementation
+  ---------------------------------------------------------------------*/
+
+static uint64_t profile_hash(const uint64_t *ips, size_t depth)
+{
+    uint64_t hash = 14695981039346656037UL;
+    size_t i;
+
+    for (i = 0; i < depth; i++)
+        hash = (hash ^ ips[i]) * 1099511628211UL;
+
+    return hash ^ (hash >> 29);
+}
+
+void xenprofile_tick(struct pt_regs *regs, uint64_t now)
+{
+    profile_cpu_t *cpu = &profile_cpus[smp_processor_id()];
+    uint64_t ips[PROFILE_MAX_DEPTH];
+
+    if (!profile_period || (now < cpu->next_sample))
+        return;
+
+    // don't try to catch up after a long gap
+    cpu->next_sample += profile_period;
+    if (cpu->next_sample <= now)
+        cpu->next_sample = now + profile_period;
+
+    ips[0] = regs->ip;
+    size_t depth = 1 + xenunwind_walk(regs->bp, regs->sp, ips + 1, PROFILE_MAX_DEPTH - 1);
+    uint64_t hash = profile_hash(ips, depth);
+    cpu->samples++;
+
+    int probe;
+    for (probe = 0; probe < PROFILE_PROBES; probe++)
+    {
+        profile_entry_t *entry = &cpu->entries[(hash + probe) & (PROFILE_ENTRIES - 1)];
+
+        if (!entry->count)
+        {
+            entry->count = 1;
+            entry->depth = depth;
+            memcpy(entry->ip, ips, depth * sizeof(uint64_t));
+            return;
+        }
+
+        if ((entry->depth == depth) && !memcmp(entry->ip, ips, depth * sizeof(uint64_t)))
+        {
+            entry->count++;
+            return;
+        }
+    }
+
+    cpu->dropped++;
+}
+
+void micropv_profile_start(uint64_t period)
+{
+    int flags = xenevents_save_disable();
+    uint64_t now = micropv_time_monotonic_clock();
+    int cpu;
+
+    for (cpu = 0; cpu < NR_CPUS; cpu++)
+    {
+        memset(&profile_cpus[cpu], 0, sizeof(profile_cpus[cpu]));
+        profile_cpus[cpu].next_sample = now + period;
+    }
+    profile_period = period;
+
+    xenevents_restore(flags);
+}
+
+void micropv_profile_stop(void)
+{
+    profile_period = 0;
+}
+
+static int profile_format(const profile_entry_t *entry, char *line)
+{
+    // keep room for the count, a chain of long names loses its innermost frames
+    int room = PROFILE_LINE_SIZE - PROFILE_COUNT_SIZE;
+    int length = 0;
+    int i;
+
+    // folded stacks run from the outermost frame to the leaf
+    for (i = entry->depth - 1; i >= 0; i--)
+    {
+        const char *name = xenunwind_symbol(entry->ip[i], NULL);
+        int frame;
+        if (name)
+            frame = psnprintf(line + length, room - length, "%s%s", name, i ? ";" : "");
+        else
+            frame = psnprintf(line + length, room - length, "0x%lx%s", entry->ip[i], i ? ";" : "");
+
+        // psnprintf returns what it would have written, so a frame that doesn't fit ends the chain
+        if (length + frame >= room)
+        {
+            if (length)
+                length--;
+            break;
+        }
+        length += frame;
+    }
+
+    length += psnprintf(line + length, PROFILE_LINE_SIZE - length, " %lu\n", entry->count);
+    return length;
+}
+
+size_t micropv_profile_export(char *buffer, size_t size)
+{
+    char line[PROFILE_LINE_SIZE];
+    size_t used = 0;
+    int cpu, i;
+
+    if (size)
+        buffer[0] = 0;
+
+    for (cpu = 0; cpu < NR_CPUS; cpu++)
+    {
+        for (i = 0; i < PROFILE_ENTRIES; i++)
+        {
+            // copy the entry so the timer can keep counting
+            int flags = xenevents_save_disable();
+            profile_entry_t entry = profile_cpus[cpu].entries[i];
+            xenevents_restore(flags);
+
+            if (!entry.count)
+                continue;
+
+            int length = profile_format(&entry, line);
+            if (used + length + 1 > size)
+                return used;
+
+            memcpy(buffer + used, line, length + 1);
+            used += length;
+        }
+    }
+
+    return used;
+}
+
+void micropv_profile_dump(void)
+{
+    char line[PROFILE_LINE_SIZE];
+    int cpu, i;
+
+    for (cpu = 0; cpu < NR_CPUS; cpu++)
+    {
+        PRINTK("cpu %i: %lu samples, %lu dropped", cpu, profile_cpus[cpu].samples, profile_cpus[cpu].dropped);
+
+        for (i = 0; i < PROFILE_ENTRIES; i++)
+        {
+            int flags = xenevents_save_disable();
+            profile_entry_t entry = profile_cpus[cpu].entries[i];
+            xenevents_restore(flags);
+
+            if (entry.count)
+                micropv_console_write(line, profile_format(&entry, line));
+        }
+    }
+}
@@ -36,6 +36,8 @@
 #include "xentime.h"
 #include "xenevents.h"
 #include "../micropv.h"
+#include "xenprofile.h"
+#include "xenpmu.h"
 
 /*---------------------------------------------------------------------
   -- project includes (exports)
@@ -100,9 +102,15 @@ static void yield_handler(uint32_t port, struct pt_regs *regs, void *context)
         unsigned long sp = regs->sp;
         unsigned long ss = regs->ss;
 
+        micropv_perf_context_t *perf_thread = micropv_perf_thread;
+
         // call handler
         micropv_scheduler_yield_callback(regs);
 
+        // the counts follow the thread
+        if (perf_thread != micropv_perf_thread)
+            xenpmu_switch(perf_thread, micropv_perf_thread);
+
         // if the timer irq changed the stack then apply the changes
         if ((sp != regs->sp) || (ss != regs->ss))
         {
@@ -131,14 +139,22 @@ static void timer_handler(evtchn_port_t ev, struct pt_regs *regs, void *ign)
     // housekeeping
     xentime_update();
 
+    // sample the interrupted code before the guest OS gets to switch context
+    xenprofile_tick(regs, micropv_time_monotonic_clock());
+
     // store the current stack data
     unsigned long sp = regs->sp;
     unsigned long ss = regs->ss;
+    micropv_perf_context_t *perf_thread = micropv_perf_thread;
 
     // call the guest OS handler. The guest returns the time to the next interrupt,
     // and will alter the register file if it want's to perform a context switch.
     timer_period = (micropv_scheduler_timer_callback ? micropv_scheduler_timer_callback : scheduler_timer_dummy)(regs, deadline);
 
+    // the counts follow the thread
+    if (perf_thread != micropv_perf_thread)
+        xenpmu_switch(perf_thread, micropv_perf_thread);
+
     // if the timer irq changed the stack then apply the changes
     if ((sp != regs->sp) || (ss != regs->ss))
     {
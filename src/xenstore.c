@@ -36,10 +36,29 @@
   -- macros
   ---------------------------------------------------------------------*/
 #define XENSTORE_IO_ACTIVE 1
+#define XENSTORE_BINARY_ACTIVE 2
+
+// XS_DIRECTORY_PART is not in the older xs_wire.h (Xen < 4.9) so we carry the wire value ourselves
+#define XENSTORE_DIRECTORY_PART 22
+
+#define XENSTORE_MAX_WATCHES 8
+#define XENSTORE_WATCH_PATH 64
+#define XENSTORE_WATCH_EVENT_SIZE (XENSTORE_WATCH_PATH + 16)
+
+#define XENSTORE_HEX_LENGTH(x) ((x) * 2)
+#define XENSTORE_BASE64_LENGTH(x) ((((x) + 2) / 3) * 4)
 
 /*---------------------------------------------------------------------
   -- data types
   ---------------------------------------------------------------------*/
+typedef struct xenstore_watch_t
+{
+    char path[XENSTORE_WATCH_PATH];
+    char token[8];
+    micropv_registry_watch_t callback;
+    void *context;
+    volatile int pending;
+} xenstore_watch_t;
 
 /*---------------------------------------------------------------------
   -- function prototypes
@@ -59,6 +78,10 @@ static char hypervisor_domid[6];
 static evtchn_port_t port = -1;
 static volatile int xenstore_event_fired = 0;
 static xenbus_transaction_t current_xbt = 0;
+static xenstore_watch_t xenstore_watches[XENSTORE_MAX_WATCHES];
+static int xenstore_watch_count = 0;
+// encoded form of the binary values, too big for a task stack. Owned by whoever set XENSTORE_BINARY_ACTIVE
+static char xenstore_binary[XENSTORE_PAYLOAD_MAX + 1];
 
 /*---------------------------------------------------------------------
   -- private functions
@@ -81,34 +104,34 @@ static inline evtchn_port_t xenstore_event(void)
 /* Write a request to the back end */
 static int xenstore_write_request(const char *message, int length)
 {
-    /* Check that the message will fit */
-    if(length > XENSTORE_RING_SIZE)
-        return -1;
-
     struct xenstore_domain_interface *xenstore = xenstore_interface();
     volatile XENSTORE_RING_IDX *head = &xenstore->req_cons;
-    XENSTORE_RING_IDX tail = MASK_XENSTORE_IDX(xenstore->req_prod);
+    XENSTORE_RING_IDX tail = xenstore->req_prod;
 
-    int i;
-    for (i = 0; i < length; i++)
+    // the indexes run freely and are only masked to address the ring, so a request
+    // bigger than the ring goes out a ring full at a time
+    int i = 0;
+    while (i < length)
     {
-        // wait for space available
-        XENSTORE_RING_IDX next_tail = MASK_XENSTORE_IDX(tail + 1);
-        while (next_tail == *head)
-            mb();
+        // wait for space available, letting the back end at what is already there
+        if ((tail - *head) >= XENSTORE_RING_SIZE)
+        {
+            xenevents_notify_remote_via_evtchn(xenstore_event());
+            while ((tail - *head) >= XENSTORE_RING_SIZE)
+                mb();
+        }
 
         // store data
-        xenstore->req[tail] = message[i];
-        tail = next_tail;
-    }
+        mb();
+        while ((i < length) && ((tail - *head) < XENSTORE_RING_SIZE))
+            xenstore->req[MASK_XENSTORE_IDX(tail++)] = message[i++];
 
-    /* Ensure that the data really is in the ring before continuing */
-    wmb();
+        /* Ensure that the data really is in the ring before continuing */
+        wmb();
 
-    // update the index
-    // XENSTORE doesn't really handle this as a circular buffer, as on ring roll over it
-    // stalls if tail < req_prod
-    xenstore->req_prod += length;
+        // update the index
+        xenstore->req_prod = tail;
+    }
 
     // return success
     return 0;
@@ -119,51 +142,99 @@ static int _xenstore_read_response(char * message, int length)
 {
     struct xenstore_domain_interface *xenstore = xenstore_interface();
     volatile XENSTORE_RING_IDX *tail = &xenstore->rsp_prod;
-    XENSTORE_RING_IDX head = MASK_XENSTORE_IDX(xenstore->rsp_cons);
+    XENSTORE_RING_IDX head = xenstore->rsp_cons;
 
     memset(message, 0xff, length);
 
-    int i;
-    for (i = 0; i < length; i++)
+    int i = 0;
+    while (i < length)
     {
         /* Wait for the back end put data in the buffer */
-        while (head == MASK_XENSTORE_IDX(*tail))
+        while (head == *tail)
             mb();
+        rmb();
+
+        // a full ring means the back end is waiting for space
+        int full = (*tail - head) >= XENSTORE_RING_SIZE;
 
         // read data
-        message[i] = xenstore->rsp[head];
-        head = MASK_XENSTORE_IDX(head + 1);
+        while ((i < length) && (head != *tail))
+            message[i++] = xenstore->rsp[MASK_XENSTORE_IDX(head++)];
+
+        // update the index as we go, a response can be bigger than the ring
+        mb();
+        xenstore->rsp_cons = head;
+        if (full)
+            xenevents_notify_remote_via_evtchn(xenstore_event());
     }
 
-    // update the index
-    xenstore->rsp_cons += length;
-
     return 0;
 }
 
+/* Read the payload of a watch event (path, token) and flag the watch */
+static void xenstore_watch_event(size_t length)
+{
+    char event[XENSTORE_WATCH_EVENT_SIZE + 1];
+    size_t event_length = MIN(length, sizeof(event) - 1);
+
+    _xenstore_read_response(event, event_length);
+    event[event_length] = 0;
+
+    char discard[16];
+    for (length -= event_length; length; length -= event_length)
+    {
+        event_length = MIN(length, sizeof(discard));
+        _xenstore_read_response(discard, event_length);
+    }
+
+    const char *token = event + strlen(event) + 1;
+    if (token >= event + sizeof(event))
+        return;
+
+    int i;
+    for (i = 0; i < xenstore_watch_count; i++)
+        if (!strcmp(xenstore_watches[i].token, token))
+            xenstore_watches[i].pending = 1;
+}
+
 static int xenstore_read_response(char *response, size_t response_size, size_t *response_length)
 {
     // make sure that the command was notified
     xenevents_notify_remote_via_evtchn(xenstore_event());
 
-    // read the response header
+    // read the response header. Watch events can come in at any time, so put them aside until we get ours
     struct xsd_sockmsg msg = { 0 };
     _xenstore_read_response((char *)&msg, sizeof(msg));
+    while (msg.type == XS_WATCH_EVENT)
+    {
+        xenstore_watch_event(msg.len);
+        _xenstore_read_response((char *)&msg, sizeof(msg));
+    }
 
     // read any response data
     if (msg.len > 0)
     {
         // read the requested response
-        register size_t length = MIN(MASK_XENSTORE_IDX(msg.len), response_size);
+        register size_t length = MIN(msg.len, response_size);
         if (response_length)
             *response_length = length;
         _xenstore_read_response(response, length);
 
-        // read the remainder
+        // read the remainder. A payload can be bigger than the dump buffer (large directories), so we only
+        // keep the first part for the error report and throw the rest away
         if (response_size < msg.len)
         {
-            _xenstore_read_response(xenstore_dump, msg.len - response_size);
-            xenstore_dump[msg.len - response_size] = 0;
+            size_t remainder = msg.len - length;
+            size_t dump_length = MIN(remainder, sizeof(xenstore_dump) - 1);
+            _xenstore_read_response(xenstore_dump, dump_length);
+            xenstore_dump[dump_length] = 0;
+
+            char discard[64];
+            for (remainder -= dump_length; remainder; remainder -= dump_length)
+            {
+                dump_length = MIN(remainder, sizeof(discard));
+                _xenstore_read_response(discard, dump_length);
+            }
         }
     }
 
@@ -314,6 +385,14 @@ int xenstore_write(xenbus_transaction_t xbt, const char *key, const char *value)
     int rc = 0;
     int key_length = strlen(key) + 1;
     int value_length = strlen(value);
+
+    // the back end refuses anything bigger, so don't send a partial message it has to skip
+    if (key_length + value_length > XENSTORE_PAYLOAD_MAX)
+    {
+        PRINTK("ERROR %s too big (%i)", key, key_length + value_length);
+        return -1;
+    }
+
     struct xsd_sockmsg msg;
     msg.type = XS_WRITE;
     msg.req_id = xenstore_request(xbt);
@@ -422,6 +501,33 @@ int xenstore_ls(xenbus_transaction_t xbt, const char * key, char *values, size_t
     return rc;
 }
 
+int xenstore_ls_part(xenbus_transaction_t xbt, const char *key, size_t offset, char *values, size_t value_size, size_t *value_length)
+{
+    int rc = 0;
+    int key_length = strlen(key) + 1;
+    char offset_value[24];
+    int offset_length = psnprintf(offset_value, sizeof(offset_value), "%lu", offset) + 1;
+    struct xsd_sockmsg msg;
+    msg.type = XENSTORE_DIRECTORY_PART;
+    msg.req_id = xenstore_request(xbt);
+    msg.tx_id = xbt;
+    msg.len = key_length + offset_length;
+
+    if (((rc = xenstore_write_request((char *)&msg, sizeof(msg))) != 0) ||
+        ((rc = xenstore_write_request(key, key_length)) != 0) ||
+        ((rc = xenstore_write_request(offset_value, offset_length)) != 0))
+    {
+        PRINTK("error sending ls part");
+        goto fail;
+    }
+    rc = xenstore_read_response(values, value_size, value_length);
+
+    fail:
+        xenstore_release();
+
+    return rc;
+}
+
 int xenstore_transaction_start(xenbus_transaction_t *xbt)
 {
     int rc = 0;
@@ -511,6 +617,102 @@ int xenstore_rm(xenbus_transaction_t xbt, const char *path)
     return rc;
 }
 
+int xenstore_watch(const char *path, micropv_registry_watch_t callback, void *context)
+{
+    if ((xenstore_watch_count == XENSTORE_MAX_WATCHES) || (strlen(path) >= XENSTORE_WATCH_PATH))
+    {
+        PRINTK("can't watch %s", path);
+        return -1;
+    }
+
+    // set it up before asking, the first event comes straight away
+    xenstore_watch_t *watch = &xenstore_watches[xenstore_watch_count];
+    strcpy(watch->path, path);
+    psnprintf(watch->token, sizeof(watch->token), "w%i", xenstore_watch_count);
+    watch->callback = callback;
+    watch->context = context;
+    watch->pending = 0;
+    xenstore_watch_count++;
+
+    int rc = 0;
+    int path_length = strlen(path) + 1;
+    int token_length = strlen(watch->token) + 1;
+    struct xsd_sockmsg msg;
+    msg.type = XS_WATCH;
+    msg.req_id = xenstore_request(XBT_NIL);
+    msg.tx_id = XBT_NIL;
+    msg.len = path_length + token_length;
+
+    /* Write the message */
+    if (((rc = xenstore_write_request((char *)&msg, sizeof(msg))) != 0) ||
+        ((rc = xenstore_write_request(path, path_length)) != 0) ||
+        ((rc = xenstore_write_request(watch->token, token_length)) != 0))
+    {
+        PRINTK("Error writing message in %s", __FUNCTION__);
+        goto fail;
+    }
+    rc = xenstore_read_response(NULL, 0, NULL);
+
+    fail:
+        xenstore_release();
+
+    if (rc)
+        xenstore_watch_count--;
+
+    return rc;
+}
+
+int xenstore_poll_watches(void)
+{
+    struct xenstore_domain_interface *xenstore = xenstore_interface();
+    int i, fired = 0;
+
+    // pick up events that came in while nobody was waiting for a response
+    micropv_interrupt_disable();
+    if (!(xenstore_flags & XENSTORE_IO_ACTIVE) && (xenstore->rsp_cons != xenstore->rsp_prod))
+    {
+        xenstore_flags |= XENSTORE_IO_ACTIVE;
+        micropv_interrupt_enable();
+
+        while (xenstore->rsp_cons != xenstore->rsp_prod)
+        {
+            struct xsd_sockmsg msg = { 0 };
+            _xenstore_read_response((char *)&msg, sizeof(msg));
+            if (msg.type == XS_WATCH_EVENT)
+                xenstore_watch_event(msg.len);
+            else
+            {
+                PRINTK("unexpected message type %i with no request", msg.type);
+                char discard[16];
+                size_t length;
+                for (; msg.len; msg.len -= length)
+                {
+                    length = MIN(msg.len, sizeof(discard));
+                    _xenstore_read_response(discard, length);
+                }
+            }
+        }
+
+        xenstore_release();
+    }
+    else
+        micropv_interrupt_enable();
+
+    // the callbacks can use the xenstore, so they run once the ring is free
+    for (i = 0; i < xenstore_watch_count; i++)
+    {
+        xenstore_watch_t *watch = &xenstore_watches[i];
+        if (watch->pending)
+        {
+            watch->pending = 0;
+            watch->callback(watch->path, watch->context);
+            fired++;
+        }
+    }
+
+    return fired;
+}
+
 static void xenstore_event_handler(evtchn_port_t port, struct pt_regs *regs, void *data)
 {
     micropv_interrupt_disable();
@@ -583,6 +785,258 @@ int xenstore_read_integer(xenbus_transaction_t xbt, const char *path, int32_t *v
     return rc;
 }
 
+int xenstore_write_int64(xenbus_transaction_t xbt, const char *path, int64_t value)
+{
+    int rc = -1;
+    char data_value[24];
+
+    psnprintf(data_value, sizeof(data_value), "%li", value);
+    if (xenstore_write(xbt, path, data_value))
+        PRINTK("xenstore_write %s fails %s", path, xenstore_dump);
+    else
+        rc = 0;
+
+    return rc;
+}
+
+int xenstore_read_int64(xenbus_transaction_t xbt, const char *path, int64_t *value)
+{
+    int rc = -1;
+    char data_value[24] = {0};
+    size_t data_length = 0;
+
+    // check this is there
+    if (xenstore_read(xbt, path, data_value, sizeof(data_value) - 1, &data_length))
+        PRINTK("xenstore_read %s fails %s", path, xenstore_dump);
+    else
+    {
+        *value = strtoll(data_value, NULL, 10);
+        rc = 0;
+    }
+
+    return rc;
+}
+
+int xenstore_write_uint64(xenbus_transaction_t xbt, const char *path, uint64_t value)
+{
+    int rc = -1;
+    char data_value[24];
+
+    psnprintf(data_value, sizeof(data_value), "%lu", value);
+    if (xenstore_write(xbt, path, data_value))
+        PRINTK("xenstore_write %s fails %s", path, xenstore_dump);
+    else
+        rc = 0;
+
+    return rc;
+}
+
+int xenstore_read_uint64(xenbus_transaction_t xbt, const char *path, uint64_t *value)
+{
+    int rc = -1;
+    char data_value[24] = {0};
+    size_t data_length = 0;
+
+    // check this is there
+    if (xenstore_read(xbt, path, data_value, sizeof(data_value) - 1, &data_length))
+        PRINTK("xenstore_read %s fails %s", path, xenstore_dump);
+    else
+    {
+        *value = strtoull(data_value, NULL, 10);
+        rc = 0;
+    }
+
+    return rc;
+}
+
+static size_t xenstore_encode_hex(char *output, const uint8_t *data, size_t data_length)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t i, o;
+
+    for (i = 0, o = 0; i < data_length; i++)
+    {
+        output[o++] = hex[data[i] >> 4];
+        output[o++] = hex[data[i] & 0xf];
+    }
+    output[o] = 0;
+
+    return o;
+}
+
+static int xenstore_hex_digit(char c)
+{
+    if ((c >= '0') && (c <= '9')) return c - '0';
+    if ((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+    if ((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
+    return -1;
+}
+
+static int xenstore_decode_hex(uint8_t *output, size_t output_size, const char *input, size_t input_length, size_t *output_length)
+{
+    size_t i, o;
+
+    if (input_length & 1)
+        return -1;
+
+    for (i = 0, o = 0; (i < input_length) && (o < output_size); i += 2)
+    {
+        int high = xenstore_hex_digit(input[i]);
+        int low = xenstore_hex_digit(input[i + 1]);
+        if ((high < 0) || (low < 0))
+            return -1;
+        output[o++] = (high << 4) | low;
+    }
+    *output_length = o;
+
+    // report truncation the same way as xenstore_read
+    return (i < input_length) ? 1 : 0;
+}
+
+static const char xenstore_base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static size_t xenstore_encode_base64(char *output, const uint8_t *data, size_t data_length)
+{
+    size_t i, o;
+
+    for (i = 0, o = 0; i < data_length; i += 3)
+    {
+        uint32_t block = data[i] << 16;
+        if (i + 1 < data_length) block |= data[i + 1] << 8;
+        if (i + 2 < data_length) block |= data[i + 2];
+
+        output[o++] = xenstore_base64[(block >> 18) & 0x3f];
+        output[o++] = xenstore_base64[(block >> 12) & 0x3f];
+        output[o++] = (i + 1 < data_length) ? xenstore_base64[(block >> 6) & 0x3f] : '=';
+        output[o++] = (i + 2 < data_length) ? xenstore_base64[block & 0x3f] : '=';
+    }
+    output[o] = 0;
+
+    return o;
+}
+
+static int xenstore_base64_digit(char c)
+{
+    if ((c >= 'A') && (c <= 'Z')) return c - 'A';
+    if ((c >= 'a') && (c <= 'z')) return c - 'a' + 26;
+    if ((c >= '0') && (c <= '9')) return c - '0' + 52;
+    if (c == '+') return 62;
+    if (c == '/') return 63;
+    return -1;
+}
+
+static int xenstore_decode_base64(uint8_t *output, size_t output_size, const char *input, size_t input_length, size_t *output_length)
+{
+    size_t i, o;
+
+    if (input_length & 3)
+        return -1;
+
+    for (i = 0, o = 0; i < input_length; i += 4)
+    {
+        int bytes = (input[i + 2] == '=') ? 1 : (input[i + 3] == '=') ? 2 : 3;
+        uint32_t block = 0;
+        int j;
+        for (j = 0; j < bytes + 1; j++)
+        {
+            int digit = xenstore_base64_digit(input[i + j]);
+            if (digit < 0)
+                return -1;
+            block |= digit << (18 - (j * 6));
+        }
+
+        for (j = 0; j < bytes; j++)
+        {
+            if (o >= output_size)
+            {
+                *output_length = o;
+                return 1;
+            }
+            output[o++] = block >> (16 - (j * 8));
+        }
+    }
+    *output_length = o;
+
+    return 0;
+}
+
+static void xenstore_binary_acquire(void)
+{
+    // wait for the other user of the encoding buffer to finish
+    micropv_interrupt_disable();
+    while (xenstore_flags & XENSTORE_BINARY_ACTIVE)
+    {
+        micropv_interrupt_enable();
+        micropv_interrupt_disable();
+    }
+    xenstore_flags |= XENSTORE_BINARY_ACTIVE;
+    micropv_interrupt_enable();
+}
+
+static void xenstore_binary_release(void)
+{
+    micropv_interrupt_disable();
+    xenstore_flags &= ~XENSTORE_BINARY_ACTIVE;
+    micropv_interrupt_enable();
+}
+
+int xenstore_write_binary(xenbus_transaction_t xbt, const char *path, const void *data, size_t data_length, micropv_registry_encoding_t encoding)
+{
+    int rc = -1;
+    size_t encoded_length = (encoding == micropv_registry_encoding_base64) ? XENSTORE_BASE64_LENGTH(data_length) : XENSTORE_HEX_LENGTH(data_length);
+
+    // the xenstore won't take anything bigger than a payload so don't blow the stack trying
+    if (encoded_length + strlen(path) + 1 > XENSTORE_PAYLOAD_MAX)
+    {
+        PRINTK("xenstore_write %s too big (%lu bytes)", path, data_length);
+        return rc;
+    }
+
+    xenstore_binary_acquire();
+    if (encoding == micropv_registry_encoding_base64)
+        xenstore_encode_base64(xenstore_binary, data, data_length);
+    else
+        xenstore_encode_hex(xenstore_binary, data, data_length);
+
+    if (xenstore_write(xbt, path, xenstore_binary))
+        PRINTK("xenstore_write %s fails %s", path, xenstore_dump);
+    else
+        rc = 0;
+    xenstore_binary_release();
+
+    return rc;
+}
+
+int xenstore_read_binary(xenbus_transaction_t xbt, const char *path, void *data, size_t data_size, size_t *data_length, micropv_registry_encoding_t encoding)
+{
+    int rc = -1;
+    size_t encoded_size = (encoding == micropv_registry_encoding_base64) ? XENSTORE_BASE64_LENGTH(data_size) : XENSTORE_HEX_LENGTH(data_size);
+    size_t value_length = 0;
+
+    *data_length = 0;
+
+    // check this is there
+    xenstore_binary_acquire();
+    int read_rc = xenstore_read(xbt, path, xenstore_binary, MIN(encoded_size, XENSTORE_PAYLOAD_MAX), &value_length);
+    if (read_rc < 0)
+        PRINTK("xenstore_read %s fails %s", path, xenstore_dump);
+    else
+    {
+        if (encoding == micropv_registry_encoding_base64)
+            rc = xenstore_decode_base64(data, data_size, xenstore_binary, value_length, data_length);
+        else
+            rc = xenstore_decode_hex(data, data_size, xenstore_binary, value_length, data_length);
+
+        if (rc < 0)
+            PRINTK("xenstore_read %s invalid encoding", path);
+        else if (read_rc)
+            rc = read_rc;
+    }
+    xenstore_binary_release();
+
+    return rc;
+}
+
 int micropv_is_shutdown(xenbus_transaction_t xbt)
 {
     const char *path = "control/shutdown";
@@ -619,8 +1073,177 @@ int micropv_registry_write_integer(xenbus_transaction_t xbt, const char *path, i
     return xenstore_write_integer(xbt, path, value);
 }
 
+int micropv_registry_watch(const char *path, micropv_registry_watch_t callback, void *context)
+{
+    return xenstore_watch(path, callback, context);
+}
+
+int micropv_registry_poll_watches(void)
+{
+    return xenstore_poll_watches();
+}
+
 int micropv_registry_rm(xenbus_transaction_t xbt, const char *path)
 {
     return xenstore_rm(xbt, path);
 }
 
+
+int micropv_registry_read_int64(xenbus_transaction_t xbt, const char *path, int64_t *value)
+{
+    return xenstore_read_int64(xbt, path, value);
+}
+
+int micropv_registry_write_int64(xenbus_transaction_t xbt, const char *path, int64_t value)
+{
+    return xenstore_write_int64(xbt, path, value);
+}
+
+int micropv_registry_read_uint64(xenbus_transaction_t xbt, const char *path, uint64_t *value)
+{
+    return xenstore_read_uint64(xbt, path, value);
+}
+
+int micropv_registry_write_uint64(xenbus_transaction_t xbt, const char *path, uint64_t value)
+{
+    return xenstore_write_uint64(xbt, path, value);
+}
+
+int micropv_registry_read_string(xenbus_transaction_t xbt, const char *path, char *value, size_t value_size)
+{
+    size_t value_length = 0;
+
+    // no room for the terminator
+    if (!value_size)
+        return -1;
+
+    // leave room for the terminator, the xenstore doesn't send one
+    int rc = xenstore_read(xbt, path, value, value_size - 1, &value_length);
+    if (rc < 0)
+        PRINTK("xenstore_read %s fails %s", path, xenstore_dump);
+    value[value_length] = 0;
+
+    return rc;
+}
+
+int micropv_registry_write_string(xenbus_transaction_t xbt, const char *path, const char *value)
+{
+    if (xenstore_write(xbt, path, value))
+    {
+        PRINTK("xenstore_write %s fails %s", path, xenstore_dump);
+        return -1;
+    }
+
+    return 0;
+}
+
+int micropv_registry_read_binary(xenbus_transaction_t xbt, const char *path, void *data, size_t data_size, size_t *data_length, micropv_registry_encoding_t encoding)
+{
+    return xenstore_read_binary(xbt, path, data, data_size, data_length, encoding);
+}
+
+int micropv_registry_write_binary(xenbus_transaction_t xbt, const char *path, const void *data, size_t data_length, micropv_registry_encoding_t encoding)
+{
+    return xenstore_write_binary(xbt, path, data, data_length, encoding);
+}
+
+static int registry_dir_fetch_part(micropv_registry_dir_t *dir)
+{
+    size_t length = 0;
+    int rc = xenstore_ls_part(dir->xbt, dir->path, dir->offset, dir->buffer, dir->buffer_size, &length);
+    if (rc < 0)
+        return -1;
+
+    // the response starts with the generation count of the directory. If this changes between parts then
+    // the directory has been modified under us and the offsets are meaningless
+    char *generation = dir->buffer;
+    size_t header = pstrnlen(generation, length) + 1;
+    if (header > length)
+        return -1;
+    uint64_t generation_value = strtoull(generation, NULL, 10);
+    if (dir->offset && (generation_value != dir->generation))
+    {
+        PRINTK("directory %s changed while listing", dir->path);
+        return -1;
+    }
+    dir->generation = generation_value;
+
+    // a truncated response leaves a partial name at the end of the buffer, drop it and pick it up in the next part
+    if (rc == 1)
+    {
+        while ((length > header) && dir->buffer[length - 1])
+            length--;
+        if (length == header)
+        {
+            PRINTK("directory %s entry bigger than the list buffer", dir->path);
+            return -1;
+        }
+    }
+
+    // the end of the list is flagged with an empty name
+    dir->complete = (rc == 0) && (length > header) && !dir->buffer[length - 1] && ((length - header == 1) || !dir->buffer[length - 2]);
+    if (dir->complete)
+        length--;
+
+    dir->position = header;
+    dir->length = length;
+    dir->offset += length - header;
+
+    return 0;
+}
+
+int micropv_registry_dir_open(micropv_registry_dir_t *dir, xenbus_transaction_t xbt, const char *path, char *buffer, size_t buffer_size)
+{
+    dir->xbt = xbt;
+    dir->path = path;
+    dir->buffer = buffer;
+    dir->buffer_size = buffer_size;
+    dir->length = dir->position = dir->offset = 0;
+    dir->generation = 0;
+    dir->partial = 0;
+    dir->complete = 0;
+
+    // try to get everything in one go
+    int rc = xenstore_ls(xbt, path, buffer, buffer_size, &dir->length);
+    if (rc < 0)
+        return -1;
+    if (rc == 0)
+    {
+        dir->complete = 1;
+        return 0;
+    }
+
+    // the buffer is too small for the complete list so walk it in parts
+    dir->partial = 1;
+    if (registry_dir_fetch_part(dir))
+    {
+        // this xenstored doesn't do parts so give back what we've got
+        PRINTK("directory %s truncated", path);
+        dir->partial = 0;
+        dir->complete = 1;
+        if (xenstore_ls(xbt, path, buffer, buffer_size, &dir->length) < 0)
+            return -1;
+        while (dir->length && buffer[dir->length - 1])
+            dir->length--;
+        return 1;
+    }
+
+    return 0;
+}
+
+const char *micropv_registry_dir_next(micropv_registry_dir_t *dir)
+{
+    // get the next part if we have consumed the current one
+    if ((dir->position >= dir->length) && dir->partial && !dir->complete)
+        if (registry_dir_fetch_part(dir) || (dir->position >= dir->length))
+            return NULL;
+
+    if (dir->position >= dir->length)
+        return NULL;
+
+    // the names are NUL separated in the buffer so hand them back in place
+    const char *name = &dir->buffer[dir->position];
+    dir->position += pstrnlen(name, dir->length - dir->position) + 1;
+
+    return name;
+}
@@ -0,0 +1,145 @@
+/*  ***********************************************************************
+    * Project:
+    * File: xenunwind.c
+    * Author: smartin
+    ***********************************************************************
+
+    Frame pointer unwinder and symbol lookup for crash reports and the profiler.
+
+    The unwinder can be pointed at a corrupt stack, so every frame is checked against the page tables before it
+    is read, and the walk stops at the first frame that isn't aligned, doesn't move up the stack or leaves the
+    window above the stack pointer.
+
+    The symbol table is generated by the Makefile. After a first relocatable link it takes every .text symbol from
+    objdump, sorts them by address and assembles them into micropv.syms.o, which goes into the second link. Entries
+    hold the offset into .text, so they stay right wherever the final image puts us. xenunwind_text_base is the
+    address of .text, worked out by the linker from _start.
+
+    Modifications
+    0.00 10/19/2026 created
+*/
+
+/*---------------------------------------------------------------------
+  -- macros (preamble)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- standard includes
+  ---------------------------------------------------------------------*/
+#include <stdint.h>
+#include <stddef.h>
+
+/*---------------------------------------------------------------------
+  -- project includes (imports)
+  ---------------------------------------------------------------------*/
+#include "../micropv.h"
+#include "hypervisor.h"
+#include "xenmmu.h"
+
+/*---------------------------------------------------------------------
+  -- project includes (exports)
+  ---------------------------------------------------------------------*/
+#include "xenunwind.h"
+
+/*---------------------------------------------------------------------
+  -- macros (postamble)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- forward declarations
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- data types
+  ---------------------------------------------------------------------*/
+typedef struct xenunwind_symbol_t
+{
+    uint32_t offset;
+    uint32_t size;
+    uint32_t name;
+} xenunwind_symbol_t;
+
+/*---------------------------------------------------------------------
+  -- function prototypes
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- global variables
+  ---------------------------------------------------------------------*/
+
+// generated at link time, see the Makefile
+extern const xenunwind_symbol_t xenunwind_symbols[];
+extern const uint32_t xenunwind_symbol_count;
+extern const char xenunwind_symbol_names[];
+extern const uint64_t xenunwind_text_base;
+
+/*---------------------------------------------------------------------
+  -- local variables
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- implementation
+  ---------------------------------------------------------------------*/
+
+size_t xenunwind_walk(uint64_t bp, uint64_t sp, uint64_t *ips, size_t max)
+{
+    uint64_t low = sp;
+    uint64_t high = sp + XENUNWIND_STACK_WINDOW;
+    uint64_t mapped_page = 0;
+    size_t depth = 0;
+
+    // each frame is the saved bp followed by the return address
+    while ((depth < max) && !(bp & 7) && (bp >= low) && (bp + 16 <= high))
+    {
+        // an aligned frame never straddles pages, so one check per page will do
+        uint64_t page = bp & ~__PAGE_MASK;
+        if (page != mapped_page)
+        {
+            if (!xenmmu_virtual_mapped(page))
+                break;
+            mapped_page = page;
+        }
+
+        const uint64_t *frame = (const uint64_t *)bp;
+        if (!frame[1])
+            break;
+        ips[depth++] = frame[1];
+
+        // the next frame must be further up the stack
+        low = bp + 16;
+        bp = frame[0];
+    }
+
+    return depth;
+}
+
+const char *xenunwind_symbol(uint64_t address, uint64_t *offset)
+{
+    uint32_t low = 0, high = xenunwind_symbol_count;
+
+    if ((address < xenunwind_text_base) || !high)
+        return NULL;
+    address -= xenunwind_text_base;
+
+    // find the last symbol at or below the address
+    while (high - low > 1)
+    {
+        uint32_t middle = (low + high) / 2;
+        if (xenunwind_symbols[middle].offset <= address)
+            low = middle;
+        else
+            high = middle;
+    }
+
+    const xenunwind_symbol_t *symbol = &xenunwind_symbols[low];
+    if (symbol->offset > address)
+        return NULL;
+
+    // assembler labels have no size, so only check functions
+    if (symbol->size && (address - symbol->offset >= symbol->size))
+        return NULL;
+
+    if (offset)
+        *offset = address - symbol->offset;
+    return &xenunwind_symbol_names[symbol->name];
+}
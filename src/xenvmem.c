@@ -0,0 +1,250 @@
+/*  ***********************************************************************
+    * Project:
+    * File: xenvmem.c
+    * Author: smartin
+    ***********************************************************************
+
+    Virtual address arenas for grant maps, MMIO and foreign frames.
+
+    The arenas have a range of their own well above the 1:1 map (VMEM_BASE), a window per arena, and there is no RAM
+    behind them, only what the callers map. The L1 tables for a run are built when it is handed out (see
+    xenmmu_build_tables) and stay for the next user. A freed run is unmapped.
+
+    Runs are found first fit in a page bitmap, a second bitmap marks the last page of each run so that a free knows
+    how long it was. A run can have a guard page after it, which is never mapped so that running off the end of a
+    mapping faults instead of scribbling on the next one.
+
+    Modifications
+    0.00 10/19/2026 created
+*/
+
+/*---------------------------------------------------------------------
+  -- macros (preamble)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- standard includes
+  ---------------------------------------------------------------------*/
+#include <stdint.h>
+#include <string.h>
+
+/*---------------------------------------------------------------------
+  -- project includes (imports)
+  ---------------------------------------------------------------------*/
+#include "../micropv.h"
+#include "hypervisor.h"
+#include "xenevents.h"
+#include "xenmmu.h"
+
+/*---------------------------------------------------------------------
+  -- project includes (exports)
+  ---------------------------------------------------------------------*/
+#include "xenvmem.h"
+
+/*---------------------------------------------------------------------
+  -- macros (postamble)
+  ---------------------------------------------------------------------*/
+// 16TB, the 1:1 map of any domain we will run in stays below this
+#define VMEM_BASE           (1UL << 44)
+#define VMEM_WINDOW         (1UL << 30)
+#define VMEM_BITS           64
+#define VMEM_WORDS(pages)   ((pages) / VMEM_BITS)
+
+// BARs are the big ones, a window can't be bigger than VMEM_WINDOW
+#define VMEM_GRANT_PAGES    (1 << 12)
+#define VMEM_MMIO_PAGES     (1 << 18)
+#define VMEM_FOREIGN_PAGES  (1 << 14)
+
+/*---------------------------------------------------------------------
+  -- forward declarations
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- data types
+  ---------------------------------------------------------------------*/
+typedef struct vmem_arena_t
+{
+    const char *name;
+    char *base;
+    size_t pages;
+    /**
+     * Pages in use, guard pages included
+     */
+    uint64_t *used;
+    /**
+     * Last page of each run, the guard page if it has one
+     */
+    uint64_t *end;
+} vmem_arena_t;
+
+/*---------------------------------------------------------------------
+  -- function prototypes
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- global variables
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- local variables
+  ---------------------------------------------------------------------*/
+static uint64_t grant_used[VMEM_WORDS(VMEM_GRANT_PAGES)], grant_end[VMEM_WORDS(VMEM_GRANT_PAGES)];
+static uint64_t mmio_used[VMEM_WORDS(VMEM_MMIO_PAGES)], mmio_end[VMEM_WORDS(VMEM_MMIO_PAGES)];
+static uint64_t foreign_used[VMEM_WORDS(VMEM_FOREIGN_PAGES)], foreign_end[VMEM_WORDS(VMEM_FOREIGN_PAGES)];
+
+static vmem_arena_t vmem_arena[micropv_vmem_arenas] =
+{
+    [micropv_vmem_arena_grant] =
+    {
+        .name = "grant", .base = (char *)(VMEM_BASE + micropv_vmem_arena_grant * VMEM_WINDOW),
+        .pages = VMEM_GRANT_PAGES, .used = grant_used, .end = grant_end
+    },
+    [micropv_vmem_arena_mmio] =
+    {
+        .name = "mmio", .base = (char *)(VMEM_BASE + micropv_vmem_arena_mmio * VMEM_WINDOW),
+        .pages = VMEM_MMIO_PAGES, .used = mmio_used, .end = mmio_end
+    },
+    [micropv_vmem_arena_foreign] =
+    {
+        .name = "foreign", .base = (char *)(VMEM_BASE + micropv_vmem_arena_foreign * VMEM_WINDOW),
+        .pages = VMEM_FOREIGN_PAGES, .used = foreign_used, .end = foreign_end
+    }
+};
+
+/*---------------------------------------------------------------------
+  -- implementation
+  ---------------------------------------------------------------------*/
+
+static int page_bit(const uint64_t *map, size_t page)
+{
+    return (map[page / VMEM_BITS] >> (page % VMEM_BITS)) & 1;
+}
+
+static void mark_pages(uint64_t *map, size_t first, size_t pages, int set)
+{
+    size_t page;
+    for (page = first; page < first + pages; page++)
+    {
+        if (set)
+            map[page / VMEM_BITS] |= 1ULL << (page % VMEM_BITS);
+        else
+            map[page / VMEM_BITS] &= ~(1ULL << (page % VMEM_BITS));
+    }
+}
+
+/* First fit search, whole words that are in use are skipped in one go */
+static long find_run(vmem_arena_t *arena, size_t pages)
+{
+    size_t page = 0, run = 0;
+
+    while (page < arena->pages)
+    {
+        if (!(page % VMEM_BITS) && (arena->used[page / VMEM_BITS] == ~0ULL))
+        {
+            page += VMEM_BITS;
+            run = 0;
+            continue;
+        }
+
+        if (page_bit(arena->used, page))
+            run = 0;
+        else if (++run == pages)
+            return page + 1 - pages;
+        page++;
+    }
+
+    return -1;
+}
+
+void *xenvmem_alloc(micropv_vmem_arena_t index, size_t pages, int flags)
+{
+    if ((index < 0) || (index >= micropv_vmem_arenas) || !pages)
+        return NULL;
+
+    vmem_arena_t *arena = &vmem_arena[index];
+    size_t total = pages + ((flags & MICROPV_VMEM_GUARD) ? 1 : 0);
+    char *virtual_address = NULL;
+
+    if (total > arena->pages)
+        return NULL;
+
+    int events = xenevents_save_disable();
+
+    long first = find_run(arena, total);
+    if (first < 0)
+        PRINTK("%s arena has no room for %lu pages", arena->name, total);
+    else
+    {
+        mark_pages(arena->used, first, total, 1);
+        mark_pages(arena->end, first + total - 1, 1, 1);
+        virtual_address = arena->base + (first << __PAGE_SHIFT);
+    }
+
+    xenevents_restore(events);
+
+    // the guard page gets its table too, so that the whole run can be unmapped in one go when it is freed
+    if (virtual_address && xenmmu_build_tables((uint64_t)virtual_address, total))
+    {
+        xenvmem_free(virtual_address);
+        return NULL;
+    }
+
+    return virtual_address;
+}
+
+static vmem_arena_t *arena_of(const void *virtual_address)
+{
+    int index;
+    for (index = 0; index < micropv_vmem_arenas; index++)
+    {
+        vmem_arena_t *arena = &vmem_arena[index];
+        if (((const char *)virtual_address >= arena->base) &&
+            ((const char *)virtual_address < arena->base + (arena->pages << __PAGE_SHIFT)))
+            return arena;
+    }
+
+    return NULL;
+}
+
+int xenvmem_free(void *virtual_address)
+{
+    vmem_arena_t *arena = arena_of(virtual_address);
+    if (!arena || ((uint64_t)virtual_address & __PAGE_MASK))
+    {
+        PRINTK("%p is not in an arena", virtual_address);
+        return -1;
+    }
+
+    // a run starts on a used page that is first in the arena or follows the end of another run or a free page
+    size_t first = ((char *)virtual_address - arena->base) >> __PAGE_SHIFT;
+    if (!page_bit(arena->used, first) || (first && page_bit(arena->used, first - 1) && !page_bit(arena->end, first - 1)))
+    {
+        PRINTK("%p is not the start of a run in the %s arena", virtual_address, arena->name);
+        return -1;
+    }
+
+    size_t last = first;
+    while (!page_bit(arena->end, last))
+        last++;
+    size_t total = last + 1 - first;
+
+    // nothing of the last user's may be left mapped for the next one
+    xenmmu_unmap_range((uint64_t)virtual_address, total);
+
+    int events = xenevents_save_disable();
+    mark_pages(arena->end, last, 1, 0);
+    mark_pages(arena->used, first, total, 0);
+    xenevents_restore(events);
+
+    return 0;
+}
+
+void *micropv_vmem_alloc(micropv_vmem_arena_t arena, size_t pages, int flags)
+{
+    return xenvmem_alloc(arena, pages, flags);
+}
+
+int micropv_vmem_free(void *virtual_address)
+{
+    return xenvmem_free(virtual_address);
+}
@@ -1,1049 +1,691 @@
-#include <string.h> /* for memset */
-#include <stdlib.h>
-#include <float.h>
-
-#define __EXTENSIONS__
-#define __USE_XOPEN_EXTENDED
-#include <stdlib.h> /* for fcvt */
+#include <string.h> /* for memcpy */
+#include <stdint.h>
+#include <stdio.h> /* for the snprintf prototypes */
 
 #include "psnprintf.h"
 
-int psnprintf(char *str, size_t n, const char *format, ...)
-{
-    va_list args;
-    int ret;
-
-    va_start(args, format);
-    ret = pvsnprintf(str, n, format, args);
-    va_end(args);
-    return ret;
-}
-
-#define STATE_NONE 0
-#define STATE_OPERATOR 1 /* Just received % */
-#define STATE_FLAG 2     /* Just received a flag or prefix or width */
-#define STATE_WIDTH 3
-#define STATE_BEFORE_PRECISION 4 /* just got dot */
-#define STATE_PRECISION 5 /* got at least one number after dot */
-#define STATE_PREFIX 6   /* just received prefix (h, l or L) */
-
-#define UNKNOWN_WIDTH 0
-#define VARIABLE_WIDTH -2
-#define UNKNOWN_PRECISION -1
-#define VARIABLE_PRECISION -2
-
-/* Following macros give reusable switch cases, used in combination
- * depending on current state. Sucks to do these as macros, but should
- * give the compiler lots of freedom to optimize.
+/* Single pass formatting engine.
+ *
+ * Everything is written through a psink_t, so there is no measuring pass
+ * and no intermediate buffer the size of the output: the caller supplies a
+ * buffer of whatever size suits it (a few dozen bytes on the stack is
+ * fine) and the flush function is called each time it fills. Runs of
+ * literal text are copied in one go.
+ *
+ * Decimal conversion works two digits at a time from a table of digit
+ * pairs, which halves the number of divisions, and hex is a table lookup
+ * per nibble.
  */
-#define CHECK_FLAG \
-    case '-':  \
-        flags |= FLAG_LEFT_ALIGN; \
-        state = STATE_FLAG; \
-        break; \
-    case '+': \
-        flags |= FLAG_SIGNED; \
-        state = STATE_FLAG; \
-        break; \
-    case '0': \
-        flags |= FLAG_ZERO_PAD; \
-        state = STATE_FLAG; \
-        break; \
-    case ' ': \
-        flags |= FLAG_SIGN_PAD; \
-        state = STATE_FLAG; \
-        break; \
-    case '#': \
-        flags |= FLAG_HASH; \
-        state = STATE_FLAG; \
-        break;
-
-#define CHECK_WIDTH \
-    case '1': \
-    case '2': \
-    case '3': \
-    case '4': \
-    case '5': \
-    case '6': \
-    case '7': \
-    case '8': \
-    case '9': \
-        width = *pfmt - '0'; /* convert to integer */ \
-        state = STATE_WIDTH; \
-        break; \
-    case '*': \
-        width = VARIABLE_WIDTH; \
-        state = STATE_WIDTH; \
-        break;
-
-#define CHECK_PRECISION \
-    case '.': \
-        precision = 0; \
-        state = STATE_BEFORE_PRECISION; \
-        break;
 
-#define CHECK_PREFIX \
-    case 'h': \
-    case 'l': \
-    case 'L': \
-        prefix = *pfmt; \
-        state = STATE_PREFIX; \
-        break;
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static const char hex_lower[] = "0123456789abcdef";
+static const char hex_upper[] = "0123456789ABCDEF";
+
+#define PAD_CHUNK 16
+static const char pad_spaces[PAD_CHUNK] = "                ";
+static const char pad_zeros[PAD_CHUNK] = "0000000000000000";
 
-#define GET_VARS \
-    if (width == VARIABLE_WIDTH) \
-        width = va_arg(ap, int); \
-    if (precision == VARIABLE_PRECISION) \
-        precision = va_arg(ap, int);
-
-#define CHECK_TYPE \
-    case 'd': \
-    case 'i': \
-    case 'u': \
-    case 'o': \
-    case 'x': \
-    case 'X': \
-    case 'p': \
-        GET_VARS \
-        ncount += pvsnfmt_int(&pinsertion, &nmax, *pfmt, flags, width, precision, prefix, ap); \
-        state = STATE_NONE; \
-        break; \
-    case 'e': \
-    case 'E': \
-    case 'f': \
-    case 'g': \
-    case 'G': \
-        GET_VARS \
-        ncount += pvsnfmt_double(&pinsertion, &nmax, *pfmt, flags, width, precision, prefix, ap); \
-        state = STATE_NONE; \
-        break; \
-    case 'c': \
-        GET_VARS \
-        ncount += pvsnfmt_char(&pinsertion, &nmax, *pfmt, flags, width, precision, prefix, ap); \
-        state = STATE_NONE; \
-        break; \
-    case 's': \
-        GET_VARS \
-        ncount += pvsnfmt_str(&pinsertion, &nmax, *pfmt, flags, width, precision, prefix, ap); \
-        state = STATE_NONE; \
-        break; \
-    case 'n': \
-        *(va_arg(ap, int *)) = ncount; \
-        state = STATE_NONE; \
-        break;
-
-#define PUTCHAR(ch) \
-    if (nmax > 1) \
-    { \
-        *pinsertion++ = ch;  \
-        nmax--; \
-    } \
-    ncount++;
+/*
+ * Sink
+ */
 
-int pvsnprintf(char *str, size_t nmax, const char *format, va_list ap)
+void psink_init(psink_t *sink, char *buffer, size_t size, psink_flush_t flush, void *context)
 {
-    /* nmax gives total size of buffer including null
-     * null is ALWAYS added, even if buffer too small for format
-     * (contrary to C99)
-     */
-
-    char *pinsertion = str;
-    const char *pfmt = format;
-    int ncount = 0;     /* number of characters printed so far */
-    int state = STATE_NONE;
-    char flags;
-    int width;
-    int precision;
-    char prefix;
+    sink->buffer = buffer;
+    sink->size = size;
+    sink->used = 0;
+    sink->flush = flush;
+    sink->context = context;
+    sink->count = 0;
+}
 
-    while (*pfmt)
+void psink_flush(psink_t *sink)
+{
+    if (sink->flush && sink->used)
     {
-        switch (state)
-        {
-        case STATE_NONE:
-            switch (*pfmt)
-            {
-            case '%':
-                state = STATE_OPERATOR;
-                flags = FLAG_DEFAULT;
-                width = UNKNOWN_WIDTH;
-                precision = UNKNOWN_PRECISION;
-                prefix = '\0';
-                break;
-
-            default:
-                PUTCHAR(*pfmt)
-            }
-            break;
-
-        case STATE_OPERATOR:
-            switch (*pfmt)
-            {
-                CHECK_FLAG
-                CHECK_WIDTH
-                CHECK_PRECISION
-                CHECK_PREFIX
-                CHECK_TYPE
-            default:
-                PUTCHAR(*pfmt) /* Unknown format, just print it (e.g. "%%") */
-                state = STATE_NONE;
-            }
-            break;
-
-        case STATE_FLAG:
-            switch (*pfmt)
-            {
-                CHECK_FLAG
-                CHECK_WIDTH
-                CHECK_PRECISION
-                CHECK_PREFIX
-                CHECK_TYPE
-            }
-            break;
+        sink->flush(sink->context, sink->buffer, sink->used);
+        sink->used = 0;
+    }
+}
 
-        case STATE_WIDTH:
-            if (*pfmt >= '0' && *pfmt <= '9' && width != -1)
-            {
-                width = width * 10 + (*pfmt - '0');
-                break;
-            }
-            switch (*pfmt)
-            {
-                CHECK_PRECISION
-                CHECK_PREFIX
-                CHECK_TYPE
-            }
-            break;
+void psink_write(psink_t *sink, const char *data, size_t length)
+{
+    sink->count += length;
 
-        case STATE_BEFORE_PRECISION:
-            if (*pfmt >= '0' && *pfmt <= '9')
-            {
-                precision = *pfmt - '0';
-                state = STATE_PRECISION;
-            }
-            else if (*pfmt == '*')
-            {
-                precision = VARIABLE_PRECISION;
-                state = STATE_PRECISION;
-            }
-            switch (*pfmt)
-            {
-                CHECK_PREFIX
-                CHECK_TYPE
-            }
-            break;
+    while (length)
+    {
+        size_t room = sink->size - sink->used;
 
-        case STATE_PRECISION:
-            if (*pfmt >= '0' && *pfmt <= '9' && precision != -1)
-            {
-                precision = precision * 10 + (*pfmt - '0');
-                break;
-            }
-            switch (*pfmt)
+        if (length > room)
+        {
+            /* a fixed buffer keeps what fits */
+            if (!sink->flush)
             {
-                CHECK_PREFIX
-                CHECK_TYPE
+                if (room)
+                {
+                    memcpy(sink->buffer + sink->used, data, room);
+                    sink->used += room;
+                }
+                return;
             }
-            break;
 
-        case STATE_PREFIX:
-            switch (*pfmt)
+            /* too big to be worth buffering, send it straight on */
+            if (length >= sink->size)
             {
-                CHECK_TYPE
+                psink_flush(sink);
+                sink->flush(sink->context, data, length);
+                return;
             }
 
+            psink_flush(sink);
+            continue;
+        }
 
-        } /* switch state */
-        pfmt++;
-
-    } /* while *pfmt */
-
-    /* Add null if there is room
-     * NOTE there is always room even if str doesn't fit unless
-     * nmax initially passed in as 0.  fmt functions take care to
-     * always leave at least one free byte at end.
-     */
-    if (nmax > 0)
-        *pinsertion = '\0';
-
-    return ncount;
+        memcpy(sink->buffer + sink->used, data, length);
+        sink->used += length;
+        return;
+    }
 }
 
-int pvsnfmt_char(char **pinsertion, size_t *nmax, const char fmt, int flags,
-                 int width, int precision, char prefix, va_list ap)
+static inline void sink_putc(psink_t *sink, char c)
 {
-    if (*nmax > 1)
+    if (sink->used < sink->size)
     {
-        *(*pinsertion)++ = (char) va_arg(ap, int);
-        (*nmax)--;
+        sink->buffer[sink->used++] = c;
+        sink->count++;
     }
-    return 1;
+    else
+        psink_write(sink, &c, 1);
+}
+
+static void sink_pad(psink_t *sink, const char *pad, int n)
+{
+    for (; n > PAD_CHUNK; n -= PAD_CHUNK)
+        psink_write(sink, pad, PAD_CHUNK);
+    if (n > 0)
+        psink_write(sink, pad, n);
 }
 
 /* strnlen not available on all platforms.. maybe autoconf it? */
 size_t pstrnlen(const char *s, size_t count)
 {
     const char *p = s;
-    while (*p && count-- > 0)
+    while (count-- > 0 && *p)
         p++;
 
     return p - s;
 }
 
-/* Format a string into the buffer.  Parameters:
- *   **pinsertion   Pointer to pointer to buffer (can be reference to NULL)
- *   *nmax          Pointer to size of buffer.  This is may be modified
- *   fmt            Format character ('s')
- *   flags          0 or combination of flags (see .h file for #defines)
- *   width          Width of string, as defined in printf
- *   precision      Precision of string, as defined in printf
- *   ap             Argument list
+/*
+ * Parsing
  */
 
-int pvsnfmt_str(char **pinsertion, size_t *nmax, const char fmt, int flags,
-                int width, int precision, char prefix, va_list ap)
+const char *pformat_parse(const char *format, pformat_spec_t *spec)
 {
-    const char *str = va_arg(ap, const char *);
-    int nprinted;
-    int len;
-    int pad = 0;
+    spec->flags = FLAG_DEFAULT;
+    spec->width = 0;
+    spec->precision = PFORMAT_UNKNOWN;
+    spec->length = 0;
 
-    /* if this is a null pointer then point to null string */
-    if (!str)
-        str = "<null>";
-
-    /* Get width magnitude, set aligment flag */
-    if (width < 0)
+    /* flags */
+    for (;; format++)
     {
-        width = -width;
-        flags |= FLAG_LEFT_ALIGN;
+        switch (*format)
+        {
+        case '-': spec->flags |= FLAG_LEFT_ALIGN; continue;
+        case '+': spec->flags |= FLAG_SIGNED; continue;
+        case '0': spec->flags |= FLAG_ZERO_PAD; continue;
+        case ' ': spec->flags |= FLAG_SIGN_PAD; continue;
+        case '#': spec->flags |= FLAG_HASH; continue;
+        }
+        break;
     }
 
-    /* Truncate due to precision */
-    if (precision < 0)
-        len = strlen(str);
-    else
-        len = pstrnlen(str, precision);
-
-    /* Determine padding length */
-    if (width > len)
-        pad = width - len;
-
-    /* Exit if just counting (not printing) */
-    if (*nmax <= 1)
-        return len + pad;
-
-    /* If right-aligned, print pad */
-    if ( !(flags & FLAG_LEFT_ALIGN) )
+    /* width */
+    if (*format == '*')
     {
-        char padchar;
-        if (flags & FLAG_ZERO_PAD)
-            padchar = '0';
-        else
-            padchar = ' ';
-
-        if (*nmax - 1 < pad)
-            nprinted = *nmax - 1;
-        else
-            nprinted = pad;
-
-        memset(*pinsertion, padchar, nprinted);
-        *pinsertion += nprinted;
-        *nmax -= nprinted;
+        spec->width = PFORMAT_VARIABLE;
+        format++;
+    }
+    else if ((*format >= '0') && (*format <= '9'))
+    {
+        spec->width = 0;
+        while ((*format >= '0') && (*format <= '9'))
+            spec->width = spec->width * 10 + (*format++ - '0');
     }
 
-    /* Output string */
-    if (*nmax <= 1)
-        nprinted = 0;
-    else if (*nmax - 1 < len)
-        nprinted = *nmax - 1;
-    else
-        nprinted = len;
-
-    memcpy(*pinsertion, str, nprinted);
-    *pinsertion += nprinted;
-    *nmax -= nprinted;
-
-    /* If left aligned, add pad */
-    if (flags & FLAG_LEFT_ALIGN)
+    /* precision */
+    if (*format == '.')
     {
-        if (*nmax <= 1)
-            nprinted = 0;
-        else if (*nmax - 1 < pad)
-            nprinted = *nmax - 1;
+        format++;
+        spec->precision = 0;
+        if (*format == '*')
+        {
+            spec->precision = PFORMAT_VARIABLE;
+            format++;
+        }
         else
-            nprinted = pad;
+        {
+            while ((*format >= '0') && (*format <= '9'))
+                spec->precision = spec->precision * 10 + (*format++ - '0');
+        }
+    }
 
-        memset(*pinsertion, ' ', nprinted);
-        *pinsertion += nprinted;
-        *nmax -= nprinted;
+    /* length */
+    switch (*format)
+    {
+    case 'h':
+        spec->length = (format[1] == 'h') ? 'H' : 'h';
+        format += (spec->length == 'H') ? 2 : 1;
+        break;
+    case 'l':
+        spec->length = (format[1] == 'l') ? 'q' : 'l';
+        format += (spec->length == 'q') ? 2 : 1;
+        break;
+    case 'j':
+    case 'z':
+    case 't':
+    case 'L':
+        spec->length = *format++;
+        break;
     }
 
-    return len + pad; /* Return total length of pad + string even if some
-                       * was truncated
-                       */
+    /* a '%' at the very end of the format has nothing after it */
+    spec->conversion = *format;
+    return *format ? format + 1 : format;
 }
 
-/* Format an integer into the buffer.  Parameters:
- *   **pinsertion   Pointer to pointer to buffer (can be reference to NULL)
- *   *nmax          Pointer to size of buffer.  This is may be modified
- *   fmt            Format character (one of "diuoxX")
- *   flags          0 or combination of flags (see .h file for #defines)
- *   width          Width of integer, as defined in printf
- *   precision      Precision of integer, as defined in printf
- *   ap             Argument list
+/*
+ * Conversions
  */
 
-int pvsnfmt_int(char **pinsertion, size_t *nmax, char fmt, int flags,
-                int width, int precision, char prefix, va_list ap)
+static void format_padded(psink_t *sink, const pformat_spec_t *spec, int width,
+                          const char *prefix, int prefix_length, int zeros, const char *body, int length)
 {
-    long int number = 0;
-    unsigned long int unumber;
-    char numbersigned = 1;
-    char iszero = 0; /* bool */
-    int base;
-    int len = 0; /* length of number component (no sign or padding) */
-    char char10;
-    char sign = 0;
-    int widthpad = 0;
-    int addprefix = 0; /* optional "0x" = 2 */
-    int totallen;
-
-    /* Stack used to hold digits, which are generated backwards
-     * and need to be popped off in the correct order
-     */
-    char numstack[22];    /* largest 64 bit number has 22 octal digits */
-    char *stackpos = numstack;
+    int total = prefix_length + zeros + length;
+    int pad = (width > total) ? width - total : 0;
+
+    if (!(spec->flags & FLAG_LEFT_ALIGN) && !(spec->flags & FLAG_ZERO_PAD))
+        sink_pad(sink, pad_spaces, pad);
+    psink_write(sink, prefix, prefix_length);
+    if (!(spec->flags & FLAG_LEFT_ALIGN) && (spec->flags & FLAG_ZERO_PAD))
+        sink_pad(sink, pad_zeros, pad);
+    sink_pad(sink, pad_zeros, zeros);
+    psink_write(sink, body, length);
+    if (spec->flags & FLAG_LEFT_ALIGN)
+        sink_pad(sink, pad_spaces, pad);
+}
+
+/* Digits of value in base 10, written backwards ending at end. Returns the first digit */
+static inline char *format_decimal(char *end, uint64_t value)
+{
+    while (value >= 100)
+    {
+        unsigned int pair = value % 100;
+        value /= 100;
+        end -= 2;
+        end[0] = digit_pairs[pair * 2];
+        end[1] = digit_pairs[pair * 2 + 1];
+    }
+
+    if (value >= 10)
+    {
+        end -= 2;
+        end[0] = digit_pairs[value * 2];
+        end[1] = digit_pairs[value * 2 + 1];
+    }
+    else
+        *--end = '0' + value;
 
-#define PUSH(x) \
-    *stackpos++ = x
+    return end;
+}
 
-#define POP() \
-    *(--stackpos)
+static void format_integer(psink_t *sink, const pformat_spec_t *spec, int width, int precision, uint64_t value, int negative)
+{
+    char digits[24];
+    char *end = digits + sizeof(digits);
+    char *start = end;
+    char prefix[2];
+    int prefix_length = 0;
+    const char *table;
+    pformat_spec_t fixed = *spec;
+
+    /* a precision turns off zero padding */
+    if (precision >= 0)
+        fixed.flags &= ~FLAG_ZERO_PAD;
+    else
+        precision = 1;
 
-    /* Retrieve value */
-    switch (prefix)
+    switch (spec->conversion)
     {
-    case 'h':
-        switch (fmt)
-        {
-            case 'd':
-            case 'i':
-                number = (signed short int) va_arg(ap, int);
-                break;
-            case 'u':
-            case 'o':
-            case 'x':
-            case 'X':
-                unumber = (unsigned short int) va_arg(ap, int);
-                numbersigned = 0;
-                break;
-             case 'p':
-                unumber = (unsigned long) va_arg(ap, void *);
-                numbersigned = 0;
-        }
+    case 'o':
+        for (; value; value >>= 3)
+            *--start = '0' + (value & 7);
+        if ((spec->flags & FLAG_HASH) && (end - start >= precision))
+            precision = end - start + 1;
         break;
-    case 'l':
-        switch (fmt)
+
+    case 'x':
+    case 'X':
+    case 'p':
+        table = (spec->conversion == 'X') ? hex_upper : hex_lower;
+        if (value && ((spec->flags & FLAG_HASH) || (spec->conversion == 'p')))
         {
-            case 'd':
-            case 'i':
-                number = va_arg(ap, signed long int);
-                break;
-            case 'u':
-            case 'o':
-            case 'x':
-            case 'X':
-                unumber = va_arg(ap, unsigned long int);
-                numbersigned = 0;
-                break;
-             case 'p':
-                unumber = (unsigned long) va_arg(ap, void *);
-                numbersigned = numbersigned;
+            prefix[prefix_length++] = '0';
+            prefix[prefix_length++] = (spec->conversion == 'X') ? 'X' : 'x';
         }
+        for (; value; value >>= 4)
+            *--start = table[value & 15];
         break;
+
     default:
-        switch (fmt)
-        {
-            case 'd':
-            case 'i':
-                number = va_arg(ap, signed int);
-                break;
-            case 'u':
-            case 'o':
-            case 'x':
-            case 'X':
-                unumber = va_arg(ap, unsigned int);
-                numbersigned = 0;
-                break;
-             case 'p':
-                unumber = (unsigned long) va_arg(ap, void *);
-                numbersigned = 0;
-         }
-    } /* switch fmt to retrieve number */
-
-    if (fmt == 'p')
-    {
-        fmt = 'x';
-        flags |= FLAG_HASH;
+        if (negative)
+            prefix[prefix_length++] = '-';
+        else if (spec->flags & FLAG_SIGNED)
+            prefix[prefix_length++] = '+';
+        else if (spec->flags & FLAG_SIGN_PAD)
+            prefix[prefix_length++] = ' ';
+        if (value)
+            start = format_decimal(end, value);
+        break;
     }
 
-    /* Discover base */
-    switch (fmt)
-    {
-        case 'd':
-        case 'i':
-        case 'u':
-            base = 10;
-            break;
-        case 'o':
-            base = 8;
-            break;
-        case 'X':
-            base = 16;
-            char10 = 'A';
-            break;
-        case 'x':
-            base = 16;
-            char10 = 'a';
-    }
+    int length = end - start;
+    int zeros = (precision > length) ? precision - length : 0;
+    format_padded(sink, &fixed, width, prefix, prefix_length, zeros, start, length);
+}
 
-    if (numbersigned)
-    {
-        if (number < 0)
-        {
-            /* Deal with negativity */
-            sign = '-';
-            number = -number;
-        }
-        else if (flags & FLAG_SIGNED)
-        {
-            sign = '+';
-        }
-        else if (flags & FLAG_SIGN_PAD)
-        {
-            sign = ' ';
-        }
-    }
+static void format_string(psink_t *sink, const pformat_spec_t *spec, int width, int precision, const char *str, int length)
+{
+    if (length < 0)
+        length = (precision < 0) ? strlen(str) : pstrnlen(str, precision);
 
-    /* Create number */
-    if (numbersigned)
-    {
-        if (number == 0)
-            iszero = 1;
-        do
-        {
-            PUSH(number % base);
-            number /= base;
-            len++;
-        } while (number != 0);
-    }
-    else
-    {
-        if (unumber == 0)
-            iszero = 1;
-        do
-        {
-            PUSH(unumber % base);
-            unumber /= base;
-            len++;
-        } while (unumber != 0);
-    }
+    format_padded(sink, spec, width, NULL, 0, 0, str, length);
+}
 
-    /* Octal hash character (alternate form) */
-    if (fmt == 'o' && (flags & FLAG_HASH) && precision <= len &&
-        precision != 0 && !iszero )
+/* Fixed point digits of a non negative value with precision decimals. Returns the length */
+static int format_fixed(char *buffer, size_t size, double value, int precision, int hash)
+{
+    char *p = buffer;
+    double scale = 0.5;
+    int i;
+
+    for (i = 0; i < precision; i++)
+        scale /= 10;
+    value += scale;
+
+    uint64_t whole = (uint64_t)value;
+    double fraction = value - (double)whole;
+    char digits[24];
+    char *start = format_decimal(digits + sizeof(digits), whole);
+    int length = digits + sizeof(digits) - start;
+
+    if ((size_t)(length + precision + 2) > size)
+        precision = size - length - 2;
+
+    memcpy(p, start, length);
+    p += length;
+    if (precision || hash)
+        *p++ = '.';
+    for (i = 0; i < precision; i++)
     {
-        precision = len + 1;
+        fraction *= 10;
+        int digit = (int)fraction;
+        *p++ = '0' + digit;
+        fraction -= digit;
     }
 
-    /* Determine width of sign, if any. */
-    if ( (fmt == 'x' || fmt == 'X') && (flags & FLAG_HASH) && !iszero )
-        addprefix = 2;
-    else if (sign != 0)
-        addprefix = 1;
+    return p - buffer;
+}
 
-    /* Make up precision (zero pad on left) */
-    while (len < precision)
-    {
-        PUSH(0);
-        len++;
-    }
+static void format_double(psink_t *sink, const pformat_spec_t *spec, int width, int precision, double value)
+{
+    char body[64];
+    char prefix[1];
+    int prefix_length = 0;
+    int length;
+    pformat_spec_t fixed = *spec;
+    char conversion = spec->conversion;
+    int upper = (conversion == 'E') || (conversion == 'G') || (conversion == 'F');
 
+    if (precision < 0)
+        precision = 6;
 
-    if (len + addprefix < width)
+    if ((value < 0) || ((value == 0) && (1 / value < 0)))
     {
-        totallen = width;
-        widthpad = width - (len + addprefix);
+        prefix[prefix_length++] = '-';
+        value = -value;
     }
-    else
-        totallen = len + addprefix;
+    else if (spec->flags & FLAG_SIGNED)
+        prefix[prefix_length++] = '+';
+    else if (spec->flags & FLAG_SIGN_PAD)
+        prefix[prefix_length++] = ' ';
 
-    if (*nmax <= 1)
-        return totallen;
+    /* nan and inf are never zero padded */
+    if ((value != value) || (value > 1.7976931348623157e308))
+    {
+        fixed.flags &= ~FLAG_ZERO_PAD;
+        format_padded(sink, &fixed, width, prefix, prefix_length, 0, (value != value) ? (upper ? "NAN" : "nan") : (upper ? "INF" : "inf"), 3);
+        return;
+    }
 
-    /* Write sign or "0x" */
-    if (flags & FLAG_ZERO_PAD)
+    /* decimal exponent, the mantissa ends up in [1, 10) */
+    int exponent = 0;
+    double mantissa = value;
+    if (mantissa != 0)
     {
-        if (addprefix == 2) /* 0x */
+        while (mantissa >= 10)
         {
-            if (*nmax > 1)
-            {
-                *(*pinsertion)++ = '0';
-                (*nmax)--;
-            }
-            if (*nmax > 1)
-            {
-                *(*pinsertion)++ = fmt;
-                (*nmax)--;
-            }
+            mantissa /= 10;
+            exponent++;
         }
-        else if (addprefix == 1) /* sign */
+        while (mantissa < 1)
         {
-            if (*nmax > 1)
-            {
-                *(*pinsertion)++ = sign;
-                (*nmax)--;
-            }
+            mantissa *= 10;
+            exponent--;
         }
     }
 
-    /* Width pad */
-    if ( !(flags & FLAG_LEFT_ALIGN) )
+    if ((conversion == 'g') || (conversion == 'G'))
     {
-        if (*nmax <= 1)
-            widthpad = 0;
-        else if (*nmax + 1 < widthpad)
-            widthpad = *nmax - 1;
+        if (!precision)
+            precision = 1;
 
-        if (flags & FLAG_ZERO_PAD)
-            memset(*pinsertion, '0', widthpad);
-        else
-            memset(*pinsertion, ' ', widthpad);
-
-        *pinsertion += widthpad;
-        *nmax -= widthpad;
-    }
-
-    /* Write sign or "0x" */
-    if ( !(flags & FLAG_ZERO_PAD) )
-    {
-        if (addprefix == 2) /* 0x */
+        /* %g is %e when the exponent is out of range, %f otherwise, with precision as significant digits */
+        if ((exponent < -4) || (exponent >= precision))
         {
-            if (*nmax > 1)
-            {
-                *(*pinsertion)++ = '0';
-                (*nmax)--;
-            }
-            if (*nmax > 1)
-            {
-                *(*pinsertion)++ = fmt;
-                (*nmax)--;
-            }
+            conversion = upper ? 'E' : 'e';
+            precision--;
         }
-        else if (addprefix == 1) /* sign */
+        else
         {
-            if (*nmax > 1)
-            {
-                *(*pinsertion)++ = sign;
-                (*nmax)--;
-            }
+            conversion = 'f';
+            precision -= exponent + 1;
         }
     }
 
-    /* Write number */
-    if (*nmax <= 1)
-        len = 0;
-    else if (*nmax + 1 < len)
-        len = *nmax - 1;
-
-    for (; len > 0; len--)
+    if (((conversion == 'f') || (conversion == 'F')) && (value < 1e19))
     {
-        char n = POP();
-        if (n <= 9)
-            *(*pinsertion)++ = n + '0';
-        else
-            *(*pinsertion)++ = n - 10 + char10;
+        length = format_fixed(body, sizeof(body) - 6, value, precision, spec->flags & FLAG_HASH);
     }
-    *nmax -= len;
-
-    if (flags & FLAG_LEFT_ALIGN)
+    else
     {
-        if (*nmax <= 1)
-            widthpad = 0;
-        else if (*nmax + 1 < widthpad)
-            widthpad = *nmax - 1;
-
-        memset(*pinsertion, ' ', widthpad);
-        *pinsertion += widthpad;
-        *nmax -= widthpad;
+        /* rounding can carry the mantissa up to 10 */
+        length = format_fixed(body, sizeof(body) - 6, mantissa, precision, spec->flags & FLAG_HASH);
+        if (body[1] == '0' && body[0] == '1' && mantissa >= 9.5)
+        {
+            length = format_fixed(body, sizeof(body) - 6, mantissa / 10, precision, spec->flags & FLAG_HASH);
+            exponent++;
+        }
+        body[length++] = upper ? 'E' : 'e';
+        body[length++] = (exponent < 0) ? '-' : '+';
+        if (exponent < 0)
+            exponent = -exponent;
+        if (exponent >= 100)
+            body[length++] = '0' + exponent / 100;
+        body[length++] = digit_pairs[(exponent % 100) * 2];
+        body[length++] = digit_pairs[(exponent % 100) * 2 + 1];
     }
 
-    return totallen;
-}
-
-/*
- * WARNING: Assumes 32 bit longs and 64 bit doubles
- */
-typedef union {
-    double D;
-    struct {
-        unsigned long W0;
-        unsigned long W1;
-    } words;
-} DBLBITS;
-
-#define EXP_MASK  0x7FF00000
-#define SIGN_MASK 0x80000000
-#define MANTISSA_MASK ~(SIGN_MASK | EXP_MASK)
-#define QNAN_MASK 0x00080000 /* first bit of mantissa */
-
-/* These functions not defined on all platforms, so
- * do the checks manually
- * WARNING: Assumes 64-bit IEEE representation
- *    (so it won't run on your Cray :)
- */
-
-#define ISNAN(x) \
-    ( (((DBLBITS *) &x)->words.W1 & EXP_MASK) == EXP_MASK \
-  && ((((DBLBITS *) &x)->words.W1 & MANTISSA_MASK) != 0 || ((DBLBITS *) &x)->words.W0 != 0) )
-
-#define ISQNAN(x) \
-    ( ISNAN(x) && (((DBLBITS *) &x)->words.W1 & QNAN_MASK) )
-
-#define ISSNAN(x) \
-    ( ISNAN(x) && !ISQNAN(x) )
+    /* %g drops trailing zeros unless # */
+    if (((spec->conversion == 'g') || (spec->conversion == 'G')) && !(spec->flags & FLAG_HASH))
+    {
+        char *exp = memchr(body, upper ? 'E' : 'e', length);
+        int tail = exp ? (body + length) - exp : 0;
+        int mantissa_length = length - tail;
 
-#define ISINF(x) \
-   ( (((DBLBITS *) &x)->words.W1 & EXP_MASK) == EXP_MASK \
-  && ((((DBLBITS *) &x)->words.W1 & MANTISSA_MASK) == 0 && ((DBLBITS *) &x)->words.W0 == 0) )
+        if (memchr(body, '.', mantissa_length))
+        {
+            while (body[mantissa_length - 1] == '0')
+                mantissa_length--;
+            if (body[mantissa_length - 1] == '.')
+                mantissa_length--;
+            memmove(body + mantissa_length, body + length - tail, tail);
+            length = mantissa_length + tail;
+        }
+    }
 
-/* Format a double-precision float into the buffer.  Parameters:
- *   **pinsertion   Pointer to pointer to buffer (can be reference to NULL)
- *   *nmax          Pointer to size of buffer.  This is may be modified
- *   fmt            Format character (one of "eEfgG")
- *   flags          0 or combination of flags (see .h file for #defines)
- *   width          Width of double, as defined in printf
- *   precision      Precision of double, as defined in printf
- *   ap             Argument list
- */
+    format_padded(sink, &fixed, width, prefix, prefix_length, 0, body, length);
+}
 
-int pvsnfmt_double(char **pinsertion, size_t *nmax, const char fmt, int flags,
-                int width, int precision, char prefix, va_list ap)
+int pformat_class(const pformat_spec_t *spec)
 {
-#if HAVE_FCVT
-    char *digits;
-    int sign = 0;
-    int dec;
-    double value = va_arg(ap, double);
-
-    int len;
-    int pad = 0;
-    int totallen;
-    char signchar = 0;
-    int leadingzeros = 0;
-
-    int printdigits; /* temporary var used in different contexts */
-
-    /* Check for special values first */
-    char *special = 0;
-    if (ISSNAN(value))
-        special = "NaN";
-    else if (ISQNAN(value))
-        special = "NaN";
-    else if ( ISINF(value) )
+    switch (spec->conversion)
     {
-        if (value < 0)
-            sign = 1;
-        special = "Inf";
+    case 'd':
+    case 'i':
+    case 'u':
+    case 'o':
+    case 'x':
+    case 'X':
+        return ((spec->length == 0) || (spec->length == 'h') || (spec->length == 'H')) ? PFORMAT_CLASS_INT : PFORMAT_CLASS_LONG;
+
+    case 'c':
+        return PFORMAT_CLASS_INT;
+
+    case 'f':
+    case 'F':
+    case 'e':
+    case 'E':
+    case 'g':
+    case 'G':
+        return (spec->length == 'L') ? PFORMAT_CLASS_LONG_DOUBLE : PFORMAT_CLASS_DOUBLE;
+
+    case 's':
+        return PFORMAT_CLASS_STRING;
+
+    case 'p':
+    case 'n':
+        return PFORMAT_CLASS_POINTER;
     }
 
-    if (special)
-    {
-        totallen = len = strlen(special);
-
-        /* Sign (this is silly for NaN but conforming to printf */
-        if (flags & (FLAG_SIGNED | FLAG_SIGN_PAD) || sign)
-        {
-            if (sign)
-                signchar = '-';
-            else if (flags & FLAG_SIGN_PAD)
-                signchar = ' ';
-            else
-                signchar = '+';
-            totallen++;
-        }
-
-        /* Padding */
-        if (totallen < width)
-            pad = width - totallen;
-        else
-            pad = 0;
-
-        totallen += pad ;
+    return PFORMAT_CLASS_NONE;
+}
 
-        /* Sign now if zeropad */
-        if (flags & FLAG_ZERO_PAD && signchar)
-        {
-            if (*nmax > 1)
-            {
-                *(*pinsertion)++ = signchar;
-                (*nmax)--;
-            }
-        }
+void pformat_value(psink_t *sink, const pformat_spec_t *spec, int width, int precision, pformat_value_t value)
+{
+    pformat_spec_t fixed = *spec;
+    uint64_t magnitude;
+    int64_t signed_value;
+    char c;
 
-        /* Right align */
-        if ( !(flags & FLAG_LEFT_ALIGN) )
-        {
-            if (*nmax <= 1)
-                pad  = 0;
-            else if (*nmax - 1 < pad )
-                pad  = *nmax - 1;
-
-            if (flags & FLAG_ZERO_PAD)
-                memset(*pinsertion, '0', pad );
-            else
-                memset(*pinsertion, ' ', pad );
-            *pinsertion += pad ;
-            *nmax -= pad ;
-        }
+    /* a negative width means left aligned, a negative precision is no precision */
+    if (width < 0)
+    {
+        fixed.flags |= FLAG_LEFT_ALIGN;
+        width = -width;
+    }
+    if (precision < 0)
+        precision = PFORMAT_UNKNOWN;
 
-        /* Sign now if not zeropad */
-        if (!(flags & FLAG_ZERO_PAD) && signchar)
+    switch (spec->conversion)
+    {
+    case 'd':
+    case 'i':
+        switch (spec->length)
         {
-            if (*nmax > 1)
-            {
-                *(*pinsertion)++ = signchar;
-                (*nmax)--;
-            }
+        case 'H': signed_value = (signed char)value.i; break;
+        case 'h': signed_value = (short)value.i; break;
+        case 0:   signed_value = (int)value.i; break;
+        default:  signed_value = value.i; break;
         }
+        magnitude = (signed_value < 0) ? -(uint64_t)signed_value : (uint64_t)signed_value;
+        format_integer(sink, &fixed, width, precision, magnitude, signed_value < 0);
+        break;
 
-        if (*nmax <= 0)
-            len = 0;
-        else if (*nmax - 1 < len)
-            len = *nmax - 1;
-        memcpy(*pinsertion, special, len);
-        *pinsertion += len;
-        *nmax -= len;
-
-        /* Left align */
-        if (flags & FLAG_LEFT_ALIGN)
+    case 'u':
+    case 'o':
+    case 'x':
+    case 'X':
+        switch (spec->length)
         {
-            if (*nmax <= 1)
-                pad  = 0;
-            else if (*nmax - 1 < pad )
-                pad  = *nmax - 1;
-
-            memset(*pinsertion, ' ', pad );
-            *pinsertion += pad ;
-            *nmax -= pad ;
+        case 'H': magnitude = (unsigned char)value.u; break;
+        case 'h': magnitude = (unsigned short)value.u; break;
+        case 0:   magnitude = (unsigned int)value.u; break;
+        default:  magnitude = value.u; break;
         }
+        format_integer(sink, &fixed, width, precision, magnitude, 0);
+        break;
 
-        return totallen;
-    }
-
-    if (fmt == 'f')
-    {
-        if (precision == UNKNOWN_PRECISION)
-            precision = 6;
+    case 'p':
+        format_integer(sink, &fixed, width, precision, (uintptr_t)value.p, 0);
+        break;
 
-        digits = fcvt(value, precision, &dec, &sign);
-        len = strlen(digits);
+    case 'c':
+        c = (char)value.i;
+        format_string(sink, &fixed, width, PFORMAT_UNKNOWN, &c, 1);
+        break;
 
-        if (dec > 0)
-            totallen = dec;
-        else
-            totallen = 0;
+    case 's':
+        /* if this is a null pointer then point to null string */
+        format_string(sink, &fixed, width, precision, value.s ? value.s : "<null>", -1);
+        break;
 
-        /* plus 1 for decimal place */
-        if (dec <= 0)
-            totallen += 2; /* and trailing ".0" */
-        else if (precision > 0 || flags & FLAG_HASH)
-            totallen += 1;
+    case 'f':
+    case 'F':
+    case 'e':
+    case 'E':
+    case 'g':
+    case 'G':
+        format_double(sink, &fixed, width, precision, value.d);
+        break;
 
+    case 'n':
+        *(int *)value.p = sink->count;
+        break;
 
-        /* Determine sign width (0 or 1) */
-        if (flags & (FLAG_SIGNED | FLAG_SIGN_PAD) || sign)
-        {
-            if (sign)
-                signchar = '-';
-            else if (flags & FLAG_SIGN_PAD)
-                signchar = ' ';
-            else
-                signchar = '+';
-            totallen++;
-        }
+    case 0:
+        break;
 
-        /* Determine if leading zeros required */
-        if (dec <= 0)
-        {
-            leadingzeros = 1 - dec; /* add one for zero before decimal point (0.) */
-        }
+    default:
+        /* Unknown format, just print it (e.g. "%%") */
+        sink_putc(sink, spec->conversion);
+        break;
+    }
+}
 
-        if (leadingzeros - 1 > precision)
-            totallen += precision;
-        else if (len - dec > 0)
-            totallen += precision;
-        else
-            totallen += leadingzeros;
+void pformat_arg(psink_t *sink, const pformat_spec_t *spec, va_list *ap)
+{
+    int width = spec->width;
+    int precision = spec->precision;
+    pformat_value_t value;
 
-        /* Determine padding width */
-        if (totallen < width)
-            pad = width - totallen;
+    if (width == PFORMAT_VARIABLE)
+        width = va_arg(*ap, int);
+    if (precision == PFORMAT_VARIABLE)
+        precision = va_arg(*ap, int);
 
-        totallen += pad;
-        if (*nmax <= 1)
-            return totallen;
+    switch (pformat_class(spec))
+    {
+    case PFORMAT_CLASS_INT:         value.i = va_arg(*ap, int); break;
+    case PFORMAT_CLASS_LONG:        value.i = va_arg(*ap, long); break;
+    case PFORMAT_CLASS_DOUBLE:      value.d = va_arg(*ap, double); break;
+    case PFORMAT_CLASS_LONG_DOUBLE: value.d = va_arg(*ap, long double); break;
+    case PFORMAT_CLASS_STRING:      value.s = va_arg(*ap, const char *); break;
+    case PFORMAT_CLASS_POINTER:     value.p = va_arg(*ap, void *); break;
+    default:                        value.u = 0; break;
+    }
 
-        /* Now that the length has been calculated, print as much of it
-         * as possible into the buffer
-         */
+    pformat_value(sink, spec, width, precision, value);
+}
 
-        /* Print sign now if padding with zeros */
-        if (flags & FLAG_ZERO_PAD && signchar != 0)
-        {
-            if (*nmax > 1)
-            {
-                *(*pinsertion)++ = signchar;
-                *nmax--;
-            }
-        }
+/*
+ * Formatting
+ */
 
-        /* Print width padding if right-aligned */
-        if ( !(flags & FLAG_LEFT_ALIGN) )
-        {
-            if (*nmax <= 1)
-                pad = 0;
-            else if (*nmax - 1 < pad)
-                pad = *nmax - 1;
-
-            if (flags & FLAG_ZERO_PAD)
-                memset(*pinsertion, '0', pad);
-            else
-                memset(*pinsertion, ' ', pad);
-
-            *pinsertion += pad;
-            *nmax -= pad;
-        }
+int pvsprintf_sink(psink_t *sink, const char *format, va_list ap)
+{
+    pformat_spec_t spec;
+    int start = sink->count;
+    va_list args;
 
-        /* Print sign now if padding was spaces */
-        if ( !(flags & FLAG_ZERO_PAD) && signchar != 0 )
-        {
-            *(*pinsertion)++ = signchar;
-            (*nmax)--;
-        }
+    va_copy(args, ap);
 
-        /* Print leading zeros */
-        if (leadingzeros)
-        {
-            /* Print "0.", then leadingzeros - 1 */
-            if (*nmax > 1)
-            {
-                *(*pinsertion)++ = '0';
-                *nmax--;
-            }
+    while (*format)
+    {
+        /* copy the literal text up to the next conversion in one go */
+        const char *literal = format;
+        while (*format && (*format != '%'))
+            format++;
+        if (format != literal)
+            psink_write(sink, literal, format - literal);
+        if (!*format)
+            break;
 
-            if (precision > 0 || flags & FLAG_HASH)
-            {
-                if (*nmax > 1)
-                {
-                    *(*pinsertion)++ = '.';
-                    (*nmax)--;
-                }
-            }
+        format = pformat_parse(format + 1, &spec);
+        pformat_arg(sink, &spec, &args);
+    }
 
-            /* WARNING not rounding here!
-             * i.e. printf(".3f", 0.0007) gives "0.000" not "0.001"
-             *
-             * This whole function could do with a rewrite...
-             */
-            if (leadingzeros - 1 > precision)
-            {
-                leadingzeros = precision + 1;
-                len = 0;
-            }
-            /* END WARNING */
+    va_end(args);
+    return sink->count - start;
+}
 
-            precision -= leadingzeros - 1;
+int psprintf_sink(psink_t *sink, const char *format, ...)
+{
+    va_list args;
+    int ret;
 
-            if (*nmax <= 1)
-                leadingzeros = 0;
-            else if (*nmax /* - 1 */ < leadingzeros /* -1 */)
-                leadingzeros = *nmax; /* -1 */
+    va_start(args, format);
+    ret = pvsprintf_sink(sink, format, args);
+    va_end(args);
+    return ret;
+}
 
-            leadingzeros--;
-            memset(*pinsertion, '0', leadingzeros);
-            *pinsertion += leadingzeros;
-            *nmax -= leadingzeros;
-        }
+int pvsnprintf(char *str, size_t nmax, const char *format, va_list ap)
+{
+    /* nmax gives total size of buffer including null
+     * null is ALWAYS added, even if buffer too small for format
+     * (contrary to C99)
+     */
+    psink_t sink;
 
-        /* Print digits before decimal place */
-        if (dec > 0)
-        {
-            if (*nmax <= 1)
-                printdigits = 0;
-            else if (*nmax - 1 < dec)
-                printdigits = *nmax - 1;
-            else
-                printdigits = dec;
-
-            memcpy(*pinsertion, digits, printdigits);
-            *pinsertion += printdigits;
-            *nmax -= printdigits;
-
-            if (precision > 0 || flags & FLAG_HASH)
-            {
-                /* Print decimal place */
-                if (*nmax > 1)
-                {
-                    *(*pinsertion)++ = '.';
-                    (*nmax)--;
-                }
+    psink_init(&sink, str, nmax ? nmax - 1 : 0, NULL, NULL);
+    pvsprintf_sink(&sink, format, ap);
 
-                /* Print trailing zero if no precision but hash given */
-                if (precision == 0 && *nmax > 1)
-                {
-                    *(*pinsertion)++ = '0';
-                    (*nmax)--;
-                }
-            }
+    if (nmax > 0)
+        str[sink.used] = '\0';
 
-            /* Bypass the digits we've already printed */
-            len -= dec;
-            digits += dec;
-        }
+    return sink.count;
+}
 
-        /* Print digits after decimal place */
-        if (len > precision)
-            len = precision;
+int psnprintf(char *str, size_t n, const char *format, ...)
+{
+    va_list args;
+    int ret;
 
-        if (*nmax <= 1)
-            printdigits = 0;
-        else if (*nmax - 1 < len)
-            printdigits = *nmax - 1;
-        else
-            printdigits = len;
+    va_start(args, format);
+    ret = pvsnprintf(str, n, format, args);
+    va_end(args);
+    return ret;
+}
 
-        memcpy(*pinsertion, digits, printdigits);
-        *pinsertion += printdigits;
-        *nmax -= printdigits;
+/* The standard names, pvsnprintf already behaves as C99 asks. The simulator links against the host C library,
+   which has its own */
+#ifndef MICROPV_SIM
+int vsnprintf(char *str, size_t n, const char *format, va_list ap)
+{
+    return pvsnprintf(str, n, format, ap);
+}
 
-        /* Print left-aligned pad */
-        if (flags & FLAG_LEFT_ALIGN)
-        {
-            if (*nmax <= 1)
-                pad = 0;
-            else if (*nmax - 1 < pad)
-                pad = *nmax - 1;
-
-            memset(*pinsertion, ' ', pad);
-            *pinsertion += pad;
-            *nmax -= pad;
-        }
-        return totallen;
-    }
-#endif
+int snprintf(char *str, size_t n, const char *format, ...)
+{
+    va_list args;
+    int ret;
 
-    return 0;
+    va_start(args, format);
+    ret = pvsnprintf(str, n, format, args);
+    va_end(args);
+    return ret;
 }
-
+#endif
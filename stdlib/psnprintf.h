@@ -3,6 +3,7 @@
 
 #include <stdarg.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -11,24 +12,82 @@ extern "C" {
 int psnprintf(char *str, size_t n, const char *format, ...) __attribute__((format (printf, 3, 4)));
 int pvsnprintf(char *str, size_t n, const char *format, va_list ap);
 
-/* Use these directly if you want to avoid overhead of psnprintf
- * Return value is number of characters printed (or number printed
- * if there had been enough room).
+/* Output sink. Formatted text is collected in buffer and handed to flush
+ * whenever the buffer fills up, and by psink_flush at the end. Without a
+ * flush function the buffer is a fixed destination and the text past its
+ * end is dropped (but still counted).
  */
-int pvsnfmt_char(char **pinsertion, size_t *nmax, const char fmt, int flags,
-                 int width, int precision, char prefix, va_list ap);
+typedef void (*psink_flush_t)(void *context, const char *data, size_t length);
 
-int pvsnfmt_int(char **pinsertion, size_t *nmax, char fmt, int flags,
-                 int width, int precision, char prefix, va_list ap);
+typedef struct psink_t
+{
+    char *buffer;
+    size_t size;
+    size_t used;
+    psink_flush_t flush;
+    void *context;
+    int count;          /* characters formatted so far, including dropped ones */
+} psink_t;
 
-int pvsnfmt_str(char **pinsertion, size_t *nmax, const char fmt, int flags,
-                 int width, int precision, char prefix, va_list ap);
+void psink_init(psink_t *sink, char *buffer, size_t size, psink_flush_t flush, void *context);
+void psink_write(psink_t *sink, const char *data, size_t length);
+void psink_flush(psink_t *sink);
 
-int pvsnfmt_double(char **pinsertion, size_t *nmax, const char fmt, int flags,
-                 int width, int precision, char prefix, va_list ap);
+/* Format into a sink in one pass. Return value is the number of characters
+ * formatted by this call. The sink is not flushed.
+ */
+int psprintf_sink(psink_t *sink, const char *format, ...) __attribute__((format (printf, 2, 3)));
+int pvsprintf_sink(psink_t *sink, const char *format, va_list ap);
+
+/* A parsed conversion specification, everything after the '%' */
+typedef struct pformat_spec_t
+{
+    char conversion;    /* d i u o x X p c s n f F e E g G, or the character to print as is */
+    char length;        /* 0, 'H' (hh), 'h', 'l', 'q' (ll), 'j', 'z', 't' or 'L' */
+    char flags;
+    int width;          /* 0 when not given, PFORMAT_VARIABLE for '*' */
+    int precision;      /* PFORMAT_UNKNOWN or PFORMAT_VARIABLE for '*' */
+} pformat_spec_t;
+
+#define PFORMAT_UNKNOWN     -1
+#define PFORMAT_VARIABLE    -2
+
+/* The argument of a conversion once it has been taken off the va_list */
+typedef union pformat_value_t
+{
+    int64_t i;
+    uint64_t u;
+    double d;
+    const char *s;
+    void *p;
+} pformat_value_t;
 
-/* These are the flags you need (use logical OR) for the flags parameter of
- * fmt functions above.
+/* What a conversion takes from the va_list, see pformat_class */
+#define PFORMAT_CLASS_NONE          0
+#define PFORMAT_CLASS_INT           1   /* int or unsigned int, read into i */
+#define PFORMAT_CLASS_LONG          2   /* long and the other 64 bit integers, read into i */
+#define PFORMAT_CLASS_DOUBLE        3   /* read into d */
+#define PFORMAT_CLASS_LONG_DOUBLE   4   /* read into d */
+#define PFORMAT_CLASS_STRING        5   /* read into s */
+#define PFORMAT_CLASS_POINTER       6   /* read into p */
+
+/* Use these directly to format arguments one at a time.
+ * pformat_parse takes the format just after the '%' and returns a pointer
+ * past the conversion character. pformat_arg takes the argument (and any
+ * '*' width or precision) from ap.
+ *
+ * pformat_class and pformat_value split pformat_arg in two so that the
+ * arguments can be taken now and formatted later. '*' width and precision
+ * are each an int in front of the argument. pformat_value takes them
+ * resolved: a negative width is left aligned and a negative precision is
+ * no precision.
+ */
+const char *pformat_parse(const char *format, pformat_spec_t *spec);
+void pformat_arg(psink_t *sink, const pformat_spec_t *spec, va_list *ap);
+int pformat_class(const pformat_spec_t *spec);
+void pformat_value(psink_t *sink, const pformat_spec_t *spec, int width, int precision, pformat_value_t value);
+
+/* These are the flags you need (use logical OR) for the flags of a spec
  */
 #define FLAG_DEFAULT         0x00
 #define FLAG_LEFT_ALIGN      0x01 /* - */
@@ -47,4 +106,3 @@ size_t pstrnlen(const char *s, size_t count);
 
 #endif /* ifdef PSNPRINTF_H */
 
-
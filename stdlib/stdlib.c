@@ -0,0 +1,335 @@
+/* ********************************************************************
+   * Project   :
+   * Author    : smartin
+   ********************************************************************
+
+    Freestanding subset of stdlib.h, so the kernel doesn't pick these up from whatever C library the embedder links.
+
+    The strto* family share one parser. Base 10 and 16 have their own loops, every digit costs a multiply and an
+    add, and the overflow check is the compiler's overflow builtins rather than a divide. There is no errno here:
+    out of range values saturate as the standard says but nothing else is reported.
+
+    qsort is an introsort: median of three quicksort, falling back to heapsort when the recursion gets deeper than
+    twice the log of the size so the worst case stays n log n, with insertion sort for the small partitions.
+    Elements are swapped a word at a time when their size and alignment allow.
+
+    Modifications:
+    0.01 19/10/2026 Initial version.
+*/
+
+/*---------------------------------------------------------------------
+  -- macros
+  ---------------------------------------------------------------------*/
+#define SORT_INSERTION          16
+
+/*---------------------------------------------------------------------
+  -- standard includes
+  ---------------------------------------------------------------------*/
+#include <stdint.h>
+#include <limits.h>
+
+/*---------------------------------------------------------------------
+  -- project includes (import)
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- project includes (export)
+  ---------------------------------------------------------------------*/
+#include <stdlib.h>
+
+/*---------------------------------------------------------------------
+  -- data types
+  ---------------------------------------------------------------------*/
+typedef int (*compare_t)(const void *, const void *);
+
+/*---------------------------------------------------------------------
+  -- function prototypes
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- global variables
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- local variables
+  ---------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------
+  -- private functions
+  ---------------------------------------------------------------------*/
+
+static inline int is_space(char c)
+{
+    return (c == ' ') || ((c >= '\t') && (c <= '\r'));
+}
+
+// value of c as a digit in any base up to 36, or 36 if it isn't one
+static inline unsigned digit_value(char c)
+{
+    if ((unsigned)(c - '0') < 10)
+        return c - '0';
+    if ((unsigned)((c | 0x20) - 'a') < 26)
+        return (c | 0x20) - 'a' + 10;
+    return 36;
+}
+
+/* Parse the magnitude of a number. overflow is set and the value saturates at UINT64_MAX if it doesn't fit. end is
+ * left at nptr when there are no digits at all.
+ */
+static uint64_t parse_number(const char *nptr, char **endptr, int base, int *negative, int *overflow)
+{
+    const char *s = nptr;
+    uint64_t value = 0;
+    unsigned digit;
+
+    *negative = 0;
+    *overflow = 0;
+
+    while (is_space(*s))
+        s++;
+    if ((*s == '-') || (*s == '+'))
+        *negative = (*s++ == '-');
+
+    // the 0x prefix only counts when a hex digit follows it
+    if (((base == 0) || (base == 16)) && (s[0] == '0') && ((s[1] | 0x20) == 'x') && (digit_value(s[2]) < 16))
+    {
+        s += 2;
+        base = 16;
+    }
+    else if (base == 0)
+        base = (s[0] == '0') ? 8 : 10;
+
+    if ((base < 2) || (base > 36) || (digit_value(*s) >= (unsigned)base))
+    {
+        if (endptr)
+            *endptr = (char *)nptr;
+        return 0;
+    }
+
+    if (base == 10)
+    {
+        for (; (digit = (unsigned)(*s - '0')) < 10; s++)
+            if (__builtin_mul_overflow(value, 10, &value) || __builtin_add_overflow(value, digit, &value))
+                *overflow = 1;
+    }
+    else if (base == 16)
+    {
+        for (; (digit = digit_value(*s)) < 16; s++)
+        {
+            if (value >> 60)
+                *overflow = 1;
+            value = (value << 4) | digit;
+        }
+    }
+    else
+    {
+        for (; (digit = digit_value(*s)) < (unsigned)base; s++)
+            if (__builtin_mul_overflow(value, (uint64_t)base, &value) || __builtin_add_overflow(value, digit, &value))
+                *overflow = 1;
+    }
+
+    if (endptr)
+        *endptr = (char *)s;
+
+    return *overflow ? UINT64_MAX : value;
+}
+
+static int64_t parse_signed(const char *nptr, char **endptr, int base)
+{
+    int negative, overflow;
+    uint64_t value = parse_number(nptr, endptr, base, &negative, &overflow);
+
+    if (negative)
+        return (value > (uint64_t)INT64_MAX + 1) ? INT64_MIN : (int64_t)-value;
+
+    return (value > INT64_MAX) ? INT64_MAX : (int64_t)value;
+}
+
+static uint64_t parse_unsigned(const char *nptr, char **endptr, int base)
+{
+    int negative, overflow;
+    uint64_t value = parse_number(nptr, endptr, base, &negative, &overflow);
+
+    // like the standard, a minus sign negates in unsigned arithmetic unless the magnitude was already too big
+    return (negative && !overflow) ? -value : value;
+}
+
+static inline void swap(char *a, char *b, size_t size, int words)
+{
+    if (words)
+    {
+        for (; size; size -= sizeof(uint64_t), a += sizeof(uint64_t), b += sizeof(uint64_t))
+        {
+            uint64_t t = *(uint64_t *)a;
+            *(uint64_t *)a = *(uint64_t *)b;
+            *(uint64_t *)b = t;
+        }
+    }
+    else
+    {
+        for (; size; size--, a++, b++)
+        {
+            char t = *a;
+            *a = *b;
+            *b = t;
+        }
+    }
+}
+
+static void sort_insertion(char *base, size_t count, size_t size, compare_t compare, int words)
+{
+    char *end = base + count * size;
+    char *i, *j;
+
+    for (i = base + size; i < end; i += size)
+        for (j = i; (j > base) && (compare(j - size, j) > 0); j -= size)
+            swap(j - size, j, size, words);
+}
+
+static void sort_sift_down(char *base, size_t root, size_t count, size_t size, compare_t compare, int words)
+{
+    size_t child;
+
+    while ((child = 2 * root + 1) < count)
+    {
+        if ((child + 1 < count) && (compare(base + child * size, base + (child + 1) * size) < 0))
+            child++;
+        if (compare(base + root * size, base + child * size) >= 0)
+            return;
+        swap(base + root * size, base + child * size, size, words);
+        root = child;
+    }
+}
+
+static void sort_heap(char *base, size_t count, size_t size, compare_t compare, int words)
+{
+    size_t i;
+
+    for (i = count / 2; i-- > 0; )
+        sort_sift_down(base, i, count, size, compare, words);
+
+    for (i = count - 1; i > 0; i--)
+    {
+        swap(base, base + i * size, size, words);
+        sort_sift_down(base, 0, i, size, compare, words);
+    }
+}
+
+static void sort_intro(char *base, size_t count, size_t size, compare_t compare, int words, int depth)
+{
+    while (count > SORT_INSERTION)
+    {
+        if (!depth--)
+        {
+            sort_heap(base, count, size, compare, words);
+            return;
+        }
+
+        // median of first, middle and last ends up at the start as the pivot
+        char *first = base;
+        char *middle = base + (count / 2) * size;
+        char *last = base + (count - 1) * size;
+        if (compare(middle, first) < 0)
+            swap(middle, first, size, words);
+        if (compare(last, middle) < 0)
+        {
+            swap(last, middle, size, words);
+            if (compare(middle, first) < 0)
+                swap(middle, first, size, words);
+        }
+        swap(first, middle, size, words);
+
+        // Hoare partition around the pivot, the median keeps both scans inside the array
+        char *i = first;
+        char *j = last + size;
+        for (;;)
+        {
+            do i += size; while ((i < last) && (compare(i, first) < 0));
+            do j -= size; while (compare(first, j) < 0);
+            if (i >= j)
+                break;
+            swap(i, j, size, words);
+        }
+        swap(first, j, size, words);
+
+        // recurse into the smaller side and loop on the larger so the stack stays log n deep
+        size_t left = (j - base) / size;
+        size_t right = count - left - 1;
+        if (left < right)
+        {
+            sort_intro(base, left, size, compare, words, depth);
+            base = j + size;
+            count = right;
+        }
+        else
+        {
+            sort_intro(j + size, right, size, compare, words, depth);
+            count = left;
+        }
+    }
+
+    sort_insertion(base, count, size, compare, words);
+}
+
+/*---------------------------------------------------------------------
+  -- public functions
+  ---------------------------------------------------------------------*/
+
+long strtol(const char *nptr, char **endptr, int base)
+{
+    return parse_signed(nptr, endptr, base);
+}
+
+long long strtoll(const char *nptr, char **endptr, int base)
+{
+    return parse_signed(nptr, endptr, base);
+}
+
+unsigned long strtoul(const char *nptr, char **endptr, int base)
+{
+    return parse_unsigned(nptr, endptr, base);
+}
+
+unsigned long long strtoull(const char *nptr, char **endptr, int base)
+{
+    return parse_unsigned(nptr, endptr, base);
+}
+
+void qsort(void *base, size_t nmemb, size_t size, int (*compar)(const void *, const void *))
+{
+    int words = !(size % sizeof(uint64_t)) && !((uintptr_t)base % sizeof(uint64_t));
+    int depth = 0;
+    size_t n;
+
+    if ((nmemb < 2) || !size)
+        return;
+
+    for (n = nmemb; n > 1; n >>= 1)
+        depth += 2;
+
+    sort_intro(base, nmemb, size, compar, words, depth);
+}
+
+void *bsearch(const void *key, const void *base, size_t nmemb, size_t size, int (*compar)(const void *, const void *))
+{
+    const char *low = base;
+
+    while (nmemb)
+    {
+        const char *middle = low + (nmemb / 2) * size;
+        int result = compar(key, middle);
+
+        if (!result)
+            return (void *)middle;
+
+        if (result > 0)
+        {
+            low = middle + size;
+            nmemb -= nmemb / 2 + 1;
+        }
+        else
+            nmemb /= 2;
+    }
+
+    return NULL;
+}
@@ -3,18 +3,48 @@
    * Author    : smartin
    ********************************************************************
 
+    Freestanding string functions.
+
+    These are called from event handlers (the crash log on every printk, the console and xenstore ring copies, the
+    scheduler clearing a pt_regs), and the upcall saves no FPU state and tasks switch the FPU lazily with CR0.TS.
+    So nothing here touches the SSE or AVX registers: the whole file is built general-regs-only, and the copies
+    use rep movsb/stosb or 8 byte words.
+
+    Copies and fills of up to 64 bytes are done inline with overlapping word loads and stores, so they never branch
+    on the exact length and never loop. Above that the kernel is picked from CPUID on first use: rep movsb/stosb
+    with FSRM or ERMS, otherwise rep movsq/stosq with the tail done as one overlapping word. memmove copies
+    backwards a word at a time when the destination overlaps the end of the source. Every path loads the words it
+    can overwrite before it stores anything, so overlap never corrupts them.
+
+    memchr, strlen and strcmp read a word at a time and find the byte they are looking for with the usual
+    has-zero-byte trick. memchr and strlen read whole aligned words, an aligned word can't cross into an unmapped
+    page. strcmp steps bytewise where a word of either string would cross a page.
+
     Modifications:
     0.01 23/10/2013 Initial version.
+    0.02 19/10/2026 CPUID dispatched memcpy, memset and memmove. memcmp and memchr.
+    0.03 19/10/2026 Word at a time strlen and strcmp. strncmp, strchr, strcpy and strncpy.
+    0.04 19/10/2026 No vector registers, they belong to whichever task an event interrupted.
 */
 
 /*---------------------------------------------------------------------
   -- macros
   ---------------------------------------------------------------------*/
+// the top bit of each byte of v that is zero (and maybe of bytes above it)
+#define HAS_ZERO(v)         (((v) - 0x0101010101010101UL) & ~(v) & 0x8080808080808080UL)
+#define STRING_PAGE_SIZE    4096
+#define STRING_IN_PAGE(p)   (((uintptr_t)(p) & (STRING_PAGE_SIZE - 1)) <= (STRING_PAGE_SIZE - 8))
+
+// keep the compiler from vectorising or using xmm registers for anything in here
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC target("general-regs-only")
+#endif
 
 /*---------------------------------------------------------------------
   -- standard includes
   ---------------------------------------------------------------------*/
 #include <stdint.h>
+#include <cpuid.h>
 
 /*---------------------------------------------------------------------
   -- project includes (import)
@@ -28,10 +58,13 @@
 /*---------------------------------------------------------------------
   -- data types
   ---------------------------------------------------------------------*/
+typedef uint64_t __attribute__((may_alias, aligned(1))) u64_unaligned_t;
+typedef uint32_t __attribute__((may_alias, aligned(1))) u32_unaligned_t;
 
 /*---------------------------------------------------------------------
   -- function prototypes
   ---------------------------------------------------------------------*/
+static void string_select(void);
 
 /*---------------------------------------------------------------------
   -- global variables
@@ -40,37 +73,362 @@
 /*---------------------------------------------------------------------
   -- local variables
   ---------------------------------------------------------------------*/
+// chosen by string_select on first use
+static void (*copy_large)(void *dest, const void *src, size_t n) = NULL;
+static void (*move_forward)(void *dest, const void *src, size_t n) = NULL;
+static void (*move_backward)(void *dest, const void *src, size_t n) = NULL;
+static void (*set_large)(void *dest, uint64_t pattern, size_t n) = NULL;
 
 /*---------------------------------------------------------------------
   -- private functions
   ---------------------------------------------------------------------*/
 
+/* Up to 64 bytes with no loops, every load is done before the first store */
+static inline void *copy_small(void *dest, const void *src, size_t n)
+{
+    uint8_t *d = dest;
+    const uint8_t *s = src;
+
+    if (n > 32)
+    {
+        uint64_t a = *(const u64_unaligned_t *)s;
+        uint64_t b = *(const u64_unaligned_t *)(s + 8);
+        uint64_t c = *(const u64_unaligned_t *)(s + 16);
+        uint64_t e = *(const u64_unaligned_t *)(s + 24);
+        uint64_t f = *(const u64_unaligned_t *)(s + n - 32);
+        uint64_t g = *(const u64_unaligned_t *)(s + n - 24);
+        uint64_t h = *(const u64_unaligned_t *)(s + n - 16);
+        uint64_t i = *(const u64_unaligned_t *)(s + n - 8);
+        *(u64_unaligned_t *)d = a;
+        *(u64_unaligned_t *)(d + 8) = b;
+        *(u64_unaligned_t *)(d + 16) = c;
+        *(u64_unaligned_t *)(d + 24) = e;
+        *(u64_unaligned_t *)(d + n - 32) = f;
+        *(u64_unaligned_t *)(d + n - 24) = g;
+        *(u64_unaligned_t *)(d + n - 16) = h;
+        *(u64_unaligned_t *)(d + n - 8) = i;
+    }
+    else if (n >= 16)
+    {
+        uint64_t a = *(const u64_unaligned_t *)s;
+        uint64_t b = *(const u64_unaligned_t *)(s + 8);
+        uint64_t c = *(const u64_unaligned_t *)(s + n - 16);
+        uint64_t e = *(const u64_unaligned_t *)(s + n - 8);
+        *(u64_unaligned_t *)d = a;
+        *(u64_unaligned_t *)(d + 8) = b;
+        *(u64_unaligned_t *)(d + n - 16) = c;
+        *(u64_unaligned_t *)(d + n - 8) = e;
+    }
+    else if (n >= 8)
+    {
+        uint64_t a = *(const u64_unaligned_t *)s;
+        uint64_t b = *(const u64_unaligned_t *)(s + n - 8);
+        *(u64_unaligned_t *)d = a;
+        *(u64_unaligned_t *)(d + n - 8) = b;
+    }
+    else if (n >= 4)
+    {
+        uint32_t a = *(const u32_unaligned_t *)s;
+        uint32_t b = *(const u32_unaligned_t *)(s + n - 4);
+        *(u32_unaligned_t *)d = a;
+        *(u32_unaligned_t *)(d + n - 4) = b;
+    }
+    else if (n)
+    {
+        uint8_t a = s[0], b = s[n / 2], c = s[n - 1];
+        d[0] = a;
+        d[n / 2] = b;
+        d[n - 1] = c;
+    }
+
+    return dest;
+}
+
+static inline void *set_small(void *dest, uint64_t pattern, size_t n)
+{
+    uint8_t *d = dest;
+
+    if (n > 32)
+    {
+        *(u64_unaligned_t *)d = pattern;
+        *(u64_unaligned_t *)(d + 8) = pattern;
+        *(u64_unaligned_t *)(d + 16) = pattern;
+        *(u64_unaligned_t *)(d + 24) = pattern;
+        *(u64_unaligned_t *)(d + n - 32) = pattern;
+        *(u64_unaligned_t *)(d + n - 24) = pattern;
+        *(u64_unaligned_t *)(d + n - 16) = pattern;
+        *(u64_unaligned_t *)(d + n - 8) = pattern;
+    }
+    else if (n >= 16)
+    {
+        *(u64_unaligned_t *)d = pattern;
+        *(u64_unaligned_t *)(d + 8) = pattern;
+        *(u64_unaligned_t *)(d + n - 16) = pattern;
+        *(u64_unaligned_t *)(d + n - 8) = pattern;
+    }
+    else if (n >= 8)
+    {
+        *(u64_unaligned_t *)d = pattern;
+        *(u64_unaligned_t *)(d + n - 8) = pattern;
+    }
+    else if (n >= 4)
+    {
+        *(u32_unaligned_t *)d = pattern;
+        *(u32_unaligned_t *)(d + n - 4) = pattern;
+    }
+    else if (n)
+    {
+        d[0] = pattern;
+        d[n / 2] = pattern;
+        d[n - 1] = pattern;
+    }
+
+    return dest;
+}
+
+static void copy_erms(void *dest, const void *src, size_t n)
+{
+    __asm__ __volatile__ ("rep movsb" : "+D" (dest), "+S" (src), "+c" (n) : : "memory");
+}
+
+static void set_erms(void *dest, uint64_t pattern, size_t n)
+{
+    __asm__ __volatile__ ("rep stosb" : "+D" (dest), "+c" (n) : "a" (pattern) : "memory");
+}
+
+/* Forward copy of more than 64 bytes in words. The last word is loaded first and stored last, it covers the bytes
+ * past the last whole word and a memmove to just below the source can't overwrite it before it is read
+ */
+static void copy_words(void *dest, const void *src, size_t n)
+{
+    uint64_t tail = *(const u64_unaligned_t *)((const uint8_t *)src + n - 8);
+    uint8_t *last = (uint8_t *)dest + n - 8;
+    size_t words = n / 8;
+
+    __asm__ __volatile__ ("rep movsq" : "+D" (dest), "+S" (src), "+c" (words) : : "memory");
+    *(u64_unaligned_t *)last = tail;
+}
+
+/* Backward copy of more than 64 bytes for memmove onto the end of the source, the first word is the one kept
+ * aside this time
+ */
+static void move_backward_words(void *dest, const void *src, size_t n)
+{
+    uint8_t *d = dest;
+    const uint8_t *s = src;
+    uint64_t head = *(const u64_unaligned_t *)s;
+
+    for (; n > 8; n -= 8)
+        *(u64_unaligned_t *)(d + n - 8) = *(const u64_unaligned_t *)(s + n - 8);
+
+    *(u64_unaligned_t *)d = head;
+}
+
+static void set_words(void *dest, uint64_t pattern, size_t n)
+{
+    uint8_t *last = (uint8_t *)dest + n - 8;
+    size_t words = n / 8;
+
+    __asm__ __volatile__ ("rep stosq" : "+D" (dest), "+c" (words) : "a" (pattern) : "memory");
+    *(u64_unaligned_t *)last = pattern;
+}
+
+/* Pick the large copy and fill kernels for this CPU */
+static void string_select(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    int erms = 0, fsrm = 0;
+
+    if (__get_cpuid_max(0, NULL) >= 7)
+    {
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        erms = (ebx >> 9) & 1;
+        fsrm = (edx >> 4) & 1;
+    }
+
+    // backwards moves have no fast string equivalent, std; rep movsb is slow everywhere
+    move_backward = move_backward_words;
+    move_forward = copy_words;
+    set_large = (erms || fsrm) ? set_erms : set_words;
+    copy_large = (erms || fsrm) ? copy_erms : copy_words;
+}
+
 /*---------------------------------------------------------------------
   -- public functions
   ---------------------------------------------------------------------*/
 
 void *memcpy(void *dest, const void *src, size_t n)
 {
-    void *retval = dest;
-    for (; n >= sizeof(long); n-= sizeof(long), dest += sizeof(long), src += sizeof(long))
-        *(long *)dest = *(long *)src;
-    for (; n; n-= sizeof(char), dest += sizeof(char), src += sizeof(char))
-        *(char *)dest = *(char *)src;
-    return retval;
+    if (n <= 64)
+        return copy_small(dest, src, n);
+    if (!copy_large)
+        string_select();
+    copy_large(dest, src, n);
+    return dest;
 }
 
-void *memset(void *dest, int src, size_t n)
+void *memmove(void *dest, const void *src, size_t n)
 {
-    void *retval = dest;
-    for (; n; n--)
-        *(char *)dest++ = src;
-    return retval;
+    // all the loads happen before the stores so small moves are safe either way
+    if (n <= 64)
+        return copy_small(dest, src, n);
+    if (!copy_large)
+        string_select();
+
+    // a forward copy only breaks when the destination starts inside the source
+    if (((uintptr_t)dest - (uintptr_t)src) >= n)
+        move_forward(dest, src, n);
+    else
+        move_backward(dest, src, n);
+    return dest;
+}
+
+void *memset(void *dest, int c, size_t n)
+{
+    uint64_t pattern = 0x0101010101010101UL * (uint8_t)c;
+
+    if (n <= 64)
+        return set_small(dest, pattern, n);
+    if (!set_large)
+        string_select();
+    set_large(dest, pattern, n);
+    return dest;
+}
+
+int memcmp(const void *s1, const void *s2, size_t n)
+{
+    const uint8_t *a = s1, *b = s2;
+
+    // find the first word that differs then let the byte order decide
+    for (; n >= 8; n -= 8, a += 8, b += 8)
+    {
+        uint64_t x = *(const u64_unaligned_t *)a;
+        uint64_t y = *(const u64_unaligned_t *)b;
+        if (x != y)
+        {
+            x = __builtin_bswap64(x);
+            y = __builtin_bswap64(y);
+            return (x < y) ? -1 : 1;
+        }
+    }
+
+    for (; n; n--, a++, b++)
+        if (*a != *b)
+            return *a - *b;
+
+    return 0;
+}
+
+void *memchr(const void *s, int c, size_t n)
+{
+    const uint8_t *p = s;
+    const uint8_t *end = p + n;
+    uint64_t pattern = 0x0101010101010101UL * (uint8_t)c;
+
+    if (!n)
+        return NULL;
+
+    // start on the aligned word holding s, the bytes before it are made not to match. A matching byte is a zero
+    // byte once the word is xored with the pattern
+    const uint64_t *word = (const uint64_t *)((uintptr_t)p & ~7UL);
+    unsigned offset = (uintptr_t)p & 7;
+    uint64_t v = (*(const u64_unaligned_t *)word ^ pattern) | ((1UL << (offset * 8)) - 1);
+
+    for (;;)
+    {
+        if (HAS_ZERO(v))
+        {
+            const uint8_t *found = (const uint8_t *)word + (__builtin_ctzl(HAS_ZERO(v)) >> 3);
+            return (found < end) ? (void *)found : NULL;
+        }
+
+        if ((const uint8_t *)++word >= end)
+            return NULL;
+        v = *(const u64_unaligned_t *)word ^ pattern;
+    }
 }
 
 size_t strlen(const char *s)
 {
-    size_t c;
-    for (c = 0; *s++; c++) ;
-    return c;
+    // start on the aligned word holding s with the bytes before it made non zero
+    const uint64_t *word = (const uint64_t *)((uintptr_t)s & ~7UL);
+    unsigned offset = (uintptr_t)s & 7;
+    uint64_t v = *(const u64_unaligned_t *)word | ((1UL << (offset * 8)) - 1);
+
+    while (!HAS_ZERO(v))
+        v = *(const u64_unaligned_t *)++word;
+
+    return (const char *)word + (__builtin_ctzl(HAS_ZERO(v)) >> 3) - s;
+}
+
+int strcmp(const char *s1, const char *s2)
+{
+    const uint8_t *a = (const uint8_t *)s1, *b = (const uint8_t *)s2;
+
+    for (;;)
+    {
+        // a word at a time while neither word runs onto the next page
+        if (STRING_IN_PAGE(a) && STRING_IN_PAGE(b))
+        {
+            uint64_t x = *(const u64_unaligned_t *)a;
+            uint64_t y = *(const u64_unaligned_t *)b;
+            if ((x == y) && !HAS_ZERO(x))
+            {
+                a += 8;
+                b += 8;
+                continue;
+            }
+
+            // the difference or the NUL is in these 8 bytes
+            for (;; a++, b++)
+                if ((*a != *b) || !*a)
+                    return *a - *b;
+        }
+
+        if ((*a != *b) || !*a)
+            return *a - *b;
+        a++;
+        b++;
+    }
+}
+
+int strncmp(const char *s1, const char *s2, size_t n)
+{
+    const uint8_t *a = (const uint8_t *)s1, *b = (const uint8_t *)s2;
+
+    for (; n; n--, a++, b++)
+        if ((*a != *b) || !*a)
+            return *a - *b;
+
+    return 0;
+}
+
+char *strchr(const char *s, int c)
+{
+    for (;; s++)
+    {
+        if (*s == (char)c)
+            return (char *)s;
+        if (!*s)
+            return NULL;
+    }
+}
+
+char *strcpy(char *dest, const char *src)
+{
+    return memcpy(dest, src, strlen(src) + 1);
+}
+
+char *strncpy(char *dest, const char *src, size_t n)
+{
+    size_t length = 0;
+
+    // the string is copied up to n and the rest of dest is filled with NULs
+    while ((length < n) && src[length])
+        length++;
+    memcpy(dest, src, length);
+    memset(dest + length, 0, n - length);
+
+    return dest;
 }
 